@@ -0,0 +1,176 @@
+#ifndef AVL_BALANCE_H
+#define AVL_BALANCE_H
+
+/**
+* The AVL rotations and rebalancing steps, written once against node
+* handles so that AVLTree and CompactAVLTree run the same code whether
+* nodes are reached by pointer, by tagged pointer or by 32-bit index.
+* Links is a small adaptor from the tree that supplies the node access:
+*
+*   typedef ... Handle;
+*   Handle left(Handle node) const;   Handle right(Handle node) const;
+*   void setLeft(Handle node, Handle child) const;
+*   void setRight(Handle node, Handle child) const;
+*   int balance(Handle node) const;   // right height minus left height
+*   void setBalance(Handle node, int balance) const;
+*   void setParent(Handle child, Handle parent) const;
+*   void resize(Handle node) const;
+*
+* setParent() is handed nil children and must ignore them, as must trees
+* without parent links. resize() is called on each node whose children
+* changed, lowest first, for trees that keep subtree sizes.
+*
+* None of these touch the link into the subtree from above: each returns
+* the subtree's new root, and the caller points the parent (or the root)
+* at it and sets its parent link.
+*/
+template <typename Links>
+struct AVLBalance
+{
+    typedef typename Links::Handle Handle;
+
+    static Handle rotateLeft(const Links& links, Handle node);
+    static Handle rotateRight(const Links& links, Handle node);
+    static Handle rebalance(const Links& links, Handle node, bool& shorter);
+    static Handle grow(const Links& links, Handle node, bool right, bool& taller);
+    static Handle shrink(const Links& links, Handle node, bool right, bool& shorter);
+};
+
+/*
+  -------------------------------------------
+  Begin implementations for the AVLBalance class.
+  -------------------------------------------
+*/
+
+/**
+* Lifts node's right child into its place. Only links change; balances
+* are left for the caller, who knows the heights involved.
+*/
+template<typename Links>
+typename AVLBalance<Links>::Handle AVLBalance<Links>::rotateLeft(const Links& links, Handle node)
+{
+    Handle up = links.right(node);
+    Handle middle = links.left(up);
+    links.setRight(node, middle);
+    links.setParent(middle, node);
+    links.setLeft(up, node);
+    links.setParent(node, up);
+    links.resize(node);
+    links.resize(up);
+    return up;
+}
+
+/**
+* Mirror image of rotateLeft().
+*/
+template<typename Links>
+typename AVLBalance<Links>::Handle AVLBalance<Links>::rotateRight(const Links& links, Handle node)
+{
+    Handle up = links.left(node);
+    Handle middle = links.right(up);
+    links.setLeft(node, middle);
+    links.setParent(middle, node);
+    links.setRight(up, node);
+    links.setParent(node, up);
+    links.resize(node);
+    links.resize(up);
+    return up;
+}
+
+/**
+* Rotates a node whose balance has reached +2 or -2 (its stored balance
+* is still the old +1 or -1) and returns the new root of its subtree.
+* Sets shorter if the subtree ended up lower than before the change that
+* unbalanced it; that only fails to happen when the taller child was
+* itself balanced, which a remove can cause but an insert cannot.
+*/
+template<typename Links>
+typename AVLBalance<Links>::Handle AVLBalance<Links>::rebalance(const Links& links, Handle node, bool& shorter)
+{
+    bool rightHeavy = links.balance(node) > 0;
+    int lean = rightHeavy ? 1 : -1;
+    Handle child = rightHeavy ? links.right(node) : links.left(node);
+    int childLean = lean * links.balance(child);
+
+    // the child leans the same way or not at all: one rotation lifts it
+    if(childLean >= 0) {
+        Handle up = rightHeavy ? rotateLeft(links, node) : rotateRight(links, node);
+        shorter = childLean != 0;
+        links.setBalance(node, shorter ? 0 : lean);
+        links.setBalance(up, shorter ? 0 : -lean);
+        return up;
+    }
+
+    // the child leans back towards node: its inner child comes up two levels
+    Handle pivot = rightHeavy ? links.left(child) : links.right(child);
+    int pivotLean = lean * links.balance(pivot);
+    if(rightHeavy) {
+        links.setRight(node, rotateRight(links, child));
+        links.setParent(pivot, node);
+        rotateLeft(links, node);
+    }
+    else {
+        links.setLeft(node, rotateLeft(links, child));
+        links.setParent(pivot, node);
+        rotateRight(links, node);
+    }
+    links.setBalance(node, pivotLean > 0 ? -lean : 0);
+    links.setBalance(child, pivotLean < 0 ? lean : 0);
+    links.setBalance(pivot, 0);
+    shorter = true;
+    return pivot;
+}
+
+/**
+* Accounts for node's right subtree (or left) having grown by one level,
+* rotating if that puts node out of balance. Returns the subtree's root
+* and sets taller if the subtree as a whole grew, in which case the
+* caller goes on to node's parent.
+*/
+template<typename Links>
+typename AVLBalance<Links>::Handle AVLBalance<Links>::grow(const Links& links, Handle node, bool right, bool& taller)
+{
+    int balance = links.balance(node) + (right ? 1 : -1);
+    if(balance >= -1 && balance <= 1) {
+        links.setBalance(node, balance);
+        taller = balance != 0;
+        return node;
+    }
+    // a rotation after an insert restores the subtree's old height
+    bool shorter;
+    taller = false;
+    return rebalance(links, node, shorter);
+}
+
+/**
+* Accounts for node's right subtree (or left) having lost a level,
+* rotating if that puts node out of balance. Returns the subtree's root
+* and sets shorter if the subtree as a whole lost a level, in which case
+* the caller goes on to node's parent.
+*/
+template<typename Links>
+typename AVLBalance<Links>::Handle AVLBalance<Links>::shrink(const Links& links, Handle node, bool right, bool& shorter)
+{
+    int oldBalance = links.balance(node);
+    int balance = oldBalance + (right ? -1 : 1);
+    if(oldBalance == 0) {
+        // the other side still holds the subtree's height
+        links.setBalance(node, balance);
+        shorter = false;
+        return node;
+    }
+    if(balance == 0) {
+        links.setBalance(node, 0);
+        shorter = true;
+        return node;
+    }
+    return rebalance(links, node, shorter);
+}
+
+/*
+  -----------------------------------------
+  End implementations for the AVLBalance class.
+  -----------------------------------------
+*/
+
+#endif
@@ -7,6 +7,8 @@
 #include <cstdint>
 #include <algorithm>
 #include "bst.h"
+#include "avl_balance.h"
+#include "fork_join.h"
 
 struct KeyError { };
 
@@ -21,22 +23,29 @@ class AVLNode : public Node<Key, Value>
 public:
     // Constructor/destructor.
     AVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
-    virtual ~AVLNode();
+    AVLNode(const ItemBuilder<Key, Value>& build, AVLNode<Key, Value>* parent);
+    ~AVLNode();
 
     // Getter/setter for the node's height.
     int8_t getBalance () const;
     void setBalance (int8_t balance);
     void updateBalance(int8_t diff);
 
-    // Getters for parent, left, and right. These need to be redefined since they
+    // Getter/setter for the number of nodes in this node's subtree. Only
+    // kept up to date while the tree has order statistics enabled.
+    uint32_t getSubtreeSize() const;
+    void setSubtreeSize(uint32_t size);
+
+    // Getters for parent, left, and right. These hide the Node versions since they
     // return pointers to AVLNodes - not plain Nodes. See the Node class in bst.h
     // for more information.
-    virtual AVLNode<Key, Value>* getParent() const override;
-    virtual AVLNode<Key, Value>* getLeft() const override;
-    virtual AVLNode<Key, Value>* getRight() const override;
+    AVLNode<Key, Value>* getParent() const;
+    AVLNode<Key, Value>* getLeft() const;
+    AVLNode<Key, Value>* getRight() const;
 
 protected:
     int8_t balance_;    // effectively a signed char
+    uint32_t subtreeSize_;  // sits in the padding after balance_
 };
 
 /*
@@ -50,7 +59,17 @@ protected:
 */
 template<class Key, class Value>
 AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value> *parent) :
-    Node<Key, Value>(key, value, parent), balance_(0)
+    Node<Key, Value>(key, value, parent), balance_(0), subtreeSize_(1)
+{
+
+}
+
+/**
+* A constructor that builds the item in place. See Node.
+*/
+template<class Key, class Value>
+AVLNode<Key, Value>::AVLNode(const ItemBuilder<Key, Value>& build, AVLNode<Key, Value> *parent) :
+    Node<Key, Value>(build, parent), balance_(0), subtreeSize_(1)
 {
 
 }
@@ -92,8 +111,26 @@ void AVLNode<Key, Value>::updateBalance(int8_t diff)
 }
 
 /**
-* An overridden function for getting the parent since a static_cast is necessary to make sure
-* that our node is a AVLNode.
+* A getter for the subtree size of a AVLNode.
+*/
+template<class Key, class Value>
+uint32_t AVLNode<Key, Value>::getSubtreeSize() const
+{
+    return subtreeSize_;
+}
+
+/**
+* A setter for the subtree size of a AVLNode.
+*/
+template<class Key, class Value>
+void AVLNode<Key, Value>::setSubtreeSize(uint32_t size)
+{
+    subtreeSize_ = size;
+}
+
+/**
+* Hides Node::getParent() since a static_cast is necessary to make sure
+* that our node is a AVLNode. The cast is resolved at compile time.
 */
 template<class Key, class Value>
 AVLNode<Key, Value> *AVLNode<Key, Value>::getParent() const
@@ -102,7 +139,7 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getParent() const
 }
 
 /**
-* Overridden for the same reasons as above.
+* Hidden for the same reasons as above.
 */
 template<class Key, class Value>
 AVLNode<Key, Value> *AVLNode<Key, Value>::getLeft() const
@@ -111,7 +148,7 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getLeft() const
 }
 
 /**
-* Overridden for the same reasons as above.
+* Hidden for the same reasons as above.
 */
 template<class Key, class Value>
 AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
@@ -127,201 +164,210 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
 */
 
 
-template <class Key, class Value>
-class AVLTree : public BinarySearchTree<Key, Value>
+template <class Key, class Value, class Compare = std::less<Key> >
+class AVLTree : public BinarySearchTree<Key, Value, Compare>
 {
 public:
-    virtual void insert (const std::pair<const Key, Value> &new_item); // TODO
+    AVLTree();
+    explicit AVLTree(const Compare& comp);
+    template<typename ForwardIt>
+    AVLTree(ForwardIt first, ForwardIt last);
+    AVLTree(const AVLTree& other);
+    AVLTree& operator=(const AVLTree& other);
     virtual void remove(const Key& key);  // TODO
+
+    typedef typename BinarySearchTree<Key, Value, Compare>::iterator iterator;
+
+    // Order statistics; see setOrderStatistics()
+    void setOrderStatistics(bool enabled);
+    bool orderStatistics() const;
+    std::size_t rank(const Key& key) const;
+    iterator select(std::size_t k) const;
+    std::size_t count(const Key& lo, const Key& hi) const;
+
+    // Splitting and joining whole trees; see split()
+    void split(const Key& key, AVLTree& right);
+    void join(AVLTree& left, std::pair<const Key, Value> pivot, AVLTree& right);
+    void append(AVLTree& other);
+    void erase(const Key& lo, const Key& hi);
+    void extract_range(const Key& lo, const Key& hi, AVLTree& out);
+
+    // Set operations, run in parallel; see unionWith()
+    void unionWith(AVLTree& other, ForkJoinPool& pool = ForkJoinPool::global());
+    void intersect(const AVLTree& other, ForkJoinPool& pool = ForkJoinPool::global());
+    void difference(const AVLTree& other, ForkJoinPool& pool = ForkJoinPool::global());
+
+    virtual bool isBalanced() const;
+    virtual int height() const;
 protected:
     virtual void nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2);
+    virtual Node<Key, Value>* createNode(const ItemBuilder<Key, Value>& build, Node<Key, Value>* parent);
+    virtual void afterInsert(Node<Key, Value>* node);
+    virtual void destructNode(Node<Key, Value>* node);
+    virtual void initBuiltNode(Node<Key, Value>* node, int leftHeight, int rightHeight, std::size_t count);
+    virtual Node<Key, Value>* tallerChild(Node<Key, Value>* node) const;
+    virtual int splitLevels(std::size_t chunks) const;
+    virtual int childSplitLevels(Node<Key, Value>* node, int levels, bool right) const;
+
+    // Node access for the rebalancing code shared through avl_balance.h
+    struct BalanceLinks
+    {
+        typedef AVLNode<Key,Value>* Handle;
+
+        Handle left(Handle node) const { return node->getLeft(); }
+        Handle right(Handle node) const { return node->getRight(); }
+        void setLeft(Handle node, Handle child) const { node->setLeft(child); }
+        void setRight(Handle node, Handle child) const { node->setRight(child); }
+        int balance(Handle node) const { return node->getBalance(); }
+        void setBalance(Handle node, int balance) const { node->setBalance(static_cast<int8_t>(balance)); }
+        void setParent(Handle child, Handle parent) const { if(child != NULL) child->setParent(parent); }
+        void resize(Handle node) const { if(sizes) AVLTree::resize(node); }
+
+        bool sizes;     // order statistics are on
+    };
+    typedef AVLBalance<BalanceLinks> Balance;
 
     // Add helper functions here
-    void insertFix(AVLNode<Key,Value>* parent, AVLNode<Key,Value>* node);
-    void removeFix(AVLNode<Key,Value>* n, int diff);
+    BalanceLinks balanceLinks() const;
+    void rebalanceUp(AVLNode<Key,Value>* node, bool right, bool grew);
+    void replaceChild(AVLNode<Key,Value>* parent, AVLNode<Key,Value>* child, AVLNode<Key,Value>* top);
     void rotateRight(AVLNode<Key,Value>* node);
     void rotateLeft(AVLNode<Key,Value>* node);
+    static std::size_t subtreeSize(AVLNode<Key,Value>* node);
+    static void resize(AVLNode<Key,Value>* node);
+    static void addToSizes(AVLNode<Key,Value>* node, int diff);
+    static uint32_t computeSizes(AVLNode<Key,Value>* node);
+    AVLNode<Key,Value>* selectNode(std::size_t k) const;
+    void requireOrderStatistics() const;
+    int checkSubtree(AVLNode<Key,Value>* node, AVLNode<Key,Value>* parent, std::size_t& size, bool& ok) const;
+    static int subtreeHeight(AVLNode<Key,Value>* node);
+    static int leftChildHeight(AVLNode<Key,Value>* node, int height);
+    static int rightChildHeight(AVLNode<Key,Value>* node, int height);
+    AVLNode<Key,Value>* joinAt(AVLNode<Key,Value>* left, int leftHeight, AVLNode<Key,Value>* pivot,
+                               AVLNode<Key,Value>* right, int rightHeight, int& height);
+    AVLNode<Key,Value>* joinSpine(AVLNode<Key,Value>* tall, int tallHeight, AVLNode<Key,Value>* pivot,
+                                  AVLNode<Key,Value>* other, int otherHeight, bool alongRight, int& height);
+    AVLNode<Key,Value>* joinTrees(AVLNode<Key,Value>* left, int leftHeight,
+                                  AVLNode<Key,Value>* right, int rightHeight, int& height);
+    void splitAt(AVLNode<Key,Value>* node, int height, const Key& key,
+                 AVLNode<Key,Value>*& left, int& leftHeight, AVLNode<Key,Value>*& right, int& rightHeight);
+    void splitFirst(AVLNode<Key,Value>* node, int height,
+                    AVLNode<Key,Value>*& first, AVLNode<Key,Value>*& rest, int& restHeight);
+    AVLNode<Key,Value>* takeTree(AVLTree& src);
+    void setTree(AVLNode<Key,Value>* root, std::size_t size);
+    void splitOut(AVLNode<Key,Value>* node, int height, const Key& key,
+                  AVLNode<Key,Value>*& left, int& leftHeight, AVLNode<Key,Value>*& match,
+                  AVLNode<Key,Value>*& right, int& rightHeight);
+
+    enum SetOperation { SET_UNION, SET_INTERSECTION, SET_DIFFERENCE };
+
+    // The outcome of a set operation on two subtrees: the resulting
+    // subtree, the nodes it left over (chained through their parent
+    // pointers, each with its subtree), and how many keys both had.
+    struct SetPiece
+    {
+        AVLNode<Key,Value>* root;
+        int height;
+        AVLNode<Key,Value>* discarded;
+        AVLNode<Key,Value>* discardedTail;
+        std::size_t matches;
+    };
+
+    // Below this height on both sides a set operation stops forking;
+    // the subproblem is then too small to repay handing it to a thread.
+    static const int PARALLEL_HEIGHT = 10;
+
+    std::size_t runSetOperation(SetOperation op, AVLNode<Key,Value>* mine, AVLNode<Key,Value>* theirs, ForkJoinPool& pool);
+    void setOperation(SetOperation op, AVLNode<Key,Value>* mine, int myHeight,
+                      AVLNode<Key,Value>* theirs, int theirHeight, SetPiece& out, ForkJoinPool* pool);
+    static void discard(SetPiece& piece, AVLNode<Key,Value>* node);
+
+    bool orderStats_;   // subtree sizes are being maintained
 };
 
-/*
- * Recall: If key is already in the tree, you should 
- * overwrite the current value with the updated value.
- */
-template<class Key, class Value>
-void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
+template<class Key, class Value, class Compare>
+const int AVLTree<Key, Value, Compare>::PARALLEL_HEIGHT;
+
+/**
+* Default constructor, which sizes the node pool for AVLNodes.
+*/
+template<class Key, class Value, class Compare>
+AVLTree<Key, Value, Compare>::AVLTree() :
+    BinarySearchTree<Key, Value, Compare>(sizeof(AVLNode<Key, Value>), alignof(AVLNode<Key, Value>)),
+    orderStats_(false)
 {
-  // 1. walking the tree
 
-  AVLNode<Key, Value> *curr = static_cast<AVLNode<Key, Value>*>(this->root_);
-  AVLNode<Key, Value> *parent = NULL;
-  while(curr != NULL){
-    // if new Key is less than current Key, go left
-    if(new_item.first < curr->getKey()){
-      parent = curr;
-      curr = curr->getLeft();
-    }
-    else if(new_item.first > curr->getKey()){
-      parent = curr;
-      curr = curr->getRight();
-    }
-    // if key already in tree
-    else {
-      curr->setValue(new_item.second);
-      parent = curr;
-      return;
-    }
-  }
-  // 2. create new node
-  AVLNode<Key, Value> *newNode = new AVLNode<Key, Value>(new_item.first, new_item.second, NULL);
+}
 
-  // 3. insert new node
+/**
+* Constructor that orders keys with the given comparator.
+*/
+template<class Key, class Value, class Compare>
+AVLTree<Key, Value, Compare>::AVLTree(const Compare& comp) :
+    BinarySearchTree<Key, Value, Compare>(sizeof(AVLNode<Key, Value>), alignof(AVLNode<Key, Value>), comp),
+    orderStats_(false)
+{
 
-  // if parent still empty, then empty tree
-  if(parent == NULL){
-    this->root_ = newNode;
-  }
-  else{
-    // insert node right if bigger than parent
-    if(newNode->getKey() > parent->getKey()){
-      newNode->setParent(parent);
-      parent->setRight(newNode);
-      // update parent balance if it was -1 or 1 before
-      if(parent->getBalance() == 1 || parent->getBalance() == -1){
-        parent->setBalance(0);
-      }
-      else{
-        // otherwise change bf to 1 because inserted right
-        parent->setBalance(1);
-        // then call insertFix b/c old bf = 0
-        insertFix(parent, newNode);
-      }
-    }
-    // insert node left if smaller than parent
-    else {
-      newNode->setParent(parent);
-      parent->setLeft(newNode);
-      // update parent balance if itwas -1 or 1 prior
-      if(parent->getBalance() == 1 || parent->getBalance() == -1){
-        parent->setBalance(0);
-      }
-      // change bf to -1 because inserted left
-      else{
-        parent->setBalance(-1);
-        // call insertFix b/c old bf = 0
-        insertFix(parent, newNode);
-      }
-    }
-  }
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::insertFix (AVLNode<Key, Value>* parent, AVLNode<Key, Value>* node)
+/**
+* Builds a balanced AVL tree from a range sorted by strictly increasing
+* key. See BinarySearchTree::assignSorted().
+*/
+template<class Key, class Value, class Compare>
+template<typename ForwardIt>
+AVLTree<Key, Value, Compare>::AVLTree(ForwardIt first, ForwardIt last) :
+    BinarySearchTree<Key, Value, Compare>(sizeof(AVLNode<Key, Value>), alignof(AVLNode<Key, Value>)),
+    orderStats_(false)
 {
-  AVLNode<Key, Value>* grandp = parent->getParent();
-  if(parent == NULL || grandp == NULL){
-    return;
-  }
-
-  // case for p is left child
-  if(grandp->getLeft() == parent){
-    // update grand bf to accurate value
-    grandp->updateBalance(-1);
+    this->assignSorted(first, last);
+}
 
-    // Case 1: bf = 0
-    if(grandp->getBalance() == 0) {return;}
+/**
+* Copy constructor. Builds a balanced copy of other in O(n), keeping
+* order statistics if other does.
+*/
+template<class Key, class Value, class Compare>
+AVLTree<Key, Value, Compare>::AVLTree(const AVLTree& other) :
+    BinarySearchTree<Key, Value, Compare>(sizeof(AVLNode<Key, Value>), alignof(AVLNode<Key, Value>), other.key_comp()),
+    orderStats_(other.orderStats_)
+{
+    this->assignSorted(other.cbegin(), other.cend());
+}
 
-    // Case 2: bf = -1, then recurse
-    else if (grandp->getBalance() == -1){
-      // keep going up to check for potential imbalance
-      insertFix(grandp, parent);
-    }
-    // Case 3: bf = -2, then this subtree imbalanced
-    else {
-      // zig-zig case, heavy left so rotate right
-      if(parent->getLeft() == node){
-        rotateRight(grandp);
-        // bf(p) = bf(g) after rotate
-        parent->setBalance(0);
-        grandp->setBalance(0);
-      }
-      // zig-zag case. do rotateLeft(p) then rotatteRight(g)
-      else if (parent->getRight() == node){
-        rotateLeft(parent);
-        rotateRight(grandp);
-
-        // Update balances
-        // Case 3a:
-        // b(n) = -1; then b(p) = 0, b(g) = 1, b(n) = 0
-        if(node->getBalance() == -1){
-          parent->setBalance(0);
-          grandp->setBalance(1);
-          node->setBalance(0);
-        }
-        // Case 3b:
-        // b(n) = 0; then b(p)=0, b(g)=0, b(n)=0
-        else if(node->getBalance() == 0){
-          parent->setBalance(0);
-          grandp->setBalance(0);
-          node->setBalance(0);
-        }
-        // Case 3c:
-        //b(n) = 1; then b(p)=-1, b(g)=0, b(n)=0
-        else {
-          parent->setBalance(-1);
-          grandp->setBalance(0);
-          node->setBalance(0);
-        }
-      }
+/**
+* Copy assignment. Replaces the contents with a balanced copy of other.
+*/
+template<class Key, class Value, class Compare>
+AVLTree<Key, Value, Compare>& AVLTree<Key, Value, Compare>::operator=(const AVLTree& other)
+{
+    if(this != &other) {
+        orderStats_ = other.orderStats_;
+        BinarySearchTree<Key, Value, Compare>::operator=(other);
     }
-  }
+    return *this;
+}
 
-  // case for p is right child
-  // grandp->getRight() == parent;
-  else{
-    grandp->updateBalance(1);
+/*
+ * Insertion itself (including overwriting the value of an
+ * existing key) is done by BinarySearchTree; once the new
+ * node is linked in, this restores the AVL balance.
+ */
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::afterInsert(Node<Key, Value>* node)
+{
+  AVLNode<Key, Value> *newNode = static_cast<AVLNode<Key, Value>*>(node);
+  AVLNode<Key, Value> *parent = newNode->getParent();
 
-    // Case 1:
-    if(grandp->getBalance() == 0){
-      return;
-    }
-    // Case 2:
-    else if(grandp->getBalance() == 1){
-      insertFix(grandp, parent);
-    }
-    // Case 3: grandp->getBalance() == 2
-    else{
-      // zig-zig case: heavy right so rotate left
-      if(parent->getRight() == node){
-        rotateLeft(grandp);
-        parent->setBalance(0);
-        grandp->setBalance(0);
-      }
-      // zig-zag: rotateRight(p), then rotateLeft(g)
-      else if (parent->getLeft() == node){
-        rotateRight(parent);
-        rotateLeft(grandp);
-
-        // Update balance
-        // Case 3a: b(n)=1, then b(p)=0, b(g)=-1, b(n)=0
-        if(node->getBalance() == 1){
-          parent->setBalance(0);
-          grandp->setBalance(-1);
-          node->setBalance(0);
-        }
-        // Case 3b: b(n)=0, then b(p)=0, b(g)=0, b(n)=0
-        else if(node->getBalance() == 0){
-          parent->setBalance(0);
-          grandp->setBalance(0);
-          node->setBalance(0);
-        }
-        // Case 3c: b(n)=-1, then b(p)=1, b(g)=0, b(n)=0
-        else {
-          parent->setBalance(1);
-          grandp->setBalance(0);
-          node->setBalance(0);
-        }
-      }
-    }
+  // count the new node on the way up first; rotations then only
+  // have to fix the nodes they move
+  if(orderStats_){
+    addToSizes(parent, 1);
+  }
+
+  // a new root has nothing above it to rebalance
+  if(parent != NULL){
+    rebalanceUp(parent, parent->getRight() == newNode, true);
   }
 }
 
@@ -329,24 +375,25 @@ void AVLTree<Key, Value>::insertFix (AVLNode<Key, Value>* parent, AVLNode<Key, V
  * Recall: The writeup specifies that if a node has 2 children you
  * should swap with the predecessor and then remove.
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>:: remove(const Key& key)
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>:: remove(const Key& key)
 {
-  AVLNode<Key,Value> *target = static_cast<AVLNode<Key,Value>*>(BinarySearchTree<Key, Value>::internalFind(key));
+  AVLNode<Key,Value> *target = static_cast<AVLNode<Key,Value>*>(BinarySearchTree<Key, Value, Compare>::internalFind(key));
   if(target == NULL){
     return;
   }
+  this->beforeUnlink(target);
 
   // if target is root_, remove and set root to NULL
   if(target == this->root_ && target->getLeft() == NULL && target->getRight() == NULL){
-    delete target;
+    this->destroyNode(target);
     this->root_ = NULL;
     return;
   }
 
   // check for 2 children first to reduce to 1 or 0 children case
   if(target->getLeft() != NULL && target->getRight() != NULL){
-    AVLNode<Key, Value> *pred = static_cast<AVLNode<Key, Value>*>(BinarySearchTree<Key,Value>::predecessor(target));
+    AVLNode<Key, Value> *pred = static_cast<AVLNode<Key, Value>*>(BinarySearchTree<Key, Value, Compare>::predecessor(target));
     nodeSwap(pred, target);
   }
 
@@ -361,9 +408,9 @@ void AVLTree<Key, Value>:: remove(const Key& key)
     }
   }
   // find parent
-  int diff = 0;
+  bool fromRight = false;
   AVLNode<Key, Value>* parent = target->getParent();
-  
+
 
   // set child's parent to target's parent since it'll be deleted
   if(child != NULL){
@@ -378,230 +425,1164 @@ void AVLTree<Key, Value>:: remove(const Key& key)
   else if(parent != NULL){
     // check if target is left child
     if(parent->getLeft() == target){
-      diff = 1;
       parent->setLeft(child);
     }
     else{
       // check if target is right child
-      diff = -1;
+      fromRight = true;
       parent->setRight(child);
     }
   }
-  delete target;
-  removeFix(parent, diff);
+  if(orderStats_){
+    addToSizes(parent, -1);
+  }
+  this->destroyNode(target);
+  if(parent != NULL){
+    rebalanceUp(parent, fromRight, false);
+  }
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>:: removeFix(AVLNode<Key, Value>* n, int diff)
+/**
+* Returns the node access the rebalancing code in avl_balance.h runs on.
+*/
+template<class Key, class Value, class Compare>
+typename AVLTree<Key, Value, Compare>::BalanceLinks AVLTree<Key, Value, Compare>::balanceLinks() const
 {
-  if(n == NULL){
-    return;
+  BalanceLinks links;
+  links.sizes = orderStats_;
+  return links;
+}
+
+/**
+* Walks up from node, whose right subtree (or left) has just grown or
+* lost a level, fixing balances and rotating where needed until some
+* subtree's height stays the same.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::rebalanceUp(AVLNode<Key, Value>* node, bool right, bool grew)
+{
+  BalanceLinks links = balanceLinks();
+  while(node != NULL){
+    AVLNode<Key, Value> *parent = node->getParent();
+    bool changed;
+    AVLNode<Key, Value> *top = grew ? Balance::grow(links, node, right, changed)
+                                    : Balance::shrink(links, node, right, changed);
+    if(top != node){
+      replaceChild(parent, node, top);
+    }
+    if(!changed){
+      return;
+    }
+    right = parent != NULL && parent->getRight() == top;
+    node = parent;
   }
-  // initialize nextdiff
-  int ndiff = 0;
-  // find parent
-  AVLNode<Key, Value>* p = n->getParent();
-  if(p != NULL){
-    if(p->getLeft() == n){
-      ndiff = 1;
+}
+
+/**
+* Puts top where child was below parent, or at the root if parent is
+* NULL. The top of a detached subtree being joined has no parent either,
+* but leaves root_ alone.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::replaceChild(AVLNode<Key, Value>* parent, AVLNode<Key, Value>* child, AVLNode<Key, Value>* top)
+{
+  top->setParent(parent);
+  if(parent == NULL){
+    if(this->root_ == child){
+      this->root_ = top;
+    }
+  }
+  else if(parent->getLeft() == child){
+    parent->setLeft(top);
+  }
+  else {
+    parent->setRight(top);
+  }
+}
+
+/**
+* Lifts node's left child into its place. Balances are left to the caller.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>:: rotateRight(AVLNode<Key, Value>* node)
+{
+  AVLNode<Key, Value> *parent = node->getParent();
+  replaceChild(parent, node, Balance::rotateRight(balanceLinks(), node));
+}
+
+/**
+* Mirror image of rotateRight().
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>:: rotateLeft(AVLNode<Key, Value>* node)
+{
+  AVLNode<Key, Value> *parent = node->getParent();
+  replaceChild(parent, node, Balance::rotateLeft(balanceLinks(), node));
+}
+
+/**
+* Creates an AVLNode, so code in BinarySearchTree builds the right type.
+*/
+template<class Key, class Value, class Compare>
+Node<Key, Value>* AVLTree<Key, Value, Compare>::createNode(const ItemBuilder<Key, Value>& build, Node<Key, Value>* parent)
+{
+    return this->constructNode(build, static_cast<AVLNode<Key, Value>*>(parent));
+}
+
+/**
+* Sets the balance of a node built by assignSorted() from its subtree
+* heights, and its subtree size, which is known for free here.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::initBuiltNode(Node<Key, Value>* node, int leftHeight, int rightHeight, std::size_t count)
+{
+    AVLNode<Key, Value>* avlNode = static_cast<AVLNode<Key, Value>*>(node);
+    avlNode->setBalance(rightHeight - leftHeight);
+    avlNode->setSubtreeSize(static_cast<uint32_t>(count));
+}
+
+/**
+* Destroys an AVLNode in place; Node's destructor is not virtual.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::destructNode(Node<Key, Value>* node)
+{
+    static_cast<AVLNode<Key, Value>*>(node)->~AVLNode();
+}
+
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2)
+{
+    BinarySearchTree<Key, Value, Compare>::nodeSwap(n1, n2);
+    int8_t tempB = n1->getBalance();
+    n1->setBalance(n2->getBalance());
+    n2->setBalance(tempB);
+    // sizes belong to the positions, which the nodes just traded
+    uint32_t tempS = n1->getSubtreeSize();
+    n1->setSubtreeSize(n2->getSubtreeSize());
+    n2->setSubtreeSize(tempS);
+}
+
+/**
+* Checks the tree against the AVL invariants: every stored balance factor
+* matches the actual heights of the node's subtrees and lies in [-1, 1],
+* every child links back to its parent, and with order statistics on
+* every subtree size is right. A tree that fails has been damaged by a
+* rebalancing bug. Walks every node, so it is O(n); only a
+* BinarySearchTree(true) answers isBalanced() in O(1).
+*/
+template<class Key, class Value, class Compare>
+bool AVLTree<Key, Value, Compare>::isBalanced() const
+{
+    bool ok = true;
+    std::size_t size;
+    checkSubtree(static_cast<AVLNode<Key, Value>*>(this->root_), NULL, size, ok);
+    return ok && size == this->size();
+}
+
+/**
+* Returns the height of the subtree at node and sets size to its node
+* count, clearing ok if any invariant isBalanced() checks fails in it.
+*/
+template<class Key, class Value, class Compare>
+int AVLTree<Key, Value, Compare>::checkSubtree(AVLNode<Key, Value>* node, AVLNode<Key, Value>* parent,
+                                               std::size_t& size, bool& ok) const
+{
+    size = 0;
+    if(node == NULL){
+        return 0;
+    }
+    if(node->getParent() != parent){
+        ok = false;
+    }
+    std::size_t leftSize, rightSize;
+    int left = checkSubtree(node->getLeft(), node, leftSize, ok);
+    int right = checkSubtree(node->getRight(), node, rightSize, ok);
+    size = leftSize + rightSize + 1;
+    if(right - left != node->getBalance() || right - left < -1 || right - left > 1){
+        ok = false;
+    }
+    if(orderStats_ && node->getSubtreeSize() != size){
+        ok = false;
+    }
+    return std::max(left, right) + 1;
+}
+
+/**
+* Returns the number of nodes on the longest root-to-leaf path. The
+* balance factors say which child is taller at every level, so this
+* follows one path down: O(log n) with no extra per-node state. (Only a
+* BinarySearchTree(true), which stores heights, answers in O(1).)
+*/
+template<class Key, class Value, class Compare>
+int AVLTree<Key, Value, Compare>::height() const
+{
+    int height = 0;
+    for(Node<Key, Value> *curr = this->root_; curr != NULL; curr = tallerChild(curr)){
+        ++height;
+    }
+    return height;
+}
+
+/**
+* Returns the child with the taller subtree, read off the balance factor.
+*/
+template<class Key, class Value, class Compare>
+Node<Key, Value>* AVLTree<Key, Value, Compare>::tallerChild(Node<Key, Value>* node) const
+{
+    AVLNode<Key, Value>* avlNode = static_cast<AVLNode<Key, Value>*>(node);
+    if(avlNode->getBalance() > 0){
+        return avlNode->getRight();
+    }
+    return avlNode->getLeft();
+}
+
+/**
+* Cuts the parallel passes by height rather than depth: levels count
+* down with each child's height, so a piece is split until its subtree
+* is no taller than a cut height c. Such a subtree holds at most 2^c - 1
+* items, and c is the least height for which chunks of those cover the
+* tree, so no piece holds more than about twice an even share. Depth
+* alone would not do, as subtrees at one depth of an AVL tree can differ
+* in size by a factor growing like 1.6^depth.
+*/
+template<class Key, class Value, class Compare>
+int AVLTree<Key, Value, Compare>::splitLevels(std::size_t chunks) const
+{
+    int cut = 1;
+    while(((std::size_t(1) << cut) - 1) * chunks < this->size()){
+        ++cut;
+    }
+    return height() - cut;
+}
+
+/**
+* Returns the levels left to split below node, on its right side or its
+* left: the levels it had less the drop in height to that child, which
+* the balance factor gives.
+*/
+template<class Key, class Value, class Compare>
+int AVLTree<Key, Value, Compare>::childSplitLevels(Node<Key, Value>* node, int levels, bool right) const
+{
+    int balance = static_cast<AVLNode<Key, Value>*>(node)->getBalance();
+    if(right ? balance < 0 : balance > 0){
+        return levels - 2;
+    }
+    return levels - 1;
+}
+
+/**
+* Turns subtree-size maintenance on or off. While it is on, every node
+* knows how many nodes its subtree holds, which rank(), select() and
+* count() use to answer in O(log n). It costs no memory (the count lives
+* in AVLNode padding) but adds O(log n) work to each insert and remove.
+* Turning it on recounts the existing tree in O(n). Sizes are 32-bit, so
+* the tree must stay below 2^32 items while it is on.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::setOrderStatistics(bool enabled)
+{
+    if(enabled && !orderStats_){
+        computeSizes(static_cast<AVLNode<Key, Value>*>(this->root_));
+    }
+    orderStats_ = enabled;
+}
+
+/**
+* Returns true if subtree sizes are being maintained.
+*/
+template<class Key, class Value, class Compare>
+bool AVLTree<Key, Value, Compare>::orderStatistics() const
+{
+    return orderStats_;
+}
+
+/**
+* Returns the number of keys less than key, i.e. the index key has or
+* would have in sorted order.
+* @throws std::logic_error if order statistics are off
+*/
+template<class Key, class Value, class Compare>
+std::size_t AVLTree<Key, Value, Compare>::rank(const Key& key) const
+{
+  requireOrderStatistics();
+  std::size_t less = 0;
+  AVLNode<Key, Value> *curr = static_cast<AVLNode<Key, Value>*>(this->root_);
+  while(curr != NULL){
+    if(this->comp_(curr->getKey(), key)){
+      // everything on the left plus curr itself is smaller
+      less += subtreeSize(curr->getLeft()) + 1;
+      curr = curr->getRight();
     }
     else {
-      ndiff = -1;
+      curr = curr->getLeft();
     }
   }
+  return less;
+}
+
+/**
+* Returns an iterator to the k-th smallest item, counting from 0.
+* @throws std::logic_error if order statistics are off
+* @throws std::out_of_range if k >= size()
+*/
+template<class Key, class Value, class Compare>
+typename AVLTree<Key, Value, Compare>::iterator
+AVLTree<Key, Value, Compare>::select(std::size_t k) const
+{
+  requireOrderStatistics();
+  if(k >= this->size()){
+    throw std::out_of_range("select: index past the end");
+  }
+  return this->makeIterator(selectNode(k));
+}
+
+/**
+* Returns the number of keys k with lo <= k < hi.
+* @throws std::logic_error if order statistics are off
+*/
+template<class Key, class Value, class Compare>
+std::size_t AVLTree<Key, Value, Compare>::count(const Key& lo, const Key& hi) const
+{
+    if(!this->comp_(lo, hi)){
+        requireOrderStatistics();
+        return 0;
+    }
+    return rank(hi) - rank(lo);
+}
+
+/**
+* Returns the size of node's subtree, 0 for an empty one.
+*/
+template<class Key, class Value, class Compare>
+std::size_t AVLTree<Key, Value, Compare>::subtreeSize(AVLNode<Key, Value>* node)
+{
+    return node == NULL ? 0 : node->getSubtreeSize();
+}
+
+/**
+* Recomputes node's subtree size from its children's.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::resize(AVLNode<Key, Value>* node)
+{
+    node->setSubtreeSize(static_cast<uint32_t>(subtreeSize(node->getLeft()) + subtreeSize(node->getRight()) + 1));
+}
+
+/**
+* Adds diff to the subtree size of node and each of its ancestors.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::addToSizes(AVLNode<Key, Value>* node, int diff)
+{
+    for(; node != NULL; node = node->getParent()){
+        node->setSubtreeSize(node->getSubtreeSize() + diff);
+    }
+}
 
-  // assume diff = -1;
-  if(diff == -1){
-    // Case 1: diff + b(n) = -2
-    if(diff + n->getBalance() == -2){
-      // get taller children
-      AVLNode<Key, Value>* c = n->getLeft();
-      // Case 1a: b(c)=-1 -> zig-zig
-      if(c->getBalance() == -1){
-        rotateRight(n);
-        n->setBalance(0);
-        c->setBalance(0);
-        removeFix(p, ndiff);
-      }
-      // Case 1b: b(c)=0 -> zig-zig
-      else if(c->getBalance() == 0){
-        rotateRight(n);
-        n->setBalance(-1);
-        c->setBalance(1);
-      }
-      // Case 1c: b(c)=1 -> zig-zag
-      else {
-        AVLNode<Key, Value>* g = c->getRight();
-        rotateLeft(c);
-        rotateRight(n);
-        if(g->getBalance() == 1){
-          n->setBalance(0);
-          c->setBalance(-1);
-          g->setBalance(0);
+/**
+* Recounts every subtree size below node, returning node's. AVL trees are
+* shallow, so the recursion depth stays logarithmic.
+*/
+template<class Key, class Value, class Compare>
+uint32_t AVLTree<Key, Value, Compare>::computeSizes(AVLNode<Key, Value>* node)
+{
+    if(node == NULL){
+        return 0;
+    }
+    uint32_t size = computeSizes(node->getLeft()) + computeSizes(node->getRight()) + 1;
+    node->setSubtreeSize(size);
+    return size;
+}
+
+/**
+* Returns the k-th smallest node, counting from 0. Needs subtree sizes
+* and k < size().
+*/
+template<class Key, class Value, class Compare>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare>::selectNode(std::size_t k) const
+{
+    AVLNode<Key, Value> *curr = static_cast<AVLNode<Key, Value>*>(this->root_);
+    while(true){
+        std::size_t leftSize = subtreeSize(curr->getLeft());
+        if(k < leftSize){
+            curr = curr->getLeft();
         }
-        else if(g->getBalance() == 0){
-          n->setBalance(0);
-          c->setBalance(0);
-          g->setBalance(0);
+        else if(k == leftSize){
+            return curr;
         }
-        // g->getBalance() == -1
         else {
-          n->setBalance(1);
-          c->setBalance(0);
-          g->setBalance(0);         
+            k -= leftSize + 1;
+            curr = curr->getRight();
         }
-        removeFix(p, ndiff);
-      }
     }
-    // Case 2: diff + b(n) = -1
-    else if(diff + n->getBalance() == -1){
-      n->setBalance(-1);
-      return;
+}
+
+/**
+* Throws unless order statistics are on.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::requireOrderStatistics() const
+{
+    if(!orderStats_){
+        throw std::logic_error("order statistics are not enabled");
     }
-    // Case 3: diff + b(n) = 0
-    else {
-      n->setBalance(0);
-      removeFix(p, ndiff);
+}
+
+
+
+/**
+* Moves every item with a key not less than key into right, replacing
+* whatever right held, and keeps the rest. Runs in O(log n): the tree is
+* cut along the search path for key and the pieces on each side are
+* joined back up, so no item is copied or rebalanced one at a time. With
+* order statistics off, counting the k items that move adds O(k).
+*
+* Afterwards the two trees share this tree's node pool, so later joins
+* between them are O(log n) too. Trees sharing a pool must not be
+* modified from different threads at once.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::split(const Key& key, AVLTree& right)
+{
+    if(&right == this){
+        throw std::invalid_argument("split: right must be a different tree");
     }
-  }
+    right.clear();
 
-  // diff = 1
-  else if (diff == 1){
-    // Case 1: diff + b(n) == 2
-    if(diff + n->getBalance() == 2){
-      AVLNode<Key, Value>* c = n->getRight();
-      // Case 1a: zig-zig
-      if(c->getBalance() == 1){
-        rotateLeft(n);
-        n->setBalance(0);
-        c->setBalance(0);
-        removeFix(p, ndiff);
-      }
-      // Case 1b: zig-zig
-      else if (c->getBalance() == 0){
-        rotateLeft(n);
-        n->setBalance(1);
-        c->setBalance(-1);
-      }
-      // Case 1c: zig-zag
-      else if (c->getBalance() == -1){
-        AVLNode<Key, Value>* g = c->getLeft();
-        rotateRight(c);
-        rotateLeft(n);
-        if(g->getBalance() == -1){
-          n->setBalance(0);
-          c->setBalance(1);
-          g->setBalance(0);
-        }
-        else if (g->getBalance() == 0){
-          n->setBalance(0);
-          c->setBalance(0);
-          g->setBalance(0);
-        }
-        else if(g->getBalance() == 1){
-          n->setBalance(-1);
-          c->setBalance(0);
-          g->setBalance(0);
-        }
-        removeFix(p, ndiff);
-      }
+    AVLNode<Key, Value> *less, *greater;
+    int lessHeight, greaterHeight;
+    splitAt(static_cast<AVLNode<Key, Value>*>(this->root_), height(), key,
+            less, lessHeight, greater, greaterHeight);
+    std::size_t moved = orderStats_ ? subtreeSize(greater) : computeSizes(greater);
+    setTree(less, this->size_ - moved);
+
+    right.comp_ = this->comp_;
+    right.pool_ = this->pool_;
+    right.setTree(greater, moved);
+}
+
+/**
+* Replaces the contents of this tree with the items of left, then pivot,
+* then the items of right, leaving left and right empty. Every key in
+* left must be less than pivot's, and pivot's less than every key in
+* right. Either of them may be this tree itself.
+*
+* Runs in O(log n) when left and right share this tree's node pool, or
+* own theirs outright, since their slabs can then be taken over whole.
+* Nodes in a pool that a third tree also uses are copied instead.
+* @throws std::invalid_argument if the keys are out of order, or if left
+*         and right are the same tree
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::join(AVLTree& left, std::pair<const Key, Value> pivot, AVLTree& right)
+{
+    if(&left == &right){
+        throw std::invalid_argument("join: left and right must be different trees");
+    }
+    if((left.rightmost_ != NULL && !this->comp_(left.rightmost_->getKey(), pivot.first)) ||
+       (right.root_ != NULL && !this->comp_(pivot.first, right.getSmallestNode()->getKey()))){
+        throw std::invalid_argument("join: keys must increase from left to pivot to right");
+    }
+    if(this != &left && this != &right){
+        this->clear();
     }
 
-    // Case 2: diff + b(n) == 1
-    else if (diff + n->getBalance() == 1){
-      n->setBalance(1);
+    auto build = [&](std::pair<const Key, Value>* where) {
+        ::new (static_cast<void*>(where)) std::pair<const Key, Value>(std::move(pivot));
+    };
+    AVLNode<Key, Value>* middle = static_cast<AVLNode<Key, Value>*>(
+        this->createNode(ItemBuilder<Key, Value>(build), NULL));
+
+    std::size_t leftSize = left.size_;
+    std::size_t rightSize = right.size_;
+    AVLNode<Key, Value> *leftRoot, *rightRoot;
+    try {
+        leftRoot = takeTree(left);
     }
-    // Case 3: diff + b(n) == 0
-    else{
-      n->setBalance(0);
-      removeFix(p,ndiff);
+    catch(...) {
+        this->destroyNode(middle);
+        throw;
     }
-  }
+    try {
+        rightRoot = takeTree(right);
+    }
+    catch(...) {
+        // left's nodes now live in this tree's pool; give them back there
+        left.pool_ = this->pool_;
+        left.setTree(leftRoot, leftSize);
+        this->destroyNode(middle);
+        throw;
+    }
+
+    int joinedHeight;
+    AVLNode<Key, Value>* root = joinAt(leftRoot, subtreeHeight(leftRoot), middle,
+                                       rightRoot, subtreeHeight(rightRoot), joinedHeight);
+    setTree(root, leftSize + rightSize + 1);
 }
 
+/**
+* Moves every item of other to the end of this tree in O(log n),
+* leaving other empty. Every key in other must be greater than every
+* key here. Node pools are handled as in join().
+* @throws std::invalid_argument if the keys overlap, or other is this tree
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::append(AVLTree& other)
+{
+    if(&other == this){
+        throw std::invalid_argument("append: cannot append a tree to itself");
+    }
+    if(other.root_ == NULL){
+        return;
+    }
+    if(this->rightmost_ != NULL && !this->comp_(this->rightmost_->getKey(), other.getSmallestNode()->getKey())){
+        throw std::invalid_argument("append: keys must be greater than every key in the tree");
+    }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>:: rotateRight(AVLNode<Key, Value>* node)
+    std::size_t otherSize = other.size_;
+    AVLNode<Key, Value>* otherRoot = takeTree(other);
+    int myHeight = height();
+    int joinedHeight;
+    AVLNode<Key, Value>* root = joinTrees(static_cast<AVLNode<Key, Value>*>(this->root_), myHeight,
+                                          otherRoot, subtreeHeight(otherRoot), joinedHeight);
+    setTree(root, this->size_ + otherSize);
+}
+
+/**
+* Removes every item with lo <= key < hi. The range is cut out with two
+* splits and the remainder joined back together, so the restructuring
+* is O(log n) however many items go; freeing the k removed nodes adds
+* O(k), where k calls to remove() would each run removeFix().
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::erase(const Key& lo, const Key& hi)
 {
-  // done if nothing on left side to rotate
-  if(node->getLeft() == NULL){
-    return;
-  }
+    if(!this->comp_(lo, hi)){
+        return;
+    }
+    AVLNode<Key, Value> *less, *rest, *middle, *greater;
+    int lessHeight, restHeight, middleHeight, greaterHeight;
+    splitAt(static_cast<AVLNode<Key, Value>*>(this->root_), height(), lo,
+            less, lessHeight, rest, restHeight);
+    splitAt(rest, restHeight, hi, middle, middleHeight, greater, greaterHeight);
 
-  // node's parent
-  AVLNode<Key, Value> *parent = node->getParent();
-  // left = y, while z = node
-  AVLNode<Key, Value> *y = node->getLeft();
+    std::size_t removed = this->destroySubtree(middle);
+    int joinedHeight;
+    setTree(joinTrees(less, lessHeight, greater, greaterHeight, joinedHeight), this->size_ - removed);
+}
+
+/**
+* Moves every item with lo <= key < hi into out, replacing whatever out
+* held. Like erase(), but the cut-out nodes become out's tree instead of
+* being freed, so it runs in O(log n) (plus O(k) to count the k items
+* moved when order statistics are off). out then shares this tree's node
+* pool, as after split().
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::extract_range(const Key& lo, const Key& hi, AVLTree& out)
+{
+    if(&out == this){
+        throw std::invalid_argument("extract_range: out must be a different tree");
+    }
+    out.clear();
+    if(!this->comp_(lo, hi)){
+        return;
+    }
+    AVLNode<Key, Value> *less, *rest, *middle, *greater;
+    int lessHeight, restHeight, middleHeight, greaterHeight;
+    splitAt(static_cast<AVLNode<Key, Value>*>(this->root_), height(), lo,
+            less, lessHeight, rest, restHeight);
+    splitAt(rest, restHeight, hi, middle, middleHeight, greater, greaterHeight);
+
+    std::size_t moved = orderStats_ ? subtreeSize(middle) : computeSizes(middle);
+    int joinedHeight;
+    setTree(joinTrees(less, lessHeight, greater, greaterHeight, joinedHeight), this->size_ - moved);
+
+    out.comp_ = this->comp_;
+    out.pool_ = this->pool_;
+    out.setTree(middle, moved);
+}
+
+/**
+* Returns the height of node's subtree by following the taller child
+* down, as height() does for the whole tree.
+*/
+template<class Key, class Value, class Compare>
+int AVLTree<Key, Value, Compare>::subtreeHeight(AVLNode<Key, Value>* node)
+{
+    int height = 0;
+    while(node != NULL){
+        ++height;
+        node = node->getBalance() > 0 ? node->getRight() : node->getLeft();
+    }
+    return height;
+}
+
+/**
+* Returns the height of node's left subtree, given node's own height.
+*/
+template<class Key, class Value, class Compare>
+int AVLTree<Key, Value, Compare>::leftChildHeight(AVLNode<Key, Value>* node, int height)
+{
+    return node->getBalance() > 0 ? height - 2 : height - 1;
+}
 
-  // asign c to z
-  node->setLeft(y->getRight());
-  if(node->getLeft() != NULL){
-    node->getLeft()->setParent(node);
+/**
+* Returns the height of node's right subtree, given node's own height.
+*/
+template<class Key, class Value, class Compare>
+int AVLTree<Key, Value, Compare>::rightChildHeight(AVLNode<Key, Value>* node, int height)
+{
+    return node->getBalance() < 0 ? height - 2 : height - 1;
+}
+
+/**
+* Joins two detached AVL subtrees with pivot between them, where every
+* key in left is less than pivot's and pivot's less than every key in
+* right. Returns the root of the result and sets height to its height.
+* When the heights are within one of each other pivot simply becomes the
+* root; otherwise see joinSpine(). Runs in O(|leftHeight - rightHeight|).
+*/
+template<class Key, class Value, class Compare>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare>::joinAt(AVLNode<Key, Value>* left, int leftHeight, AVLNode<Key, Value>* pivot,
+                                                          AVLNode<Key, Value>* right, int rightHeight, int& height)
+{
+    if(leftHeight > rightHeight + 1){
+        return joinSpine(left, leftHeight, pivot, right, rightHeight, true, height);
+    }
+    if(rightHeight > leftHeight + 1){
+        return joinSpine(right, rightHeight, pivot, left, leftHeight, false, height);
+    }
+    pivot->setParent(NULL);
+    pivot->setLeft(left);
+    pivot->setRight(right);
+    if(left != NULL){
+        left->setParent(pivot);
+    }
+    if(right != NULL){
+        right->setParent(pivot);
+    }
+    pivot->setBalance(rightHeight - leftHeight);
+    if(orderStats_){
+        resize(pivot);
+    }
+    height = std::max(leftHeight, rightHeight) + 1;
+    return pivot;
+}
+
+/**
+* The uneven case of joinAt(). Walks down the spine of the taller tree
+* on the side facing the other one (its right spine if alongRight) to
+* the first subtree at most one taller than other, puts pivot in its
+* place with that subtree and other as children, and climbs back up
+* fixing balances. Each node on the way is at most two out of balance,
+* and the same single and double rotations as after an insert repair it;
+* unlike after an insert, the subtree may still have grown afterwards,
+* so the climb goes on to the top of the spine.
+*
+* Nothing outside the two subtrees is touched, and root_ only if one of
+* their nodes is the root, so once root_ is cleared, joins of disjoint
+* subtrees may run on different threads at once.
+*/
+template<class Key, class Value, class Compare>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare>::joinSpine(AVLNode<Key, Value>* tall, int tallHeight, AVLNode<Key, Value>* pivot,
+                                                             AVLNode<Key, Value>* other, int otherHeight, bool alongRight, int& height)
+{
+  // balance factors are read from the spine's point of view, where a
+  // positive lean means the outer side (the spine side) is taller
+  int sign = alongRight ? 1 : -1;
+  auto outerChild = [alongRight](AVLNode<Key, Value>* node) {
+    return alongRight ? node->getRight() : node->getLeft();
+  };
+  auto innerChild = [alongRight](AVLNode<Key, Value>* node) {
+    return alongRight ? node->getLeft() : node->getRight();
+  };
+  auto rotateInward = [this, alongRight](AVLNode<Key, Value>* node) {
+    if(alongRight) rotateLeft(node); else rotateRight(node);
+  };
+  auto rotateOutward = [this, alongRight](AVLNode<Key, Value>* node) {
+    if(alongRight) rotateRight(node); else rotateLeft(node);
+  };
+
+  tall->setParent(NULL);
+
+  AVLNode<Key, Value> *parent = NULL;
+  AVLNode<Key, Value> *spine = tall;
+  int spineHeight = tallHeight;
+  while(spineHeight > otherHeight + 1){
+    parent = spine;
+    spineHeight = alongRight ? rightChildHeight(spine, spineHeight) : leftChildHeight(spine, spineHeight);
+    spine = outerChild(spine);
   }
-  // if z was root, change to y
-  if(parent == NULL){
-    this->root_ = y;
+
+  // pivot takes spine's place, with spine inside and other outside
+  AVLNode<Key, Value> *inner = spine, *outer = other;
+  pivot->setLeft(alongRight ? inner : outer);
+  pivot->setRight(alongRight ? outer : inner);
+  if(inner != NULL){
+    inner->setParent(pivot);
   }
-  // if z had parents, update pointers
-  // if right side
-  else if(parent->getRight() == node){
-    parent->setRight(y);
+  if(outer != NULL){
+    outer->setParent(pivot);
   }
-  // if left side
-  else if (parent->getLeft() == node){
-    parent->setLeft(y);
+  pivot->setBalance(sign * (otherHeight - spineHeight));
+  pivot->setParent(parent);
+  if(alongRight){
+    parent->setRight(pivot);
   }
+  else {
+    parent->setLeft(pivot);
+  }
+  if(orderStats_){
+    resize(pivot);
+  }
+
+  // curr is the subtree that replaced one of oldHeight, now currHeight tall
+  AVLNode<Key, Value> *curr = pivot;
+  int currHeight = std::max(spineHeight, otherHeight) + 1;
+  int oldHeight = spineHeight;
+  while(curr->getParent() != NULL){
+    AVLNode<Key, Value> *node = curr->getParent();
+    int innerHeight = oldHeight - sign * node->getBalance();
+    int nodeOldHeight = std::max(innerHeight, oldHeight) + 1;
+    if(orderStats_){
+      resize(node);
+    }
 
-  y->setParent(parent);
-  y->setRight(node);
-  node->setParent(y);
+    int lean = sign * curr->getBalance();
+    if(currHeight - innerHeight <= 1){
+      node->setBalance(sign * (currHeight - innerHeight));
+      currHeight = std::max(innerHeight, currHeight) + 1;
+      curr = node;
+    }
+    // Case 1: curr does not lean inward, so a single rotation lifts it
+    else if(lean >= 0){
+      int middleHeight = lean > 0 ? currHeight - 2 : currHeight - 1;
+      int outerHeight = currHeight - 1;
+      rotateInward(node);
+      int nodeHeight = std::max(innerHeight, middleHeight) + 1;
+      node->setBalance(sign * (middleHeight - innerHeight));
+      curr->setBalance(sign * (outerHeight - nodeHeight));
+      currHeight = std::max(nodeHeight, outerHeight) + 1;
+    }
+    // Case 2: curr leans inward, so its inner child comes up two levels
+    else {
+      AVLNode<Key, Value> *grand = innerChild(curr);
+      int grandHeight = currHeight - 1;
+      int grandLean = sign * grand->getBalance();
+      int grandInner = grandLean > 0 ? grandHeight - 2 : grandHeight - 1;
+      int grandOuter = grandLean < 0 ? grandHeight - 2 : grandHeight - 1;
+      int outerHeight = currHeight - 2;
+      rotateOutward(curr);
+      rotateInward(node);
+      int nodeHeight = std::max(innerHeight, grandInner) + 1;
+      int currNewHeight = std::max(grandOuter, outerHeight) + 1;
+      node->setBalance(sign * (grandInner - innerHeight));
+      curr->setBalance(sign * (outerHeight - grandOuter));
+      grand->setBalance(sign * (currNewHeight - nodeHeight));
+      currHeight = std::max(nodeHeight, currNewHeight) + 1;
+      curr = grand;
+    }
+    oldHeight = nodeOldHeight;
+  }
+  height = currHeight;
+  return curr;
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>:: rotateLeft(AVLNode<Key, Value>* node)
+/**
+* Joins two detached subtrees with no pivot between them, where every
+* key in left is less than every key in right. The smallest node of
+* right is cut out to serve as the pivot. Runs in O(log n).
+*/
+template<class Key, class Value, class Compare>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare>::joinTrees(AVLNode<Key, Value>* left, int leftHeight,
+                                                             AVLNode<Key, Value>* right, int rightHeight, int& height)
 {
-  // done if no node to rotate
-  if(node->getRight() == NULL){
-    return;
-  }
-  // node's parent
-  AVLNode<Key, Value> *parent = node->getParent();
-  // left = y, while x = node
-  AVLNode<Key, Value> *y = node->getRight();
+    if(right == NULL){
+        if(left != NULL){
+            left->setParent(NULL);
+        }
+        height = leftHeight;
+        return left;
+    }
+    AVLNode<Key, Value> *first, *rest;
+    int restHeight;
+    splitFirst(right, rightHeight, first, rest, restHeight);
+    return joinAt(left, leftHeight, first, rest, restHeight, height);
+}
 
-  // assign b to x
-  node->setRight(y->getLeft());
-  if(node->getRight() != NULL){
-    node->getRight()->setParent(node);
-  }
+/**
+* Splits the detached subtree at node, of the given height, into the
+* keys less than key (left) and the rest (right), along with their
+* heights. Each node on the search path is joined onto the side it
+* belongs to with the pieces cut off below it; the join costs telescope
+* to O(log n) in total.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::splitAt(AVLNode<Key, Value>* node, int height, const Key& key,
+                                           AVLNode<Key, Value>*& left, int& leftHeight,
+                                           AVLNode<Key, Value>*& right, int& rightHeight)
+{
+    if(node == NULL){
+        left = right = NULL;
+        leftHeight = rightHeight = 0;
+        return;
+    }
+    AVLNode<Key, Value> *nodeLeft = node->getLeft();
+    AVLNode<Key, Value> *nodeRight = node->getRight();
+    int nodeLeftHeight = leftChildHeight(node, height);
+    int nodeRightHeight = rightChildHeight(node, height);
+    if(nodeLeft != NULL){
+        nodeLeft->setParent(NULL);
+    }
+    if(nodeRight != NULL){
+        nodeRight->setParent(NULL);
+    }
 
-  // if x was root, set to y instead
-  if(parent == NULL){
-    this->root_ = y;
-  }
+    if(this->comp_(node->getKey(), key)){
+        // node and its left subtree stay on the left
+        AVLNode<Key, Value> *below;
+        int belowHeight;
+        splitAt(nodeRight, nodeRightHeight, key, below, belowHeight, right, rightHeight);
+        left = joinAt(nodeLeft, nodeLeftHeight, node, below, belowHeight, leftHeight);
+    }
+    else {
+        AVLNode<Key, Value> *below;
+        int belowHeight;
+        splitAt(nodeLeft, nodeLeftHeight, key, left, leftHeight, below, belowHeight);
+        right = joinAt(below, belowHeight, node, nodeRight, nodeRightHeight, rightHeight);
+    }
+}
 
-  // if x had parents, update pointers
-  else if(parent->getLeft() == node){
-    parent->setLeft(y);
-  }
-  else if(parent->getRight() == node){
-    parent->setRight(y);
-  }
-  
-  y->setParent(parent);
-  y->setLeft(node);
-  node->setParent(y);
+/**
+* Cuts the smallest node out of the detached subtree at node, returning
+* it in first and the remaining subtree and its height in rest and
+* restHeight. Runs in O(log n).
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::splitFirst(AVLNode<Key, Value>* node, int height,
+                                              AVLNode<Key, Value>*& first, AVLNode<Key, Value>*& rest, int& restHeight)
+{
+    AVLNode<Key, Value> *nodeLeft = node->getLeft();
+    AVLNode<Key, Value> *nodeRight = node->getRight();
+    int nodeRightHeight = rightChildHeight(node, height);
+    if(nodeRight != NULL){
+        nodeRight->setParent(NULL);
+    }
+    if(nodeLeft == NULL){
+        node->setRight(NULL);
+        node->setParent(NULL);
+        first = node;
+        rest = nodeRight;
+        restHeight = nodeRightHeight;
+        return;
+    }
+    nodeLeft->setParent(NULL);
+    AVLNode<Key, Value> *leftRest;
+    int leftRestHeight;
+    splitFirst(nodeLeft, leftChildHeight(node, height), first, leftRest, leftRestHeight);
+    rest = joinAt(leftRest, leftRestHeight, node, nodeRight, nodeRightHeight, restHeight);
 }
 
+/**
+* Detaches src's nodes and returns their root, leaving src empty, so
+* they can be joined into this tree. If src uses another node pool that
+* no other tree shares, this tree's pool adopts its slabs; if a third
+* tree shares it, the items are copied into this tree's pool instead
+* and src's nodes freed. Subtree sizes are recounted if this tree keeps
+* them and src did not.
+*/
+template<class Key, class Value, class Compare>
+AVLNode<Key, Value>* AVLTree<Key, Value, Compare>::takeTree(AVLTree& src)
+{
+    AVLNode<Key, Value> *root = static_cast<AVLNode<Key, Value>*>(src.root_);
+    if(root != NULL && src.pool_ != this->pool_){
+        if(src.pool_.use_count() > 1){
+            typename BinarySearchTree<Key, Value, Compare>::const_iterator it = src.cbegin();
+            root = static_cast<AVLNode<Key, Value>*>(this->buildSorted(it, src.size_, NULL));
+            src.clear();
+            return root;
+        }
+        this->pool_->adopt(*src.pool_);
+    }
+    if(root != NULL && orderStats_ && !src.orderStats_){
+        computeSizes(root);
+    }
+    src.root_ = NULL;
+    src.rightmost_ = NULL;
+    src.size_ = 0;
+    return root;
+}
 
+/**
+* Makes the detached subtree at root this tree's contents, holding size
+* items, and finds the new rightmost node.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::setTree(AVLNode<Key, Value>* root, std::size_t size)
+{
+    if(root != NULL){
+        root->setParent(NULL);
+    }
+    this->root_ = root;
+    this->size_ = size;
+    Node<Key, Value> *last = root;
+    while(last != NULL && last->getRight() != NULL){
+        last = last->getRight();
+    }
+    this->rightmost_ = last;
+}
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2)
+
+/**
+* Adds every item of other whose key is not already here, leaving other
+* empty; where both trees hold a key, this tree's value is kept. Node
+* pools are handled as in join().
+*
+* The union, intersect() and difference() all divide and conquer with
+* joins: the root of the other tree splits this one in two, the two
+* halves are combined with the other tree's subtrees independently, and
+* the results are joined back around that root. The halves are forked
+* onto pool, whose idle workers steal them, until the pieces get small.
+* For trees of m <= n items this does O(m log(n/m + 1)) work, so much
+* less than m searches when m is small, with O(log^2 n) span. The result
+* is built from the existing nodes, rebalanced by the joins.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::unionWith(AVLTree& other, ForkJoinPool& pool)
 {
-    BinarySearchTree<Key, Value>::nodeSwap(n1, n2);
-    int8_t tempB = n1->getBalance();
-    n1->setBalance(n2->getBalance());
-    n2->setBalance(tempB);
+    if(&other == this){
+        return;
+    }
+    std::size_t mySize = this->size_;
+    std::size_t theirSize = other.size_;
+    AVLNode<Key, Value>* theirs = takeTree(other);
+    std::size_t matches = runSetOperation(SET_UNION, static_cast<AVLNode<Key, Value>*>(this->root_), theirs, pool);
+    this->size_ = mySize + theirSize - matches;
+}
+
+/**
+* Removes every item whose key is not in other, which is left as it
+* was. See unionWith().
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::intersect(const AVLTree& other, ForkJoinPool& pool)
+{
+    if(&other == this){
+        return;
+    }
+    std::size_t matches = runSetOperation(SET_INTERSECTION, static_cast<AVLNode<Key, Value>*>(this->root_),
+                                          static_cast<AVLNode<Key, Value>*>(other.root_), pool);
+    this->size_ = matches;
+}
+
+/**
+* Removes every item whose key is in other, which is left as it was.
+* See unionWith().
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::difference(const AVLTree& other, ForkJoinPool& pool)
+{
+    if(&other == this){
+        this->clear();
+        return;
+    }
+    std::size_t matches = runSetOperation(SET_DIFFERENCE, static_cast<AVLNode<Key, Value>*>(this->root_),
+                                          static_cast<AVLNode<Key, Value>*>(other.root_), pool);
+    this->size_ -= matches;
+}
+
+/**
+* Combines this tree's nodes, rooted at mine, with theirs, installs the
+* result as this tree's contents and frees the nodes it left over.
+* Returns how many keys the two had in common; the caller sets size_.
+*/
+template<class Key, class Value, class Compare>
+std::size_t AVLTree<Key, Value, Compare>::runSetOperation(SetOperation op, AVLNode<Key, Value>* mine,
+                                                          AVLNode<Key, Value>* theirs, ForkJoinPool& pool)
+{
+    int myHeight = subtreeHeight(mine);
+    int theirHeight = subtreeHeight(theirs);
+    // no worker may rotate a node that root_ still points at
+    this->root_ = NULL;
+
+    SetPiece result;
+    if(myHeight >= PARALLEL_HEIGHT && theirHeight >= PARALLEL_HEIGHT){
+        pool.invoke([&]() {
+            setOperation(op, mine, myHeight, theirs, theirHeight, result, &pool);
+        });
+    }
+    else {
+        setOperation(op, mine, myHeight, theirs, theirHeight, result, NULL);
+    }
+    setTree(result.root, this->size_);
+
+    // the pool is not thread-safe, so the leftovers are freed here
+    AVLNode<Key, Value>* node = result.discarded;
+    while(node != NULL){
+        AVLNode<Key, Value>* next = node->getParent();
+        this->destroySubtree(node);
+        node = next;
+    }
+    return result.matches;
+}
+
+/**
+* Applies op to the detached subtrees mine and theirs, with their
+* heights, into out. The nodes of mine are reused for the result, as are
+* those of theirs for a union; otherwise theirs is only read. Forks its
+* two halves onto pool while both sides are tall enough to be worth it;
+* pool is NULL when running sequentially.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::setOperation(SetOperation op, AVLNode<Key, Value>* mine, int myHeight,
+                                                AVLNode<Key, Value>* theirs, int theirHeight, SetPiece& out, ForkJoinPool* pool)
+{
+    out.discarded = out.discardedTail = NULL;
+    out.matches = 0;
+    if(mine == NULL){
+        out.root = op == SET_UNION ? theirs : NULL;
+        out.height = op == SET_UNION ? theirHeight : 0;
+        if(out.root != NULL){
+            out.root->setParent(NULL);
+        }
+        return;
+    }
+    if(theirs == NULL){
+        if(op == SET_INTERSECTION){
+            discard(out, mine);
+            out.root = NULL;
+            out.height = 0;
+        }
+        else {
+            out.root = mine;
+            out.height = myHeight;
+        }
+        return;
+    }
+
+    AVLNode<Key, Value> *theirLeft = theirs->getLeft();
+    AVLNode<Key, Value> *theirRight = theirs->getRight();
+    int theirLeftHeight = leftChildHeight(theirs, theirHeight);
+    int theirRightHeight = rightChildHeight(theirs, theirHeight);
+    if(op == SET_UNION){
+        // theirs is taken apart; its root is joined or discarded below
+        theirs->setLeft(NULL);
+        theirs->setRight(NULL);
+    }
+
+    AVLNode<Key, Value> *less, *match, *greater;
+    int lessHeight, greaterHeight;
+    splitOut(mine, myHeight, theirs->getKey(), less, lessHeight, match, greater, greaterHeight);
+
+    SetPiece left, right;
+    bool parallel = pool != NULL && theirHeight >= PARALLEL_HEIGHT && myHeight >= PARALLEL_HEIGHT;
+    auto doLeft = [&]() {
+        setOperation(op, less, lessHeight, theirLeft, theirLeftHeight, left, parallel ? pool : NULL);
+    };
+    auto doRight = [&]() {
+        setOperation(op, greater, greaterHeight, theirRight, theirRightHeight, right, parallel ? pool : NULL);
+    };
+    if(parallel){
+        pool->fork(doLeft, doRight);
+    }
+    else {
+        doLeft();
+        doRight();
+    }
+
+    out.matches = left.matches + right.matches;
+    out.discarded = left.discarded != NULL ? left.discarded : right.discarded;
+    out.discardedTail = right.discardedTail != NULL ? right.discardedTail : left.discardedTail;
+    if(left.discardedTail != NULL){
+        left.discardedTail->setParent(right.discarded);
+    }
+
+    AVLNode<Key, Value> *pivot = NULL;
+    if(match != NULL){
+        ++out.matches;
+    }
+    if(op == SET_UNION){
+        pivot = match != NULL ? match : theirs;
+        if(match != NULL){
+            discard(out, theirs);
+        }
+    }
+    else if(op == SET_INTERSECTION){
+        pivot = match;
+    }
+    else if(match != NULL){
+        discard(out, match);
+    }
+
+    if(pivot != NULL){
+        out.root = joinAt(left.root, left.height, pivot, right.root, right.height, out.height);
+    }
+    else {
+        out.root = joinTrees(left.root, left.height, right.root, right.height, out.height);
+    }
+}
+
+/**
+* Adds the subtree at node to piece's leftovers.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::discard(SetPiece& piece, AVLNode<Key, Value>* node)
+{
+    node->setParent(piece.discarded);
+    piece.discarded = node;
+    if(piece.discardedTail == NULL){
+        piece.discardedTail = node;
+    }
+}
+
+/**
+* Like splitAt(), but a node whose key is equivalent to key is cut out
+* on its own and returned in match (NULL if there is none) instead of
+* going to the right side.
+*/
+template<class Key, class Value, class Compare>
+void AVLTree<Key, Value, Compare>::splitOut(AVLNode<Key, Value>* node, int height, const Key& key,
+                                            AVLNode<Key, Value>*& left, int& leftHeight, AVLNode<Key, Value>*& match,
+                                            AVLNode<Key, Value>*& right, int& rightHeight)
+{
+    if(node == NULL){
+        left = match = right = NULL;
+        leftHeight = rightHeight = 0;
+        return;
+    }
+    AVLNode<Key, Value> *nodeLeft = node->getLeft();
+    AVLNode<Key, Value> *nodeRight = node->getRight();
+    int nodeLeftHeight = leftChildHeight(node, height);
+    int nodeRightHeight = rightChildHeight(node, height);
+    if(nodeLeft != NULL){
+        nodeLeft->setParent(NULL);
+    }
+    if(nodeRight != NULL){
+        nodeRight->setParent(NULL);
+    }
+
+    AVLNode<Key, Value> *below;
+    int belowHeight;
+    if(this->comp_(node->getKey(), key)){
+        splitOut(nodeRight, nodeRightHeight, key, below, belowHeight, match, right, rightHeight);
+        left = joinAt(nodeLeft, nodeLeftHeight, node, below, belowHeight, leftHeight);
+    }
+    else if(this->comp_(key, node->getKey())){
+        splitOut(nodeLeft, nodeLeftHeight, key, left, leftHeight, match, below, belowHeight);
+        right = joinAt(below, belowHeight, node, nodeRight, nodeRightHeight, rightHeight);
+    }
+    else {
+        node->setLeft(NULL);
+        node->setRight(NULL);
+        node->setParent(NULL);
+        match = node;
+        left = nodeLeft;
+        leftHeight = nodeLeftHeight;
+        right = nodeRight;
+        rightHeight = nodeRightHeight;
+    }
 }
 
 
@@ -0,0 +1,1128 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "bst.h"
+#include "avlbst.h"
+#include "frozen_map.h"
+#include "btree.h"
+#include "simd_index.h"
+#include "concurrent_avl.h"
+#include "persistent_avl.h"
+#include "mapped_avl.h"
+#include "durable_avl.h"
+#include "compact_avl.h"
+
+using namespace std;
+
+// Benchmarks for the search trees.
+// Usage: bst-bench <benchmark> [n]
+// Run without arguments to list the benchmarks.
+
+typedef chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start)
+{
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void report(const char* what, double seconds, size_t ops)
+{
+    cout << "  " << left << setw(36) << what << right
+         << fixed << setprecision(1) << setw(10) << seconds * 1e9 / ops
+         << " ns/op" << endl;
+}
+
+// Returns n distinct keys in random order.
+static vector<uint64_t> shuffledKeys(size_t n, unsigned seed)
+{
+    vector<uint64_t> keys(n);
+    for(size_t i = 0; i < n; ++i) {
+        keys[i] = i * 2 + 1;
+    }
+    mt19937_64 rng(seed);
+    shuffle(keys.begin(), keys.end(), rng);
+    return keys;
+}
+
+// Looks up every key (plus an equal number of misses) in random order.
+template<typename Tree>
+static void timeFind(const char* what, Tree& tree, const vector<uint64_t>& keys)
+{
+    vector<uint64_t> probes(keys);
+    for(size_t i = 0; i < keys.size(); ++i) {
+        probes.push_back(keys[i] - 1);
+    }
+    mt19937_64 rng(7);
+    shuffle(probes.begin(), probes.end(), rng);
+
+    uint64_t found = 0;
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < probes.size(); ++i) {
+        if(tree.find(probes[i]) != tree.end()) ++found;
+    }
+    report(what, secondsSince(start), probes.size());
+    if(found != keys.size()) cout << "  (unexpected hit count " << found << ")" << endl;
+}
+
+static void benchFind(size_t n)
+{
+    cout << "find, " << n << " keys" << endl;
+    vector<uint64_t> keys = shuffledKeys(n, 1);
+
+    BinarySearchTree<uint64_t, uint64_t> bst;
+    AVLTree<uint64_t, uint64_t> avl;
+    for(size_t i = 0; i < n; ++i) {
+        bst.insert(make_pair(keys[i], keys[i]));
+        avl.insert(make_pair(keys[i], keys[i]));
+    }
+    timeFind("BinarySearchTree::find", bst, keys);
+    timeFind("AVLTree::find", avl, keys);
+
+    cout << "  sizeof(Node<uint64_t,uint64_t>)    " << sizeof(Node<uint64_t, uint64_t>) << endl;
+    cout << "  sizeof(AVLNode<uint64_t,uint64_t>) " << sizeof(AVLNode<uint64_t, uint64_t>) << endl;
+}
+
+// Loads n already-sorted records one insert at a time and in bulk.
+static void benchBulkLoad(size_t n)
+{
+    cout << "sorted load, " << n << " keys" << endl;
+    vector<pair<uint64_t, uint64_t> > records(n);
+    for(size_t i = 0; i < n; ++i) {
+        records[i] = make_pair(i * 2 + 1, i);
+    }
+
+    {
+        AVLTree<uint64_t, uint64_t> avl;
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            avl.insert(records[i]);
+        }
+        report("AVLTree::insert loop", secondsSince(start), n);
+    }
+    {
+        AVLTree<uint64_t, uint64_t> avl;
+        Clock::time_point start = Clock::now();
+        avl.assignSorted(records.begin(), records.end());
+        report("AVLTree::assignSorted", secondsSince(start), n);
+    }
+}
+
+// Appends n increasing keys, with and without an end() hint.
+static void benchAppend(size_t n)
+{
+    cout << "append, " << n << " keys" << endl;
+    {
+        AVLTree<uint64_t, uint64_t> avl;
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            avl.insert(make_pair(uint64_t(i), uint64_t(i)));
+        }
+        report("AVLTree::insert", secondsSince(start), n);
+    }
+    {
+        AVLTree<uint64_t, uint64_t> avl;
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            avl.insert(avl.end(), make_pair(uint64_t(i), uint64_t(i)));
+        }
+        report("AVLTree::insert(end(), ...)", secondsSince(start), n);
+    }
+    {
+        BinarySearchTree<uint64_t, uint64_t> bst;
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            bst.insert(bst.end(), make_pair(uint64_t(i), uint64_t(i)));
+        }
+        report("BinarySearchTree::insert(end(), ...)", secondsSince(start), n);
+    }
+}
+
+// Walks a full tree forwards and backwards.
+static void benchScan(size_t n)
+{
+    cout << "scan, " << n << " keys" << endl;
+    vector<uint64_t> keys = shuffledKeys(n, 1);
+    AVLTree<uint64_t, uint64_t> avl;
+    for(size_t i = 0; i < n; ++i) {
+        avl.insert(make_pair(keys[i], keys[i]));
+    }
+
+    uint64_t sum = 0;
+    Clock::time_point start = Clock::now();
+    for(AVLTree<uint64_t, uint64_t>::const_iterator it = avl.cbegin(); it != avl.cend(); ++it) {
+        sum += it->second;
+    }
+    report("AVLTree forward scan", secondsSince(start), n);
+
+    start = Clock::now();
+    for(AVLTree<uint64_t, uint64_t>::const_reverse_iterator it = avl.crbegin(); it != avl.crend(); ++it) {
+        sum -= it->second;
+    }
+    report("AVLTree reverse scan", secondsSince(start), n);
+    if(sum != 0) cout << "  (scans disagree)" << endl;
+}
+
+// Sums the values in many short random ranges, by scan() and by
+// filtering a walk from begin() as callers had to before.
+static void benchRange(size_t n)
+{
+    cout << "range, " << n << " keys" << endl;
+    vector<uint64_t> keys = shuffledKeys(n, 1);
+    AVLTree<uint64_t, uint64_t> avl;
+    for(size_t i = 0; i < n; ++i) {
+        avl.insert(make_pair(keys[i], keys[i]));
+    }
+
+    const size_t queries = 100000;
+    const uint64_t width = 200;   // covers about 100 keys
+    uint64_t sum = 0;
+    Clock::time_point start = Clock::now();
+    for(size_t q = 0; q < queries; ++q) {
+        uint64_t lo = keys[q % n];
+        avl.scan(lo, lo + width, [&](const pair<const uint64_t, uint64_t>& item) {
+            sum += item.second;
+        });
+    }
+    report("AVLTree::scan (per query)", secondsSince(start), queries);
+
+    // the old way is O(n) per query, so only time a handful
+    const size_t slowQueries = 10;
+    start = Clock::now();
+    for(size_t q = 0; q < slowQueries; ++q) {
+        uint64_t lo = keys[q % n];
+        for(AVLTree<uint64_t, uint64_t>::iterator it = avl.begin(); it != avl.end(); ++it) {
+            if(it->first >= lo && it->first < lo + width) sum -= it->second;
+        }
+    }
+    report("filtered full walk (per query)", secondsSince(start), slowQueries);
+    cout << "  checksum " << sum << endl;
+}
+
+// Cost of maintaining subtree sizes, and the queries they enable.
+static void benchOrderStatistics(size_t n)
+{
+    cout << "order statistics, " << n << " keys" << endl;
+    vector<uint64_t> keys = shuffledKeys(n, 1);
+
+    {
+        AVLTree<uint64_t, uint64_t> avl;
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            avl.insert(make_pair(keys[i], keys[i]));
+        }
+        report("AVLTree::insert", secondsSince(start), n);
+    }
+
+    AVLTree<uint64_t, uint64_t> avl;
+    avl.setOrderStatistics(true);
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        avl.insert(make_pair(keys[i], keys[i]));
+    }
+    report("AVLTree::insert with sizes", secondsSince(start), n);
+
+    uint64_t sum = 0;
+    start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        sum += avl.rank(keys[i]);
+    }
+    report("AVLTree::rank", secondsSince(start), n);
+
+    start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        sum += avl.select(keys[i] / 2)->first;
+    }
+    report("AVLTree::select", secondsSince(start), n);
+
+    start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        avl.remove(keys[i]);
+    }
+    report("AVLTree::remove with sizes", secondsSince(start), n);
+    cout << "  checksum " << sum << endl;
+}
+
+// Builds a balanced tree and a degenerate one (a right spine) of n keys
+// with values of type V, and times clear() on each.
+template<typename V>
+static void timeClear(const char* balancedName, const char* spineName, size_t n)
+{
+    vector<pair<uint64_t, V> > records(n);
+    for(size_t i = 0; i < n; ++i) {
+        records[i].first = i;
+    }
+    {
+        BinarySearchTree<uint64_t, V> balanced(records.begin(), records.end());
+        Clock::time_point start = Clock::now();
+        balanced.clear();
+        report(balancedName, secondsSince(start), n);
+    }
+    {
+        BinarySearchTree<uint64_t, V> spine;
+        for(size_t i = 0; i < n; ++i) {
+            spine.insert(spine.end(), records[i]);
+        }
+        Clock::time_point start = Clock::now();
+        spine.clear();
+        report(spineName, secondsSince(start), n);
+    }
+}
+
+static void benchClear(size_t n)
+{
+    cout << "clear, " << n << " keys" << endl;
+    timeClear<uint64_t>("balanced, uint64_t values", "degenerate, uint64_t values", n);
+    // values with a destructor take the full teardown walk
+    cout << "clear, " << n / 10 << " keys" << endl;
+    timeClear<string>("balanced, string values", "degenerate, string values", n / 10);
+}
+
+// isBalanced() on plain and height-tracking trees, and what tracking
+// costs per insert.
+static void benchBalance(size_t n)
+{
+    cout << "balance, " << n << " keys" << endl;
+    vector<uint64_t> keys = shuffledKeys(n, 1);
+    BinarySearchTree<uint64_t, uint64_t> plain;
+    BinarySearchTree<uint64_t, uint64_t> tracked(true);
+
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        plain.insert(make_pair(keys[i], keys[i]));
+    }
+    report("BinarySearchTree::insert", secondsSince(start), n);
+    start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        tracked.insert(make_pair(keys[i], keys[i]));
+    }
+    report("BinarySearchTree::insert tracked", secondsSince(start), n);
+
+    // on a balanced tree the plain check has to visit every node
+    vector<pair<uint64_t, uint64_t> > records(n);
+    for(size_t i = 0; i < n; ++i) {
+        records[i] = make_pair(i, i);
+    }
+    plain.assignSorted(records.begin(), records.end());
+    tracked.assignSorted(records.begin(), records.end());
+
+    const size_t checks = 10;
+    size_t balanced = 0;
+    start = Clock::now();
+    for(size_t i = 0; i < checks; ++i) {
+        balanced += plain.isBalanced();
+    }
+    report("isBalanced() (per call)", secondsSince(start), checks);
+    start = Clock::now();
+    for(size_t i = 0; i < checks; ++i) {
+        balanced += tracked.isBalanced();
+    }
+    report("isBalanced() tracked (per call)", secondsSince(start), checks);
+    cout << "  height " << tracked.height() << ", balanced " << balanced << "/" << 2 * checks << endl;
+}
+
+// Counts how often a comparator is called.
+struct CountingLess
+{
+    static uint64_t calls;
+    bool operator()(const string& a, const string& b) const
+    {
+        ++calls;
+        return a < b;
+    }
+};
+uint64_t CountingLess::calls = 0;
+
+// Finds string keys sharing a long common prefix, where each comparison
+// is expensive, and reports comparisons per lookup.
+static void benchStringKeys(size_t n)
+{
+    cout << "string keys, " << n << " keys" << endl;
+    vector<uint64_t> ids = shuffledKeys(n, 1);
+    vector<string> keys(n);
+    for(size_t i = 0; i < n; ++i) {
+        keys[i] = "customer/region-eu-west/account/" + to_string(ids[i]);
+    }
+
+    AVLTree<string, uint64_t, CountingLess> avl;
+    for(size_t i = 0; i < n; ++i) {
+        avl.insert(make_pair(keys[i], ids[i]));
+    }
+
+    CountingLess::calls = 0;
+    uint64_t found = 0;
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        if(avl.find(keys[i]) != avl.end()) ++found;
+    }
+    report("AVLTree<string>::find", secondsSince(start), n);
+    cout << "  comparisons per find " << fixed << setprecision(1)
+         << double(CountingLess::calls) / n << ", tree height " << avl.height() << endl;
+    if(found != n) cout << "  (unexpected hit count " << found << ")" << endl;
+}
+
+// Looks up each probe key and reports the time per lookup.
+template<typename Map, typename Key>
+static void timeLookups(const char* what, const Map& map, const vector<Key>& probes)
+{
+    uint64_t found = 0;
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < probes.size(); ++i) {
+        if(map.find(probes[i]) != map.end()) ++found;
+    }
+    report(what, secondsSince(start), probes.size());
+    if(found * 2 != probes.size()) cout << "  (unexpected hit count " << found << ")" << endl;
+}
+
+// AVLTree::find in a loop against find_many() over batches of growing
+// size, on the same random probe sequence.
+static void benchFindMany(size_t n)
+{
+    cout << "find_many, " << n << " keys" << endl;
+    vector<uint64_t> keys = shuffledKeys(n, 1);
+    AVLTree<uint64_t, uint64_t> avl;
+    for(size_t i = 0; i < n; ++i) {
+        avl.insert(make_pair(keys[i], keys[i]));
+    }
+
+    // half hits, half misses, in random order
+    const size_t numProbes = 2000000;
+    mt19937_64 rng(7);
+    vector<uint64_t> probes(numProbes);
+    for(size_t i = 0; i < numProbes; ++i) {
+        probes[i] = keys[rng() % n] - (i & 1);
+    }
+    timeLookups("AVLTree::find loop", avl, probes);
+
+    const size_t batchSizes[] = { 1, 2, 4, 8, 16, 32, 64, 256 };
+    for(size_t b = 0; b < sizeof(batchSizes) / sizeof(batchSizes[0]); ++b) {
+        size_t batch = batchSizes[b];
+        vector<uint64_t> group;
+        vector<AVLTree<uint64_t, uint64_t>::iterator> out;
+        uint64_t found = 0;
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < numProbes; i += batch) {
+            group.assign(probes.begin() + i, probes.begin() + min(numProbes, i + batch));
+            avl.find_many(group, out);
+            for(size_t j = 0; j < out.size(); ++j) {
+                if(out[j] != avl.end()) ++found;
+            }
+        }
+        string label = "find_many, batch " + to_string(batch);
+        report(label.c_str(), secondsSince(start), numProbes);
+        if(found * 2 != numProbes) cout << "  (unexpected hit count " << found << ")" << endl;
+    }
+}
+
+// AVLTree::find against a frozen copy of the same tree, at 1M, 10M and
+// 100M keys, stopping at n.
+static void benchFrozen(size_t n)
+{
+    const size_t numProbes = 2000000;
+    for(size_t size = min(n, size_t(1000000)); size <= n; size *= 10) {
+        cout << "frozen, " << size << " keys" << endl;
+        AVLTree<uint64_t, uint64_t> avl;
+        {
+            vector<pair<uint64_t, uint64_t> > records(size);
+            for(size_t i = 0; i < size; ++i) {
+                records[i] = make_pair(i * 2 + 1, i);
+            }
+            avl.assignSorted(records.begin(), records.end());
+        }
+
+        Clock::time_point start = Clock::now();
+        FrozenMap<uint64_t, uint64_t> frozen = freeze(avl);
+        report("freeze (per key)", secondsSince(start), size);
+
+        // half hits, half misses, in random order
+        mt19937_64 rng(7);
+        vector<uint64_t> probes(numProbes);
+        for(size_t i = 0; i < numProbes; ++i) {
+            probes[i] = (rng() % size) * 2 + (i & 1);
+        }
+        timeLookups("AVLTree::find", avl, probes);
+        timeLookups("FrozenMap::find", frozen, probes);
+    }
+}
+
+// Random inserts, lookups, a full in-order walk and random removes on an
+// AVLTree and a BTreeMap holding the same keys.
+template<typename Tree>
+static void timeTreeOps(const char* name, size_t n)
+{
+    vector<uint64_t> keys = shuffledKeys(n, 1);
+    string label(name);
+    Tree tree;
+
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        tree.insert(make_pair(keys[i], keys[i]));
+    }
+    report((label + "::insert").c_str(), secondsSince(start), n);
+
+    timeFind((label + "::find").c_str(), tree, keys);
+
+    uint64_t sum = 0;
+    start = Clock::now();
+    for(typename Tree::iterator it = tree.begin(); it != tree.end(); ++it) {
+        sum += it->second;
+    }
+    report((label + " iteration").c_str(), secondsSince(start), n);
+
+    shuffle(keys.begin(), keys.end(), mt19937_64(3));
+    start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        tree.remove(keys[i]);
+    }
+    report((label + "::remove").c_str(), secondsSince(start), n);
+    if(!tree.empty() || sum == 0) cout << "  (unexpected result)" << endl;
+}
+
+static void benchBTree(size_t n)
+{
+    cout << "btree, " << n << " keys" << endl;
+    timeTreeOps<AVLTree<uint64_t, uint64_t> >("AVLTree", n);
+    timeTreeOps<BTreeMap<uint64_t, uint64_t> >("BTreeMap", n);
+}
+
+// AVLTree::find against a SimdIndex of the same keys at each instruction
+// set the CPU supports, for 32- and 64-bit keys.
+template<typename Key>
+static void timeSimdIndex(size_t n)
+{
+    cout << "simd index, " << n << " keys of " << 8 * sizeof(Key) << " bits" << endl;
+    AVLTree<Key, Key> avl;
+    {
+        vector<pair<Key, Key> > records(n);
+        for(size_t i = 0; i < n; ++i) {
+            records[i] = make_pair(Key(i * 2 + 1), Key(i));
+        }
+        avl.assignSorted(records.begin(), records.end());
+    }
+    SimdIndex<Key, Key> index = makeSimdIndex(avl);
+
+    // half hits, half misses, in random order
+    const size_t numProbes = 2000000;
+    mt19937_64 rng(7);
+    vector<Key> probes(numProbes);
+    for(size_t i = 0; i < numProbes; ++i) {
+        probes[i] = Key((rng() % n) * 2 + (i & 1));
+    }
+    timeLookups("AVLTree::find", avl, probes);
+
+    const char* names[] = { "SimdIndex::find, scalar", "SimdIndex::find, SSE", "SimdIndex::find, AVX2" };
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_SSE, SIMD_AVX2 };
+    for(size_t i = 0; i < 3; ++i) {
+        index.setLevel(levels[i]);
+        if(index.level() == levels[i]) {
+            timeLookups(names[i], index, probes);
+        }
+    }
+}
+
+static void benchSimdIndex(size_t n)
+{
+    timeSimdIndex<uint32_t>(n);
+    timeSimdIndex<uint64_t>(n);
+}
+
+// An AVLTree behind one mutex, the arrangement ConcurrentAVLTree replaces.
+class LockedAVLTree
+{
+public:
+    bool find(uint64_t key, uint64_t& value)
+    {
+        lock_guard<mutex> lock(lock_);
+        AVLTree<uint64_t, uint64_t>::iterator it = tree_.find(key);
+        if(it == tree_.end()) return false;
+        value = it->second;
+        return true;
+    }
+    void insert(const pair<const uint64_t, uint64_t>& item)
+    {
+        lock_guard<mutex> lock(lock_);
+        tree_.insert(item);
+    }
+    void remove(uint64_t key)
+    {
+        lock_guard<mutex> lock(lock_);
+        tree_.remove(key);
+    }
+private:
+    mutex lock_;
+    AVLTree<uint64_t, uint64_t> tree_;
+};
+
+// Runs numReaders threads doing random lookups alongside one thread doing
+// random inserts and removes, for a fixed time. Reports the wall time per
+// lookup summed over all readers, which falls as readers scale.
+template<typename Tree>
+static void timeConcurrentReads(const char* name, Tree& tree, const vector<uint64_t>& keys, size_t numReaders)
+{
+    const double duration = 0.5;
+    atomic<bool> stop(false);
+    atomic<size_t> reads(0);
+    atomic<size_t> found(0);
+    size_t writes = 0;
+
+    vector<thread> readers;
+    for(size_t r = 0; r < numReaders; ++r) {
+        readers.push_back(thread([&, r]() {
+            mt19937_64 rng(r + 1);
+            size_t done = 0;
+            size_t hits = 0;
+            uint64_t value;
+            while(!stop.load(memory_order_relaxed)) {
+                // use the result, or the compiler may drop a plain
+                // tree's search as having no effect
+                for(int i = 0; i < 256; ++i) {
+                    hits += tree.find(keys[rng() % keys.size()], value);
+                }
+                done += 256;
+            }
+            reads += done;
+            found += hits;
+        }));
+    }
+    Clock::time_point start = Clock::now();
+    mt19937_64 rng(99);
+    while(secondsSince(start) < duration) {
+        for(int i = 0; i < 64; ++i) {
+            uint64_t key = keys[rng() % keys.size()];
+            if(i & 1) tree.remove(key);
+            else tree.insert(make_pair(key, key));
+        }
+        writes += 64;
+    }
+    stop = true;
+    for(size_t r = 0; r < readers.size(); ++r) {
+        readers[r].join();
+    }
+    double seconds = secondsSince(start);
+
+    string label = string(name) + ", " + to_string(numReaders) + " readers";
+    report(label.c_str(), seconds, reads.load());
+    cout << "    hits " << found.load() << endl;
+    report("  concurrent writes", seconds, writes);
+}
+
+// Runs numWriters threads doing random inserts and removes for a fixed
+// time, and reports the wall time per write summed over all writers.
+template<typename Tree>
+static void timeConcurrentWrites(const char* name, Tree& tree, const vector<uint64_t>& keys, size_t numWriters)
+{
+    const double duration = 0.5;
+    atomic<bool> stop(false);
+    atomic<size_t> writes(0);
+
+    Clock::time_point start = Clock::now();
+    vector<thread> writers;
+    for(size_t w = 0; w < numWriters; ++w) {
+        writers.push_back(thread([&, w]() {
+            mt19937_64 rng(w + 1000);
+            size_t done = 0;
+            while(!stop.load(memory_order_relaxed)) {
+                for(int i = 0; i < 64; ++i) {
+                    uint64_t key = keys[rng() % keys.size()];
+                    if(i & 1) tree.remove(key);
+                    else tree.insert(make_pair(key, key));
+                }
+                done += 64;
+            }
+            writes += done;
+        }));
+    }
+    this_thread::sleep_for(chrono::duration<double>(duration));
+    stop = true;
+    for(size_t w = 0; w < writers.size(); ++w) {
+        writers[w].join();
+    }
+    double seconds = secondsSince(start);
+
+    string label = string(name) + ", " + to_string(numWriters) + " writers";
+    report(label.c_str(), seconds, writes.load());
+}
+
+// Read throughput of ConcurrentAVLTree against a mutex-wrapped AVLTree,
+// with a writer running throughout, for 1 reader up to one per core; then
+// write throughput with 1 writer up to one per core.
+static void benchConcurrent(size_t n)
+{
+    size_t cores = max(1u, thread::hardware_concurrency());
+    cout << "concurrent, " << n << " keys, " << cores << " cores" << endl;
+    vector<uint64_t> keys = shuffledKeys(n, 1);
+    ConcurrentAVLTree<uint64_t, uint64_t> concurrent;
+    LockedAVLTree locked;
+    for(size_t i = 0; i < n; ++i) {
+        concurrent.insert(make_pair(keys[i], keys[i]));
+        locked.insert(make_pair(keys[i], keys[i]));
+    }
+    for(size_t readers = 1; readers <= max(cores, size_t(2)); readers *= 2) {
+        timeConcurrentReads("ConcurrentAVLTree", concurrent, keys, readers);
+        timeConcurrentReads("AVLTree + mutex", locked, keys, readers);
+    }
+    for(size_t writers = 1; writers <= max(cores, size_t(2)); writers *= 2) {
+        timeConcurrentWrites("ConcurrentAVLTree", concurrent, keys, writers);
+        timeConcurrentWrites("AVLTree + mutex", locked, keys, writers);
+    }
+}
+
+// Taking a point-in-time copy of a tree: AVLTree's O(n) copy constructor
+// against PersistentAVLTree::snapshot(), plus what path copying costs on
+// every insert.
+static void benchSnapshot(size_t n)
+{
+    cout << "snapshot, " << n << " keys" << endl;
+    vector<uint64_t> keys = shuffledKeys(n, 1);
+    AVLTree<uint64_t, uint64_t> avl;
+    PersistentAVLTree<uint64_t, uint64_t> persistent;
+
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        avl.insert(make_pair(keys[i], keys[i]));
+    }
+    report("AVLTree::insert", secondsSince(start), n);
+    start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        persistent.insert(make_pair(keys[i], keys[i]));
+    }
+    report("PersistentAVLTree::insert", secondsSince(start), n);
+
+    const size_t copies = 10;
+    start = Clock::now();
+    for(size_t i = 0; i < copies; ++i) {
+        AVLTree<uint64_t, uint64_t> copy(avl);
+        if(copy.size() != n) cout << "  (bad copy)" << endl;
+    }
+    report("AVLTree copy", secondsSince(start), copies);
+
+    const size_t snapshots = 1000000;
+    start = Clock::now();
+    for(size_t i = 0; i < snapshots; ++i) {
+        PersistentAVLTree<uint64_t, uint64_t> snap = persistent.snapshot();
+        if(snap.size() != n) cout << "  (bad snapshot)" << endl;
+    }
+    report("PersistentAVLTree::snapshot", secondsSince(start), snapshots);
+
+    // a snapshot taken, then every key updated: the writer pays for copies
+    PersistentAVLTree<uint64_t, uint64_t> before = persistent.snapshot();
+    start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        persistent.insert(make_pair(keys[i], keys[i] + 1));
+    }
+    report("insert while a snapshot is held", secondsSince(start), n);
+    if(before.at(keys[0]) != keys[0]) cout << "  (snapshot changed)" << endl;
+}
+
+// Dropping a tenth of the keys: one remove() per key against one
+// erase() of the whole range, then split() and join() of the full tree.
+static void benchErase(size_t n)
+{
+    cout << "erase, " << n << " keys" << endl;
+    vector<pair<uint64_t, uint64_t> > records(n);
+    for(size_t i = 0; i < n; ++i) {
+        records[i] = make_pair(i, i);
+    }
+    AVLTree<uint64_t, uint64_t> removed(records.begin(), records.end());
+    AVLTree<uint64_t, uint64_t> erased(records.begin(), records.end());
+    uint64_t lo = n / 2, hi = n / 2 + n / 10;
+
+    Clock::time_point start = Clock::now();
+    for(uint64_t key = lo; key < hi; ++key) {
+        removed.remove(key);
+    }
+    report("AVLTree::remove of each key", secondsSince(start), hi - lo);
+    start = Clock::now();
+    erased.erase(lo, hi);
+    report("AVLTree::erase of the range", secondsSince(start), hi - lo);
+    if(erased.size() != removed.size()) cout << "  (sizes differ)" << endl;
+
+    // with subtree sizes the moved items need not be counted, so a split
+    // is O(log n) outright
+    const size_t rounds = 100000;
+    AVLTree<uint64_t, uint64_t> right;
+    erased.setOrderStatistics(true);
+    right.setOrderStatistics(true);
+    start = Clock::now();
+    for(size_t i = 0; i < rounds; ++i) {
+        uint64_t key = (i * 7919) % n;
+        erased.split(key, right);
+        erased.append(right);
+    }
+    report("split + append", secondsSince(start), rounds);
+    if(erased.size() != removed.size()) cout << "  (bad split)" << endl;
+}
+
+// Reconciling two trees whose keys half overlap: a find() per key of
+// one tree against the join-based set operations, on pools of growing
+// size.
+static void benchSetOps(size_t n)
+{
+    cout << "setops, " << n << " keys per tree" << endl;
+    vector<pair<uint64_t, uint64_t> > evens(n), mixed(n);
+    for(size_t i = 0; i < n; ++i) {
+        evens[i] = make_pair(2 * i, i);
+        // first half shared with evens, second half disjoint
+        mixed[i] = make_pair(i < n / 2 ? 2 * i : n + 2 * i + 1, i);
+    }
+    AVLTree<uint64_t, uint64_t> first(evens.begin(), evens.end());
+    AVLTree<uint64_t, uint64_t> second(mixed.begin(), mixed.end());
+
+    Clock::time_point start = Clock::now();
+    size_t common = 0;
+    for(AVLTree<uint64_t, uint64_t>::iterator it = second.begin(); it != second.end(); ++it) {
+        if(first.find(it->first) != first.end()) ++common;
+    }
+    report("find() per key", secondsSince(start), n);
+
+    size_t cores = max(1u, thread::hardware_concurrency());
+    for(size_t threads = 1; threads <= max(cores, size_t(4)); threads *= 2) {
+        ForkJoinPool pool(threads);
+        cout << "  " << threads << " thread(s)" << endl;
+        AVLTree<uint64_t, uint64_t> result(first);
+        start = Clock::now();
+        result.intersect(second, pool);
+        report("intersect", secondsSince(start), n);
+        if(result.size() != common) cout << "  (bad intersection)" << endl;
+
+        result = first;
+        start = Clock::now();
+        result.difference(second, pool);
+        report("difference", secondsSince(start), n);
+
+        result = first;
+        AVLTree<uint64_t, uint64_t> consumed(second);
+        start = Clock::now();
+        result.unionWith(consumed, pool);
+        report("unionWith", secondsSince(start), n);
+        if(result.size() != 2 * n - common) cout << "  (bad union)" << endl;
+    }
+}
+
+// A full pass over tree's n items: the iterator on one thread against
+// parallel_for_each() and parallel_reduce() on 1 to N threads.
+template<typename Tree>
+static void timeTraverse(Tree& tree, size_t n)
+{
+    Clock::time_point start = Clock::now();
+    uint64_t sum = 0;
+    for(typename Tree::iterator it = tree.begin(); it != tree.end(); ++it) {
+        sum += it->second;
+    }
+    report("iterator", secondsSince(start), n);
+
+    size_t cores = max(1u, thread::hardware_concurrency());
+    size_t most = max(cores, size_t(4));
+    for(size_t threads = 1; threads <= most; threads *= 2) {
+        ForkJoinPool pool(threads);
+        cout << "  " << threads << " thread(s)" << endl;
+        start = Clock::now();
+        tree.parallel_for_each([](pair<const uint64_t, uint64_t>& item) { item.second += 1; }, pool);
+        report("parallel_for_each", secondsSince(start), n);
+        start = Clock::now();
+        uint64_t total = tree.parallel_reduce(uint64_t(0),
+            [](uint64_t acc, const pair<const uint64_t, uint64_t>& item) { return acc + item.second; },
+            [](uint64_t a, uint64_t b) { return a + b; }, pool);
+        report("parallel_reduce", secondsSince(start), n);
+        sum += n;
+        if(total != sum) cout << "  (bad sum)" << endl;
+        if(threads < most && threads * 2 > most) threads = most / 2;
+    }
+}
+
+// Whole-tree passes over AVLTrees built from sorted and from shuffled
+// keys, and over a BinarySearchTree built from sorted keys, which
+// degenerates into a list.
+static void benchTraverse(size_t n)
+{
+    cout << "traverse, " << n << " keys" << endl;
+    {
+        AVLTree<uint64_t, uint64_t> tree;
+        for(uint64_t i = 0; i < n; ++i) {
+            tree.insert(tree.end(), make_pair(i, i));
+        }
+        timeTraverse(tree, n);
+    }
+    {
+        cout << "shuffled AVLTree" << endl;
+        vector<uint64_t> keys = shuffledKeys(n, 7);
+        AVLTree<uint64_t, uint64_t> tree;
+        for(size_t i = 0; i < n; ++i) {
+            tree.insert(make_pair(keys[i], keys[i]));
+        }
+        timeTraverse(tree, n);
+    }
+    size_t skewed = min<size_t>(n, 10000000);
+    cout << "skewed BinarySearchTree, " << skewed << " keys" << endl;
+    BinarySearchTree<uint64_t, uint64_t> tree;
+    for(uint64_t i = 0; i < skewed; ++i) {
+        tree.insert(tree.end(), make_pair(i, i));
+    }
+    timeTraverse(tree, skewed);
+}
+
+// Saves a tree to a file and loads it back: load() rebuilds it balanced
+// in one pass, against reinserting the saved items one at a time.
+static void benchSerialize(size_t n)
+{
+    cout << "serialize, " << n << " keys" << endl;
+    const char* path = "bst-bench.snapshot";
+    AVLTree<uint64_t, uint64_t> tree;
+    mt19937_64 rng(11);
+    uint64_t key = 0;
+    for(size_t i = 0; i < n; ++i) {
+        key += 1 + rng() % 16;
+        tree.insert(tree.end(), make_pair(key, rng() % 1000000));
+    }
+
+    Clock::time_point start = Clock::now();
+    {
+        ofstream out(path, ios::binary);
+        tree.save(out);
+    }
+    report("save", secondsSince(start), n);
+    ifstream sizer(path, ios::binary | ios::ate);
+    cout << "  " << fixed << setprecision(2) << double(sizer.tellg()) / n << " bytes per item" << endl;
+
+    AVLTree<uint64_t, uint64_t> loaded;
+    start = Clock::now();
+    {
+        ifstream in(path, ios::binary);
+        loaded.load(in);
+    }
+    report("load", secondsSince(start), n);
+
+    AVLTree<uint64_t, uint64_t> reinserted;
+    start = Clock::now();
+    for(AVLTree<uint64_t, uint64_t>::iterator it = loaded.begin(); it != loaded.end(); ++it) {
+        reinserted.insert(*it);
+    }
+    report("insert loop (in memory)", secondsSince(start), n);
+    remove(path);
+
+    if(loaded.size() != n || !loaded.isBalanced() || loaded.begin()->second != tree.begin()->second) {
+        cout << "  (bad round trip)" << endl;
+    }
+}
+
+// Startup: reloading a snapshot builds every node, while mapping a tree
+// image only checks its header. Then lookups on each.
+static void benchMapped(size_t n)
+{
+    cout << "mapped image, " << n << " keys" << endl;
+    const char* snapshotPath = "bst-bench.snapshot";
+    const char* imagePath = "bst-bench.image";
+    vector<uint64_t> keys = shuffledKeys(n, 12);
+    {
+        AVLTree<uint64_t, uint64_t> tree;
+        for(size_t i = 0; i < n; ++i) {
+            tree.insert(make_pair(keys[i], i));
+        }
+        ofstream out(snapshotPath, ios::binary);
+        tree.save(out);
+        out.close();
+        writeMappedImage(tree, imagePath);
+    }
+
+    AVLTree<uint64_t, uint64_t> loaded;
+    Clock::time_point start = Clock::now();
+    {
+        ifstream in(snapshotPath, ios::binary);
+        loaded.load(in);
+    }
+    double loadSeconds = secondsSince(start);
+    start = Clock::now();
+    MappedAVLTree<uint64_t, uint64_t> mapped(imagePath);
+    double openSeconds = secondsSince(start);
+    cout << "  startup: AVLTree::load " << fixed << setprecision(3) << loadSeconds * 1e3
+         << " ms, MappedAVLTree open " << openSeconds * 1e3 << " ms" << endl;
+
+    // half hits, half misses; the first pass over the image pages it in
+    const size_t numProbes = 2000000;
+    mt19937_64 rng(7);
+    vector<uint64_t> probes(numProbes);
+    for(size_t i = 0; i < numProbes; ++i) {
+        probes[i] = keys[rng() % n] - (i & 1);
+    }
+    timeLookups("MappedAVLTree::find (first pass)", mapped, probes);
+    timeLookups("MappedAVLTree::find", mapped, probes);
+    timeLookups("AVLTree::find", loaded, probes);
+    remove(snapshotPath);
+    remove(imagePath);
+}
+
+// Times n random inserts into a DurableAVLTree opened with the given
+// options, committing at the end, from empty files each time.
+static void timeDurable(const char* what, const DurabilityOptions& options, const vector<uint64_t>& keys, size_t n)
+{
+    const char* path = "bst-bench.durable";
+    remove("bst-bench.durable.log");
+    remove("bst-bench.durable.snapshot");
+    {
+        DurableAVLTree<uint64_t, uint64_t> tree(path, options);
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            tree.insert(make_pair(keys[i], i));
+        }
+        tree.commit();
+        report(what, secondsSince(start), n);
+    }
+    remove("bst-bench.durable.log");
+    remove("bst-bench.durable.snapshot");
+}
+
+// Mutation throughput of the plain tree against the logged one under
+// each sync policy. Syncing every insert is capped at 10000 of them.
+static void benchDurable(size_t n)
+{
+    cout << "durable inserts, " << n << " keys" << endl;
+    vector<uint64_t> keys = shuffledKeys(n, 13);
+    {
+        AVLTree<uint64_t, uint64_t> tree;
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            tree.insert(make_pair(keys[i], i));
+        }
+        report("AVLTree (not durable)", secondsSince(start), n);
+    }
+
+    DurabilityOptions options;
+    options.sync = SYNC_NEVER;
+    timeDurable("SYNC_NEVER, group of 1", options, keys, n);
+    options.groupSize = 64;
+    timeDurable("SYNC_NEVER, group of 64", options, keys, n);
+    options.sync = SYNC_INTERVAL;
+    options.groupSize = 1;
+    timeDurable("SYNC_INTERVAL 100ms, group of 1", options, keys, n);
+    options.groupSize = 64;
+    timeDurable("SYNC_INTERVAL 100ms, group of 64", options, keys, n);
+    options.sync = SYNC_EVERY_GROUP;
+    timeDurable("SYNC_EVERY_GROUP, group of 64", options, keys, n);
+    options.groupSize = 1;
+    timeDurable("SYNC_EVERY_GROUP, group of 1", options, keys, min<size_t>(n, 10000));
+}
+
+// Prints the bytes per node of each layout for one key/value type.
+template<typename Key, typename Value>
+static void printNodeBytes(const char* types)
+{
+    cout << "  " << left << setw(24) << types << right
+         << setw(10) << sizeof(AVLNode<Key, Value>)
+         << setw(10) << CompactAVLTree<Key, Value>::nodeBytes()
+         << setw(12) << CompactAVLTree<Key, Value, less<Key>, false>::nodeBytes()
+         << setw(10) << CompactAVLTree<Key, Value, less<Key>, true, true>::nodeBytes()
+         << setw(12) << CompactAVLTree<Key, Value, less<Key>, false, true>::nodeBytes() << endl;
+}
+
+// Inserts, finds and iterates over n random keys, then reports the
+// memory the nodes take, scaled up to 100M entries as well.
+template<typename Tree>
+static void timeCompact(const char* name, size_t nodeBytes, const vector<uint64_t>& keys)
+{
+    size_t n = keys.size();
+    string label(name);
+    Tree tree;
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < n; ++i) {
+        tree.insert(make_pair(keys[i], keys[i]));
+    }
+    report((label + "::insert").c_str(), secondsSince(start), n);
+    timeFind((label + "::find").c_str(), tree, keys);
+    uint64_t sum = 0;
+    start = Clock::now();
+    for(typename Tree::iterator it = tree.begin(); it != tree.end(); ++it) {
+        sum += it->second;
+    }
+    report((label + " iteration").c_str(), secondsSince(start), n);
+    cout << "  " << fixed << setprecision(2) << nodeBytes * double(n) / (1 << 30) << " GiB of nodes, "
+         << nodeBytes * 1e8 / (1 << 30) << " GiB at 100M entries" << endl;
+    if(sum == 0) cout << "  (unexpected result)" << endl;
+}
+
+// Per-node overhead: AVLTree's nodes against CompactAVLTree's, with and
+// without parent links, linked by pointer or by 32-bit arena index.
+static void benchCompact(size_t n)
+{
+    cout << "node bytes            " << setw(10) << "AVLTree" << setw(10) << "compact"
+         << setw(12) << "no parents" << setw(10) << "indexed" << setw(12) << "idx, no par" << endl;
+    printNodeBytes<int, int>("<int, int>");
+    printNodeBytes<uint64_t, uint64_t>("<uint64_t, uint64_t>");
+    printNodeBytes<uint64_t, string>("<uint64_t, string>");
+    printNodeBytes<string, string>("<string, string>");
+
+    cout << "compact trees, " << n << " keys of <uint64_t, uint64_t>" << endl;
+    vector<uint64_t> keys = shuffledKeys(n, 14);
+    timeCompact<AVLTree<uint64_t, uint64_t> >("AVLTree", sizeof(AVLNode<uint64_t, uint64_t>), keys);
+    typedef CompactAVLTree<uint64_t, uint64_t> WithParents;
+    timeCompact<WithParents>("CompactAVLTree", WithParents::nodeBytes(), keys);
+    typedef CompactAVLTree<uint64_t, uint64_t, less<uint64_t>, false> NoParents;
+    timeCompact<NoParents>("CompactAVLTree (no parents)", NoParents::nodeBytes(), keys);
+    typedef CompactAVLTree<uint64_t, uint64_t, less<uint64_t>, true, true> Indexed;
+    timeCompact<Indexed>("CompactAVLTree (indexed)", Indexed::nodeBytes(), keys);
+    typedef CompactAVLTree<uint64_t, uint64_t, less<uint64_t>, false, true> IndexedNoParents;
+    timeCompact<IndexedNoParents>("CompactAVLTree (indexed, no parents)", IndexedNoParents::nodeBytes(), keys);
+}
+
+struct Benchmark
+{
+    const char* name;
+    void (*run)(size_t n);
+    size_t defaultN;
+};
+
+static const Benchmark benchmarks[] = {
+    { "find", benchFind, 1000000 },
+    { "bulk", benchBulkLoad, 1000000 },
+    { "append", benchAppend, 1000000 },
+    { "scan", benchScan, 1000000 },
+    { "range", benchRange, 1000000 },
+    { "ostat", benchOrderStatistics, 1000000 },
+    { "clear", benchClear, 10000000 },
+    { "balance", benchBalance, 1000000 },
+    { "strings", benchStringKeys, 1000000 },
+    { "frozen", benchFrozen, 1000000 },
+    { "btree", benchBTree, 1000000 },
+    { "findmany", benchFindMany, 1000000 },
+    { "simd", benchSimdIndex, 1000000 },
+    { "concurrent", benchConcurrent, 1000000 },
+    { "snapshot", benchSnapshot, 1000000 },
+    { "erase", benchErase, 1000000 },
+    { "setops", benchSetOps, 1000000 },
+    { "traverse", benchTraverse, 100000000 },
+    { "serialize", benchSerialize, 10000000 },
+    { "mapped", benchMapped, 10000000 },
+    { "durable", benchDurable, 1000000 },
+    { "compact", benchCompact, 10000000 },
+};
+
+int main(int argc, char* argv[])
+{
+    size_t count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    if(argc < 2) {
+        cout << "usage: " << argv[0] << " <benchmark> [n]" << endl;
+        for(size_t i = 0; i < count; ++i) {
+            cout << "  " << benchmarks[i].name << " (default n = " << benchmarks[i].defaultN << ")" << endl;
+        }
+        return 1;
+    }
+    for(size_t i = 0; i < count; ++i) {
+        if(strcmp(argv[1], benchmarks[i].name) == 0) {
+            size_t n = argc > 2 ? strtoull(argv[2], NULL, 10) : benchmarks[i].defaultN;
+            benchmarks[i].run(n);
+            return 0;
+        }
+    }
+    cout << "unknown benchmark " << argv[1] << endl;
+    return 1;
+}
@@ -1,10 +1,41 @@
+#include <cctype>
+#include <cstdio>
 #include <iostream>
 #include <map>
+#include <sstream>
+#include <string>
+#include <vector>
 #include "bst.h"
 #include "avlbst.h"
+#include "frozen_map.h"
+#include "btree.h"
+#include "simd_index.h"
+#include "concurrent_avl.h"
+#include "persistent_avl.h"
+#include "mapped_avl.h"
+#include "durable_avl.h"
+#include "compact_avl.h"
 
 using namespace std;
 
+// Orders names case-blind and lets them be looked up by C string
+// without building a std::string first.
+struct NameLess
+{
+    typedef void is_transparent;
+    bool operator()(const std::string& a, const std::string& b) const { return less(a.c_str(), b.c_str()); }
+    bool operator()(const std::string& a, const char* b) const { return less(a.c_str(), b); }
+    bool operator()(const char* a, const std::string& b) const { return less(a, b.c_str()); }
+    static bool less(const char* a, const char* b)
+    {
+        while(*a != '\0' && tolower(*a) == tolower(*b)) {
+            ++a;
+            ++b;
+        }
+        return tolower(*a) < tolower(*b);
+    }
+};
+
 
 int main(int argc, char *argv[])
 {
@@ -44,5 +75,223 @@ int main(int argc, char *argv[])
     cout << "Erasing b" << endl;
     at.remove('b');
 
+    // Node pool: steady insert/remove churn should reuse freed slots
+    AVLTree<int,int> churn;
+    for(int i = 0; i < 1000; ++i) {
+        churn.insert(std::make_pair(i, i));
+    }
+    PoolStats before = churn.poolStats();
+    for(int i = 0; i < 100000; ++i) {
+        churn.remove(i % 1000);
+        churn.insert(std::make_pair(i % 1000, i));
+    }
+    PoolStats after = churn.poolStats();
+    cout << "\nSlabs allocated during churn: "
+         << after.slabAllocs - before.slabAllocs << endl;
+    churn.clear();
+    cout << "Slabs still held after clear: "
+         << churn.poolStats().slabAllocs - churn.poolStats().slabFrees << endl;
+
+    // In-place insertion: try_emplace leaves an existing key alone
+    AVLTree<std::string,std::string> names;
+    names.emplace("ada", "lovelace");
+    names.try_emplace("ada", "byron");
+    names.insert_or_assign("alan", "turing");
+    for(AVLTree<std::string,std::string>::iterator it = names.begin(); it != names.end(); ++it) {
+        cout << it->first << " " << it->second << endl;
+    }
+
+    // Bulk load from already-sorted records
+    std::map<int,int> sorted;
+    for(int i = 0; i < 100; ++i) {
+        sorted[i * 2] = i;
+    }
+    AVLTree<int,int> loaded(sorted.begin(), sorted.end());
+    cout << "Bulk-loaded tree is balanced: " << loaded.isBalanced() << endl;
+
+    // Hinted insert: appending at end() skips the search from the root
+    AVLTree<int,int> log;
+    for(int i = 0; i < 10; ++i) {
+        log.insert(log.end(), std::make_pair(i, i * i));
+    }
+    log.insert(log.find(5), std::make_pair(4, -1));
+    cout << "Appended tree is balanced: " << log.isBalanced()
+         << ", log[4] = " << log[4] << endl;
+
+    // Newest-first: walk the same tree backwards
+    cout << "Last three keys:";
+    AVLTree<int,int>::const_reverse_iterator rit = log.crbegin();
+    for(int i = 0; i < 3 && rit != log.crend(); ++i, ++rit) {
+        cout << " " << rit->first;
+    }
+    cout << endl;
+
+    // Range queries: keys in [20, 30) of the bulk-loaded tree
+    cout << "Keys in [20, 30):";
+    loaded.scan(20, 30, [](const std::pair<const int,int>& item) {
+        cout << " " << item.first;
+    });
+    cout << endl;
+    cout << "First key above 31: " << loaded.upper_bound(31)->first << endl;
+
+    // Order statistics: median and rank without walking the tree
+    loaded.setOrderStatistics(true);
+    loaded.remove(0);
+    cout << "Size " << loaded.size() << ", median key " << loaded.select(loaded.size() / 2)->first
+         << ", rank of 50 is " << loaded.rank(50)
+         << ", keys in [10, 20): " << loaded.count(10, 20) << endl;
+
+    // Height tracking: health checks without walking the tree
+    BinarySearchTree<int,int> tracked(true);
+    for(int i = 0; i < 5; ++i) {
+        tracked.insert(std::make_pair(i, i));
+    }
+    cout << "Tracked tree height " << tracked.height()
+         << ", balanced: " << tracked.isBalanced() << ", deepest path:";
+    std::vector<int> path = tracked.deepestPath();
+    for(size_t i = 0; i < path.size(); ++i) {
+        cout << " " << path[i];
+    }
+    cout << endl;
+
+    // Custom ordering with heterogeneous lookup
+    AVLTree<std::string,int,NameLess> people;
+    people.insert(std::make_pair(std::string("bob"), 1));
+    people.insert(std::make_pair(std::string("Alice"), 2));
+    people.insert(std::make_pair(std::string("carol"), 3));
+    cout << "First person: " << people.begin()->first
+         << ", BOB found: " << (people.find("BOB") != people.end()) << endl;
+
+    // Read-only snapshot for lookup-heavy tables
+    FrozenMap<int,int> frozen = freeze(loaded);
+    cout << "Frozen copy has " << frozen.size() << " keys, first " << frozen.begin()->first
+         << ", value of 42 is " << frozen.at(42) << endl;
+
+    // B-tree with the same interface, for large in-memory tables
+    BTreeMap<int,int> wide;
+    for(int i = 0; i < 1000; ++i) {
+        wide.insert(std::make_pair(i, i * i));
+    }
+    wide.remove(500);
+    cout << "B-tree has " << wide.size() << " keys, 30 -> " << wide[30]
+         << ", 500 found: " << (wide.find(500) != wide.end()) << endl;
+
+    // Batched lookups: the descents overlap their cache misses
+    std::vector<int> wanted;
+    wanted.push_back(7);
+    wanted.push_back(500);
+    wanted.push_back(64);
+    std::vector<AVLTree<int,int>::iterator> hits;
+    loaded.find_many(wanted, hits);
+    for(size_t i = 0; i < wanted.size(); ++i) {
+        cout << "Key " << wanted[i] << (hits[i] != loaded.end() ? " found" : " missing") << endl;
+    }
+
+    // Read-only index for integer keys, searched with SIMD where available
+    SimdIndex<int,int> index = makeSimdIndex(loaded);
+    const char* levelNames[] = { "scalar", "SSE", "AVX2" };
+    cout << "SIMD index (" << levelNames[index.level()] << ") has " << index.size()
+         << " keys, first key not below 31 is " << index.lower_bound(31)->first << endl;
+
+    // Shared map with lock-free lookups; writers lock only the nodes they change
+    ConcurrentAVLTree<int,std::string> shared;
+    shared.insert(std::make_pair(2, std::string("two")));
+    shared.insert(std::make_pair(1, std::string("one")));
+    shared.remove(2);
+    std::string name;
+    cout << "Shared map has " << shared.size() << " key(s), 1 -> "
+         << (shared.find(1, name) ? name : std::string("missing")) << endl;
+
+    // Persistent tree: snapshots are O(1) and unaffected by later writes
+    PersistentAVLTree<int,int> live;
+    live.insert(std::make_pair(1, 10));
+    PersistentAVLTree<int,int> report = live.snapshot();
+    live.insert(std::make_pair(1, 11));
+    live.insert(std::make_pair(2, 20));
+    cout << "Snapshot: " << report.size() << " key(s), 1 -> " << report[1]
+         << "; live: " << live.size() << " key(s), 1 -> " << live[1] << endl;
+
+    // Copies of ordinary trees are deep and balanced
+    AVLTree<int,int> copy(loaded);
+    copy.remove(42);
+    cout << "Copy has " << copy.size() << " keys, original still has " << loaded.size() << endl;
+
+    // Range surgery: split off the upper half, drop a range, join back
+    AVLTree<int,int> upper;
+    copy.split(100, upper);
+    copy.erase(10, 50);
+    cout << "Split at 100: " << copy.size() << " keys below (after erasing [10, 50)), "
+         << upper.size() << " above" << endl;
+    copy.append(upper);
+    cout << "Appended back: " << copy.size() << " keys, " << upper.size() << " left over" << endl;
+
+    // Set operations built from joins
+    AVLTree<int,int> odds, small;
+    for(int i = 1; i < 20; i += 2) odds.insert(std::make_pair(i, i));
+    for(int i = 0; i < 10; ++i) small.insert(std::make_pair(i, i));
+    AVLTree<int,int> both(small);
+    both.intersect(odds);
+    small.difference(odds);
+    cout << "Intersection has " << both.size() << " keys, difference " << small.size();
+    odds.unionWith(small);
+    cout << ", union " << odds.size() << endl;
+
+    // Whole-tree passes split across threads at subtree boundaries
+    long total = loaded.parallel_reduce(0L,
+        [](long acc, const std::pair<const int,int>& item) { return acc + item.first; },
+        [](long a, long b) { return a + b; });
+    cout << "Parallel sum of keys: " << total << endl;
+
+    // Binary snapshot: saved in key order, reloaded balanced in one pass
+    std::stringstream saved;
+    loaded.save(saved);
+    AVLTree<int,int> restored;
+    restored.load(saved);
+    cout << "Snapshot of " << saved.str().size() << " bytes restored " << restored.size()
+         << " keys, balanced: " << restored.isBalanced() << endl;
+
+    // Tree image: mapped and searched in place, nothing rebuilt at startup
+    writeMappedImage(loaded, "bst-test.image");
+    {
+        MappedAVLTree<int,int> image("bst-test.image");
+        cout << "Mapped image has " << image.size() << " keys, 42 -> " << image.at(42)
+             << ", first key not below 31 is " << image.lower_bound(31)->first
+             << ", checksum ok: " << image.verify() << endl;
+    }
+    std::remove("bst-test.image");
+
+    // Logged mutations: reopening replays the log over the last snapshot
+    {
+        DurableAVLTree<int,std::string> durable("bst-test.durable");
+        durable.insert(std::make_pair(1, std::string("one")));
+        durable.insert(std::make_pair(2, std::string("two")));
+        durable.remove(1);
+    }
+    {
+        DurableAVLTree<int,std::string> durable("bst-test.durable");
+        cout << "Durable tree recovered " << durable.size() << " key(s) from "
+             << durable.recovered() << " log records, 2 -> " << durable.find(2)->second << endl;
+    }
+    std::remove("bst-test.durable.log");
+    std::remove("bst-test.durable.snapshot");
+
+    // Compact nodes: balance in the pointer bits, optionally no parents
+    CompactAVLTree<int,int,std::less<int>,false> compact;
+    for(int i = 0; i < 100; ++i) {
+        compact.insert(std::make_pair(i, i * i));
+    }
+    compact.remove(50);
+    cout << "Compact tree has " << compact.size() << " keys in " << compact.nodeBytes()
+         << "-byte nodes, balanced: " << compact.isBalanced() << ", 51 -> " << compact[51] << endl;
+
+    // Indexed nodes: 32-bit links into a contiguous arena
+    CompactAVLTree<int,int,std::less<int>,true,true> indexed;
+    for(int i = 0; i < 100; ++i) {
+        indexed.insert(std::make_pair(i, i * i));
+    }
+    indexed.remove(50);
+    cout << "Indexed tree has " << indexed.size() << " keys in " << indexed.nodeBytes()
+         << "-byte nodes, balanced: " << indexed.isBalanced() << ", 51 -> " << indexed[51] << endl;
+
     return 0;
 }
@@ -6,20 +6,101 @@
 #include <cstdlib>
 #include <utility>
 #include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include "node_pool.h"
+#include "fork_join.h"
+#include "tree_snapshot.h"
+
+/**
+ * A non-owning handle to a callable that constructs a node's
+ * key/value pair in place at a given address. It lets the tree
+ * hand arbitrary constructor arguments through the virtual
+ * createNode() hook, so a node's item is built directly inside
+ * the node without an intermediate pair being copied or moved.
+ */
+template <typename Key, typename Value>
+class ItemBuilder
+{
+public:
+    template<typename F>
+    explicit ItemBuilder(F& build);
+
+    void operator()(std::pair<const Key, Value>* where) const;
+
+private:
+    template<typename F>
+    static void invoke(void* build, std::pair<const Key, Value>* where);
+
+    void (*invoke_)(void*, std::pair<const Key, Value>*);
+    void* build_;
+};
+
+/**
+* Wraps build, which must outlive the ItemBuilder.
+*/
+template<typename Key, typename Value>
+template<typename F>
+ItemBuilder<Key, Value>::ItemBuilder(F& build) :
+    invoke_(&ItemBuilder<Key, Value>::template invoke<F>),
+    build_(&build)
+{
+
+}
+
+/**
+* Constructs the item at where.
+*/
+template<typename Key, typename Value>
+void ItemBuilder<Key, Value>::operator()(std::pair<const Key, Value>* where) const
+{
+    invoke_(build_, where);
+}
+
+template<typename Key, typename Value>
+template<typename F>
+void ItemBuilder<Key, Value>::invoke(void* build, std::pair<const Key, Value>* where)
+{
+    (*static_cast<F*>(build))(where);
+}
+
+/**
+ * True when emplace() is given a key and a value, so it can look the key
+ * up before building anything, as try_emplace() does.
+ */
+template <typename Key, typename... Args>
+struct EmplacesKeyFirst : std::false_type
+{
+};
+
+template <typename Key, typename K, typename V>
+struct EmplacesKeyFirst<Key, K, V> : std::is_same<typename std::decay<K>::type, Key>
+{
+};
 
 /**
  * A templated class for a Node in a search tree.
- * The getters for parent/left/right are virtual so
- * that they can be overridden for future kinds of
- * search trees, such as Red Black trees, Splay trees,
- * and AVL trees.
+ * The getters for parent/left/right are not virtual: nodes
+ * for other kinds of search trees, such as AVL trees, derive
+ * from Node and hide them with versions returning their own
+ * node type. Every call is resolved from the static type, so
+ * traversals inline fully and nodes carry no vtable pointer.
+ * Because the destructor is not virtual either, trees destroy
+ * nodes through BinarySearchTree::destructNode().
  */
 template <typename Key, typename Value>
 class Node
 {
 public:
     Node(const Key& key, const Value& value, Node<Key, Value>* parent);
-    virtual ~Node();
+    Node(const ItemBuilder<Key, Value>& build, Node<Key, Value>* parent);
+    ~Node();
 
     const std::pair<const Key, Value>& getItem() const;
     std::pair<const Key, Value>& getItem();
@@ -27,9 +108,9 @@ public:
     const Value& getValue() const;
     Value& getValue();
 
-    virtual Node<Key, Value>* getParent() const;
-    virtual Node<Key, Value>* getLeft() const;
-    virtual Node<Key, Value>* getRight() const;
+    Node<Key, Value>* getParent() const;
+    Node<Key, Value>* getLeft() const;
+    Node<Key, Value>* getRight() const;
 
     void setParent(Node<Key, Value>* parent);
     void setLeft(Node<Key, Value>* left);
@@ -37,7 +118,11 @@ public:
     void setValue(const Value &value);
 
 protected:
-    std::pair<const Key, Value> item_;
+    // In a union so the constructor can build the item in place
+    // from an ItemBuilder; Node constructs and destroys it itself.
+    union {
+        std::pair<const Key, Value> item_;
+    };
     Node<Key, Value>* parent_;
     Node<Key, Value>* left_;
     Node<Key, Value>* right_;
@@ -54,23 +139,35 @@ protected:
 */
 template<typename Key, typename Value>
 Node<Key, Value>::Node(const Key& key, const Value& value, Node<Key, Value>* parent) :
-    item_(key, value),
     parent_(parent),
     left_(NULL),
     right_(NULL)
 {
+    ::new (static_cast<void*>(&item_)) std::pair<const Key, Value>(key, value);
+}
 
+/**
+* Constructor that builds the item in place. If build throws, the node
+* is not constructed and nothing needs to be destroyed.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>::Node(const ItemBuilder<Key, Value>& build, Node<Key, Value>* parent) :
+    parent_(parent),
+    left_(NULL),
+    right_(NULL)
+{
+    build(&item_);
 }
 
 /**
-* Destructor, which does not need to do anything since the pointers inside of a node
+* Destructor, which only destroys the item since the pointers inside of a node
 * are only used as references to existing nodes. The nodes pointed to by parent/left/right
 * are freed by the BinarySearchTree.
 */
 template<typename Key, typename Value>
 Node<Key, Value>::~Node()
 {
-
+    item_.~pair();
 }
 
 /**
@@ -119,7 +216,7 @@ Value& Node<Key, Value>::getValue()
 }
 
 /**
-* An implementation of the virtual function for retreiving the parent.
+* A getter for the parent.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getParent() const
@@ -128,7 +225,7 @@ Node<Key, Value>* Node<Key, Value>::getParent() const
 }
 
 /**
-* An implementation of the virtual function for retreiving the left child.
+* A getter for the left child.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getLeft() const
@@ -137,7 +234,7 @@ Node<Key, Value>* Node<Key, Value>::getLeft() const
 }
 
 /**
-* An implementation of the virtual function for retreiving the right child.
+* A getter for the right child.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getRight() const
@@ -188,30 +285,124 @@ void Node<Key, Value>::setValue(const Value& value)
 */
 
 /**
-* A templated unbalanced binary search tree.
+* The node used by a BinarySearchTree that tracks heights. It records the
+* height of its subtree and whether its two subtrees differ in height by
+* more than one.
 */
 template <typename Key, typename Value>
+class HeightNode : public Node<Key, Value>
+{
+public:
+    HeightNode(const ItemBuilder<Key, Value>& build, HeightNode<Key, Value>* parent);
+
+    int getHeight() const;
+    void setHeight(int height);
+    bool isSkewed() const;
+    void setSkewed(bool skewed);
+
+protected:
+    int height_;    // 1 for a leaf
+    bool skewed_;
+};
+
+/**
+* Builds the item in place; a new node is a leaf.
+*/
+template<typename Key, typename Value>
+HeightNode<Key, Value>::HeightNode(const ItemBuilder<Key, Value>& build, HeightNode<Key, Value>* parent) :
+    Node<Key, Value>(build, parent),
+    height_(1),
+    skewed_(false)
+{
+
+}
+
+/**
+* Returns the height of the subtree rooted here.
+*/
+template<typename Key, typename Value>
+int HeightNode<Key, Value>::getHeight() const
+{
+    return height_;
+}
+
+/**
+* Sets the height of the subtree rooted here.
+*/
+template<typename Key, typename Value>
+void HeightNode<Key, Value>::setHeight(int height)
+{
+    height_ = height;
+}
+
+/**
+* Returns true if the child subtrees differ in height by more than one.
+*/
+template<typename Key, typename Value>
+bool HeightNode<Key, Value>::isSkewed() const
+{
+    return skewed_;
+}
+
+/**
+* Marks whether the child subtrees differ in height by more than one.
+*/
+template<typename Key, typename Value>
+void HeightNode<Key, Value>::setSkewed(bool skewed)
+{
+    skewed_ = skewed;
+}
+
+/**
+* A templated unbalanced binary search tree.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
 class BinarySearchTree
 {
 public:
     BinarySearchTree(); //TODO
+    explicit BinarySearchTree(bool trackHeights);
+    explicit BinarySearchTree(const Compare& comp, bool trackHeights = false);
+    template<typename ForwardIt>
+    BinarySearchTree(ForwardIt first, ForwardIt last);
+    BinarySearchTree(const BinarySearchTree& other);
+    BinarySearchTree& operator=(const BinarySearchTree& other);
     virtual ~BinarySearchTree(); //TODO
     virtual void insert(const std::pair<const Key, Value>& keyValuePair); //TODO
     virtual void remove(const Key& key); //TODO
     void clear(); //TODO
-    bool isBalanced() const; //TODO
+    template<typename ForwardIt>
+    void assignSorted(ForwardIt first, ForwardIt last);
+    void save(std::ostream& out) const;
+    void load(std::istream& in);
+    virtual bool isBalanced() const; //TODO
+    virtual int height() const;
+    std::vector<Key> deepestPath() const;
+    bool tracksHeights() const;
     void print() const;
     bool empty() const;
+    std::size_t size() const;
+    const PoolStats& poolStats() const;
+    Compare key_comp() const;
 
     template<typename PPKey, typename PPValue>
     friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue> & tree);
 public:
+    class const_iterator;
+
     /**
     * An internal iterator class for traversing the contents of the BST.
+    * It is bidirectional: decrementing end() yields the largest item.
     */
     class iterator  // TODO
     {
     public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key, Value>* pointer;
+        typedef std::pair<const Key, Value>& reference;
+
         iterator();
 
         std::pair<const Key,Value>& operator*() const;
@@ -221,21 +412,117 @@ public:
         bool operator!=(const iterator& rhs) const;
 
         iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
 
     protected:
-        friend class BinarySearchTree<Key, Value>;
-        iterator(Node<Key,Value>* ptr);
+        friend class BinarySearchTree<Key, Value, Compare>;
+        friend class const_iterator;
+        iterator(Node<Key,Value>* ptr, const BinarySearchTree<Key, Value, Compare>* tree);
         Node<Key, Value> *current_;
+        const BinarySearchTree<Key, Value, Compare> *tree_;  // lets end() step back
+    };
+
+    /**
+    * Read-only counterpart of iterator. An iterator converts to it.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const std::pair<const Key, Value>* pointer;
+        typedef const std::pair<const Key, Value>& reference;
+
+        const_iterator();
+        const_iterator(const iterator& it);
+
+        const std::pair<const Key,Value>& operator*() const;
+        const std::pair<const Key,Value>* operator->() const;
+
+        // friends so either side may be a plain iterator
+        friend bool operator==(const const_iterator& lhs, const const_iterator& rhs)
+        {
+            return lhs.current_ == rhs.current_;
+        }
+        friend bool operator!=(const const_iterator& lhs, const const_iterator& rhs)
+        {
+            return lhs.current_ != rhs.current_;
+        }
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class BinarySearchTree<Key, Value, Compare>;
+        const_iterator(const Node<Key,Value>* ptr, const BinarySearchTree<Key, Value, Compare>* tree);
+        const Node<Key, Value> *current_;
+        const BinarySearchTree<Key, Value, Compare> *tree_;
     };
 
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
 public:
     iterator begin() const;
     iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+    reverse_iterator rbegin() const;
+    reverse_iterator rend() const;
+    const_reverse_iterator crbegin() const;
+    const_reverse_iterator crend() const;
     iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key) const;
+    std::pair<iterator, iterator> equal_range(const Key& key) const;
+    // Heterogeneous lookup, offered when Compare declares is_transparent,
+    // so callers need not build a Key just to search for one
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const K& key) const;
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(const K& key) const;
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator upper_bound(const K& key) const;
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    std::pair<iterator, iterator> equal_range(const K& key) const;
+    template<typename F>
+    void scan(const Key& lo, const Key& hi, F callback) const;
+    void find_many(const std::vector<Key>& keys, std::vector<iterator>& out) const;
+    template<typename F>
+    void parallel_for_each(F fn, ForkJoinPool& pool = ForkJoinPool::global()) const;
+    template<typename T, typename F, typename C>
+    T parallel_reduce(T init, F fn, C combine, ForkJoinPool& pool = ForkJoinPool::global()) const;
     Value& operator[](const Key& key);
     Value const & operator[](const Key& key) const;
 
+    template<typename P, typename = typename std::enable_if<
+        !std::is_lvalue_reference<P>::value &&
+        std::is_constructible<std::pair<const Key, Value>, P&&>::value>::type>
+    std::pair<iterator, bool> insert(P&& keyValuePair);
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(const Key& key, M&& obj);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(Key&& key, M&& obj);
+    iterator insert(iterator hint, const std::pair<const Key, Value>& keyValuePair);
+    template<typename P, typename = typename std::enable_if<
+        !std::is_lvalue_reference<P>::value &&
+        std::is_constructible<std::pair<const Key, Value>, P&&>::value>::type>
+    iterator insert(iterator hint, P&& keyValuePair);
+
 protected:
+    BinarySearchTree(std::size_t nodeSize, std::size_t nodeAlign, const Compare& comp = Compare());
+
     // Mandatory helper functions
     Node<Key, Value>* internalFind(const Key& k) const; // TODO
     Node<Key, Value> *getSmallestNode() const;  // TODO
@@ -249,12 +536,69 @@ protected:
 
     // Add helper functions here
     void clearTraversal(Node<Key, Value>* root);
+    std::size_t destroySubtree(Node<Key, Value>* root);
     int getBalance(Node<Key, Value> *node) const;
     static Node<Key, Value>* successor(Node<Key, Value>* current);
+    iterator makeIterator(Node<Key, Value>* node) const;
+    template<typename K>
+    Node<Key, Value>* findNode(const K& key) const;
+    template<typename K>
+    Node<Key, Value>* lowerBoundNode(const K& key) const;
+    template<typename K>
+    Node<Key, Value>* upperBoundNode(const K& key) const;
+    Node<Key, Value>* findSlot(const Key& key, Node<Key, Value>*& parent, bool& left) const;
+    void findGroup(const Key* keys, std::size_t count, iterator* out) const;
+    template<typename T, typename F, typename C>
+    T reduceSubtree(Node<Key, Value>* node, Node<Key, Value>* next, Node<Key, Value>* stop, int levels,
+                    const T& init, F& fn, C& combine, ForkJoinPool& pool) const;
+    template<typename F>
+    static void visitRun(Node<Key, Value>* first, Node<Key, Value>* stop, F& fn);
+    static std::size_t chunkCount(const ForkJoinPool& pool);
+    virtual int splitLevels(std::size_t chunks) const;
+    virtual int childSplitLevels(Node<Key, Value>* node, int levels, bool right) const;
+
+    // Descents find_many() keeps in flight at once. Enough to cover a
+    // miss's latency with the other searches' work, few enough that their
+    // state stays in registers and L1.
+    static const std::size_t FIND_GROUP_SIZE = 16;
+    Node<Key, Value>* findSlotNear(Node<Key, Value>* hint, const Key& key, Node<Key, Value>*& parent, bool& left) const;
+    void linkNode(Node<Key, Value>* node, Node<Key, Value>* parent, bool left);
+    void beforeUnlink(Node<Key, Value>* node);
+    void retireNode(Node<Key, Value>* node, Node<Key, Value>* parent);
+    void updateHeights(Node<Key, Value>* node);
+    static int nodeHeight(Node<Key, Value>* node);
+    virtual Node<Key, Value>* tallerChild(Node<Key, Value>* node) const;
+    void requireHeights() const;
+    virtual void afterInsert(Node<Key, Value>* node);
+    template<typename KeyArg, typename... Args>
+    std::pair<iterator, bool> tryEmplaceImpl(KeyArg&& key, Args&&... args);
+    template<typename KeyArg, typename ValueArg>
+    std::pair<iterator, bool> emplaceImpl(std::true_type, KeyArg&& key, ValueArg&& value);
+    template<typename... Args>
+    std::pair<iterator, bool> emplaceImpl(std::false_type, Args&&... args);
+    template<typename KeyArg, typename M>
+    std::pair<iterator, bool> insertOrAssignImpl(KeyArg&& key, M&& obj);
+    template<typename NodeT>
+    NodeT* constructNode(const ItemBuilder<Key, Value>& build, NodeT* parent);
+    virtual Node<Key, Value>* createNode(const ItemBuilder<Key, Value>& build, Node<Key, Value>* parent);
+    void destroyNode(Node<Key, Value>* node);
+    virtual void destructNode(Node<Key, Value>* node);
+    virtual void initBuiltNode(Node<Key, Value>* node, int leftHeight, int rightHeight, std::size_t count);
+    template<typename ForwardIt>
+    Node<Key, Value>* buildSorted(ForwardIt& it, std::size_t count, Node<Key, Value>* parent);
+    static int perfectHeight(std::size_t count);
 
 protected:
     Node<Key, Value>* root_;
-    // You should not need other data members
+    Node<Key, Value>* rightmost_;   // largest node, so end() hints are O(1)
+    std::size_t size_;
+    bool trackHeights_;     // nodes are HeightNodes
+    std::size_t skewed_;    // how many nodes are out of balance
+    Compare comp_;
+    // Trees split from one another share a pool, so nodes can move
+    // between them without being copied. Such trees must not be
+    // modified from different threads at once.
+    std::shared_ptr<NodePool> pool_;
 };
 
 /*
@@ -266,27 +610,29 @@ Begin implementations for the BinarySearchTree::iterator class.
 /**
 * Explicit constructor that initializes an iterator with a given node pointer.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator(Node<Key,Value> *ptr)
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::iterator::iterator(Node<Key,Value> *ptr, const BinarySearchTree<Key, Value, Compare>* tree)
 {
     this->current_ = ptr;
+    this->tree_ = tree;
 }
 
 /**
 * A default constructor that initializes the iterator to NULL.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator() 
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::iterator::iterator() 
 {
     this->current_ = NULL;
+    this->tree_ = NULL;
 }
 
 /**
 * Provides access to the item.
 */
-template<class Key, class Value>
+template<class Key, class Value, class Compare>
 std::pair<const Key,Value> &
-BinarySearchTree<Key, Value>::iterator::operator*() const
+BinarySearchTree<Key, Value, Compare>::iterator::operator*() const
 {
     return current_->getItem();
 }
@@ -294,9 +640,9 @@ BinarySearchTree<Key, Value>::iterator::operator*() const
 /**
 * Provides access to the address of the item.
 */
-template<class Key, class Value>
+template<class Key, class Value, class Compare>
 std::pair<const Key,Value> *
-BinarySearchTree<Key, Value>::iterator::operator->() const
+BinarySearchTree<Key, Value, Compare>::iterator::operator->() const
 {
     return &(current_->getItem());
 }
@@ -305,10 +651,10 @@ BinarySearchTree<Key, Value>::iterator::operator->() const
 * Checks if 'this' iterator's internals have the same value
 * as 'rhs'
 */
-template<class Key, class Value>
+template<class Key, class Value, class Compare>
 bool
-BinarySearchTree<Key, Value>::iterator::operator==(
-    const BinarySearchTree<Key, Value>::iterator& rhs) const
+BinarySearchTree<Key, Value, Compare>::iterator::operator==(
+    const BinarySearchTree<Key, Value, Compare>::iterator& rhs) const
 {
     return this->current_ == rhs.current_;
 }
@@ -317,10 +663,10 @@ BinarySearchTree<Key, Value>::iterator::operator==(
 * Checks if 'this' iterator's internals have a different value
 * as 'rhs'
 */
-template<class Key, class Value>
+template<class Key, class Value, class Compare>
 bool
-BinarySearchTree<Key, Value>::iterator::operator!=(
-    const BinarySearchTree<Key, Value>::iterator& rhs) const
+BinarySearchTree<Key, Value, Compare>::iterator::operator!=(
+    const BinarySearchTree<Key, Value, Compare>::iterator& rhs) const
 {
     // TODO
     return this->current_ != rhs.current_;
@@ -330,9 +676,9 @@ BinarySearchTree<Key, Value>::iterator::operator!=(
 /**
 * Advances the iterator's location using an in-order sequencing
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator&
-BinarySearchTree<Key, Value>::iterator::operator++()
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator&
+BinarySearchTree<Key, Value, Compare>::iterator::operator++()
 {
     // check if current node is NULL first
     if(this->current_ == NULL){
@@ -363,6 +709,48 @@ BinarySearchTree<Key, Value>::iterator::operator++()
     return *this;
 }
 
+/**
+* Advances the iterator, returning its previous position.
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::iterator::operator++(int)
+{
+    iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/**
+* Moves the iterator back to the previous item in order. Decrementing
+* end() moves to the largest item. Like ++, the climbs back up the tree
+* are paid for by the descents, so a full scan is O(n).
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator&
+BinarySearchTree<Key, Value, Compare>::iterator::operator--()
+{
+    if(this->current_ == NULL){
+        this->current_ = this->tree_->rightmost_;
+    }
+    else {
+        this->current_ = BinarySearchTree<Key, Value, Compare>::predecessor(this->current_);
+    }
+    return *this;
+}
+
+/**
+* Moves the iterator back, returning its previous position.
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::iterator::operator--(int)
+{
+    iterator old(*this);
+    --(*this);
+    return old;
+}
+
 
 /*
 -------------------------------------------------------------
@@ -371,189 +759,1186 @@ End implementations for the BinarySearchTree::iterator class.
 */
 
 /*
------------------------------------------------------
-Begin implementations for the BinarySearchTree class.
------------------------------------------------------
+-------------------------------------------------------------------
+Begin implementations for the BinarySearchTree::const_iterator class.
+-------------------------------------------------------------------
 */
 
 /**
-* Default constructor for a BinarySearchTree, which sets the root to NULL.
+* Initializes the iterator with a given node pointer.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::BinarySearchTree() :
-    root_(NULL)
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::const_iterator::const_iterator(const Node<Key,Value> *ptr, const BinarySearchTree<Key, Value, Compare>* tree) :
+    current_(ptr),
+    tree_(tree)
 {
+}
 
+/**
+* A default constructor that initializes the iterator to NULL.
+*/
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::const_iterator::const_iterator() :
+    current_(NULL),
+    tree_(NULL)
+{
 }
 
-template<typename Key, typename Value>
-BinarySearchTree<Key, Value>::~BinarySearchTree()
+/**
+* Converts a mutable iterator to the same position.
+*/
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::const_iterator::const_iterator(const iterator& it) :
+    current_(it.current_),
+    tree_(it.tree_)
 {
-    // TODO
-    clear();
 }
 
 /**
- * Returns true if tree is empty
+* Provides read-only access to the item.
 */
-template<class Key, class Value>
-bool BinarySearchTree<Key, Value>::empty() const
+template<class Key, class Value, class Compare>
+const std::pair<const Key,Value> &
+BinarySearchTree<Key, Value, Compare>::const_iterator::operator*() const
 {
-    return root_ == NULL;
+    return current_->getItem();
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::print() const
+/**
+* Provides read-only access to the address of the item.
+*/
+template<class Key, class Value, class Compare>
+const std::pair<const Key,Value> *
+BinarySearchTree<Key, Value, Compare>::const_iterator::operator->() const
 {
-    printRoot(root_);
-    std::cout << "\n";
+    return &(current_->getItem());
 }
 
 /**
-* Returns an iterator to the "smallest" item in the tree
+* Advances to the next item in order; end() stays at end().
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::begin() const
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator&
+BinarySearchTree<Key, Value, Compare>::const_iterator::operator++()
 {
-    BinarySearchTree<Key, Value>::iterator begin(getSmallestNode());
-    return begin;
+    if(current_ != NULL){
+        current_ = BinarySearchTree<Key, Value, Compare>::successor(const_cast<Node<Key, Value>*>(current_));
+    }
+    return *this;
 }
 
 /**
-* Returns an iterator whose value means INVALID
+* Advances the iterator, returning its previous position.
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::end() const
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::const_iterator::operator++(int)
 {
-    BinarySearchTree<Key, Value>::iterator end(NULL);
-    return end;
+    const_iterator old(*this);
+    ++(*this);
+    return old;
 }
 
 /**
-* Returns an iterator to the item with the given key, k
-* or the end iterator if k does not exist in the tree
+* Moves back to the previous item in order; end() moves to the largest.
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::find(const Key & k) const
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator&
+BinarySearchTree<Key, Value, Compare>::const_iterator::operator--()
 {
-    Node<Key, Value> *curr = internalFind(k);
-    BinarySearchTree<Key, Value>::iterator it(curr);
-    return it;
+    if(current_ == NULL){
+        current_ = tree_->rightmost_;
+    }
+    else {
+        current_ = BinarySearchTree<Key, Value, Compare>::predecessor(const_cast<Node<Key, Value>*>(current_));
+    }
+    return *this;
 }
 
 /**
- * @precondition The key exists in the map
- * Returns the value associated with the key
- */
-template<class Key, class Value>
-Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
+* Moves the iterator back, returning its previous position.
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::const_iterator::operator--(int)
 {
-    Node<Key, Value> *curr = internalFind(key);
-    if(curr == NULL) throw std::out_of_range("Invalid key");
-    return curr->getValue();
+    const_iterator old(*this);
+    --(*this);
+    return old;
 }
-template<class Key, class Value>
-Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
+
+/*
+-----------------------------------------------------------------
+End implementations for the BinarySearchTree::const_iterator class.
+-------------------------------------------------------------
+*/
+
+/*
+-----------------------------------------------------
+Begin implementations for the BinarySearchTree class.
+-----------------------------------------------------
+*/
+
+/**
+* Default constructor for a BinarySearchTree, which sets the root to NULL.
+*/
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::BinarySearchTree() :
+    root_(NULL),
+    rightmost_(NULL),
+    size_(0),
+    trackHeights_(false),
+    skewed_(0),
+    comp_(),
+    pool_(std::make_shared<NodePool>(sizeof(Node<Key, Value>), alignof(Node<Key, Value>)))
 {
-    Node<Key, Value> *curr = internalFind(key);
-    if(curr == NULL) throw std::out_of_range("Invalid key");
-    return curr->getValue();
+
 }
 
 /**
-* An insert method to insert into a Binary Search Tree.
-* The tree will not remain balanced when inserting.
-* Recall: If key is already in the tree, you should 
-* overwrite the current value with the updated value.
+* Constructor that chooses whether the tree tracks subtree heights. A
+* tracking tree spends O(depth) extra work per insert and remove, and a
+* few bytes per node, to answer isBalanced() and height() in O(1).
+* AVLTree has no such mode: its height() follows balance factors in
+* O(log n), and its isBalanced() verifies the whole tree.
 */
-template<class Key, class Value>
-void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &keyValuePair)
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::BinarySearchTree(bool trackHeights) :
+    root_(NULL),
+    rightmost_(NULL),
+    size_(0),
+    trackHeights_(trackHeights),
+    skewed_(0),
+    comp_(),
+    pool_(std::make_shared<NodePool>(trackHeights ? sizeof(HeightNode<Key, Value>) : sizeof(Node<Key, Value>),
+                                    trackHeights ? alignof(HeightNode<Key, Value>) : alignof(Node<Key, Value>)))
 {
-    // define a curr to traverse and a parent tracker
-    Node<Key, Value> *curr = root_;
-    Node<Key, Value> *parent = NULL;
 
-    // keeps traveling until curr reach null
-    while(curr != NULL){
-        if(keyValuePair.first < curr->getKey()){
-            parent = curr;
-            curr = curr->getLeft();
-        }
-        else if(keyValuePair.first > curr->getKey()){
-            parent = curr;
-            curr = curr->getRight();
-        }
-        // if key is already in tree
-        else {
-            curr->setValue(keyValuePair.second);
-            parent = curr;
-            return;
-        }
-    }
+}
 
-    // once traverse done, initialize new node
-    Node<Key, Value> *nodeNew = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, NULL);
+/**
+* Constructor that orders keys with the given comparator instead of a
+* default-constructed one.
+*/
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::BinarySearchTree(const Compare& comp, bool trackHeights) :
+    root_(NULL),
+    rightmost_(NULL),
+    size_(0),
+    trackHeights_(trackHeights),
+    skewed_(0),
+    comp_(comp),
+    pool_(std::make_shared<NodePool>(trackHeights ? sizeof(HeightNode<Key, Value>) : sizeof(Node<Key, Value>),
+                                    trackHeights ? alignof(HeightNode<Key, Value>) : alignof(Node<Key, Value>)))
+{
 
-    // check if parent still is null, then empty BST;
-    if(parent == NULL){
-      root_ = nodeNew;
-    }
-    else {
-      // check if newNode is bigger than parent
-      if(nodeNew->getKey() > parent->getKey()){
-          nodeNew->setParent(parent);
-          // add to the right of parent;
-          parent->setRight(nodeNew);
-      }
-      // otherwise newNode is smaller than parent
-      else{
-          nodeNew->setParent(parent);
-          parent->setLeft(nodeNew);
-      }
-    }
 }
 
+/**
+* Builds a balanced tree from a range sorted by strictly increasing key.
+* See assignSorted().
+*/
+template<class Key, class Value, class Compare>
+template<typename ForwardIt>
+BinarySearchTree<Key, Value, Compare>::BinarySearchTree(ForwardIt first, ForwardIt last) :
+    root_(NULL),
+    rightmost_(NULL),
+    size_(0),
+    trackHeights_(false),
+    skewed_(0),
+    comp_(),
+    pool_(std::make_shared<NodePool>(sizeof(Node<Key, Value>), alignof(Node<Key, Value>)))
+{
+    assignSorted(first, last);
+}
 
 /**
-* A remove method to remove a specific key from a Binary Search Tree.
-* Recall: The writeup specifies that if a node has 2 children you
-* should swap with the predecessor and then remove.
+* Copy constructor. Builds a balanced copy of other's items in O(n),
+* tracking heights if other does. The copy shares nothing with other.
 */
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::remove(const Key& key)
+template<typename Key, typename Value, typename Compare>
+BinarySearchTree<Key, Value, Compare>::BinarySearchTree(const BinarySearchTree& other) :
+    root_(NULL),
+    rightmost_(NULL),
+    size_(0),
+    trackHeights_(other.trackHeights_),
+    skewed_(0),
+    comp_(other.comp_),
+    pool_(std::make_shared<NodePool>(other.trackHeights_ ? sizeof(HeightNode<Key, Value>) : sizeof(Node<Key, Value>),
+                                    other.trackHeights_ ? alignof(HeightNode<Key, Value>) : alignof(Node<Key, Value>)))
 {
-  // find the key
-  Node<Key, Value> *target = internalFind(key);
-  if(target == NULL){
-    // if key not found, do nothing
-    return;
-  }
+    assignSorted(other.cbegin(), other.cend());
+}
 
-  // if target is a single root_, remove and set root to NULL
-  if(target == root_ && target->getLeft() == NULL && target->getRight() == NULL){
-    delete target;
-    root_ = NULL;
-    return;
-  }
+/**
+* Copy assignment. Replaces the contents with a balanced copy of other's
+* items. Whether heights are tracked stays as it was for this tree, since
+* that fixes the size of its nodes.
+*/
+template<typename Key, typename Value, typename Compare>
+BinarySearchTree<Key, Value, Compare>&
+BinarySearchTree<Key, Value, Compare>::operator=(const BinarySearchTree& other)
+{
+    if(this != &other) {
+        comp_ = other.comp_;
+        assignSorted(other.cbegin(), other.cend());
+    }
+    return *this;
+}
 
-  // check case for 2 children first because we reduces it 
-  // to 1 or 0 children case
-  if(target->getLeft() != NULL && target->getRight() != NULL){
-    Node<Key, Value> *pre = predecessor(target);
-    nodeSwap(target, pre);
-  }
+/**
+* Constructor for derived trees whose nodes are larger than a plain Node,
+* so the node pool hands out slots of the right size.
+*/
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::BinarySearchTree(std::size_t nodeSize, std::size_t nodeAlign, const Compare& comp) :
+    root_(NULL),
+    rightmost_(NULL),
+    size_(0),
+    trackHeights_(false),
+    skewed_(0),
+    comp_(comp),
+    pool_(std::make_shared<NodePool>(nodeSize, nodeAlign))
+{
 
-  Node<Key, Value> *child = NULL;
-  // if 1 children
-  // check right side child first
-  if(target->getRight() != NULL){
-    // set child to right side
-    child = target->getRight();
-    // change child's parent to target's parent
-    child->setParent(target->getParent());
+}
+
+template<typename Key, typename Value, typename Compare>
+BinarySearchTree<Key, Value, Compare>::~BinarySearchTree()
+{
+    // TODO
+    clear();
+}
+
+/**
+ * Returns true if tree is empty
+*/
+template<class Key, class Value, class Compare>
+bool BinarySearchTree<Key, Value, Compare>::empty() const
+{
+    return root_ == NULL;
+}
+
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::print() const
+{
+    printRoot(root_);
+    std::cout << "\n";
+}
+
+/**
+* Returns the number of items in the tree
+*/
+template<class Key, class Value, class Compare>
+std::size_t BinarySearchTree<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+/**
+* Returns a copy of the comparator that orders the keys
+*/
+template<class Key, class Value, class Compare>
+Compare BinarySearchTree<Key, Value, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+* Returns the node pool's allocation counters. Trees that share a pool
+* (see AVLTree::split()) report the same counters.
+*/
+template<class Key, class Value, class Compare>
+const PoolStats& BinarySearchTree<Key, Value, Compare>::poolStats() const
+{
+    return pool_->stats();
+}
+
+/**
+* Returns an iterator to the "smallest" item in the tree
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::begin() const
+{
+    BinarySearchTree<Key, Value, Compare>::iterator begin(getSmallestNode(), this);
+    return begin;
+}
+
+/**
+* Returns an iterator whose value means INVALID
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::end() const
+{
+    BinarySearchTree<Key, Value, Compare>::iterator end(NULL, this);
+    return end;
+}
+
+/**
+* Returns a read-only iterator to the "smallest" item in the tree
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::cbegin() const
+{
+    return const_iterator(begin());
+}
+
+/**
+* Returns the read-only end iterator
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::cend() const
+{
+    return const_iterator(end());
+}
+
+/**
+* Returns a reverse iterator to the "largest" item in the tree
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::reverse_iterator
+BinarySearchTree<Key, Value, Compare>::rbegin() const
+{
+    return reverse_iterator(end());
+}
+
+/**
+* Returns the reverse iterator past the "smallest" item
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::reverse_iterator
+BinarySearchTree<Key, Value, Compare>::rend() const
+{
+    return reverse_iterator(begin());
+}
+
+/**
+* Returns a read-only reverse iterator to the "largest" item in the tree
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_reverse_iterator
+BinarySearchTree<Key, Value, Compare>::crbegin() const
+{
+    return const_reverse_iterator(cend());
+}
+
+/**
+* Returns the read-only reverse iterator past the "smallest" item
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_reverse_iterator
+BinarySearchTree<Key, Value, Compare>::crend() const
+{
+    return const_reverse_iterator(cbegin());
+}
+
+/**
+* Returns an iterator to the item with the given key, k
+* or the end iterator if k does not exist in the tree
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::find(const Key & k) const
+{
+    Node<Key, Value> *curr = internalFind(k);
+    BinarySearchTree<Key, Value, Compare>::iterator it(curr, this);
+    return it;
+}
+
+/**
+* Wraps a node of this tree in an iterator, for subclasses that find
+* nodes themselves.
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::makeIterator(Node<Key, Value>* node) const
+{
+    return iterator(node, this);
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key,
+* or end() if there is none
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    return iterator(lowerBoundNode(key), this);
+}
+
+/**
+* Returns an iterator to the first item whose key is greater than key,
+* or end() if there is none
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::upper_bound(const Key& key) const
+{
+    return iterator(upperBoundNode(key), this);
+}
+
+/**
+* Returns the range of items matching key: empty, or just the one item
+* since keys are unique
+*/
+template<class Key, class Value, class Compare>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator,
+          typename BinarySearchTree<Key, Value, Compare>::iterator>
+BinarySearchTree<Key, Value, Compare>::equal_range(const Key& key) const
+{
+    Node<Key, Value> *first = lowerBoundNode(key);
+    Node<Key, Value> *last = first;
+    if(last != NULL && !comp_(key, last->getKey())){
+        last = successor(last);
+    }
+    return std::make_pair(iterator(first, this), iterator(last, this));
+}
+
+/**
+* find() for any type Compare can order against Key.
+*/
+template<class Key, class Value, class Compare>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::find(const K& key) const
+{
+    return iterator(findNode(key), this);
+}
+
+/**
+* lower_bound() for any type Compare can order against Key.
+*/
+template<class Key, class Value, class Compare>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::lower_bound(const K& key) const
+{
+    return iterator(lowerBoundNode(key), this);
+}
+
+/**
+* upper_bound() for any type Compare can order against Key.
+*/
+template<class Key, class Value, class Compare>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::upper_bound(const K& key) const
+{
+    return iterator(upperBoundNode(key), this);
+}
+
+/**
+* equal_range() for any type Compare can order against Key.
+*/
+template<class Key, class Value, class Compare>
+template<typename K, typename C, typename>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator,
+          typename BinarySearchTree<Key, Value, Compare>::iterator>
+BinarySearchTree<Key, Value, Compare>::equal_range(const K& key) const
+{
+    Node<Key, Value> *first = lowerBoundNode(key);
+    Node<Key, Value> *last = first;
+    if(last != NULL && !comp_(key, last->getKey())){
+        last = successor(last);
+    }
+    return std::make_pair(iterator(first, this), iterator(last, this));
+}
+
+/**
+* Calls callback(item) for every item with lo <= key < hi, in order.
+* Descends once to the first item in range and then steps through
+* successors, so a range of k items costs O(log n + k) and no node
+* beyond the search path and the range itself is read.
+*/
+template<class Key, class Value, class Compare>
+template<typename F>
+void BinarySearchTree<Key, Value, Compare>::scan(const Key& lo, const Key& hi, F callback) const
+{
+    Node<Key, Value> *curr = lowerBoundNode(lo);
+    while(curr != NULL && comp_(curr->getKey(), hi)){
+        callback(curr->getItem());
+        curr = successor(curr);
+    }
+}
+
+/**
+* Calls fn(item) for every item, on several of pool's threads at once.
+* The tree is split into subtrees that are handed out by forking, so
+* work stealing evens out any that turn out slower; see reduceSubtree().
+* Each subtree's items are visited in key order; different subtrees go
+* in no particular order relative to each other. fn is called from
+* several threads at once, and the tree must not be modified meanwhile.
+*/
+template<class Key, class Value, class Compare>
+template<typename F>
+void BinarySearchTree<Key, Value, Compare>::parallel_for_each(F fn, ForkJoinPool& pool) const
+{
+    // a fold whose result carries nothing
+    auto visit = [&](bool, std::pair<const Key, Value>& item) { fn(item); return true; };
+    auto ignore = [](bool, bool) { return true; };
+    parallel_reduce(true, visit, ignore, pool);
+}
+
+/**
+* Folds every item into a value in parallel, split up as by
+* parallel_for_each(). Each piece starts from init and folds its items
+* in key order with acc = fn(acc, item); the pieces' results are then
+* merged with combine(leftResult, rightResult), always in key order. So
+* the result equals a sequential fold whenever combine is associative
+* and init is its identity, even if combine is not commutative.
+*/
+template<class Key, class Value, class Compare>
+template<typename T, typename F, typename C>
+T BinarySearchTree<Key, Value, Compare>::parallel_reduce(T init, F fn, C combine, ForkJoinPool& pool) const
+{
+    std::size_t chunks = chunkCount(pool);
+    int levels = chunks <= 1 ? 0 : splitLevels(chunks);
+    if(levels <= 0){
+        return reduceSubtree(root_, NULL, NULL, 0, init, fn, combine, pool);
+    }
+    T result(init);
+    pool.invoke([&]() { result = reduceSubtree(root_, NULL, NULL, levels, init, fn, combine, pool); });
+    return result;
+}
+
+/**
+* Folds the items of node's subtree, then those from next up to, but not
+* including, stop; next is the first item after node's subtree. While
+* levels is positive, a node with two children is split: its left
+* subtree becomes one task, and the node, its right subtree and the
+* rest another, forked so an idle thread can steal either, each with
+* the levels childSplitLevels() leaves it. Nodes with one child are
+* passed in place, so a chain costs no forks, and whatever is not split
+* is walked through successor pointers, so no shape of tree can exhaust
+* the stack.
+*/
+template<class Key, class Value, class Compare>
+template<typename T, typename F, typename C>
+T BinarySearchTree<Key, Value, Compare>::reduceSubtree(Node<Key, Value>* node, Node<Key, Value>* next,
+                                                        Node<Key, Value>* stop, int levels, const T& init,
+                                                        F& fn, C& combine, ForkJoinPool& pool) const
+{
+    T acc(init);
+    while(node != NULL && levels > 0){
+        Node<Key, Value> *left = node->getLeft();
+        Node<Key, Value> *right = node->getRight();
+        if(left != NULL && right != NULL){
+            int leftLevels = childSplitLevels(node, levels, false);
+            int rightLevels = childSplitLevels(node, levels, true);
+            T leftAcc(init), rightAcc(init);
+            pool.fork(
+                [&]() { leftAcc = reduceSubtree(left, node, node, leftLevels, init, fn, combine, pool); },
+                [&]() {
+                    rightAcc = fn(rightAcc, node->getItem());
+                    rightAcc = combine(rightAcc, reduceSubtree(right, next, stop, rightLevels, init, fn, combine, pool));
+                });
+            return combine(acc, combine(leftAcc, rightAcc));
+        }
+        levels = childSplitLevels(node, levels, left == NULL);
+        if(left == NULL){
+            // node comes first, then its right subtree
+            acc = fn(acc, node->getItem());
+            node = right;
+        }
+        else {
+            // the left subtree comes first, then node and the rest
+            next = node;
+            node = left;
+        }
+    }
+
+    // node's subtree and the run from next follow on from each other
+    Node<Key, Value> *first = next;
+    if(node != NULL){
+        for(first = node; first->getLeft() != NULL; first = first->getLeft()){
+        }
+    }
+    auto fold = [&](std::pair<const Key, Value>& item) { acc = fn(acc, item); };
+    visitRun(first, stop, fold);
+    return acc;
+}
+
+/**
+* Calls fn(item) for first and each following node up to, but not
+* including, stop (NULL for the end). Steps from node to node through
+* parent pointers, like the iterator, so no stack is needed and a
+* degenerate tree is as safe to walk as a balanced one.
+*/
+template<class Key, class Value, class Compare>
+template<typename F>
+void BinarySearchTree<Key, Value, Compare>::visitRun(Node<Key, Value>* first, Node<Key, Value>* stop, F& fn)
+{
+    for(Node<Key, Value> *curr = first; curr != stop; curr = successor(curr)){
+        fn(curr->getItem());
+    }
+}
+
+/**
+* Returns how many pieces the parallel passes aim to split the tree into
+* on pool: about 16 per thread, so stealing has work to even out, or 1
+* with one thread.
+*/
+template<class Key, class Value, class Compare>
+std::size_t BinarySearchTree<Key, Value, Compare>::chunkCount(const ForkJoinPool& pool)
+{
+    if(pool.threads() <= 1){
+        return 1;
+    }
+    return 16 * pool.threads();
+}
+
+/**
+* Returns how many times the parallel passes may split on the way down
+* from the root to make about chunks pieces. Nothing here bounds the
+* tree's shape or knows subtree sizes, so each split spends one level
+* and the log2(chunks) levels give chunks pieces on a balanced tree. A
+* lopsided split leaves one piece bigger than the rest; stealing evens
+* that out only as far as the pieces allow, and a tree that is mostly
+* one long chain stays mostly on one thread, as walking a chain is
+* serial anyway. Subclasses that know their shape do better.
+*/
+template<class Key, class Value, class Compare>
+int BinarySearchTree<Key, Value, Compare>::splitLevels(std::size_t chunks) const
+{
+    int levels = 0;
+    while((std::size_t(1) << levels) < chunks){
+        ++levels;
+    }
+    return levels;
+}
+
+/**
+* Returns the levels left to split below node, on its right side or its
+* left, given the levels it had: one fewer past a split, unchanged past
+* a node with one child, which is not split.
+*/
+template<class Key, class Value, class Compare>
+int BinarySearchTree<Key, Value, Compare>::childSplitLevels(Node<Key, Value>* node, int levels, bool) const
+{
+    if(node->getLeft() != NULL && node->getRight() != NULL){
+        return levels - 1;
+    }
+    return levels;
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<class Key, class Value, class Compare>
+Value& BinarySearchTree<Key, Value, Compare>::operator[](const Key& key)
+{
+    Node<Key, Value> *curr = internalFind(key);
+    if(curr == NULL) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+template<class Key, class Value, class Compare>
+Value const & BinarySearchTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    Node<Key, Value> *curr = internalFind(key);
+    if(curr == NULL) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+
+/**
+* An insert method to insert into a Binary Search Tree.
+* The tree will not remain balanced when inserting.
+* Recall: If key is already in the tree, you should 
+* overwrite the current value with the updated value.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::insert(const std::pair<const Key, Value> &keyValuePair)
+{
+    Node<Key, Value> *parent;
+    bool left;
+    Node<Key, Value> *curr = findSlot(keyValuePair.first, parent, left);
+
+    // if key is already in tree
+    if(curr != NULL){
+        curr->setValue(keyValuePair.second);
+        return;
+    }
+
+    // otherwise copy the pair straight into a new node
+    auto build = [&](std::pair<const Key, Value>* where) {
+        ::new (static_cast<void*>(where)) std::pair<const Key, Value>(keyValuePair);
+    };
+    linkNode(createNode(ItemBuilder<Key, Value>(build), parent), parent, left);
+}
+
+/**
+* Inserts from an rvalue pair, moving the key and value into the node.
+* Like the other insert, an existing key has its value overwritten
+* (by move assignment). Returns an iterator to the item and whether
+* a new node was added.
+*/
+template<class Key, class Value, class Compare>
+template<typename P, typename>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::insert(P&& keyValuePair)
+{
+    return insertOrAssignImpl(std::forward<P>(keyValuePair).first,
+                              std::forward<P>(keyValuePair).second);
+}
+
+/**
+* Constructs a key/value pair from args directly inside a new node, then
+* links it in if its key is not already present. As with std::map, the
+* existing value is left alone on a duplicate. Given a Key and a value,
+* the key is looked up first and nothing is built for a duplicate; other
+* arguments are built into a node first, which goes back to the node
+* pool on a duplicate, so the heap is not touched.
+*/
+template<class Key, class Value, class Compare>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::emplace(Args&&... args)
+{
+    return emplaceImpl(EmplacesKeyFirst<Key, Args...>(), std::forward<Args>(args)...);
+}
+
+/**
+* emplace() of a key and a value: searches before building.
+*/
+template<class Key, class Value, class Compare>
+template<typename KeyArg, typename ValueArg>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::emplaceImpl(std::true_type, KeyArg&& key, ValueArg&& value)
+{
+    return tryEmplaceImpl(std::forward<KeyArg>(key), std::forward<ValueArg>(value));
+}
+
+/**
+* emplace() of anything else: the key only exists once the item is built.
+*/
+template<class Key, class Value, class Compare>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::emplaceImpl(std::false_type, Args&&... args)
+{
+    auto build = [&](std::pair<const Key, Value>* where) {
+        ::new (static_cast<void*>(where)) std::pair<const Key, Value>(std::forward<Args>(args)...);
+    };
+    Node<Key, Value> *node = createNode(ItemBuilder<Key, Value>(build), NULL);
+
+    Node<Key, Value> *parent;
+    bool left;
+    Node<Key, Value> *curr = findSlot(node->getKey(), parent, left);
+    if(curr != NULL){
+        destroyNode(node);
+        return std::make_pair(iterator(curr, this), false);
+    }
+    node->setParent(parent);
+    linkNode(node, parent, left);
+    return std::make_pair(iterator(node, this), true);
+}
+
+/**
+* If key is absent, inserts a node whose value is constructed in place
+* from args. If key is present nothing is constructed, moved or
+* allocated, and the existing value is left alone.
+*/
+template<class Key, class Value, class Compare>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::try_emplace(const Key& key, Args&&... args)
+{
+    return tryEmplaceImpl(key, std::forward<Args>(args)...);
+}
+
+template<class Key, class Value, class Compare>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::try_emplace(Key&& key, Args&&... args)
+{
+    return tryEmplaceImpl(std::move(key), std::forward<Args>(args)...);
+}
+
+/**
+* Assigns obj to the value of key if it exists, otherwise inserts a node
+* with key and obj constructed in place. Returns an iterator to the item
+* and whether a new node was added.
+*/
+template<class Key, class Value, class Compare>
+template<typename M>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::insert_or_assign(const Key& key, M&& obj)
+{
+    return insertOrAssignImpl(key, std::forward<M>(obj));
+}
+
+template<class Key, class Value, class Compare>
+template<typename M>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::insert_or_assign(Key&& key, M&& obj)
+{
+    return insertOrAssignImpl(std::move(key), std::forward<M>(obj));
+}
+
+template<class Key, class Value, class Compare>
+template<typename KeyArg, typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::tryEmplaceImpl(KeyArg&& key, Args&&... args)
+{
+    Node<Key, Value> *parent;
+    bool left;
+    Node<Key, Value> *curr = findSlot(key, parent, left);
+    if(curr != NULL){
+        return std::make_pair(iterator(curr, this), false);
+    }
+
+    auto build = [&](std::pair<const Key, Value>* where) {
+        ::new (static_cast<void*>(where)) std::pair<const Key, Value>(
+            std::piecewise_construct,
+            std::forward_as_tuple(std::forward<KeyArg>(key)),
+            std::forward_as_tuple(std::forward<Args>(args)...));
+    };
+    Node<Key, Value> *node = createNode(ItemBuilder<Key, Value>(build), parent);
+    linkNode(node, parent, left);
+    return std::make_pair(iterator(node, this), true);
+}
+
+template<class Key, class Value, class Compare>
+template<typename KeyArg, typename M>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::insertOrAssignImpl(KeyArg&& key, M&& obj)
+{
+    Node<Key, Value> *parent;
+    bool left;
+    Node<Key, Value> *curr = findSlot(key, parent, left);
+    if(curr != NULL){
+        curr->getValue() = std::forward<M>(obj);
+        return std::make_pair(iterator(curr, this), false);
+    }
+
+    auto build = [&](std::pair<const Key, Value>* where) {
+        ::new (static_cast<void*>(where)) std::pair<const Key, Value>(
+            std::forward<KeyArg>(key), std::forward<M>(obj));
+    };
+    Node<Key, Value> *node = createNode(ItemBuilder<Key, Value>(build), parent);
+    linkNode(node, parent, left);
+    return std::make_pair(iterator(node, this), true);
+}
+
+/**
+* Inserts using hint, an iterator to the item that should follow the new
+* key (end() to append after the largest key), or to the item just before
+* it, such as the result of the previous insert in an increasing stream.
+* When the hint is right the new node is linked next to it without
+* descending from the root, so appends cost amortized O(1); otherwise
+* this falls back to a normal insert. Overwrites the value of an existing
+* key like insert(). Returns an iterator to the item.
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::insert(iterator hint, const std::pair<const Key, Value> &keyValuePair)
+{
+    Node<Key, Value> *parent;
+    bool left;
+    Node<Key, Value> *curr = findSlotNear(hint.current_, keyValuePair.first, parent, left);
+    if(curr != NULL){
+        curr->setValue(keyValuePair.second);
+        return iterator(curr, this);
+    }
+
+    auto build = [&](std::pair<const Key, Value>* where) {
+        ::new (static_cast<void*>(where)) std::pair<const Key, Value>(keyValuePair);
+    };
+    Node<Key, Value> *node = createNode(ItemBuilder<Key, Value>(build), parent);
+    linkNode(node, parent, left);
+    return iterator(node, this);
+}
+
+/**
+* Hinted insert from an rvalue pair, moving the key and value in.
+*/
+template<class Key, class Value, class Compare>
+template<typename P, typename>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::insert(iterator hint, P&& keyValuePair)
+{
+    Node<Key, Value> *parent;
+    bool left;
+    Node<Key, Value> *curr = findSlotNear(hint.current_, keyValuePair.first, parent, left);
+    if(curr != NULL){
+        curr->getValue() = std::forward<P>(keyValuePair).second;
+        return iterator(curr, this);
+    }
+
+    auto build = [&](std::pair<const Key, Value>* where) {
+        ::new (static_cast<void*>(where)) std::pair<const Key, Value>(
+            std::forward<P>(keyValuePair).first, std::forward<P>(keyValuePair).second);
+    };
+    Node<Key, Value> *node = createNode(ItemBuilder<Key, Value>(build), parent);
+    linkNode(node, parent, left);
+    return iterator(node, this);
+}
+
+/**
+* Walks down from the root looking for key. Returns the node holding it,
+* or NULL with parent set to the node a new key would hang from (NULL for
+* an empty tree) and left telling which side. Makes one comparison per
+* level, like lowerBoundNode(), and one more at the bottom to tell
+* whether the last node not less than key is actually equal to it.
+*/
+template<class Key, class Value, class Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::findSlot(const Key& key, Node<Key, Value>*& parent, bool& left) const
+{
+    // define a curr to traverse and a parent tracker
+    Node<Key, Value> *curr = root_;
+    Node<Key, Value> *bound = NULL;
+    parent = NULL;
+    left = false;
+
+    // keeps traveling until curr reach null
+    while(curr != NULL){
+        parent = curr;
+        if(comp_(curr->getKey(), key)){
+            left = false;
+            curr = curr->getRight();
+        }
+        else {
+            bound = curr;
+            left = true;
+            curr = curr->getLeft();
+        }
+    }
+    // if key is already in tree
+    if(bound != NULL && !comp_(key, bound->getKey())){
+        return bound;
+    }
+    return NULL;
+}
+
+/**
+* Like findSlot(), but first tries the gap next to hint (NULL meaning
+* end()). key belongs right before hint if it lies between hint and its
+* predecessor, or right after hint if it lies between hint and its
+* successor. Two adjacent nodes always have a free child pointer between
+* them, so the new node hangs off whichever one has it. Falls back to
+* findSlot() when key is not next to hint.
+*/
+template<class Key, class Value, class Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::findSlotNear(Node<Key, Value>* hint, const Key& key, Node<Key, Value>*& parent, bool& left) const
+{
+    if(root_ == NULL){
+        parent = NULL;
+        left = false;
+        return NULL;
+    }
+
+    // find the two neighbours key would sit between
+    Node<Key, Value> *before = NULL;
+    Node<Key, Value> *after = NULL;
+    if(hint == NULL){
+        before = rightmost_;
+    }
+    else if(comp_(key, hint->getKey())){
+        before = predecessor(hint);
+        after = hint;
+    }
+    else if(comp_(hint->getKey(), key)){
+        before = hint;
+        // the last node has no successor, and looking for one would
+        // climb to the root; appends hinted at the previous append hit this
+        after = hint == rightmost_ ? NULL : successor(hint);
+    }
+    else {
+        return hint;
+    }
+
+    // the hint was wrong, or key matches a neighbour
+    if((before != NULL && !comp_(before->getKey(), key)) ||
+       (after != NULL && !comp_(key, after->getKey()))){
+        return findSlot(key, parent, left);
+    }
+
+    if(before != NULL && before->getRight() == NULL){
+        parent = before;
+        left = false;
+    }
+    else {
+        parent = after;
+        left = true;
+    }
+    return NULL;
+}
+
+/**
+* Hangs a new node off parent on the given side (or makes it the root
+* when parent is NULL), then lets the tree rebalance.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::linkNode(Node<Key, Value>* node, Node<Key, Value>* parent, bool left)
+{
+    // check if parent still is null, then empty BST;
+    if(parent == NULL){
+        root_ = node;
+        rightmost_ = node;
+    }
+    else if(left){
+        parent->setLeft(node);
+    }
+    else{
+        parent->setRight(node);
+        if(parent == rightmost_){
+            rightmost_ = node;
+        }
+    }
+    ++size_;
+    afterInsert(node);
+}
+
+/**
+* Bookkeeping for a node about to be unlinked by remove(). The largest
+* node has no right child, so if it goes the new largest is either the
+* largest node of its left subtree or its parent.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::beforeUnlink(Node<Key, Value>* node)
+{
+    if(node == rightmost_){
+        rightmost_ = predecessor(node);
+    }
+    --size_;
+}
+
+/**
+* Finishes remove() once node has been unlinked from parent (NULL if it
+* was the root): fixes the tracked heights above it and destroys it.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::retireNode(Node<Key, Value>* node, Node<Key, Value>* parent)
+{
+    if(trackHeights_){
+        if(static_cast<HeightNode<Key, Value>*>(node)->isSkewed()){
+            --skewed_;
+        }
+        updateHeights(parent);
+    }
+    destroyNode(node);
+}
+
+/**
+* Recomputes the height and skew of node and its ancestors after one of
+* node's subtrees changed. Stops at the first node whose height comes out
+* unchanged, since nothing above it can change either.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::updateHeights(Node<Key, Value>* node)
+{
+    while(node != NULL){
+        HeightNode<Key, Value>* hnode = static_cast<HeightNode<Key, Value>*>(node);
+        int leftHeight = nodeHeight(node->getLeft());
+        int rightHeight = nodeHeight(node->getRight());
+
+        bool skewed = abs(leftHeight - rightHeight) > 1;
+        if(skewed != hnode->isSkewed()){
+            hnode->setSkewed(skewed);
+            if(skewed) ++skewed_;
+            else --skewed_;
+        }
+
+        int height = std::max(leftHeight, rightHeight) + 1;
+        if(height == hnode->getHeight()){
+            return;
+        }
+        hnode->setHeight(height);
+        node = node->getParent();
+    }
+}
+
+/**
+* Returns the tracked height of node's subtree, 0 for an empty one.
+*/
+template<class Key, class Value, class Compare>
+int BinarySearchTree<Key, Value, Compare>::nodeHeight(Node<Key, Value>* node)
+{
+    return node == NULL ? 0 : static_cast<HeightNode<Key, Value>*>(node)->getHeight();
+}
+
+/**
+* Returns the child of node with the taller subtree (the left one on a
+* tie), or NULL for a leaf. Needs tracked heights.
+*/
+template<class Key, class Value, class Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::tallerChild(Node<Key, Value>* node) const
+{
+    requireHeights();
+    if(nodeHeight(node->getLeft()) >= nodeHeight(node->getRight())){
+        return node->getLeft();
+    }
+    return node->getRight();
+}
+
+/**
+* Throws unless the tree was constructed to track heights.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::requireHeights() const
+{
+    if(!trackHeights_){
+        throw std::logic_error("height tracking is not enabled");
+    }
+}
+
+/**
+* Hook called once a new node has been linked in. A plain BST does not
+* rebalance; a height-tracking one updates the heights above the node.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::afterInsert(Node<Key, Value>* node)
+{
+  if(trackHeights_){
+    updateHeights(node->getParent());
+  }
+}
+
+
+/**
+* A remove method to remove a specific key from a Binary Search Tree.
+* Recall: The writeup specifies that if a node has 2 children you
+* should swap with the predecessor and then remove.
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::remove(const Key& key)
+{
+  // find the key
+  Node<Key, Value> *target = internalFind(key);
+  if(target == NULL){
+    // if key not found, do nothing
+    return;
+  }
+  beforeUnlink(target);
+
+  // if target is a single root_, remove and set root to NULL
+  if(target == root_ && target->getLeft() == NULL && target->getRight() == NULL){
+    retireNode(target, NULL);
+    root_ = NULL;
+    return;
+  }
+
+  // check case for 2 children first because we reduces it 
+  // to 1 or 0 children case
+  if(target->getLeft() != NULL && target->getRight() != NULL){
+    Node<Key, Value> *pre = predecessor(target);
+    nodeSwap(target, pre);
+  }
+
+  Node<Key, Value> *parent = target->getParent();
+  Node<Key, Value> *child = NULL;
+  // if 1 children
+  // check right side child first
+  if(target->getRight() != NULL){
+    // set child to right side
+    child = target->getRight();
+    // change child's parent to target's parent
+    child->setParent(target->getParent());
     // check if target parent isn't null
     if(target->getParent() != NULL){
       // change target's parent to point to child instead of target
@@ -571,7 +1956,7 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
       // child now becomes the root
       root_ = child;
     }
-    delete target;
+    retireNode(target, parent);
     return;
   }
   // check left side next
@@ -589,7 +1974,7 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
     else{
       root_ = child;
     }
-    delete target;
+    retireNode(target, parent);
     return;
   }
   // if child is still null, target has 0 child
@@ -598,22 +1983,22 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
     // check if target was left child
     if(target->getParent()->getLeft() == target){
       target->getParent()->setLeft(NULL);
-      delete target;
+      retireNode(target, parent);
       return;
     }
     // otherwise target is right child
     else{
       target->getParent()->setRight(NULL);
-      delete target;
+      retireNode(target, parent);
       return;
     }
   }
 }
 
 
-template<class Key, class Value>
+template<class Key, class Value, class Compare>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current)
+BinarySearchTree<Key, Value, Compare>::successor(Node<Key, Value>* current)
 {
   if(current == NULL){
     return NULL;
@@ -631,21 +2016,22 @@ BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current)
   else{
     // otherwise no right child
     Node<Key, Value> *parent = succ->getParent();
-    // traverse up while parent isn't a left child of its parent
-    while(parent != NULL && parent->getParent()->getLeft() != parent){
+    // traverse up while we are coming from a right child
+    while(parent != NULL && parent->getRight() == succ){
+      succ = parent;
       parent = parent->getParent();
     }
-    // otherwise next parent is successor
-    parent = parent->getParent();
+    // the first parent reached from its left side is the successor,
+    // or NULL if current was the largest node
     succ = parent;
   }
   return succ;
 }
 
 
-template<class Key, class Value>
+template<class Key, class Value, class Compare>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
+BinarySearchTree<Key, Value, Compare>::predecessor(Node<Key, Value>* current)
 {
     // if current's null, just return null
     if(current == NULL){
@@ -667,13 +2053,13 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
     else{
       // find first parent of pred
       Node<Key, Value> *parent = pred->getParent();
-      // traverse up while the pred parent isn't a right child of its parent
-      while(parent != NULL && parent->getParent()->getRight() != parent){
+      // traverse up while we are coming from a left child
+      while(parent != NULL && parent->getLeft() == pred){
+        pred = parent;
         parent = parent->getParent();
       }
-      // otherwise, the next parent is the predecessor
-      parent = parent->getParent();
-      // now assign current to the parent found
+      // the first parent reached from its right side is the predecessor,
+      // or NULL if current was the smallest node
       pred = parent;
     }
     return pred; 
@@ -684,23 +2070,312 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
 * A method to remove all contents of the tree and
 * reset the values in the tree for use again.
 */
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clear()
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::clear()
 {
+  if(pool_.use_count() > 1){
+    // other trees still have nodes in the pool; give back only ours
+    destroySubtree(root_);
+    root_ = NULL;
+    rightmost_ = NULL;
+    size_ = 0;
+    skewed_ = 0;
+    return;
+  }
   clearTraversal(root_);
   // resets root_ at the end;
   root_ = NULL;
+  rightmost_ = NULL;
+  size_ = 0;
+  skewed_ = 0;
+  // every node is destroyed, so hand the slabs back in one go
+  pool_->release();
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clearTraversal(Node<Key, Value>* root)
+/**
+* Replaces the contents of the tree with the key/value pairs in
+* [first, last), which must be sorted by strictly increasing key.
+* Builds a perfectly balanced tree in O(n) without any per-key descent
+* or rebalancing, with the nodes allocated from one contiguous slab.
+* Throws std::invalid_argument, leaving the tree untouched, if the keys
+* are out of order or repeated.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename ForwardIt>
+void BinarySearchTree<Key, Value, Compare>::assignSorted(ForwardIt first, ForwardIt last)
+{
+  // validate before touching the tree
+  std::size_t count = 0;
+  if(first != last){
+    ForwardIt prev = first;
+    ForwardIt it = first;
+    for(++it, count = 1; it != last; ++it, ++prev, ++count){
+      if(!comp_(prev->first, it->first)){
+        throw std::invalid_argument("assignSorted: keys must be strictly increasing");
+      }
+    }
+  }
+
+  clear();
+  pool_->reserve(count);
+  try {
+    root_ = buildSorted(first, count, NULL);
+  }
+  catch(...) {
+    // buildSorted already destroyed whatever it had built
+    clear();
+    throw;
+  }
+  rightmost_ = root_;
+  while(rightmost_ != NULL && rightmost_->getRight() != NULL){
+    rightmost_ = rightmost_->getRight();
+  }
+  size_ = count;
+}
+
+/**
+* Writes the tree's items to out as a binary snapshot (see
+* tree_snapshot.h) in one in-order pass. Integral keys are delta-encoded
+* and every block of records carries a CRC-32.
+* @throws std::runtime_error if the stream fails
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::save(std::ostream& out) const
+{
+  SnapshotWriter<Key, Value> writer(out, size_);
+  for(const_iterator it = cbegin(); it != cend(); ++it){
+    writer.put(it->first, it->second);
+  }
+  writer.finish();
+}
+
+/**
+* Replaces the contents of the tree with a snapshot written by save(),
+* reading exactly its bytes from in. The items stream straight into
+* buildSorted(), so the tree comes back perfectly balanced in O(n) with
+* no per-key descent or rebalancing. The snapshot must have been saved
+* with the same key order; keys are not compared again. Key and Value
+* must be default-constructible.
+* @throws std::runtime_error if the snapshot is truncated, corrupt, or
+*         written for other types, leaving the tree empty
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::load(std::istream& in)
+{
+  clear();
+  SnapshotReader<Key, Value> reader(in);
+  std::size_t count = static_cast<std::size_t>(reader.count());
+  // the count is unchecked until the records run out, so reserve no more
+  // than one block can hold; the pool grows slab by slab beyond that
+  pool_->reserve(std::min<std::size_t>(count, SNAPSHOT_BLOCK_BYTES));
+  try {
+    SnapshotItemIterator<Key, Value> it(reader, count);
+    root_ = buildSorted(it, count, NULL);
+    size_ = count;
+    reader.finish();
+  }
+  catch(...) {
+    clear();
+    throw;
+  }
+  rightmost_ = root_;
+  while(rightmost_ != NULL && rightmost_->getRight() != NULL){
+    rightmost_ = rightmost_->getRight();
+  }
+}
+
+/**
+* Builds a perfectly balanced subtree out of the next count items of it,
+* advancing it past them. Nodes are created in key order, so they sit in
+* memory in the order an iterator visits them. If an item throws, the
+* nodes built so far are destroyed and their slots handed back, since the
+* pool may be shared with other trees.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename ForwardIt>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::buildSorted(ForwardIt& it, std::size_t count, Node<Key, Value>* parent)
+{
+  if(count == 0){
+    return NULL;
+  }
+  // the right side gets the extra item when count is even
+  std::size_t leftCount = (count - 1) / 2;
+  std::size_t rightCount = count - 1 - leftCount;
+
+  Node<Key, Value>* left = buildSorted(it, leftCount, NULL);
+  Node<Key, Value>* node;
+  try {
+    auto build = [&](std::pair<const Key, Value>* where) {
+      ::new (static_cast<void*>(where)) std::pair<const Key, Value>(it->first, it->second);
+    };
+    node = createNode(ItemBuilder<Key, Value>(build), parent);
+  }
+  catch(...) {
+    destroySubtree(left);
+    throw;
+  }
+  ++it;
+  node->setLeft(left);
+  if(left != NULL){
+    left->setParent(node);
+  }
+  try {
+    node->setRight(buildSorted(it, rightCount, node));
+  }
+  catch(...) {
+    destroySubtree(node);
+    throw;
+  }
+  initBuiltNode(node, perfectHeight(leftCount), perfectHeight(rightCount), count);
+  return node;
+}
+
+/**
+* Returns the height of a perfectly balanced subtree with count nodes.
+*/
+template<typename Key, typename Value, typename Compare>
+int BinarySearchTree<Key, Value, Compare>::perfectHeight(std::size_t count)
 {
-  if(root != NULL){
-    // assume delete left side
-    clearTraversal(root->getLeft());
-    // assume delete right side
-    clearTraversal(root->getRight());
-    delete root;
+  int height = 0;
+  while(count > 0){
+    count /= 2;
+    ++height;
+  }
+  return height;
+}
+
+/**
+* Hook called for every node built by assignSorted() with the heights of
+* its two subtrees and the number of nodes in its own subtree. A plain
+* BST keeps no balance information.
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::initBuiltNode(Node<Key, Value>* node, int leftHeight, int rightHeight, std::size_t count)
+{
+  // the built tree is perfectly balanced, so nothing is skewed
+  if(trackHeights_){
+    static_cast<HeightNode<Key, Value>*>(node)->setHeight(std::max(leftHeight, rightHeight) + 1);
+  }
+}
+
+/**
+* Destroys every node below root in O(n) time and O(1) extra space,
+* scrambling the links as it goes. Their slots are not returned one by
+* one; clear() releases the whole pool afterwards. When the key/value
+* pair needs no destructor there is nothing to do at all (node types
+* only add trivially destructible members to Node).
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::clearTraversal(Node<Key, Value>* root)
+{
+  // nothing to run; the slots go back to the heap with the pool
+  if(std::is_trivially_destructible<std::pair<const Key, Value> >::value){
+    return;
+  }
+
+  // rotate each left child up until the current node has none, then
+  // destroy it and continue down its right side; this visits every
+  // node without a stack, so degenerate trees are safe to tear down
+  Node<Key, Value> *curr = root;
+  while(curr != NULL){
+    Node<Key, Value> *left = curr->getLeft();
+    if(left != NULL){
+      curr->setLeft(left->getRight());
+      left->setRight(curr);
+      curr = left;
+    }
+    else {
+      Node<Key, Value> *next = curr->getRight();
+      destructNode(curr);
+      curr = next;
+    }
+  }
+}
+
+/**
+* Destroys every node below root and puts each slot back on the pool's
+* free list, returning how many there were. Unlike clearTraversal() this
+* leaves the rest of the pool intact, so it suits a subtree unlinked from
+* a larger tree, or a tree whose pool other trees share.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t BinarySearchTree<Key, Value, Compare>::destroySubtree(Node<Key, Value>* root)
+{
+  // same stackless walk as clearTraversal()
+  std::size_t count = 0;
+  Node<Key, Value> *curr = root;
+  while(curr != NULL){
+    Node<Key, Value> *left = curr->getLeft();
+    if(left != NULL){
+      curr->setLeft(left->getRight());
+      left->setRight(curr);
+      curr = left;
+    }
+    else {
+      Node<Key, Value> *next = curr->getRight();
+      destroyNode(curr);
+      ++count;
+      curr = next;
+    }
+  }
+  return count;
+}
+
+/**
+* Constructs a node of type NodeT in a slot taken from the node pool.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename NodeT>
+NodeT* BinarySearchTree<Key, Value, Compare>::constructNode(const ItemBuilder<Key, Value>& build, NodeT* parent)
+{
+  void* slot = pool_->allocate();
+  try {
+    return new (slot) NodeT(build, parent);
+  }
+  catch(...) {
+    pool_->deallocate(slot);
+    throw;
+  }
+}
+
+/**
+* Creates a node of the tree's own node type: a HeightNode when heights
+* are tracked. Derived trees override this so code in BinarySearchTree
+* can build their nodes.
+*/
+template<typename Key, typename Value, typename Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::createNode(const ItemBuilder<Key, Value>& build, Node<Key, Value>* parent)
+{
+  if(trackHeights_){
+    return constructNode(build, static_cast<HeightNode<Key, Value>*>(parent));
+  }
+  return constructNode(build, parent);
+}
+
+/**
+* Destroys a node and puts its slot back on the pool's free list
+* so the next insert can reuse it.
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::destroyNode(Node<Key, Value>* node)
+{
+  destructNode(node);
+  pool_->deallocate(node);
+}
+
+/**
+* Runs the destructor of a node without freeing its slot. Derived trees
+* override this to destroy their own node type, since Node has no
+* virtual destructor.
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::destructNode(Node<Key, Value>* node)
+{
+  if(trackHeights_){
+    static_cast<HeightNode<Key, Value>*>(node)->~HeightNode();
+  }
+  else {
+    node->~Node();
   }
 }
 
@@ -708,9 +2383,9 @@ void BinarySearchTree<Key, Value>::clearTraversal(Node<Key, Value>* root)
 /**
 * A helper function to find the smallest node in the tree.
 */
-template<typename Key, typename Value>
+template<typename Key, typename Value, typename Compare>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::getSmallestNode() const
+BinarySearchTree<Key, Value, Compare>::getSmallestNode() const
 {
   Node<Key, Value> *target = root_;
 
@@ -727,42 +2402,197 @@ BinarySearchTree<Key, Value>::getSmallestNode() const
 * return a pointer to it or NULL if no item with that key
 * exists
 */
-template<typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) const
+template<typename Key, typename Value, typename Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::internalFind(const Key& key) const
 {
-  // initialize curr at root
-  Node<Key, Value> *curr = root_;
+  return findNode(key);
+}
 
-  // traverse while curr isn't null
-  while(curr != NULL){
-    // if key is less than curr's key, go left
-    if(key < curr->getKey()){
-      curr = curr->getLeft();
+/**
+* Finds the node whose key is equivalent to key, or NULL. Rather than
+* testing for both less and greater at every level, it descends to the
+* lower bound with a single comparison per level and then checks that
+* one candidate for equality.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename K>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::findNode(const K& key) const
+{
+  Node<Key, Value> *curr = lowerBoundNode(key);
+  if(curr != NULL && !comp_(key, curr->getKey())){
+    return curr;
+  }
+  return NULL;
+}
+
+template<class Key, class Value, class Compare>
+const std::size_t BinarySearchTree<Key, Value, Compare>::FIND_GROUP_SIZE;
+
+/**
+* Looks up every key in keys, setting out[i] to find(keys[i]). The
+* searches run in groups of FIND_GROUP_SIZE that take one step down the
+* tree in turn, prefetching the next node each search will visit. The
+* cache misses of a group then overlap instead of following one another,
+* as they do when find() is called in a loop.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::find_many(const std::vector<Key>& keys, std::vector<iterator>& out) const
+{
+  out.resize(keys.size());
+  for(std::size_t i = 0; i < keys.size(); i += FIND_GROUP_SIZE){
+    findGroup(&keys[i], std::min(FIND_GROUP_SIZE, keys.size() - i), &out[i]);
+  }
+}
+
+/**
+* Runs the lower-bound descents of find_many() for up to FIND_GROUP_SIZE
+* keys side by side. Searches that fall off the tree are swapped out of
+* the active prefix, so each round only visits live ones.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::findGroup(const Key* keys, std::size_t count, iterator* out) const
+{
+  Node<Key, Value> *curr[FIND_GROUP_SIZE];
+  Node<Key, Value> *bound[FIND_GROUP_SIZE];
+  std::size_t slot[FIND_GROUP_SIZE];
+  for(std::size_t i = 0; i < count; ++i){
+    curr[i] = root_;
+    bound[i] = NULL;
+    slot[i] = i;
+  }
+
+  std::size_t active = root_ != NULL ? count : 0;
+  while(active > 0){
+    for(std::size_t j = 0; j < active; ){
+      Node<Key, Value> *node = curr[j];
+      if(comp_(node->getKey(), keys[slot[j]])){
+        node = node->getRight();
+      }
+      else {
+        bound[j] = node;
+        node = node->getLeft();
+      }
+      if(node != NULL){
+#if defined(__GNUC__)
+        __builtin_prefetch(node);
+#endif
+        curr[j] = node;
+        ++j;
+      }
+      else {
+        // done: park the result and move the last live search here
+        --active;
+        std::swap(slot[j], slot[active]);
+        std::swap(bound[j], bound[active]);
+        curr[j] = curr[active];
+      }
+    }
+  }
+
+  for(std::size_t j = 0; j < count; ++j){
+    Node<Key, Value> *found = bound[j];
+    if(found != NULL && comp_(keys[slot[j]], found->getKey())){
+      found = NULL;
     }
-    // if key is greater than curr's key, go right
-    else if(key > curr->getKey()){
+    out[slot[j]] = iterator(found, this);
+  }
+}
+
+/**
+* Returns the node with the smallest key not less than key, or NULL.
+* Remembers the last node where the search went left, which is the
+* answer once the search falls off the tree.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename K>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::lowerBoundNode(const K& key) const
+{
+  Node<Key, Value> *curr = root_;
+  Node<Key, Value> *bound = NULL;
+  while(curr != NULL){
+    if(comp_(curr->getKey(), key)){
       curr = curr->getRight();
     }
-    // otherwise if they match, return this node
     else {
-      return curr;
+      bound = curr;
+      curr = curr->getLeft();
     }
   }
+  return bound;
+}
 
-  return curr;
+/**
+* Returns the node with the smallest key greater than key, or NULL.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename K>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::upperBoundNode(const K& key) const
+{
+  Node<Key, Value> *curr = root_;
+  Node<Key, Value> *bound = NULL;
+  while(curr != NULL){
+    if(comp_(key, curr->getKey())){
+      bound = curr;
+      curr = curr->getLeft();
+    }
+    else {
+      curr = curr->getRight();
+    }
+  }
+  return bound;
 }
 
 /**
  * Return true iff the BST is balanced.
  */
-template<typename Key, typename Value>
-bool BinarySearchTree<Key, Value>::isBalanced() const
+template<typename Key, typename Value, typename Compare>
+bool BinarySearchTree<Key, Value, Compare>::isBalanced() const
 {
+  // a tracking tree counts its out-of-balance nodes as it goes
+  if(trackHeights_){
+    return skewed_ == 0;
+  }
   return getBalance(root_) != -1;
 }
 
-template<typename Key, typename Value>
-int BinarySearchTree<Key, Value>::getBalance(Node<Key, Value> *node) const
+/**
+* Returns the number of nodes on the longest root-to-leaf path, in O(1).
+* @throws std::logic_error unless the tree tracks heights
+*/
+template<typename Key, typename Value, typename Compare>
+int BinarySearchTree<Key, Value, Compare>::height() const
+{
+  requireHeights();
+  return nodeHeight(root_);
+}
+
+/**
+* Returns the keys on a longest root-to-leaf path, root first. Follows the
+* taller child at each level, so it costs O(height) rather than a walk
+* of the whole tree.
+* @throws std::logic_error unless the tree can tell which child is taller
+*/
+template<typename Key, typename Value, typename Compare>
+std::vector<Key> BinarySearchTree<Key, Value, Compare>::deepestPath() const
+{
+  std::vector<Key> path;
+  for(Node<Key, Value> *curr = root_; curr != NULL; curr = tallerChild(curr)){
+    path.push_back(curr->getKey());
+  }
+  return path;
+}
+
+/**
+* Returns true if the tree was constructed to track heights.
+*/
+template<typename Key, typename Value, typename Compare>
+bool BinarySearchTree<Key, Value, Compare>::tracksHeights() const
+{
+  return trackHeights_;
+}
+
+template<typename Key, typename Value, typename Compare>
+int BinarySearchTree<Key, Value, Compare>::getBalance(Node<Key, Value> *node) const
 {
   if(node == NULL){
     return 0;
@@ -785,8 +2615,8 @@ int BinarySearchTree<Key, Value>::getBalance(Node<Key, Value> *node) const
   return std::max(leftHeight, rightHeight) + 1;
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
 {
     if((n1 == n2) || (n1 == NULL) || (n2 == NULL) ) {
         return;
@@ -867,6 +2697,17 @@ void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value
         this->root_ = n1;
     }
 
+    // tracked heights describe positions, which the nodes just traded
+    if(trackHeights_) {
+        HeightNode<Key, Value>* h1 = static_cast<HeightNode<Key, Value>*>(n1);
+        HeightNode<Key, Value>* h2 = static_cast<HeightNode<Key, Value>*>(n2);
+        int tempH = h1->getHeight();
+        h1->setHeight(h2->getHeight());
+        h2->setHeight(tempH);
+        bool tempS = h1->isSkewed();
+        h1->setSkewed(h2->isSkewed());
+        h2->setSkewed(tempS);
+    }
 }
 
 /**
@@ -0,0 +1,878 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "node_pool.h"
+
+/**
+* A sorted map stored as a B-tree, offering the same insert / remove /
+* find / operator[] / iterator surface as BinarySearchTree so it can
+* replace an AVLTree without changing the calling code.
+*
+* Each node holds many keys in one array, sized so that the keys of a
+* node fill about four cache lines, with the values in a second array
+* next to it. A lookup therefore misses cache about once per level of a
+* tree that is several times shallower than a binary one, and searches
+* within a node run over contiguous memory.
+*
+* Differences from BinarySearchTree: iterators yield a pair of references
+* rather than a reference to a stored pair, and any insert or remove
+* invalidates all iterators, since items move between nodes. Keys and
+* values must be nothrow move-constructible.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class BTreeMap
+{
+public:
+    BTreeMap();
+    explicit BTreeMap(const Compare& comp);
+    ~BTreeMap();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool isBalanced() const;
+    bool empty() const;
+    std::size_t size() const;
+
+private:
+    BTreeMap(const BTreeMap&) = delete;
+    BTreeMap& operator=(const BTreeMap&) = delete;
+
+    // Minimum degree: nodes other than the root hold between DEGREE - 1
+    // and 2 * DEGREE - 1 items.
+    static const int NODE_KEY_BYTES = 256;
+    static const int DEGREE = NODE_KEY_BYTES / (2 * sizeof(Key)) < 2 ? 2 : NODE_KEY_BYTES / (2 * sizeof(Key));
+    static const int MAX_ITEMS = 2 * DEGREE - 1;
+    static const int MIN_ITEMS = DEGREE - 1;
+
+    struct InternalNode;
+
+    // Items live in raw storage so that only the first count are built.
+    struct LeafNode
+    {
+        InternalNode* parent;
+        unsigned short index;   // position among the parent's children
+        unsigned short count;   // number of items
+        bool leaf;
+        typename std::aligned_storage<sizeof(Key), alignof(Key)>::type keys[MAX_ITEMS];
+        typename std::aligned_storage<sizeof(Value), alignof(Value)>::type values[MAX_ITEMS];
+
+        Key& key(int i) { return *reinterpret_cast<Key*>(&keys[i]); }
+        Value& value(int i) { return *reinterpret_cast<Value*>(&values[i]); }
+    };
+
+    struct InternalNode : public LeafNode
+    {
+        LeafNode* children[MAX_ITEMS + 1];
+    };
+
+public:
+    /**
+    * A bidirectional iterator visiting items in key order. Dereferencing
+    * gives a pair of references, so it->first and it->second work as
+    * they do on a BinarySearchTree iterator.
+    */
+    class iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key&, Value&> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, Value&> reference;
+
+        // operator-> has to return something that outlives the call
+        class pointer
+        {
+        public:
+            pointer(const reference& ref) : ref_(ref) { }
+            const reference* operator->() const { return &ref_; }
+        private:
+            reference ref_;
+        };
+
+        iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
+
+    protected:
+        friend class BTreeMap<Key, Value, Compare>;
+        iterator(const BTreeMap<Key, Value, Compare>* tree, LeafNode* node, int pos);
+        const BTreeMap<Key, Value, Compare> *tree_;
+        LeafNode *node_;    // NULL for end()
+        int pos_;
+    };
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+private:
+    LeafNode* newNode(bool leaf);
+    void freeNode(LeafNode* node);
+    int lowerBoundIn(LeafNode* node, const Key& key) const;
+    static LeafNode* child(LeafNode* node, int i);
+    static void setChild(InternalNode* node, int i, LeafNode* child);
+    static void moveItem(LeafNode* dst, int di, LeafNode* src, int si);
+    static void destroyItem(LeafNode* node, int i);
+    static void shiftRight(LeafNode* node, int from);
+    static void shiftLeft(LeafNode* node, int from);
+    void splitChild(InternalNode* parent, int i);
+    void fixUnderflow(LeafNode* node);
+    void borrowFromLeft(InternalNode* parent, int i);
+    void borrowFromRight(InternalNode* parent, int i);
+    void mergeChildren(InternalNode* parent, int i);
+    void destroySubtree(LeafNode* node);
+    static LeafNode* leftmostLeaf(LeafNode* node);
+    static LeafNode* rightmostLeaf(LeafNode* node);
+
+    LeafNode* root_;
+    std::size_t size_;
+    Compare comp_;
+    NodePool leafPool_;
+    NodePool internalPool_;
+};
+
+// Definitions for the node capacity constants, needed when they are bound
+// to a reference, as in std::min or a stream insertion.
+template<typename Key, typename Value, typename Compare>
+const int BTreeMap<Key, Value, Compare>::NODE_KEY_BYTES;
+template<typename Key, typename Value, typename Compare>
+const int BTreeMap<Key, Value, Compare>::DEGREE;
+template<typename Key, typename Value, typename Compare>
+const int BTreeMap<Key, Value, Compare>::MAX_ITEMS;
+template<typename Key, typename Value, typename Compare>
+const int BTreeMap<Key, Value, Compare>::MIN_ITEMS;
+
+/*
+  -------------------------------------------------
+  Begin implementations for the BTreeMap::iterator class.
+  -------------------------------------------------
+*/
+
+/**
+* A default constructor that initializes the iterator to NULL.
+*/
+template<typename Key, typename Value, typename Compare>
+BTreeMap<Key, Value, Compare>::iterator::iterator() :
+    tree_(NULL),
+    node_(NULL),
+    pos_(0)
+{
+
+}
+
+/**
+* Initializes the iterator at item pos of node.
+*/
+template<typename Key, typename Value, typename Compare>
+BTreeMap<Key, Value, Compare>::iterator::iterator(const BTreeMap<Key, Value, Compare>* tree, LeafNode* node, int pos) :
+    tree_(tree),
+    node_(node),
+    pos_(pos)
+{
+
+}
+
+/**
+* Provides access to the key and value.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::iterator::reference
+BTreeMap<Key, Value, Compare>::iterator::operator*() const
+{
+    return reference(node_->key(pos_), node_->value(pos_));
+}
+
+/**
+* Provides member access to the key and value, as it->first and it->second.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::iterator::pointer
+BTreeMap<Key, Value, Compare>::iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+/**
+* Checks if both iterators are at the same item.
+*/
+template<typename Key, typename Value, typename Compare>
+bool BTreeMap<Key, Value, Compare>::iterator::operator==(const iterator& rhs) const
+{
+    return node_ == rhs.node_ && pos_ == rhs.pos_;
+}
+
+/**
+* Checks if the iterators are at different items.
+*/
+template<typename Key, typename Value, typename Compare>
+bool BTreeMap<Key, Value, Compare>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Advances to the next item in key order. In an internal node that is the
+* first item of the subtree to the right of the current one; in a leaf it
+* is the next slot, or else the separator above the first ancestor
+* subtree we are not at the end of.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::iterator&
+BTreeMap<Key, Value, Compare>::iterator::operator++()
+{
+    if(node_ == NULL) {
+        return *this;
+    }
+    if(!node_->leaf) {
+        node_ = leftmostLeaf(child(node_, pos_ + 1));
+        pos_ = 0;
+        return *this;
+    }
+    ++pos_;
+    while(node_ != NULL && pos_ == node_->count) {
+        pos_ = node_->index;
+        node_ = node_->parent;
+    }
+    if(node_ == NULL) {
+        pos_ = 0;
+    }
+    return *this;
+}
+
+/**
+* Advances the iterator, returning its previous position.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::iterator
+BTreeMap<Key, Value, Compare>::iterator::operator++(int)
+{
+    iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/**
+* Moves back to the previous item in key order; end() moves to the last.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::iterator&
+BTreeMap<Key, Value, Compare>::iterator::operator--()
+{
+    if(node_ == NULL) {
+        if(tree_->root_ != NULL) {
+            node_ = rightmostLeaf(tree_->root_);
+            pos_ = node_->count - 1;
+        }
+        return *this;
+    }
+    if(!node_->leaf) {
+        node_ = rightmostLeaf(child(node_, pos_));
+        pos_ = node_->count - 1;
+        return *this;
+    }
+    while(node_ != NULL && pos_ == 0) {
+        pos_ = node_->index;
+        node_ = node_->parent;
+    }
+    if(node_ != NULL) {
+        --pos_;
+    }
+    return *this;
+}
+
+/**
+* Moves the iterator back, returning its previous position.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::iterator
+BTreeMap<Key, Value, Compare>::iterator::operator--(int)
+{
+    iterator old(*this);
+    --(*this);
+    return old;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the BTreeMap::iterator class.
+  -----------------------------------------------
+*/
+
+/*
+  -------------------------------------------
+  Begin implementations for the BTreeMap class.
+  -------------------------------------------
+*/
+
+/**
+* Default constructor, which creates an empty map.
+*/
+template<typename Key, typename Value, typename Compare>
+BTreeMap<Key, Value, Compare>::BTreeMap() :
+    root_(NULL),
+    size_(0),
+    comp_(),
+    leafPool_(sizeof(LeafNode), alignof(LeafNode)),
+    internalPool_(sizeof(InternalNode), alignof(InternalNode))
+{
+
+}
+
+/**
+* Constructor that orders keys with the given comparator.
+*/
+template<typename Key, typename Value, typename Compare>
+BTreeMap<Key, Value, Compare>::BTreeMap(const Compare& comp) :
+    root_(NULL),
+    size_(0),
+    comp_(comp),
+    leafPool_(sizeof(LeafNode), alignof(LeafNode)),
+    internalPool_(sizeof(InternalNode), alignof(InternalNode))
+{
+
+}
+
+/**
+* Destructor, which destroys every item.
+*/
+template<typename Key, typename Value, typename Compare>
+BTreeMap<Key, Value, Compare>::~BTreeMap()
+{
+    clear();
+}
+
+/**
+* Inserts the key/value pair, overwriting the value if the key is already
+* present. Splits every full node on the way down, so the leaf reached
+* always has room and no split ever has to travel back up.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    const Key& key = keyValuePair.first;
+    if(root_ == NULL) {
+        root_ = newNode(true);
+    }
+    else if(root_->count == MAX_ITEMS) {
+        InternalNode* top = static_cast<InternalNode*>(newNode(false));
+        setChild(top, 0, root_);
+        root_ = top;
+        splitChild(top, 0);
+    }
+
+    LeafNode* node = root_;
+    while(true) {
+        int i = lowerBoundIn(node, key);
+        if(i < node->count && !comp_(key, node->key(i))) {
+            node->value(i) = keyValuePair.second;
+            return;
+        }
+        if(node->leaf) {
+            // copy first, so a throwing copy leaves the node untouched
+            Key newKey(key);
+            Value newValue(keyValuePair.second);
+            shiftRight(node, i);
+            ::new (static_cast<void*>(&node->keys[i])) Key(std::move(newKey));
+            ::new (static_cast<void*>(&node->values[i])) Value(std::move(newValue));
+            ++node->count;
+            ++size_;
+            return;
+        }
+        InternalNode* parent = static_cast<InternalNode*>(node);
+        if(parent->children[i]->count == MAX_ITEMS) {
+            splitChild(parent, i);
+            // the median moved up to slot i; see which half key is in
+            if(!comp_(key, parent->key(i)) && !comp_(parent->key(i), key)) {
+                parent->value(i) = keyValuePair.second;
+                return;
+            }
+            if(comp_(parent->key(i), key)) {
+                ++i;
+            }
+        }
+        node = parent->children[i];
+    }
+}
+
+/**
+* Removes the key if present. An item in an internal node is replaced by
+* its predecessor, which always sits at the end of a leaf; the leaf is
+* then refilled from its siblings or merged, repairing upwards.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::remove(const Key& key)
+{
+    LeafNode* node = root_;
+    while(node != NULL) {
+        int i = lowerBoundIn(node, key);
+        if(i < node->count && !comp_(key, node->key(i))) {
+            LeafNode* leaf = node;
+            if(node->leaf) {
+                destroyItem(node, i);
+                shiftLeft(node, i + 1);
+            }
+            else {
+                leaf = rightmostLeaf(child(node, i));
+                destroyItem(node, i);
+                moveItem(node, i, leaf, leaf->count - 1);
+            }
+            --leaf->count;
+            --size_;
+            fixUnderflow(leaf);
+            return;
+        }
+        node = node->leaf ? NULL : child(node, i);
+    }
+}
+
+/**
+* Deletes all items, returning every node to the pools at once.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::clear()
+{
+    if(root_ != NULL) {
+        destroySubtree(root_);
+    }
+    root_ = NULL;
+    size_ = 0;
+    leafPool_.release();
+    internalPool_.release();
+}
+
+/**
+* A B-tree keeps every leaf at the same depth, so it is always balanced.
+*/
+template<typename Key, typename Value, typename Compare>
+bool BTreeMap<Key, Value, Compare>::isBalanced() const
+{
+    return true;
+}
+
+/**
+* Returns true if the map is empty.
+*/
+template<typename Key, typename Value, typename Compare>
+bool BTreeMap<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+/**
+* Returns the number of items.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t BTreeMap<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+/**
+* Returns an iterator to the item with the smallest key.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::iterator
+BTreeMap<Key, Value, Compare>::begin() const
+{
+    if(root_ == NULL) {
+        return end();
+    }
+    return iterator(this, leftmostLeaf(root_), 0);
+}
+
+/**
+* Returns the end iterator.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::iterator
+BTreeMap<Key, Value, Compare>::end() const
+{
+    return iterator(this, NULL, 0);
+}
+
+/**
+* Returns an iterator to the item with the given key, or end().
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::iterator
+BTreeMap<Key, Value, Compare>::find(const Key& key) const
+{
+    LeafNode* node = root_;
+    while(node != NULL) {
+        int i = lowerBoundIn(node, key);
+        if(i < node->count && !comp_(key, node->key(i))) {
+            return iterator(this, node, i);
+        }
+        node = node->leaf ? NULL : child(node, i);
+    }
+    return end();
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<typename Key, typename Value, typename Compare>
+Value& BTreeMap<Key, Value, Compare>::operator[](const Key& key)
+{
+    iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it.node_->value(it.pos_);
+}
+template<typename Key, typename Value, typename Compare>
+Value const & BTreeMap<Key, Value, Compare>::operator[](const Key& key) const
+{
+    iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it.node_->value(it.pos_);
+}
+
+/**
+* Takes an empty node from the matching pool.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::LeafNode*
+BTreeMap<Key, Value, Compare>::newNode(bool leaf)
+{
+    LeafNode* node;
+    if(leaf) {
+        node = ::new (leafPool_.allocate()) LeafNode;
+    }
+    else {
+        node = ::new (internalPool_.allocate()) InternalNode;
+    }
+    node->parent = NULL;
+    node->index = 0;
+    node->count = 0;
+    node->leaf = leaf;
+    return node;
+}
+
+/**
+* Returns an empty node to its pool.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::freeNode(LeafNode* node)
+{
+    if(node->leaf) {
+        leafPool_.deallocate(node);
+    }
+    else {
+        internalPool_.deallocate(node);
+    }
+}
+
+/**
+* Returns the first slot of node whose key is not less than key, by
+* binary search over the node's key array.
+*/
+template<typename Key, typename Value, typename Compare>
+int BTreeMap<Key, Value, Compare>::lowerBoundIn(LeafNode* node, const Key& key) const
+{
+    int lo = 0;
+    int hi = node->count;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(comp_(node->key(mid), key)) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+* Returns child i of an internal node.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::LeafNode*
+BTreeMap<Key, Value, Compare>::child(LeafNode* node, int i)
+{
+    return static_cast<InternalNode*>(node)->children[i];
+}
+
+/**
+* Makes child the i-th child of node, keeping its back links in step.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::setChild(InternalNode* node, int i, LeafNode* child)
+{
+    node->children[i] = child;
+    child->parent = node;
+    child->index = static_cast<unsigned short>(i);
+}
+
+/**
+* Moves the item at src[si] into the empty slot dst[di], leaving src[si]
+* empty.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::moveItem(LeafNode* dst, int di, LeafNode* src, int si)
+{
+    ::new (static_cast<void*>(&dst->keys[di])) Key(std::move(src->key(si)));
+    ::new (static_cast<void*>(&dst->values[di])) Value(std::move(src->value(si)));
+    destroyItem(src, si);
+}
+
+/**
+* Destroys the item at node[i], leaving the slot empty.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::destroyItem(LeafNode* node, int i)
+{
+    node->key(i).~Key();
+    node->value(i).~Value();
+}
+
+/**
+* Moves items from..count-1 (and in an internal node the children after
+* them) up one slot, leaving slot from empty. Does not change count.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::shiftRight(LeafNode* node, int from)
+{
+    for(int i = node->count - 1; i >= from; --i) {
+        moveItem(node, i + 1, node, i);
+    }
+    if(!node->leaf) {
+        InternalNode* in = static_cast<InternalNode*>(node);
+        for(int i = node->count; i > from; --i) {
+            setChild(in, i + 1, in->children[i]);
+        }
+    }
+}
+
+/**
+* Moves items from..count-1 (and in an internal node the children after
+* them) down one slot into the empty slot from - 1. Does not change count.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::shiftLeft(LeafNode* node, int from)
+{
+    for(int i = from; i < node->count; ++i) {
+        moveItem(node, i - 1, node, i);
+    }
+    if(!node->leaf) {
+        InternalNode* in = static_cast<InternalNode*>(node);
+        for(int i = from + 1; i <= node->count; ++i) {
+            setChild(in, i - 1, in->children[i]);
+        }
+    }
+}
+
+/**
+* Splits the full child i of parent around its median item, which moves
+* up into parent at slot i with the new right half as child i + 1.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::splitChild(InternalNode* parent, int i)
+{
+    LeafNode* left = parent->children[i];
+    LeafNode* right = newNode(left->leaf);
+
+    for(int j = 0; j < MIN_ITEMS; ++j) {
+        moveItem(right, j, left, DEGREE + j);
+    }
+    if(!left->leaf) {
+        for(int j = 0; j <= MIN_ITEMS; ++j) {
+            setChild(static_cast<InternalNode*>(right), j, child(left, DEGREE + j));
+        }
+    }
+    right->count = MIN_ITEMS;
+
+    shiftRight(parent, i);
+    moveItem(parent, i, left, MIN_ITEMS);
+    left->count = MIN_ITEMS;
+    setChild(parent, i + 1, right);
+    ++parent->count;
+}
+
+/**
+* Restores the minimum fill of node after it lost an item, borrowing
+* from a sibling when one can spare an item and merging with one
+* otherwise. A merge takes an item from the parent, so the repair may
+* continue upwards; an emptied root is replaced by its only child.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::fixUnderflow(LeafNode* node)
+{
+    while(node != root_ && node->count < MIN_ITEMS) {
+        InternalNode* parent = node->parent;
+        int i = node->index;
+        if(i > 0 && parent->children[i - 1]->count > MIN_ITEMS) {
+            borrowFromLeft(parent, i);
+            return;
+        }
+        if(i < parent->count && parent->children[i + 1]->count > MIN_ITEMS) {
+            borrowFromRight(parent, i);
+            return;
+        }
+        mergeChildren(parent, i > 0 ? i - 1 : i);
+        node = parent;
+    }
+
+    if(root_->count == 0) {
+        LeafNode* old = root_;
+        if(root_->leaf) {
+            root_ = NULL;
+        }
+        else {
+            root_ = child(root_, 0);
+            root_->parent = NULL;
+            root_->index = 0;
+        }
+        freeNode(old);
+    }
+}
+
+/**
+* Rotates one item from child i - 1 through the parent into child i.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::borrowFromLeft(InternalNode* parent, int i)
+{
+    LeafNode* node = parent->children[i];
+    LeafNode* left = parent->children[i - 1];
+
+    shiftRight(node, 0);
+    moveItem(node, 0, parent, i - 1);
+    moveItem(parent, i - 1, left, left->count - 1);
+    if(!node->leaf) {
+        InternalNode* in = static_cast<InternalNode*>(node);
+        // shiftRight moved children 1.. up; slot 0 needs moving too
+        setChild(in, 1, in->children[0]);
+        setChild(in, 0, child(left, left->count));
+    }
+    --left->count;
+    ++node->count;
+}
+
+/**
+* Rotates one item from child i + 1 through the parent into child i.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::borrowFromRight(InternalNode* parent, int i)
+{
+    LeafNode* node = parent->children[i];
+    LeafNode* right = parent->children[i + 1];
+
+    moveItem(node, node->count, parent, i);
+    moveItem(parent, i, right, 0);
+    if(!node->leaf) {
+        InternalNode* rightIn = static_cast<InternalNode*>(right);
+        setChild(static_cast<InternalNode*>(node), node->count + 1, rightIn->children[0]);
+        setChild(rightIn, 0, rightIn->children[1]);
+    }
+    // slot 0 and child 0 are settled; close the gap left by item 0
+    shiftLeft(right, 1);
+    --right->count;
+    ++node->count;
+}
+
+/**
+* Merges child i + 1 and the separating item i into child i, removing
+* both from the parent.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::mergeChildren(InternalNode* parent, int i)
+{
+    LeafNode* left = parent->children[i];
+    LeafNode* right = parent->children[i + 1];
+
+    moveItem(left, left->count, parent, i);
+    for(int j = 0; j < right->count; ++j) {
+        moveItem(left, left->count + 1 + j, right, j);
+    }
+    if(!left->leaf) {
+        for(int j = 0; j <= right->count; ++j) {
+            setChild(static_cast<InternalNode*>(left), left->count + 1 + j, child(right, j));
+        }
+    }
+    left->count += right->count + 1;
+
+    // close the gap in the parent: items after i and children after i + 1
+    for(int j = i + 1; j < parent->count; ++j) {
+        moveItem(parent, j - 1, parent, j);
+    }
+    for(int j = i + 2; j <= parent->count; ++j) {
+        setChild(parent, j - 1, parent->children[j]);
+    }
+    --parent->count;
+    freeNode(right);
+}
+
+/**
+* Destroys the items below node. Their nodes are returned in bulk by
+* clear(). When the items need no destructor there is nothing to do.
+*/
+template<typename Key, typename Value, typename Compare>
+void BTreeMap<Key, Value, Compare>::destroySubtree(LeafNode* node)
+{
+    if(std::is_trivially_destructible<Key>::value && std::is_trivially_destructible<Value>::value) {
+        return;
+    }
+    for(int i = 0; i < node->count; ++i) {
+        destroyItem(node, i);
+    }
+    if(!node->leaf) {
+        // recursion depth is the height of the tree, a handful of levels
+        for(int i = 0; i <= node->count; ++i) {
+            destroySubtree(child(node, i));
+        }
+    }
+}
+
+/**
+* Returns the leaf holding the smallest key under node.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::LeafNode*
+BTreeMap<Key, Value, Compare>::leftmostLeaf(LeafNode* node)
+{
+    while(!node->leaf) {
+        node = child(node, 0);
+    }
+    return node;
+}
+
+/**
+* Returns the leaf holding the largest key under node.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BTreeMap<Key, Value, Compare>::LeafNode*
+BTreeMap<Key, Value, Compare>::rightmostLeaf(LeafNode* node)
+{
+    while(!node->leaf) {
+        node = child(node, node->count);
+    }
+    return node;
+}
+
+/*
+  -----------------------------------------
+  End implementations for the BTreeMap class.
+  -----------------------------------------
+*/
+
+#endif
@@ -0,0 +1,1208 @@
+#ifndef COMPACT_AVL_H
+#define COMPACT_AVL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "avl_balance.h"
+#include "node_pool.h"
+
+/**
+* How a node handle is packed into a link field together with the two
+* balance bits. A handle is either a pointer to the node, whose two low
+* bits are always zero, or a 32-bit index into a CompactNodeStore arena,
+* which is shifted up to make room for them.
+*/
+template <typename Handle>
+struct CompactLinkTraits;
+
+template <typename NodeT>
+struct CompactLinkTraits<NodeT*>
+{
+    typedef std::uintptr_t Tagged;
+
+    static NodeT* nil() { return NULL; }
+    static Tagged tag(NodeT* handle, unsigned bits) { return reinterpret_cast<Tagged>(handle) | bits; }
+    static NodeT* untag(Tagged link) { return reinterpret_cast<NodeT*>(link & ~Tagged(3)); }
+};
+
+template <>
+struct CompactLinkTraits<std::uint32_t>
+{
+    typedef std::uint32_t Tagged;
+
+    // the largest index that still fits beside the tag bits
+    static std::uint32_t nil() { return 0x3FFFFFFF; }
+    static Tagged tag(std::uint32_t handle, unsigned bits) { return (handle << 2) | bits; }
+    static std::uint32_t untag(Tagged link) { return link >> 2; }
+};
+
+/**
+* The parent link of a CompactAVLNode. Trees built without parent
+* pointers use the empty specialization below, which takes no space.
+*/
+template <typename Handle, bool Parents>
+class CompactParentLink
+{
+public:
+    CompactParentLink() : parent_(CompactLinkTraits<Handle>::nil()) { }
+    Handle getParent() const { return parent_; }
+    void setParent(Handle parent) { parent_ = parent; }
+
+private:
+    Handle parent_;
+};
+
+template <typename Handle>
+class CompactParentLink<Handle, false>
+{
+public:
+    Handle getParent() const { return CompactLinkTraits<Handle>::nil(); }
+    void setParent(Handle) { }
+};
+
+template <typename Key, typename Value, bool Parents, bool Indexed>
+class CompactAVLNode;
+
+/**
+* The handle type nodes link to each other with: a pointer, or with
+* Indexed a 32-bit arena index.
+*/
+template <typename Key, typename Value, bool Parents, bool Indexed>
+struct CompactNodeHandle
+{
+    typedef typename std::conditional<Indexed, std::uint32_t,
+                                      CompactAVLNode<Key, Value, Parents, Indexed>*>::type type;
+};
+
+/**
+* An AVL node with no room spent on bookkeeping: the balance factor,
+* which is always -1, 0 or +1, lives in the two low bits of the left
+* link. With Parents false the node has no parent link either, and holds
+* just its item and two links. With Indexed the links are 32-bit arena
+* indexes rather than pointers, which halves them on 64-bit hosts.
+*/
+template <typename Key, typename Value, bool Parents, bool Indexed>
+class CompactAVLNode : public CompactParentLink<typename CompactNodeHandle<Key, Value, Parents, Indexed>::type, Parents>
+{
+public:
+    typedef typename CompactNodeHandle<Key, Value, Parents, Indexed>::type Handle;
+    typedef CompactLinkTraits<Handle> Links;
+
+    explicit CompactAVLNode(const std::pair<const Key, Value>& item);
+    ~CompactAVLNode();
+
+    const std::pair<const Key, Value>& getItem() const { return item_; }
+    std::pair<const Key, Value>& getItem() { return item_; }
+    const Key& getKey() const { return item_.first; }
+
+    Handle getLeft() const { return Links::untag(left_); }
+    Handle getRight() const { return right_; }
+    void setLeft(Handle left) { left_ = Links::tag(left, left_ & TAG_MASK); }
+    void setRight(Handle right) { right_ = right; }
+
+    // Balance is the height of the right subtree minus that of the left.
+    int getBalance() const { return static_cast<int>(left_ & TAG_MASK) - 1; }
+    void setBalance(int balance) { left_ = (left_ & ~TAG_MASK) | static_cast<typename Links::Tagged>(balance + 1); }
+
+private:
+    static const typename Links::Tagged TAG_MASK = 3;
+
+    union {
+        std::pair<const Key, Value> item_;
+    };
+    typename Links::Tagged left_;   // left child, with balance + 1 in the low bits
+    Handle right_;
+};
+
+/**
+* Constructs a leaf holding a copy of item.
+*/
+template<typename Key, typename Value, bool Parents, bool Indexed>
+CompactAVLNode<Key, Value, Parents, Indexed>::CompactAVLNode(const std::pair<const Key, Value>& item) :
+    left_(Links::tag(Links::nil(), 1)),
+    right_(Links::nil())
+{
+    static_assert(Indexed || alignof(CompactAVLNode) > TAG_MASK, "node pointers need two free low bits");
+    ::new (static_cast<void*>(&item_)) std::pair<const Key, Value>(item);
+}
+
+/**
+* Destroys the item.
+*/
+template<typename Key, typename Value, bool Parents, bool Indexed>
+CompactAVLNode<Key, Value, Parents, Indexed>::~CompactAVLNode()
+{
+    item_.~pair();
+}
+
+/**
+* Where a CompactAVLTree's nodes live, and how a handle reaches one.
+* Nodes linked by pointer come from a NodePool.
+*/
+template <typename NodeT, bool Indexed>
+class CompactNodeStore
+{
+public:
+    typedef NodeT* Handle;
+
+    CompactNodeStore() : pool_(sizeof(NodeT), alignof(NodeT)) { }
+
+    NodeT& at(Handle handle) { return *handle; }
+    const NodeT& at(Handle handle) const { return *handle; }
+
+    /**
+    * Builds a node holding a copy of item.
+    */
+    template<typename Item>
+    Handle create(const Item& item)
+    {
+        NodeT* node = static_cast<NodeT*>(pool_.allocate());
+        try {
+            ::new (static_cast<void*>(node)) NodeT(item);
+        }
+        catch(...) {
+            pool_.deallocate(node);
+            throw;
+        }
+        return node;
+    }
+
+    /**
+    * Destroys a node and frees its slot.
+    */
+    void destroy(Handle handle)
+    {
+        handle->~NodeT();
+        pool_.deallocate(handle);
+    }
+
+    /**
+    * Frees all memory at once. Every node must already be destroyed.
+    */
+    void release() { pool_.release(); }
+
+    const PoolStats& stats() const { return pool_.stats(); }
+
+private:
+    NodePool pool_;
+};
+
+/**
+* Nodes addressed by 32-bit index. They sit in an arena of equal-sized
+* chunks, each one contiguous; index i is slot i % CHUNK_SLOTS of chunk
+* i / CHUNK_SLOTS. Adding a chunk never moves existing nodes, so
+* references to items stay valid as the tree grows. Freed slots are
+* reused first, linked through their first four bytes.
+*
+* Since links are indexes, the arena means the same thing at any
+* address, and for trivially copyable keys and values it can be copied or
+* written out byte for byte.
+*/
+template <typename NodeT>
+class CompactNodeStore<NodeT, true>
+{
+public:
+    typedef std::uint32_t Handle;
+
+    CompactNodeStore() : used_(0), free_(CompactLinkTraits<Handle>::nil())
+    {
+        stats_.slabAllocs = stats_.slabFrees = stats_.nodeAllocs = stats_.nodeFrees = 0;
+    }
+
+    ~CompactNodeStore() { release(); }
+
+    NodeT& at(Handle handle)
+    {
+        return *reinterpret_cast<NodeT*>(&chunks_[handle >> CHUNK_BITS][handle & (CHUNK_SLOTS - 1)]);
+    }
+
+    const NodeT& at(Handle handle) const
+    {
+        return *reinterpret_cast<const NodeT*>(&chunks_[handle >> CHUNK_BITS][handle & (CHUNK_SLOTS - 1)]);
+    }
+
+    /**
+    * Builds a node holding a copy of item.
+    * @throws std::length_error if the arena already holds 2^30 - 1 nodes
+    */
+    template<typename Item>
+    Handle create(const Item& item)
+    {
+        Handle handle;
+        bool reused = free_ != CompactLinkTraits<Handle>::nil();
+        if(reused) {
+            handle = free_;
+        }
+        else {
+            if(used_ == CompactLinkTraits<Handle>::nil()) {
+                throw std::length_error("CompactAVLTree: more nodes than 32-bit links can address");
+            }
+            handle = used_;
+            if((handle >> CHUNK_BITS) == chunks_.size()) {
+                chunks_.push_back(new Slot[CHUNK_SLOTS]);
+                ++stats_.slabAllocs;
+            }
+        }
+        Slot* slot = &chunks_[handle >> CHUNK_BITS][handle & (CHUNK_SLOTS - 1)];
+        Handle next = reused ? *reinterpret_cast<Handle*>(slot) : used_ + 1;
+        ::new (static_cast<void*>(slot)) NodeT(item);
+        if(reused) {
+            free_ = next;
+        }
+        else {
+            ++used_;
+        }
+        ++stats_.nodeAllocs;
+        return handle;
+    }
+
+    /**
+    * Destroys a node and puts its slot on the free list.
+    */
+    void destroy(Handle handle)
+    {
+        NodeT& node = at(handle);
+        node.~NodeT();
+        *reinterpret_cast<Handle*>(&node) = free_;
+        free_ = handle;
+        ++stats_.nodeFrees;
+    }
+
+    /**
+    * Frees all memory at once. Every node must already be destroyed.
+    */
+    void release()
+    {
+        for(std::size_t i = 0; i < chunks_.size(); ++i) {
+            delete[] chunks_[i];
+            ++stats_.slabFrees;
+        }
+        chunks_.clear();
+        used_ = 0;
+        free_ = CompactLinkTraits<Handle>::nil();
+    }
+
+    const PoolStats& stats() const { return stats_; }
+
+private:
+    CompactNodeStore(const CompactNodeStore&) = delete;
+    CompactNodeStore& operator=(const CompactNodeStore&) = delete;
+
+    static const unsigned CHUNK_BITS = 12;
+    static const std::uint32_t CHUNK_SLOTS = 1u << CHUNK_BITS;
+
+    typedef typename std::aligned_storage<sizeof(NodeT), alignof(NodeT)>::type Slot;
+
+    std::vector<Slot*> chunks_;
+    Handle used_;       // slots handed out at least once
+    Handle free_;       // first freed slot, or nil
+    PoolStats stats_;
+};
+
+/**
+* An AVL tree using CompactAVLNode, for large maps where per-node overhead
+* dominates memory use.
+*
+* With Parents true (the default) nodes keep a parent link and iterators
+* hold a single handle, as in AVLTree. With Parents false, nodes have
+* none: insert and remove record the path down from the root and
+* rebalance back up along it, and iterators carry the path to their node
+* instead, held on the heap. That makes iterators costlier to copy, and
+* an iterator is invalidated by any insert or remove rather than only by
+* removing its own node.
+*
+* With Indexed true, nodes link to each other by 32-bit index into a
+* chunked arena instead of by pointer, for at most 2^30 - 1 nodes.
+*
+* The tree only ever reaches a node through its handle and the node
+* store, and rotates and rebalances with the code in avl_balance.h that
+* AVLTree runs too, so the same steps run in every mode. Both modes
+* rebalance along the path recorded on the way down, which is held in a
+* fixed array of MAX_HEIGHT entries, more than the height of any AVL
+* tree that fits in memory; the parent links are kept up to date for the
+* iterators' sake.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key>, bool Parents = true, bool Indexed = false>
+class CompactAVLTree
+{
+public:
+    typedef CompactAVLNode<Key, Value, Parents, Indexed> Node;
+    typedef typename Node::Handle Handle;
+
+    // An AVL tree of height 64 has over 10^13 nodes.
+    static const int MAX_HEIGHT = 64;
+
+    CompactAVLTree();
+    explicit CompactAVLTree(const Compare& comp);
+    ~CompactAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool isBalanced() const;
+    int height() const;
+    bool empty() const;
+    std::size_t size() const;
+    const PoolStats& poolStats() const;
+    static std::size_t nodeBytes();
+
+private:
+    CompactAVLTree(const CompactAVLTree&) = delete;
+    CompactAVLTree& operator=(const CompactAVLTree&) = delete;
+
+    typedef CompactLinkTraits<Handle> Links;
+    typedef CompactNodeStore<Node, Indexed> Store;
+
+    // Where an iterator is: the node alone when nodes know their parent,
+    // otherwise the whole path down to it.
+    template<bool HasParents, typename Dummy = void>
+    struct Cursor
+    {
+        Cursor() : node(Links::nil()) { }
+        Handle current() const { return node; }
+        void descend(Handle next) { node = next; }
+        void backTo(int, Handle at) { node = at; }
+        bool ascend(const Store& store);
+
+        Handle node;
+    };
+
+    template<typename Dummy>
+    struct Cursor<false, Dummy>
+    {
+        Handle current() const { return path.empty() ? Links::nil() : path.back(); }
+        void descend(Handle next) { path.push_back(next); }
+        void backTo(int length, Handle) { path.resize(length); }
+        bool ascend(const Store& store);
+
+        std::vector<Handle> path;
+    };
+
+    typedef Cursor<Parents> Position;
+
+public:
+    /**
+    * A bidirectional iterator visiting items in key order. Const picks
+    * const_iterator, whose items are read-only; an iterator converts to
+    * it.
+    */
+    template<bool Const>
+    class basic_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef typename std::conditional<Const, const value_type&, value_type&>::type reference;
+        typedef typename std::conditional<Const, const value_type*, value_type*>::type pointer;
+
+        basic_iterator();
+        template<bool OtherConst, typename = typename std::enable_if<Const && !OtherConst>::type>
+        basic_iterator(const basic_iterator<OtherConst>& other);
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        // friends so either side may be a plain iterator
+        friend bool operator==(const basic_iterator& lhs, const basic_iterator& rhs)
+        {
+            return lhs.position_.current() == rhs.position_.current();
+        }
+        friend bool operator!=(const basic_iterator& lhs, const basic_iterator& rhs)
+        {
+            return !(lhs == rhs);
+        }
+
+        basic_iterator& operator++();
+        basic_iterator operator++(int);
+        basic_iterator& operator--();
+        basic_iterator operator--(int);
+
+    private:
+        friend class CompactAVLTree<Key, Value, Compare, Parents, Indexed>;
+        template<bool> friend class basic_iterator;
+        typedef typename std::conditional<Const, const CompactAVLTree, CompactAVLTree>::type Tree;
+        basic_iterator(Tree* tree, const Position& position);
+
+        Tree* tree_;
+        Position position_;     // no node for end()
+    };
+
+    typedef basic_iterator<false> iterator;
+    typedef basic_iterator<true> const_iterator;
+
+    iterator begin();
+    const_iterator begin() const;
+    iterator end();
+    const_iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+private:
+    // The nodes from the root down to where an insert or remove works,
+    // and the direction taken out of each.
+    struct Path
+    {
+        Handle nodes[MAX_HEIGHT];
+        bool right[MAX_HEIGHT];
+        int depth;
+    };
+
+    // Node access for the rebalancing code shared through avl_balance.h
+    struct BalanceLinks
+    {
+        typedef typename Node::Handle Handle;
+
+        Handle left(Handle handle) const { return store.at(handle).getLeft(); }
+        Handle right(Handle handle) const { return store.at(handle).getRight(); }
+        void setLeft(Handle handle, Handle child) const { store.at(handle).setLeft(child); }
+        void setRight(Handle handle, Handle child) const { store.at(handle).setRight(child); }
+        int balance(Handle handle) const { return store.at(handle).getBalance(); }
+        void setBalance(Handle handle, int balance) const { store.at(handle).setBalance(balance); }
+        void setParent(Handle child, Handle parent) const
+        {
+            if(Parents && child != Links::nil()) store.at(child).setParent(parent);
+        }
+        void resize(Handle) const { }
+
+        Store& store;
+    };
+    typedef AVLBalance<BalanceLinks> Balance;
+
+    Node& node(Handle handle);
+    const Node& node(Handle handle) const;
+    Handle insertNode(const std::pair<const Key, Value>& keyValuePair, bool assign);
+    Position firstPosition() const;
+    Position findPosition(const Key& key) const;
+    Position lowerBoundPosition(const Key& key) const;
+    void step(Position& position, bool forward) const;
+    void descendToEnd(Position& position, Handle handle, bool rightmost) const;
+    void link(Path& path, int i, Handle child);
+    void setParentOf(Handle child, Handle parent);
+    int checkBalance(Handle handle, bool& ok) const;
+
+    Handle root_;
+    std::size_t size_;
+    Compare comp_;
+    Store store_;
+};
+
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+const int CompactAVLTree<Key, Value, Compare, Parents, Indexed>::MAX_HEIGHT;
+
+/*
+  -------------------------------------------------------
+  Begin implementations for the CompactAVLTree::iterator class.
+  -------------------------------------------------------
+*/
+
+/**
+* Moves a parent-linked cursor up one level. Returns whether the node it
+* left was the right child of the new one; moves to end() from the root.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+template<bool HasParents, typename Dummy>
+bool CompactAVLTree<Key, Value, Compare, Parents, Indexed>::Cursor<HasParents, Dummy>::ascend(const Store& store)
+{
+    Handle parent = store.at(node).getParent();
+    bool fromRight = parent != Links::nil() && store.at(parent).getRight() == node;
+    node = parent;
+    return fromRight;
+}
+
+/**
+* Pops the path by one node. Returns whether the node popped was the
+* right child of the new top.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+template<typename Dummy>
+bool CompactAVLTree<Key, Value, Compare, Parents, Indexed>::Cursor<false, Dummy>::ascend(const Store& store)
+{
+    Handle child = path.back();
+    path.pop_back();
+    return !path.empty() && store.at(path.back()).getRight() == child;
+}
+
+/**
+* A default constructor that initializes the iterator to NULL.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+template<bool Const>
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::basic_iterator<Const>::basic_iterator() :
+    tree_(NULL)
+{
+
+}
+
+/**
+* Converts an iterator to a const_iterator at the same item.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+template<bool Const>
+template<bool OtherConst, typename>
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::basic_iterator<Const>::basic_iterator(const basic_iterator<OtherConst>& other) :
+    tree_(other.tree_),
+    position_(other.position_)
+{
+
+}
+
+/**
+* Initializes an iterator of the given tree at position.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+template<bool Const>
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::basic_iterator<Const>::basic_iterator(Tree* tree, const Position& position) :
+    tree_(tree),
+    position_(position)
+{
+
+}
+
+/**
+* Provides access to the item.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+template<bool Const>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::template basic_iterator<Const>::reference
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::basic_iterator<Const>::operator*() const
+{
+    return tree_->node(position_.current()).getItem();
+}
+
+/**
+* Provides a pointer to the item.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+template<bool Const>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::template basic_iterator<Const>::pointer
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::basic_iterator<Const>::operator->() const
+{
+    return &(tree_->node(position_.current()).getItem());
+}
+
+/**
+* Advances the iterator to the next item.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+template<bool Const>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::template basic_iterator<Const>&
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::basic_iterator<Const>::operator++()
+{
+    tree_->step(position_, true);
+    return *this;
+}
+
+/**
+* Advances the iterator, returning its previous position.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+template<bool Const>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::template basic_iterator<Const>
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::basic_iterator<Const>::operator++(int)
+{
+    basic_iterator before(*this);
+    tree_->step(position_, true);
+    return before;
+}
+
+/**
+* Moves the iterator to the previous item; from end() that is the last.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+template<bool Const>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::template basic_iterator<Const>&
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::basic_iterator<Const>::operator--()
+{
+    tree_->step(position_, false);
+    return *this;
+}
+
+/**
+* Moves the iterator back, returning its previous position.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+template<bool Const>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::template basic_iterator<Const>
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::basic_iterator<Const>::operator--(int)
+{
+    basic_iterator before(*this);
+    tree_->step(position_, false);
+    return before;
+}
+
+/*
+  -------------------------------------------------------
+  End implementations for the CompactAVLTree::iterator class.
+  -------------------------------------------------------
+*/
+
+/*
+  -------------------------------------------
+  Begin implementations for the CompactAVLTree class.
+  -------------------------------------------
+*/
+
+/**
+* Default constructor for an empty tree.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::CompactAVLTree() :
+    root_(Links::nil()),
+    size_(0),
+    comp_()
+{
+
+}
+
+/**
+* Constructor that orders keys with the given comparator.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::CompactAVLTree(const Compare& comp) :
+    root_(Links::nil()),
+    size_(0),
+    comp_(comp)
+{
+
+}
+
+/**
+* Destroys every item.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::~CompactAVLTree()
+{
+    clear();
+}
+
+/**
+* Inserts the key/value pair, overwriting the value if the key is already
+* present.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+void CompactAVLTree<Key, Value, Compare, Parents, Indexed>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    insertNode(keyValuePair, true);
+}
+
+/**
+* Removes the item with the given key, if any. A node with two children
+* first trades places with its successor, so that the node unlinked
+* always has at most one child. Nodes trade places rather than items, so
+* iterators to other items stay valid in the parent-link mode.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+void CompactAVLTree<Key, Value, Compare, Parents, Indexed>::remove(const Key& key)
+{
+    Path path;
+    path.depth = 0;
+    Handle target = root_;
+    while(target != Links::nil()) {
+        path.nodes[path.depth] = target;
+        if(comp_(key, node(target).getKey())) {
+            path.right[path.depth++] = false;
+            target = node(target).getLeft();
+        }
+        else if(comp_(node(target).getKey(), key)) {
+            path.right[path.depth++] = true;
+            target = node(target).getRight();
+        }
+        else {
+            break;
+        }
+    }
+    if(target == Links::nil()) {
+        return;
+    }
+
+    Node& doomed = node(target);
+    if(doomed.getLeft() != Links::nil() && doomed.getRight() != Links::nil()) {
+        int at = path.depth;
+        path.right[path.depth++] = true;
+        Handle successor = doomed.getRight();
+        while(node(successor).getLeft() != Links::nil()) {
+            path.nodes[path.depth] = successor;
+            path.right[path.depth++] = false;
+            successor = node(successor).getLeft();
+        }
+        path.nodes[path.depth] = successor;
+
+        // successor takes target's place, target takes successor's
+        Node& moved = node(successor);
+        Handle successorRight = moved.getRight();
+        if(path.depth == at + 1) {
+            moved.setRight(target);
+        }
+        else {
+            moved.setRight(doomed.getRight());
+            node(path.nodes[path.depth - 1]).setLeft(target);
+        }
+        moved.setLeft(doomed.getLeft());
+        doomed.setLeft(Links::nil());
+        doomed.setRight(successorRight);
+        int balance = moved.getBalance();
+        moved.setBalance(doomed.getBalance());
+        doomed.setBalance(balance);
+        path.nodes[at] = successor;
+        path.nodes[path.depth] = target;
+        link(path, at, successor);
+        setParentOf(moved.getLeft(), successor);
+        setParentOf(moved.getRight(), successor);
+        setParentOf(target, path.nodes[path.depth - 1]);
+        setParentOf(successorRight, target);
+    }
+
+    Handle child = doomed.getLeft() != Links::nil() ? doomed.getLeft() : doomed.getRight();
+    link(path, path.depth, child);
+    store_.destroy(target);
+    --size_;
+
+    BalanceLinks links = { store_ };
+    bool shorter = true;
+    for(int i = path.depth - 1; i >= 0 && shorter; --i) {
+        Handle top = Balance::shrink(links, path.nodes[i], path.right[i], shorter);
+        if(top != path.nodes[i]) {
+            link(path, i, top);
+        }
+    }
+}
+
+/**
+* Removes every item.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+void CompactAVLTree<Key, Value, Compare, Parents, Indexed>::clear()
+{
+    // destroy without a stack by rotating left children up to the right
+    Handle handle = root_;
+    while(handle != Links::nil()) {
+        Node& current = node(handle);
+        Handle left = current.getLeft();
+        if(left != Links::nil()) {
+            current.setLeft(node(left).getRight());
+            node(left).setRight(handle);
+            handle = left;
+        }
+        else {
+            Handle next = current.getRight();
+            store_.destroy(handle);
+            handle = next;
+        }
+    }
+    root_ = Links::nil();
+    size_ = 0;
+    // every node is destroyed, so hand the memory back in one go
+    store_.release();
+}
+
+/**
+* Checks every node's stored balance against the heights of its subtrees
+* and that none is out of [-1, 1]. Walks the whole tree.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+bool CompactAVLTree<Key, Value, Compare, Parents, Indexed>::isBalanced() const
+{
+    bool ok = true;
+    checkBalance(root_, ok);
+    return ok;
+}
+
+/**
+* Returns the number of nodes on the longest path from the root, found
+* by following the taller side at each node.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+int CompactAVLTree<Key, Value, Compare, Parents, Indexed>::height() const
+{
+    int height = 0;
+    for(Handle handle = root_; handle != Links::nil(); ++height) {
+        const Node& current = node(handle);
+        handle = current.getBalance() > 0 ? current.getRight() : current.getLeft();
+    }
+    return height;
+}
+
+/**
+* Returns true if the tree is empty.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+bool CompactAVLTree<Key, Value, Compare, Parents, Indexed>::empty() const
+{
+    return size_ == 0;
+}
+
+/**
+* Returns the number of items.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+std::size_t CompactAVLTree<Key, Value, Compare, Parents, Indexed>::size() const
+{
+    return size_;
+}
+
+/**
+* Returns the node store's counters. For an arena, slabs are its chunks.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+const PoolStats& CompactAVLTree<Key, Value, Compare, Parents, Indexed>::poolStats() const
+{
+    return store_.stats();
+}
+
+/**
+* Returns the bytes taken by each node.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+std::size_t CompactAVLTree<Key, Value, Compare, Parents, Indexed>::nodeBytes()
+{
+    return sizeof(Node);
+}
+
+/**
+* Returns an iterator to the smallest item.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::iterator
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::begin()
+{
+    return iterator(this, firstPosition());
+}
+
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::const_iterator
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::begin() const
+{
+    return const_iterator(this, firstPosition());
+}
+
+/**
+* Returns the end iterator.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::iterator
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::end()
+{
+    return iterator(this, Position());
+}
+
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::const_iterator
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::end() const
+{
+    return const_iterator(this, Position());
+}
+
+/**
+* Returns a const_iterator to the smallest item.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::const_iterator
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::cbegin() const
+{
+    return begin();
+}
+
+/**
+* Returns the end const_iterator.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::const_iterator
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::cend() const
+{
+    return end();
+}
+
+/**
+* Returns an iterator to the item with the given key, or end().
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::iterator
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::find(const Key& key)
+{
+    return iterator(this, findPosition(key));
+}
+
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::const_iterator
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::find(const Key& key) const
+{
+    return const_iterator(this, findPosition(key));
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key,
+* or end().
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::iterator
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::lower_bound(const Key& key)
+{
+    return iterator(this, lowerBoundPosition(key));
+}
+
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::const_iterator
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::lower_bound(const Key& key) const
+{
+    return const_iterator(this, lowerBoundPosition(key));
+}
+
+/**
+* Returns the value for key, inserting a default one if it is missing.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+Value& CompactAVLTree<Key, Value, Compare, Parents, Indexed>::operator[](const Key& key)
+{
+    return node(insertNode(std::pair<const Key, Value>(key, Value()), false)).getItem().second;
+}
+
+/**
+* Returns the value for key.
+* @throws std::out_of_range if the key is not in the tree
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+Value const & CompactAVLTree<Key, Value, Compare, Parents, Indexed>::operator[](const Key& key) const
+{
+    const_iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it->second;
+}
+
+/**
+* Returns the node a handle refers to.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::Node&
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::node(Handle handle)
+{
+    return store_.at(handle);
+}
+
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+const typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::Node&
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::node(Handle handle) const
+{
+    return store_.at(handle);
+}
+
+/**
+* Inserts the key/value pair unless the key is present, in which case its
+* value is overwritten if assign is set. Records the path down, then walks
+* back up it updating balance factors until a subtree's height stops
+* changing, rotating at most once. Returns the handle of the key's node,
+* so callers need not look it up again.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::Handle
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::insertNode(const std::pair<const Key, Value>& keyValuePair, bool assign)
+{
+    Path path;
+    path.depth = 0;
+    for(Handle handle = root_; handle != Links::nil(); ++path.depth) {
+        Node& current = node(handle);
+        path.nodes[path.depth] = handle;
+        if(comp_(keyValuePair.first, current.getKey())) {
+            path.right[path.depth] = false;
+            handle = current.getLeft();
+        }
+        else if(comp_(current.getKey(), keyValuePair.first)) {
+            path.right[path.depth] = true;
+            handle = current.getRight();
+        }
+        else {
+            if(assign) {
+                current.getItem().second = keyValuePair.second;
+            }
+            return handle;
+        }
+    }
+
+    Handle leaf = store_.create(keyValuePair);
+    path.nodes[path.depth] = leaf;
+    link(path, path.depth, leaf);
+    ++size_;
+
+    BalanceLinks links = { store_ };
+    bool taller = true;
+    for(int i = path.depth - 1; i >= 0 && taller; --i) {
+        Handle top = Balance::grow(links, path.nodes[i], path.right[i], taller);
+        if(top != path.nodes[i]) {
+            link(path, i, top);
+        }
+    }
+    return leaf;
+}
+
+/**
+* Returns the position of the smallest item.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::Position
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::firstPosition() const
+{
+    Position position;
+    descendToEnd(position, root_, false);
+    return position;
+}
+
+/**
+* Returns the position of the item with the given key, or the end.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::Position
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::findPosition(const Key& key) const
+{
+    Position position = lowerBoundPosition(key);
+    Handle found = position.current();
+    if(found != Links::nil() && comp_(key, node(found).getKey())) {
+        return Position();
+    }
+    return position;
+}
+
+/**
+* Returns the position of the first item whose key is not less than key,
+* or the end.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+typename CompactAVLTree<Key, Value, Compare, Parents, Indexed>::Position
+CompactAVLTree<Key, Value, Compare, Parents, Indexed>::lowerBoundPosition(const Key& key) const
+{
+    // descend all the way, then back up to the last node where the
+    // search went left, which is the answer
+    Position position;
+    Handle best = Links::nil();
+    int bestLength = 0;
+    int length = 0;
+    for(Handle handle = root_; handle != Links::nil(); ++length) {
+        const Node& current = node(handle);
+        position.descend(handle);
+        if(comp_(current.getKey(), key)) {
+            handle = current.getRight();
+        }
+        else {
+            best = handle;
+            bestLength = length + 1;
+            handle = current.getLeft();
+        }
+    }
+    position.backTo(bestLength, best);
+    return position;
+}
+
+/**
+* Moves position to the in-order successor (forward) or predecessor.
+* That is the outermost node of the subtree on that side if there is
+* one, otherwise the first ancestor reached from the other side. Stepping
+* back from the end goes to the last node.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+void CompactAVLTree<Key, Value, Compare, Parents, Indexed>::step(Position& position, bool forward) const
+{
+    Handle current = position.current();
+    if(current == Links::nil()) {
+        if(!forward) {
+            descendToEnd(position, root_, true);
+        }
+        return;
+    }
+    const Node& here = node(current);
+    Handle side = forward ? here.getRight() : here.getLeft();
+    if(side != Links::nil()) {
+        descendToEnd(position, side, !forward);
+        return;
+    }
+    // climb until we leave a subtree from the side we are moving away from
+    while(position.current() != Links::nil() && position.ascend(store_) == forward) {
+    }
+}
+
+/**
+* Moves position down to handle, a child of where it is (or the root,
+* from the end), and on to the rightmost or leftmost node below it.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+void CompactAVLTree<Key, Value, Compare, Parents, Indexed>::descendToEnd(Position& position, Handle handle, bool rightmost) const
+{
+    while(handle != Links::nil()) {
+        position.descend(handle);
+        const Node& current = node(handle);
+        handle = rightmost ? current.getRight() : current.getLeft();
+    }
+}
+
+/**
+* Points the link that held path.nodes[i] (its parent's child link, or
+* the root) at child, and child's parent link back at that parent.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+void CompactAVLTree<Key, Value, Compare, Parents, Indexed>::link(Path& path, int i, Handle child)
+{
+    Handle parent = i == 0 ? Links::nil() : path.nodes[i - 1];
+    if(parent == Links::nil()) {
+        root_ = child;
+    }
+    else if(path.right[i - 1]) {
+        node(parent).setRight(child);
+    }
+    else {
+        node(parent).setLeft(child);
+    }
+    setParentOf(child, parent);
+}
+
+/**
+* Sets child's parent link, if child exists and nodes have them.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+void CompactAVLTree<Key, Value, Compare, Parents, Indexed>::setParentOf(Handle child, Handle parent)
+{
+    if(Parents && child != Links::nil()) {
+        node(child).setParent(parent);
+    }
+}
+
+/**
+* Returns the height of the subtree at handle, clearing ok if any node in
+* it has a wrong or out-of-range balance, or a wrong parent link.
+*/
+template<typename Key, typename Value, typename Compare, bool Parents, bool Indexed>
+int CompactAVLTree<Key, Value, Compare, Parents, Indexed>::checkBalance(Handle handle, bool& ok) const
+{
+    if(handle == Links::nil()) {
+        return 0;
+    }
+    const Node& current = node(handle);
+    if(Parents && ((current.getLeft() != Links::nil() && node(current.getLeft()).getParent() != handle) ||
+                   (current.getRight() != Links::nil() && node(current.getRight()).getParent() != handle))) {
+        ok = false;
+    }
+    int left = checkBalance(current.getLeft(), ok);
+    int right = checkBalance(current.getRight(), ok);
+    if(right - left != current.getBalance() || right - left < -1 || right - left > 1) {
+        ok = false;
+    }
+    return 1 + (left > right ? left : right);
+}
+
+/*
+  -----------------------------------------
+  End implementations for the CompactAVLTree class.
+  -----------------------------------------
+*/
+
+#endif
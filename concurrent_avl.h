@@ -0,0 +1,1210 @@
+#ifndef CONCURRENT_AVL_H
+#define CONCURRENT_AVL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+* Tracks which threads may still be looking at memory a writer has
+* unlinked, so that it is freed only once none can be.
+*
+* A thread announces the global epoch in a slot for as long as it is
+* inside the structure. A writer retires a pointer together with the
+* epoch current just after it was unlinked. Whoever frees memory first
+* advances the epoch; a thread announcing after that can no longer reach
+* anything retired before it. A retired pointer is released once every
+* announced epoch is newer than its own.
+*/
+class EpochReclaimer
+{
+public:
+    static const std::size_t SLOTS = 64;
+
+    EpochReclaimer();
+
+    std::size_t enter();
+    void exit(std::size_t slot);
+    std::uint64_t current() const;
+    void advance();
+    std::uint64_t oldestActive() const;
+
+    /**
+    * Holds a slot for the lifetime of the guard. The slot number is
+    * the caller's for as long as the guard lives, so per-slot state
+    * keyed by it needs no further locking.
+    */
+    class Guard
+    {
+    public:
+        explicit Guard(EpochReclaimer& epochs) : epochs_(epochs), slot_(epochs.enter()) { }
+        ~Guard() { epochs_.exit(slot_); }
+        std::size_t slot() const { return slot_; }
+    private:
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        EpochReclaimer& epochs_;
+        std::size_t slot_;
+    };
+
+private:
+    // One cache line per slot, so threads on different cores do not
+    // contend for a line they only write to themselves.
+    struct alignas(64) Slot
+    {
+        std::atomic<std::uint64_t> epoch;   // 0 when free
+    };
+
+    std::atomic<std::uint64_t> epoch_;
+    Slot slots_[SLOTS];
+};
+
+/**
+* Initializes all slots to free.
+*/
+inline EpochReclaimer::EpochReclaimer() :
+    epoch_(1)
+{
+    for(std::size_t i = 0; i < SLOTS; ++i) {
+        slots_[i].epoch.store(0, std::memory_order_relaxed);
+    }
+}
+
+/**
+* Claims a free slot and announces the current epoch in it. Threads
+* start probing at a slot picked from their id, so each usually finds
+* its own slot free at once. Waits if every slot is taken.
+*/
+inline std::size_t EpochReclaimer::enter()
+{
+    std::size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+    while(true) {
+        for(std::size_t i = 0; i < SLOTS; ++i) {
+            std::size_t slot = (start + i) % SLOTS;
+            std::uint64_t expected = 0;
+            // seq_cst orders the announcement before the thread's loads
+            if(slots_[slot].epoch.compare_exchange_strong(expected, epoch_.load())) {
+                return slot;
+            }
+        }
+        std::this_thread::yield();
+    }
+}
+
+/**
+* Frees the slot taken by enter().
+*/
+inline void EpochReclaimer::exit(std::size_t slot)
+{
+    slots_[slot].epoch.store(0, std::memory_order_release);
+}
+
+/**
+* Returns the epoch to retire a just-unlinked pointer with. The caller
+* must have unlinked it before calling. Only a load, so writers retiring
+* on different cores do not fight over the epoch's cache line.
+*/
+inline std::uint64_t EpochReclaimer::current() const
+{
+    return epoch_.load();
+}
+
+/**
+* Moves to a new epoch. Threads entering from now on announce an epoch
+* newer than everything retired so far.
+*/
+inline void EpochReclaimer::advance()
+{
+    epoch_.fetch_add(1);
+}
+
+/**
+* Returns the oldest epoch announced by a thread, or the current epoch
+* when there are none. Pointers retired before it are safe to free.
+*/
+inline std::uint64_t EpochReclaimer::oldestActive() const
+{
+    std::uint64_t oldest = epoch_.load();
+    for(std::size_t i = 0; i < SLOTS; ++i) {
+        std::uint64_t announced = slots_[i].epoch.load();
+        if(announced != 0 && announced < oldest) {
+            oldest = announced;
+        }
+    }
+    return oldest;
+}
+
+/**
+* An AVL tree map that any number of threads may read and write at once.
+*
+* This follows Bronson et al.'s optimistic relaxed-balance AVL tree.
+* Every node carries a mutex and a version number. Readers take no
+* locks: they walk down hand over hand, reading a child and then checking
+* that its parent's version has not moved. A rotation bumps the version
+* of the node it moves down, which is the only way keys can leave a
+* subtree, so a reader that sees the version unchanged knows its key
+* could not have slipped past it and otherwise retries from that node.
+* A reader that meets a rotation in progress waits for it to finish.
+*
+* Writers search the same way and then lock only what they change: an
+* insert locks the node it hangs the new leaf from, an update locks the
+* node itself, and unlinking a node locks it and its parent. Rebalancing
+* runs afterwards, bottom up, one node at a time: each node is repaired
+* with it and its parent locked, plus the child (and grandchild for a
+* double rotation) a rotation moves. Locks are always taken top down, so
+* writers cannot deadlock. Balance is relaxed: under contention the tree
+* may briefly be outside the AVL bound, and it is back within it once
+* writers go quiet.
+* Removing a key with two children only clears its value, leaving a
+* routing node that is unlinked once it has a free child.
+*
+* Unlinked nodes and replaced values are retired through an
+* EpochReclaimer. Every operation holds a slot while it runs, and each
+* slot keeps its own list of retired memory, so writers never share a
+* lock to retire or free.
+*
+* Lookups copy values out, since a reference into the tree could
+* outlive the value it points at.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class ConcurrentAVLTree
+{
+public:
+    ConcurrentAVLTree();
+    explicit ConcurrentAVLTree(const Compare& comp);
+    ~ConcurrentAVLTree();
+
+    bool find(const Key& key, Value& value) const;
+    bool contains(const Key& key) const;
+    template<typename F>
+    void scan(const Key& lo, const Key& hi, F callback) const;
+    std::size_t size() const;
+    bool empty() const;
+
+    bool insert(const std::pair<const Key, Value>& keyValuePair);
+    bool remove(const Key& key);
+    void clear();
+
+    bool isBalanced() const;
+
+private:
+    ConcurrentAVLTree(const ConcurrentAVLTree&) = delete;
+    ConcurrentAVLTree& operator=(const ConcurrentAVLTree&) = delete;
+
+    // The fields every node has, including the holder above the root,
+    // which has no key. Child and parent links are guarded by the lock
+    // of the node holding them; a node's parent link by its parent's.
+    struct Link
+    {
+        Link() : left(NULL), right(NULL), parent(NULL), height(0), version(0), value(NULL) { }
+        Link* child(int dir) const { return dir < 0 ? left.load() : right.load(); }
+        void setChild(int dir, Link* node) { if(dir < 0) left.store(node); else right.store(node); }
+
+        std::atomic<Link*> left;
+        std::atomic<Link*> right;
+        std::atomic<Link*> parent;
+        std::atomic<int> height;
+        std::atomic<std::uint64_t> version;
+        std::atomic<const Value*> value;    // NULL in a routing node
+        std::mutex lock;
+    };
+
+    struct Node : Link
+    {
+        Node(const Key& k, const Value* v, Link* p) : key(k)
+        {
+            this->value.store(v, std::memory_order_relaxed);
+            this->parent.store(p, std::memory_order_relaxed);
+            this->height.store(1, std::memory_order_relaxed);
+        }
+        const Key key;
+    };
+
+    // A node or value no longer reachable, and the epoch it left in.
+    struct Retired
+    {
+        Link* node;
+        const Value* value;
+        std::uint64_t epoch;
+    };
+
+    // What one slot has retired and added, touched only by its holder.
+    struct alignas(64) SlotState
+    {
+        SlotState() : reclaimAt(RECLAIM_BATCH), count(0) { }
+        std::vector<Retired> retired;
+        std::size_t reclaimAt;
+        std::atomic<std::ptrdiff_t> count;
+    };
+
+    enum Outcome { RETRY, ABSENT, PRESENT };
+
+    // Version bits: set while the node is being rotated down, and once
+    // it is out of the tree; every completed rotation adds SHRINK_COUNT.
+    static const std::uint64_t UNLINKED = 1;
+    static const std::uint64_t SHRINKING = 2;
+    static const std::uint64_t SHRINK_COUNT = 4;
+
+    // Polls of a rotating node's version before blocking on its lock.
+    static const int SPIN_COUNT = 100;
+    // Retired entries a slot lets pile up before it first tries to free.
+    static const std::size_t RECLAIM_BATCH = 64;
+
+    static const Key& keyOf(const Link* node) { return static_cast<const Node*>(node)->key; }
+    static int height(const Link* node) { return node == NULL ? 0 : node->height.load(); }
+    static void waitUntilShrinkCompleted(Link* node, std::uint64_t version);
+    int compare(const Key& key, const Link* node) const;
+
+    Outcome attemptGet(const Key& key, Link* node, int dir, std::uint64_t nodeVersion,
+                       const Value*& found) const;
+    Link* ceiling(const Key* key, bool inclusive) const;
+    Outcome attemptCeiling(const Key* key, bool inclusive, Link* node, int dir,
+                           std::uint64_t nodeVersion, Link* above, Link*& found) const;
+
+    bool update(const Key& key, const Value* value, std::size_t slot);
+    bool attemptInsertIntoEmpty(const Key& key, const Value* value);
+    Outcome attemptUpdate(const Key& key, const Value* value, Link* parent, Link* node,
+                          std::uint64_t nodeVersion, std::size_t slot);
+    Outcome attemptNodeUpdate(const Value* value, Link* parent, Link* node, std::size_t slot);
+    static bool attemptUnlinkLocked(Link* parent, Link* node);
+
+    void fixHeightAndRebalance(Link* node, std::size_t slot);
+    Link* rebalanceLocked(Link* parent, Link* node, std::size_t slot);
+    static Link* rebalanceToRight(Link* parent, Link* node, Link* left, int hR0);
+    static Link* rebalanceToLeft(Link* parent, Link* node, Link* right, int hL0);
+    static Link* rotateRight(Link* parent, Link* node, Link* left, int hR, int hLL, Link* leftRight, int hLR);
+    static Link* rotateLeft(Link* parent, Link* node, int hL, Link* right, Link* rightLeft, int hRL, int hRR);
+    static Link* rotateRightOverLeft(Link* parent, Link* node, Link* left, int hR, int hLL,
+                                     Link* leftRight, int hLRL);
+    static Link* rotateLeftOverRight(Link* parent, Link* node, int hL, Link* right, int hRR,
+                                     Link* rightLeft, int hRLR);
+
+    void retire(std::size_t slot, Link* node, const Value* value);
+    void reclaim(SlotState& state);
+    static void release(const Retired& entry);
+    static void destroySubtree(Link* node);
+    int checkSubtree(const Link* node, const Link* parent, bool& ok) const;
+
+    Compare comp_;
+    Link* holder_;              // root is holder_->right
+    mutable EpochReclaimer epochs_;
+    SlotState slots_[EpochReclaimer::SLOTS];
+};
+
+template<typename Key, typename Value, typename Compare>
+const std::uint64_t ConcurrentAVLTree<Key, Value, Compare>::UNLINKED;
+template<typename Key, typename Value, typename Compare>
+const std::uint64_t ConcurrentAVLTree<Key, Value, Compare>::SHRINKING;
+template<typename Key, typename Value, typename Compare>
+const std::uint64_t ConcurrentAVLTree<Key, Value, Compare>::SHRINK_COUNT;
+template<typename Key, typename Value, typename Compare>
+const std::size_t ConcurrentAVLTree<Key, Value, Compare>::RECLAIM_BATCH;
+
+/*
+  -------------------------------------------------
+  Begin implementations for the ConcurrentAVLTree class.
+  -------------------------------------------------
+*/
+
+/**
+* Default constructor, which creates an empty tree.
+*/
+template<typename Key, typename Value, typename Compare>
+ConcurrentAVLTree<Key, Value, Compare>::ConcurrentAVLTree() :
+    comp_(),
+    holder_(new Link())
+{
+
+}
+
+/**
+* Constructor that orders keys with the given comparator.
+*/
+template<typename Key, typename Value, typename Compare>
+ConcurrentAVLTree<Key, Value, Compare>::ConcurrentAVLTree(const Compare& comp) :
+    comp_(comp),
+    holder_(new Link())
+{
+
+}
+
+/**
+* Destructor. No thread may still be using the tree.
+*/
+template<typename Key, typename Value, typename Compare>
+ConcurrentAVLTree<Key, Value, Compare>::~ConcurrentAVLTree()
+{
+    for(std::size_t i = 0; i < EpochReclaimer::SLOTS; ++i) {
+        for(std::size_t j = 0; j < slots_[i].retired.size(); ++j) {
+            release(slots_[i].retired[j]);
+        }
+    }
+    destroySubtree(holder_->right.load());
+    delete holder_;
+}
+
+/**
+* Copies the value for key into value and returns true, or returns false
+* if the key is absent.
+*/
+template<typename Key, typename Value, typename Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::find(const Key& key, Value& value) const
+{
+    EpochReclaimer::Guard guard(epochs_);
+    const Value* found;
+    // the holder never moves, so the search from it never has to retry
+    attemptGet(key, holder_, 1, 0, found);
+    if(found == NULL) {
+        return false;
+    }
+    value = *found;
+    return true;
+}
+
+/**
+* Returns true if key is in the tree.
+*/
+template<typename Key, typename Value, typename Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::contains(const Key& key) const
+{
+    EpochReclaimer::Guard guard(epochs_);
+    const Value* found;
+    attemptGet(key, holder_, 1, 0, found);
+    return found != NULL;
+}
+
+/**
+* Calls callback(item) for each item with lo <= key < hi, in key order.
+* Each step is a fresh validated search for the next key, so the scan is
+* weakly consistent: it reports every key present from start to end,
+* with the value it had at some point during the scan, and may or may
+* not report keys inserted or removed meanwhile. For a point-in-time
+* view use PersistentAVLTree::snapshot(). The callback must not write to
+* this tree from the same thread, and a long scan delays reclamation.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename F>
+void ConcurrentAVLTree<Key, Value, Compare>::scan(const Key& lo, const Key& hi, F callback) const
+{
+    EpochReclaimer::Guard guard(epochs_);
+    Link* node = ceiling(&lo, true);
+    while(node != NULL && comp_(keyOf(node), hi)) {
+        const Value* value = node->value.load();
+        if(value != NULL) {
+            const std::pair<const Key, Value> item(keyOf(node), *value);
+            callback(item);
+        }
+        node = ceiling(&keyOf(node), false);
+    }
+}
+
+/**
+* Returns the number of items, which is exact whenever no write is in
+* progress. Sums per-slot counts, so writers never share a counter.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t ConcurrentAVLTree<Key, Value, Compare>::size() const
+{
+    std::ptrdiff_t total = 0;
+    for(std::size_t i = 0; i < EpochReclaimer::SLOTS; ++i) {
+        total += slots_[i].count.load(std::memory_order_relaxed);
+    }
+    return total < 0 ? 0 : static_cast<std::size_t>(total);
+}
+
+/**
+* Returns true if the tree is empty.
+*/
+template<typename Key, typename Value, typename Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::empty() const
+{
+    return size() == 0;
+}
+
+/**
+* Inserts the key/value pair, replacing the value if the key is present.
+* Returns true if the key was new.
+*/
+template<typename Key, typename Value, typename Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    std::unique_ptr<const Value> value(new Value(keyValuePair.second));
+    EpochReclaimer::Guard guard(epochs_);
+    bool replaced = update(keyValuePair.first, value.get(), guard.slot());
+    // the tree owns the value from here on
+    value.release();
+    if(!replaced) {
+        std::atomic<std::ptrdiff_t>& count = slots_[guard.slot()].count;
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    return !replaced;
+}
+
+/**
+* Removes key if present, returning whether it was.
+*/
+template<typename Key, typename Value, typename Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    EpochReclaimer::Guard guard(epochs_);
+    bool removed = update(key, NULL, guard.slot());
+    if(removed) {
+        std::atomic<std::ptrdiff_t>& count = slots_[guard.slot()].count;
+        count.store(count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    }
+    return removed;
+}
+
+/**
+* Removes every item, smallest first, one remove() at a time. Not
+* atomic: keys inserted while it runs may survive it.
+*/
+template<typename Key, typename Value, typename Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::clear()
+{
+    while(true) {
+        // a fresh slot per key lets each removal's garbage be freed
+        EpochReclaimer::Guard guard(epochs_);
+        Link* node = ceiling(NULL, true);
+        while(node != NULL && node->value.load() == NULL) {
+            node = ceiling(&keyOf(node), false);
+        }
+        if(node == NULL) {
+            return;
+        }
+        if(update(keyOf(node), NULL, guard.slot())) {
+            std::atomic<std::ptrdiff_t>& count = slots_[guard.slot()].count;
+            count.store(count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        }
+    }
+}
+
+/**
+* Checks that every node's stored height is right, that left and right
+* heights differ by at most one, that parent links match and that no
+* routing node is left with a free child. Only meaningful while no write
+* is in progress, since balance is repaired lazily under contention.
+*/
+template<typename Key, typename Value, typename Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::isBalanced() const
+{
+    bool ok = true;
+    checkSubtree(holder_->right.load(), holder_, ok);
+    return ok;
+}
+
+/**
+* Returns once node's version has moved on from version, if version
+* says a rotation was under way. Polls briefly, then waits on the
+* node's lock, which the rotating writer holds.
+*/
+template<typename Key, typename Value, typename Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::waitUntilShrinkCompleted(Link* node, std::uint64_t version)
+{
+    if((version & SHRINKING) == 0) {
+        return;
+    }
+    for(int i = 0; i < SPIN_COUNT; ++i) {
+        if(node->version.load() != version) {
+            return;
+        }
+    }
+    std::lock_guard<std::mutex> wait(node->lock);
+}
+
+/**
+* Returns -1, 0 or 1 as key orders before, with or after node's key.
+*/
+template<typename Key, typename Value, typename Compare>
+int ConcurrentAVLTree<Key, Value, Compare>::compare(const Key& key, const Link* node) const
+{
+    if(comp_(key, keyOf(node))) return -1;
+    if(comp_(keyOf(node), key)) return 1;
+    return 0;
+}
+
+/**
+* Searches for key below node, starting with node's child in direction
+* dir (-1 left, 1 right). nodeVersion is node's version when the caller
+* read the link to it. Sets found to the key's value, or NULL if absent,
+* or returns RETRY if node was rotated down meanwhile, in which case the
+* caller must search again from its own node.
+*/
+template<typename Key, typename Value, typename Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Outcome
+ConcurrentAVLTree<Key, Value, Compare>::attemptGet(const Key& key, Link* node, int dir,
+                                                   std::uint64_t nodeVersion, const Value*& found) const
+{
+    while(true) {
+        Link* child = node->child(dir);
+        if(child == NULL) {
+            if(node->version.load() != nodeVersion) return RETRY;
+            found = NULL;
+            return ABSENT;
+        }
+        int childDir = compare(key, child);
+        if(childDir == 0) {
+            found = child->value.load();
+            return found == NULL ? ABSENT : PRESENT;
+        }
+        std::uint64_t childVersion = child->version.load();
+        if((childVersion & (SHRINKING | UNLINKED)) != 0) {
+            waitUntilShrinkCompleted(child, childVersion);
+            if(node->version.load() != nodeVersion) return RETRY;
+        }
+        else if(child != node->child(dir)) {
+            if(node->version.load() != nodeVersion) return RETRY;
+        }
+        else {
+            if(node->version.load() != nodeVersion) return RETRY;
+            Outcome outcome = attemptGet(key, child, childDir, childVersion, found);
+            if(outcome != RETRY) return outcome;
+        }
+        // the child moved under us but node did not; look at node again
+    }
+}
+
+/**
+* Returns the node with the smallest key not before *key (or after it,
+* if not inclusive), or the smallest node of all if key is NULL. The
+* node may be a routing node. Must be called inside a guard.
+*/
+template<typename Key, typename Value, typename Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Link*
+ConcurrentAVLTree<Key, Value, Compare>::ceiling(const Key* key, bool inclusive) const
+{
+    Link* found;
+    attemptCeiling(key, inclusive, holder_, 1, 0, NULL, found);
+    return found;
+}
+
+/**
+* The ceiling() counterpart of attemptGet(). above is the smallest node
+* after key seen on the path down to node, the answer if node's subtree
+* holds nothing closer.
+*/
+template<typename Key, typename Value, typename Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Outcome
+ConcurrentAVLTree<Key, Value, Compare>::attemptCeiling(const Key* key, bool inclusive, Link* node, int dir,
+                                                       std::uint64_t nodeVersion, Link* above,
+                                                       Link*& found) const
+{
+    while(true) {
+        Link* child = node->child(dir);
+        if(child == NULL) {
+            if(node->version.load() != nodeVersion) return RETRY;
+            found = above;
+            return PRESENT;
+        }
+        int cmp = key == NULL ? -1 : compare(*key, child);
+        if(cmp == 0 && inclusive) {
+            found = child;
+            return PRESENT;
+        }
+        int childDir = cmp < 0 ? -1 : 1;
+        std::uint64_t childVersion = child->version.load();
+        if((childVersion & (SHRINKING | UNLINKED)) != 0) {
+            waitUntilShrinkCompleted(child, childVersion);
+            if(node->version.load() != nodeVersion) return RETRY;
+        }
+        else if(child != node->child(dir)) {
+            if(node->version.load() != nodeVersion) return RETRY;
+        }
+        else {
+            if(node->version.load() != nodeVersion) return RETRY;
+            Link* childAbove = childDir < 0 ? child : above;
+            if(attemptCeiling(key, inclusive, child, childDir, childVersion, childAbove, found) != RETRY) {
+                return PRESENT;
+            }
+        }
+    }
+}
+
+/**
+* Sets key's value to value, or removes key if value is NULL. Returns
+* true if key was present. On return the tree owns value.
+*/
+template<typename Key, typename Value, typename Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::update(const Key& key, const Value* value, std::size_t slot)
+{
+    while(true) {
+        Link* root = holder_->right.load();
+        if(root == NULL) {
+            if(value == NULL || attemptInsertIntoEmpty(key, value)) {
+                return false;
+            }
+        }
+        else {
+            std::uint64_t rootVersion = root->version.load();
+            if((rootVersion & (SHRINKING | UNLINKED)) != 0) {
+                waitUntilShrinkCompleted(root, rootVersion);
+            }
+            else if(root == holder_->right.load()) {
+                Outcome outcome = attemptUpdate(key, value, holder_, root, rootVersion, slot);
+                if(outcome != RETRY) {
+                    return outcome == PRESENT;
+                }
+            }
+        }
+    }
+}
+
+/**
+* Makes a node for key the root if the tree is still empty.
+*/
+template<typename Key, typename Value, typename Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::attemptInsertIntoEmpty(const Key& key, const Value* value)
+{
+    std::lock_guard<std::mutex> lock(holder_->lock);
+    if(holder_->right.load() != NULL) {
+        return false;
+    }
+    holder_->right.store(new Node(key, value, holder_));
+    return true;
+}
+
+/**
+* Carries update() on below node, which was reached from parent while
+* node's version was nodeVersion. Returns RETRY if the caller has to
+* search again from parent.
+*/
+template<typename Key, typename Value, typename Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Outcome
+ConcurrentAVLTree<Key, Value, Compare>::attemptUpdate(const Key& key, const Value* value, Link* parent,
+                                                      Link* node, std::uint64_t nodeVersion,
+                                                      std::size_t slot)
+{
+    int dir = compare(key, node);
+    if(dir == 0) {
+        return attemptNodeUpdate(value, parent, node, slot);
+    }
+    while(true) {
+        Link* child = node->child(dir);
+        if(node->version.load() != nodeVersion) return RETRY;
+        if(child == NULL) {
+            if(value == NULL) {
+                return ABSENT;
+            }
+            bool linked = false;
+            {
+                std::lock_guard<std::mutex> lock(node->lock);
+                if(node->version.load() != nodeVersion) return RETRY;
+                // otherwise another insert got here first; look again
+                if(node->child(dir) == NULL) {
+                    node->setChild(dir, new Node(key, value, node));
+                    linked = true;
+                }
+            }
+            if(linked) {
+                fixHeightAndRebalance(node, slot);
+                return ABSENT;
+            }
+        }
+        else {
+            std::uint64_t childVersion = child->version.load();
+            if((childVersion & (SHRINKING | UNLINKED)) != 0) {
+                waitUntilShrinkCompleted(child, childVersion);
+            }
+            else if(child == node->child(dir)) {
+                if(node->version.load() != nodeVersion) return RETRY;
+                Outcome outcome = attemptUpdate(key, value, node, child, childVersion, slot);
+                if(outcome != RETRY) return outcome;
+            }
+        }
+    }
+}
+
+/**
+* Applies update() to node, which holds the key. A removal that leaves
+* node with a free child unlinks it under parent's and node's locks;
+* anything else swaps the value under node's lock alone.
+*/
+template<typename Key, typename Value, typename Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Outcome
+ConcurrentAVLTree<Key, Value, Compare>::attemptNodeUpdate(const Value* value, Link* parent, Link* node,
+                                                          std::size_t slot)
+{
+    if(value == NULL && node->value.load() == NULL) {
+        return ABSENT;
+    }
+    const Value* prev;
+    if(value == NULL && (node->left.load() == NULL || node->right.load() == NULL)) {
+        {
+            std::lock_guard<std::mutex> parentLock(parent->lock);
+            if((parent->version.load() & UNLINKED) != 0 || node->parent.load() != parent) return RETRY;
+            std::lock_guard<std::mutex> nodeLock(node->lock);
+            prev = node->value.load();
+            if(prev == NULL) return ABSENT;
+            if(!attemptUnlinkLocked(parent, node)) return RETRY;
+        }
+        retire(slot, node, prev);
+        fixHeightAndRebalance(parent, slot);
+        return PRESENT;
+    }
+    {
+        std::lock_guard<std::mutex> nodeLock(node->lock);
+        if((node->version.load() & UNLINKED) != 0) return RETRY;
+        prev = node->value.load();
+        if(value == NULL && prev == NULL) return ABSENT;
+        // a child left since we looked, so this removal must unlink
+        if(value == NULL && (node->left.load() == NULL || node->right.load() == NULL)) return RETRY;
+        node->value.store(value);
+    }
+    if(prev == NULL) {
+        return ABSENT;
+    }
+    retire(slot, NULL, prev);
+    return PRESENT;
+}
+
+/**
+* Splices node, which has at most one child, out from under parent.
+* Both must be locked. Returns false if node is no longer parent's child
+* or has gained a second child.
+*/
+template<typename Key, typename Value, typename Compare>
+bool ConcurrentAVLTree<Key, Value, Compare>::attemptUnlinkLocked(Link* parent, Link* node)
+{
+    Link* parentLeft = parent->left.load();
+    Link* parentRight = parent->right.load();
+    if(parentLeft != node && parentRight != node) {
+        return false;
+    }
+    Link* left = node->left.load();
+    Link* right = node->right.load();
+    if(left != NULL && right != NULL) {
+        return false;
+    }
+    Link* splice = left != NULL ? left : right;
+    if(parentLeft == node) parent->left.store(splice);
+    else parent->right.store(splice);
+    if(splice != NULL) splice->parent.store(parent);
+    node->version.store(UNLINKED);
+    node->value.store(NULL);
+    return true;
+}
+
+/**
+* Repairs node and then whatever each repair damages above it, until a
+* node needs nothing. Each node is examined with it and its parent
+* locked. Heights are only ever written under both locks too, so what a
+* repair reads cannot change under it, and a writer that changes a
+* height always goes on to examine the parent afterwards: together that
+* leaves the tree strictly balanced once writers go quiet.
+*
+* A rotation may hand back a node below it to repair first. The walk
+* then keeps climbing until it has examined the rotation's parent again,
+* even if the deeper node turns out to need nothing by the time it is
+* locked.
+*/
+template<typename Key, typename Value, typename Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::fixHeightAndRebalance(Link* node, std::size_t slot)
+{
+    Link* top = NULL;
+    while(node != NULL) {
+        Link* parent = node->parent.load();
+        if(parent == NULL) {
+            return;
+        }
+        if((node->version.load() & UNLINKED) != 0) {
+            // its remover repairs around it; climb on only if a rotation
+            // above is still waiting for its parent to be examined
+            node = top != NULL ? parent : NULL;
+            continue;
+        }
+        std::lock_guard<std::mutex> parentLock(parent->lock);
+        if((parent->version.load() & UNLINKED) == 0 && node->parent.load() == parent) {
+            std::lock_guard<std::mutex> nodeLock(node->lock);
+            Link* next = rebalanceLocked(parent, node, slot);
+            if(node == top) {
+                top = NULL;
+            }
+            if(next != NULL && next != parent && top == NULL) {
+                top = parent;
+            }
+            else if(next == NULL && top != NULL) {
+                next = parent;
+            }
+            node = next;
+        }
+    }
+}
+
+/**
+* Unlinks, rotates or re-heights node, with it and parent locked.
+* Returns the next node to repair, or NULL if node needed nothing.
+*/
+template<typename Key, typename Value, typename Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Link*
+ConcurrentAVLTree<Key, Value, Compare>::rebalanceLocked(Link* parent, Link* node, std::size_t slot)
+{
+    Link* left = node->left.load();
+    Link* right = node->right.load();
+    if((left == NULL || right == NULL) && node->value.load() == NULL) {
+        if(attemptUnlinkLocked(parent, node)) {
+            retire(slot, node, NULL);
+            return parent;
+        }
+        return node;
+    }
+    int hN = node->height.load();
+    int hL0 = height(left);
+    int hR0 = height(right);
+    int hNRepl = 1 + std::max(hL0, hR0);
+    int bal = hL0 - hR0;
+    if(bal > 1) {
+        return rebalanceToRight(parent, node, left, hR0);
+    }
+    if(bal < -1) {
+        return rebalanceToLeft(parent, node, right, hL0);
+    }
+    if(hNRepl != hN) {
+        node->height.store(hNRepl);
+        return parent;
+    }
+    return NULL;
+}
+
+/**
+* Rotates right at node, whose left subtree is too tall, first rotating
+* left at the left child if its inner side is the taller. Locks left,
+* and its right child for a double rotation. Returns the next node to
+* repair.
+*/
+template<typename Key, typename Value, typename Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Link*
+ConcurrentAVLTree<Key, Value, Compare>::rebalanceToRight(Link* parent, Link* node, Link* left, int hR0)
+{
+    std::lock_guard<std::mutex> leftLock(left->lock);
+    int hL = left->height.load();
+    if(hL - hR0 <= 1) {
+        return node;
+    }
+    Link* leftRight = left->right.load();
+    int hLL0 = height(left->left.load());
+    int hLR0 = height(leftRight);
+    if(hLL0 >= hLR0) {
+        return rotateRight(parent, node, left, hR0, hLL0, leftRight, hLR0);
+    }
+    {
+        std::lock_guard<std::mutex> leftRightLock(leftRight->lock);
+        int hLR = leftRight->height.load();
+        if(hLL0 >= hLR) {
+            return rotateRight(parent, node, left, hR0, hLL0, leftRight, hLR);
+        }
+        int hLRL = height(leftRight->left.load());
+        int b = hLL0 - hLRL;
+        // only double-rotate if it leaves left needing no repair itself
+        if(b >= -1 && b <= 1 && !((hLL0 == 0 || hLRL == 0) && left->value.load() == NULL)) {
+            return rotateRightOverLeft(parent, node, left, hR0, hLL0, leftRight, hLRL);
+        }
+        // otherwise rotate left at left on its own, even though it is
+        // within balance; the walk repairs left and then climbs back to
+        // rotate node
+        return rotateLeft(node, left, hLL0, leftRight, leftRight->left.load(), hLRL,
+                          height(leftRight->right.load()));
+    }
+}
+
+/**
+* Mirror image of rebalanceToRight().
+*/
+template<typename Key, typename Value, typename Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Link*
+ConcurrentAVLTree<Key, Value, Compare>::rebalanceToLeft(Link* parent, Link* node, Link* right, int hL0)
+{
+    std::lock_guard<std::mutex> rightLock(right->lock);
+    int hR = right->height.load();
+    if(hL0 - hR >= -1) {
+        return node;
+    }
+    Link* rightLeft = right->left.load();
+    int hRL0 = height(rightLeft);
+    int hRR0 = height(right->right.load());
+    if(hRR0 >= hRL0) {
+        return rotateLeft(parent, node, hL0, right, rightLeft, hRL0, hRR0);
+    }
+    {
+        std::lock_guard<std::mutex> rightLeftLock(rightLeft->lock);
+        int hRL = rightLeft->height.load();
+        if(hRR0 >= hRL) {
+            return rotateLeft(parent, node, hL0, right, rightLeft, hRL, hRR0);
+        }
+        int hRLR = height(rightLeft->right.load());
+        int b = hRR0 - hRLR;
+        if(b >= -1 && b <= 1 && !((hRR0 == 0 || hRLR == 0) && right->value.load() == NULL)) {
+            return rotateLeftOverRight(parent, node, hL0, right, hRR0, rightLeft, hRLR);
+        }
+        return rotateRight(node, right, rightLeft, hRR0, height(rightLeft->left.load()),
+                           rightLeft->right.load(), hRLR);
+    }
+}
+
+/**
+* Single right rotation of locked node under locked parent. node's
+* version is marked shrinking for the duration, since keys leave its
+* subtree; the links are changed in an order that keeps every other
+* node's subtree searchable throughout. Returns the next node to repair.
+*/
+template<typename Key, typename Value, typename Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Link*
+ConcurrentAVLTree<Key, Value, Compare>::rotateRight(Link* parent, Link* node, Link* left, int hR, int hLL,
+                                                    Link* leftRight, int hLR)
+{
+    std::uint64_t nodeVersion = node->version.load();
+    Link* parentLeft = parent->left.load();
+    node->version.store(nodeVersion | SHRINKING);
+
+    node->left.store(leftRight);
+    if(leftRight != NULL) leftRight->parent.store(node);
+    left->right.store(node);
+    node->parent.store(left);
+    if(parentLeft == node) parent->left.store(left);
+    else parent->right.store(left);
+    left->parent.store(parent);
+
+    int hNRepl = 1 + std::max(hLR, hR);
+    node->height.store(hNRepl);
+    left->height.store(1 + std::max(hLL, hNRepl));
+    node->version.store(nodeVersion + SHRINK_COUNT);
+
+    // node's height is right, but it may still be out of balance or a
+    // routing node that can now go
+    int balN = hLR - hR;
+    if(balN < -1 || balN > 1) return node;
+    if((leftRight == NULL || hR == 0) && node->value.load() == NULL) return node;
+    int balL = hLL - hNRepl;
+    if(balL < -1 || balL > 1) return left;
+    if(hLL == 0 && left->value.load() == NULL) return left;
+    return parent;
+}
+
+/**
+* Mirror image of rotateRight().
+*/
+template<typename Key, typename Value, typename Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Link*
+ConcurrentAVLTree<Key, Value, Compare>::rotateLeft(Link* parent, Link* node, int hL, Link* right,
+                                                   Link* rightLeft, int hRL, int hRR)
+{
+    std::uint64_t nodeVersion = node->version.load();
+    Link* parentLeft = parent->left.load();
+    node->version.store(nodeVersion | SHRINKING);
+
+    node->right.store(rightLeft);
+    if(rightLeft != NULL) rightLeft->parent.store(node);
+    right->left.store(node);
+    node->parent.store(right);
+    if(parentLeft == node) parent->left.store(right);
+    else parent->right.store(right);
+    right->parent.store(parent);
+
+    int hNRepl = 1 + std::max(hL, hRL);
+    node->height.store(hNRepl);
+    right->height.store(1 + std::max(hNRepl, hRR));
+    node->version.store(nodeVersion + SHRINK_COUNT);
+
+    int balN = hRL - hL;
+    if(balN < -1 || balN > 1) return node;
+    if((rightLeft == NULL || hL == 0) && node->value.load() == NULL) return node;
+    int balR = hRR - hNRepl;
+    if(balR < -1 || balR > 1) return right;
+    if(hRR == 0 && right->value.load() == NULL) return right;
+    return parent;
+}
+
+/**
+* Double rotation: left at left, then right at node, done as one step
+* with parent, node, left and leftRight all locked. Both node and left
+* lose keys from their subtrees, so both are marked shrinking.
+*/
+template<typename Key, typename Value, typename Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Link*
+ConcurrentAVLTree<Key, Value, Compare>::rotateRightOverLeft(Link* parent, Link* node, Link* left, int hR,
+                                                            int hLL, Link* leftRight, int hLRL)
+{
+    std::uint64_t nodeVersion = node->version.load();
+    std::uint64_t leftVersion = left->version.load();
+    Link* parentLeft = parent->left.load();
+    Link* leftRightLeft = leftRight->left.load();
+    Link* leftRightRight = leftRight->right.load();
+    int hLRR = height(leftRightRight);
+
+    node->version.store(nodeVersion | SHRINKING);
+    left->version.store(leftVersion | SHRINKING);
+
+    node->left.store(leftRightRight);
+    if(leftRightRight != NULL) leftRightRight->parent.store(node);
+    left->right.store(leftRightLeft);
+    if(leftRightLeft != NULL) leftRightLeft->parent.store(left);
+    leftRight->left.store(left);
+    left->parent.store(leftRight);
+    leftRight->right.store(node);
+    node->parent.store(leftRight);
+    if(parentLeft == node) parent->left.store(leftRight);
+    else parent->right.store(leftRight);
+    leftRight->parent.store(parent);
+
+    int hNRepl = 1 + std::max(hLRR, hR);
+    node->height.store(hNRepl);
+    int hLRepl = 1 + std::max(hLL, hLRL);
+    left->height.store(hLRepl);
+    leftRight->height.store(1 + std::max(hLRepl, hNRepl));
+    node->version.store(nodeVersion + SHRINK_COUNT);
+    left->version.store(leftVersion + SHRINK_COUNT);
+
+    int balN = hLRR - hR;
+    if(balN < -1 || balN > 1) return node;
+    if((leftRightRight == NULL || hR == 0) && node->value.load() == NULL) return node;
+    int balLR = hLRepl - hNRepl;
+    if(balLR < -1 || balLR > 1) return leftRight;
+    return parent;
+}
+
+/**
+* Mirror image of rotateRightOverLeft().
+*/
+template<typename Key, typename Value, typename Compare>
+typename ConcurrentAVLTree<Key, Value, Compare>::Link*
+ConcurrentAVLTree<Key, Value, Compare>::rotateLeftOverRight(Link* parent, Link* node, int hL, Link* right,
+                                                            int hRR, Link* rightLeft, int hRLR)
+{
+    std::uint64_t nodeVersion = node->version.load();
+    std::uint64_t rightVersion = right->version.load();
+    Link* parentLeft = parent->left.load();
+    Link* rightLeftLeft = rightLeft->left.load();
+    Link* rightLeftRight = rightLeft->right.load();
+    int hRLL = height(rightLeftLeft);
+
+    node->version.store(nodeVersion | SHRINKING);
+    right->version.store(rightVersion | SHRINKING);
+
+    node->right.store(rightLeftLeft);
+    if(rightLeftLeft != NULL) rightLeftLeft->parent.store(node);
+    right->left.store(rightLeftRight);
+    if(rightLeftRight != NULL) rightLeftRight->parent.store(right);
+    rightLeft->right.store(right);
+    right->parent.store(rightLeft);
+    rightLeft->left.store(node);
+    node->parent.store(rightLeft);
+    if(parentLeft == node) parent->left.store(rightLeft);
+    else parent->right.store(rightLeft);
+    rightLeft->parent.store(parent);
+
+    int hNRepl = 1 + std::max(hL, hRLL);
+    node->height.store(hNRepl);
+    int hRRepl = 1 + std::max(hRLR, hRR);
+    right->height.store(hRRepl);
+    rightLeft->height.store(1 + std::max(hNRepl, hRRepl));
+    node->version.store(nodeVersion + SHRINK_COUNT);
+    right->version.store(rightVersion + SHRINK_COUNT);
+
+    int balN = hRLL - hL;
+    if(balN < -1 || balN > 1) return node;
+    if((rightLeftLeft == NULL || hL == 0) && node->value.load() == NULL) return node;
+    int balRL = hRRepl - hNRepl;
+    if(balRL < -1 || balRL > 1) return rightLeft;
+    return parent;
+}
+
+/**
+* Queues an unlinked node and/or a replaced value on the caller's slot,
+* to be freed once no thread can still reach them.
+*/
+template<typename Key, typename Value, typename Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::retire(std::size_t slot, Link* node, const Value* value)
+{
+    SlotState& state = slots_[slot];
+    Retired entry = { node, value, epochs_.current() };
+    state.retired.push_back(entry);
+    if(state.retired.size() >= state.reclaimAt) {
+        reclaim(state);
+    }
+}
+
+/**
+* Frees the entries of state that no thread can reach any more. What is
+* left waits until the list has doubled, so a thread stalled inside the
+* tree cannot make every retire() rescan a growing list.
+*/
+template<typename Key, typename Value, typename Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::reclaim(SlotState& state)
+{
+    epochs_.advance();
+    std::uint64_t oldest = epochs_.oldestActive();
+    std::size_t kept = 0;
+    for(std::size_t i = 0; i < state.retired.size(); ++i) {
+        if(state.retired[i].epoch < oldest) {
+            release(state.retired[i]);
+        }
+        else {
+            state.retired[kept++] = state.retired[i];
+        }
+    }
+    state.retired.resize(kept);
+    state.reclaimAt = std::max(RECLAIM_BATCH, 2 * kept);
+}
+
+/**
+* Frees a retired node and/or value.
+*/
+template<typename Key, typename Value, typename Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::release(const Retired& entry)
+{
+    delete static_cast<Node*>(entry.node);
+    delete entry.value;
+}
+
+/**
+* Frees node, its subtree and their values.
+*/
+template<typename Key, typename Value, typename Compare>
+void ConcurrentAVLTree<Key, Value, Compare>::destroySubtree(Link* node)
+{
+    if(node == NULL) {
+        return;
+    }
+    destroySubtree(node->left.load());
+    destroySubtree(node->right.load());
+    delete node->value.load();
+    delete static_cast<Node*>(node);
+}
+
+/**
+* Returns the height of node's subtree, clearing ok if anything in it
+* breaks the invariants isBalanced() checks.
+*/
+template<typename Key, typename Value, typename Compare>
+int ConcurrentAVLTree<Key, Value, Compare>::checkSubtree(const Link* node, const Link* parent, bool& ok) const
+{
+    if(node == NULL) {
+        return 0;
+    }
+    const Link* left = node->left.load();
+    const Link* right = node->right.load();
+    if(node->parent.load() != parent) ok = false;
+    if((left == NULL || right == NULL) && node->value.load() == NULL) ok = false;
+    if(left != NULL && !comp_(keyOf(left), keyOf(node))) ok = false;
+    if(right != NULL && !comp_(keyOf(node), keyOf(right))) ok = false;
+    int hL = checkSubtree(left, node, ok);
+    int hR = checkSubtree(right, node, ok);
+    if(hL - hR < -1 || hL - hR > 1) ok = false;
+    int h = 1 + std::max(hL, hR);
+    if(node->height.load() != h) ok = false;
+    return h;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the ConcurrentAVLTree class.
+  -----------------------------------------------
+*/
+
+#endif
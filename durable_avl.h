@@ -0,0 +1,633 @@
+#ifndef DURABLE_AVL_H
+#define DURABLE_AVL_H
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "avlbst.h"
+#include "tree_snapshot.h"
+
+/*
+  The write-ahead log kept by DurableAVLTree, in path + ".log":
+
+    header, 16 bytes:
+      "BSTL"         magic
+      uint16         format version (DURABLE_LOG_VERSION)
+      uint8, uint8   sizeof(Key), sizeof(Value)
+      8 bytes        zero
+    groups, each:
+      uint32         payload length in bytes, never 0
+      uint32         CRC-32 of the payload
+      bytes          records
+
+  A record is one byte of DURABLE_LOG_INSERT followed by the key and the
+  value, or DURABLE_LOG_REMOVE followed by the key, each encoded with
+  SnapshotCodec. Fixed-size integers are little-endian. A group is
+  written with a single write() and is applied all or nothing: recovery
+  stops at the first group that is cut short or fails its checksum.
+
+  The latest checkpoint is a save() snapshot in path + ".snapshot".
+*/
+
+static const std::uint16_t DURABLE_LOG_VERSION = 1;
+static const unsigned char DURABLE_LOG_INSERT = 1;
+static const unsigned char DURABLE_LOG_REMOVE = 2;
+
+/**
+* When DurableAVLTree forces logged groups from the OS to the disk.
+*/
+enum SyncPolicy
+{
+    SYNC_EVERY_GROUP,   // fdatasync after every group: survives power loss
+    SYNC_INTERVAL,      // fdatasync at most once per syncIntervalMs
+    SYNC_NEVER          // leave it to the OS: survives a crash of the process only
+};
+
+/**
+* Settings for a DurableAVLTree.
+*/
+struct DurabilityOptions
+{
+    DurabilityOptions() : sync(SYNC_EVERY_GROUP), groupSize(1), syncIntervalMs(100) { }
+
+    SyncPolicy sync;
+    // Mutations gathered into each group. Those still waiting for their
+    // group to fill are not in the log until it does or commit() runs.
+    std::size_t groupSize;
+    unsigned syncIntervalMs;    // for SYNC_INTERVAL
+};
+
+/**
+* An AVLTree whose inserts and removes are recorded in a write-ahead log,
+* so that its contents survive a crash.
+*
+* Each mutation is applied to the tree in memory and appended to the
+* current group of log records. A full group goes to the log file in one
+* write and is synced as the SyncPolicy says, so the cost of a write and
+* an fsync is shared by every mutation in the group (group commit).
+* checkpoint() saves a snapshot of the tree and empties the log.
+*
+* Opening a tree recovers it: the latest snapshot is loaded, the log is
+* replayed on top of it, and if the log held anything the result is
+* checkpointed, which truncates the log. Replaying is idempotent, as
+* records only ever set or delete a key, so a crash between writing a
+* snapshot and truncating the log loses nothing.
+*
+* Like AVLTree, it is not safe to use from several threads at once.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class DurableAVLTree
+{
+public:
+    typedef typename AVLTree<Key, Value, Compare>::const_iterator const_iterator;
+
+    explicit DurableAVLTree(const std::string& path, const DurabilityOptions& options = DurabilityOptions());
+    ~DurableAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void commit();
+    void checkpoint();
+
+    const_iterator find(const Key& key) const;
+    const_iterator begin() const;
+    const_iterator end() const;
+    std::size_t size() const;
+    bool empty() const;
+    const AVLTree<Key, Value, Compare>& tree() const;
+    std::size_t recovered() const;
+
+private:
+    DurableAVLTree(const DurableAVLTree&) = delete;
+    DurableAVLTree& operator=(const DurableAVLTree&) = delete;
+
+    void recover();
+    bool replayGroup(std::istream& in);
+    void openLog();
+    void logRecord();
+    void writeGroup(bool forceSync);
+    void sync(int fd, const std::string& what);
+    void syncDirectory();
+    std::string logHeader() const;
+
+    static const std::size_t LOG_HEADER_BYTES = 16;
+    // The log header keeps sizeof(Key) and sizeof(Value) in a byte each.
+    static_assert(sizeof(Key) < 256 && sizeof(Value) < 256, "logged keys and values must be under 256 bytes");
+
+    AVLTree<Key, Value, Compare> tree_;
+    DurabilityOptions options_;
+    std::string path_;
+    int log_;                   // log file descriptor, open for appending
+    off_t logSize_;             // length of the log up to its last whole group
+    std::string group_;         // encoded records not yet written
+    std::size_t pending_;       // records in group_
+    bool unsynced_;             // groups written since the last sync
+    std::size_t recovered_;     // records replayed when opened
+    std::chrono::steady_clock::time_point lastSync_;
+};
+
+template<typename Key, typename Value, typename Compare>
+const std::size_t DurableAVLTree<Key, Value, Compare>::LOG_HEADER_BYTES;
+
+/*
+  -------------------------------------------
+  Begin implementations for the DurableAVLTree class.
+  -------------------------------------------
+*/
+
+/**
+* Opens the tree stored at path, creating it if there is none, and
+* recovers its contents from the snapshot and log there.
+* @throws std::runtime_error if the files cannot be read or written, or
+*         were written for other key or value types
+*/
+template<typename Key, typename Value, typename Compare>
+DurableAVLTree<Key, Value, Compare>::DurableAVLTree(const std::string& path, const DurabilityOptions& options) :
+    options_(options),
+    path_(path),
+    log_(-1),
+    logSize_(0),
+    pending_(0),
+    unsynced_(false),
+    recovered_(0),
+    lastSync_(std::chrono::steady_clock::now())
+{
+    if(options_.groupSize == 0) {
+        throw std::invalid_argument("DurableAVLTree: groupSize must be at least 1");
+    }
+    try {
+        recover();
+        openLog();
+    }
+    catch(...) {
+        // recovery can fail after opening the log, and no destructor runs
+        if(log_ >= 0) {
+            ::close(log_);
+        }
+        throw;
+    }
+}
+
+/**
+* Writes out the pending group, then closes the log. Errors are ignored
+* here; call commit() first to see them.
+*/
+template<typename Key, typename Value, typename Compare>
+DurableAVLTree<Key, Value, Compare>::~DurableAVLTree()
+{
+    try {
+        commit();
+    }
+    catch(...) {
+    }
+    ::close(log_);
+}
+
+/**
+* Inserts or updates an item and logs it. It is durable once its group
+* has been written and synced.
+* @throws std::runtime_error if the log cannot be written; the change is
+*         kept in memory and in the pending group, for commit() to retry
+*/
+template<typename Key, typename Value, typename Compare>
+void DurableAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    tree_.insert(keyValuePair);
+    group_.push_back(static_cast<char>(DURABLE_LOG_INSERT));
+    SnapshotCodec<Key>::write(group_, keyValuePair.first);
+    SnapshotCodec<Value>::write(group_, keyValuePair.second);
+    logRecord();
+}
+
+/**
+* Removes the item with the given key, if any, and logs it. Removing a
+* missing key logs nothing.
+* @throws std::runtime_error as for insert()
+*/
+template<typename Key, typename Value, typename Compare>
+void DurableAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    if(tree_.find(key) == tree_.end()) {
+        return;
+    }
+    tree_.remove(key);
+    group_.push_back(static_cast<char>(DURABLE_LOG_REMOVE));
+    SnapshotCodec<Key>::write(group_, key);
+    logRecord();
+}
+
+/**
+* Writes the pending group now, however small, and syncs the log unless
+* the policy is SYNC_NEVER. Every mutation so far is then durable.
+* @throws std::runtime_error if the log cannot be written or synced
+*/
+template<typename Key, typename Value, typename Compare>
+void DurableAVLTree<Key, Value, Compare>::commit()
+{
+    writeGroup(true);
+}
+
+/**
+* Saves a snapshot of the tree and truncates the log, so that recovery
+* only has the snapshot to load. The snapshot is written beside the old
+* one and renamed over it once synced.
+* @throws std::runtime_error if a file cannot be written or synced
+*/
+template<typename Key, typename Value, typename Compare>
+void DurableAVLTree<Key, Value, Compare>::checkpoint()
+{
+    std::string snapshot = path_ + ".snapshot";
+    std::string temp = snapshot + ".tmp";
+    {
+        std::ofstream out(temp.c_str(), std::ios::binary | std::ios::trunc);
+        tree_.save(out);
+    }
+    int fd = ::open(temp.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw std::runtime_error("DurableAVLTree: cannot open " + temp + ": " + std::strerror(errno));
+    }
+    try {
+        sync(fd, temp);
+    }
+    catch(...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    if(std::rename(temp.c_str(), snapshot.c_str()) != 0) {
+        throw std::runtime_error("DurableAVLTree: cannot rename " + temp + ": " + std::strerror(errno));
+    }
+    syncDirectory();
+
+    // the snapshot covers everything logged or pending
+    group_.clear();
+    pending_ = 0;
+    if(log_ >= 0) {
+        if(::ftruncate(log_, LOG_HEADER_BYTES) != 0) {
+            throw std::runtime_error("DurableAVLTree: cannot truncate " + path_ + ".log: " + std::strerror(errno));
+        }
+        sync(log_, path_ + ".log");
+        logSize_ = LOG_HEADER_BYTES;
+        unsynced_ = false;
+    }
+}
+
+/**
+* Returns an iterator to the item with the given key, or end().
+*/
+template<typename Key, typename Value, typename Compare>
+typename DurableAVLTree<Key, Value, Compare>::const_iterator
+DurableAVLTree<Key, Value, Compare>::find(const Key& key) const
+{
+    return tree_.find(key);
+}
+
+/**
+* Returns an iterator to the smallest key.
+*/
+template<typename Key, typename Value, typename Compare>
+typename DurableAVLTree<Key, Value, Compare>::const_iterator
+DurableAVLTree<Key, Value, Compare>::begin() const
+{
+    return tree_.cbegin();
+}
+
+/**
+* Returns the end iterator.
+*/
+template<typename Key, typename Value, typename Compare>
+typename DurableAVLTree<Key, Value, Compare>::const_iterator
+DurableAVLTree<Key, Value, Compare>::end() const
+{
+    return tree_.cend();
+}
+
+/**
+* Returns the number of items.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t DurableAVLTree<Key, Value, Compare>::size() const
+{
+    return tree_.size();
+}
+
+/**
+* Returns true if the tree is empty.
+*/
+template<typename Key, typename Value, typename Compare>
+bool DurableAVLTree<Key, Value, Compare>::empty() const
+{
+    return tree_.empty();
+}
+
+/**
+* Returns the tree in memory, for the read operations not repeated here.
+*/
+template<typename Key, typename Value, typename Compare>
+const AVLTree<Key, Value, Compare>& DurableAVLTree<Key, Value, Compare>::tree() const
+{
+    return tree_;
+}
+
+/**
+* Returns the number of log records replayed when the tree was opened.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t DurableAVLTree<Key, Value, Compare>::recovered() const
+{
+    return recovered_;
+}
+
+/**
+* Loads the snapshot, if there is one, replays the log on top of it and,
+* if the log held anything past its header, checkpoints the result.
+*/
+template<typename Key, typename Value, typename Compare>
+void DurableAVLTree<Key, Value, Compare>::recover()
+{
+    std::ifstream snapshot((path_ + ".snapshot").c_str(), std::ios::binary);
+    if(snapshot) {
+        tree_.load(snapshot);
+    }
+
+    std::string logPath = path_ + ".log";
+    std::ifstream log(logPath.c_str(), std::ios::binary);
+    if(!log) {
+        return;
+    }
+    std::string header(LOG_HEADER_BYTES, '\0');
+    log.read(&header[0], LOG_HEADER_BYTES);
+    if(static_cast<std::size_t>(log.gcount()) < LOG_HEADER_BYTES) {
+        // cut short while being created; openLog() writes it afresh
+        log.close();
+        std::remove(logPath.c_str());
+        return;
+    }
+    if(header != logHeader()) {
+        throw std::runtime_error("DurableAVLTree: " + logPath +
+                                 " is not a log for these key and value types");
+    }
+    while(replayGroup(log)) {
+    }
+    bool trailing = log.peek() != std::char_traits<char>::eof() || recovered_ > 0;
+    log.close();
+    if(trailing) {
+        openLog();
+        checkpoint();
+    }
+}
+
+/**
+* Applies the next group of the log to the tree. Returns false, having
+* applied nothing, at the end of the log or at a group that is cut short
+* or damaged; everything after that is discarded.
+*/
+template<typename Key, typename Value, typename Compare>
+bool DurableAVLTree<Key, Value, Compare>::replayGroup(std::istream& in)
+{
+    std::streampos start = in.tellg();
+    unsigned char frame[8];
+    in.read(reinterpret_cast<char*>(frame), sizeof(frame));
+    if(in.gcount() != static_cast<std::streamsize>(sizeof(frame))) {
+        in.clear();
+        in.seekg(start);
+        return false;
+    }
+    std::uint32_t length = 0, crc = 0;
+    for(int i = 0; i < 4; ++i) {
+        length |= std::uint32_t(frame[i]) << (8 * i);
+        crc |= std::uint32_t(frame[4 + i]) << (8 * i);
+    }
+    // read in pieces, so a damaged length cannot allocate past the file
+    std::vector<char> payload;
+    while(length > 0 && payload.size() < length && in) {
+        std::size_t at = payload.size();
+        payload.resize(at + std::min<std::size_t>(length - at, 1 << 20));
+        in.read(&payload[at], payload.size() - at);
+        payload.resize(at + static_cast<std::size_t>(in.gcount()));
+    }
+    if(length == 0 || payload.size() != length ||
+       snapshotCrc32(0, reinterpret_cast<const unsigned char*>(payload.data()), length) != crc) {
+        in.clear();
+        in.seekg(start);
+        return false;
+    }
+
+    const char* p = payload.data();
+    const char* end = p + payload.size();
+    std::vector<std::pair<bool, std::pair<Key, Value> > > records;
+    try {
+        while(p != end) {
+            unsigned char op = static_cast<unsigned char>(*p++);
+            std::pair<bool, std::pair<Key, Value> > record;
+            record.first = op == DURABLE_LOG_INSERT;
+            if(op != DURABLE_LOG_INSERT && op != DURABLE_LOG_REMOVE) {
+                throw std::runtime_error("load: unknown log record");
+            }
+            p = SnapshotCodec<Key>::read(p, end, record.second.first);
+            if(record.first) {
+                p = SnapshotCodec<Value>::read(p, end, record.second.second);
+            }
+            records.push_back(record);
+        }
+    }
+    catch(std::runtime_error&) {
+        // a group that passed its checksum but does not parse
+        in.clear();
+        in.seekg(start);
+        return false;
+    }
+    for(std::size_t i = 0; i < records.size(); ++i) {
+        if(records[i].first) {
+            tree_.insert(std::pair<const Key, Value>(records[i].second.first, records[i].second.second));
+        }
+        else {
+            tree_.remove(records[i].second.first);
+        }
+    }
+    recovered_ += records.size();
+    return true;
+}
+
+/**
+* Opens the log for appending, creating it with its header if it does
+* not exist yet.
+*/
+template<typename Key, typename Value, typename Compare>
+void DurableAVLTree<Key, Value, Compare>::openLog()
+{
+    if(log_ >= 0) {
+        return;
+    }
+    std::string logPath = path_ + ".log";
+    int fd = ::open(logPath.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if(fd < 0) {
+        throw std::runtime_error("DurableAVLTree: cannot open " + logPath + ": " + std::strerror(errno));
+    }
+    off_t size;
+    try {
+        struct stat info;
+        if(::fstat(fd, &info) != 0) {
+            throw std::runtime_error("DurableAVLTree: cannot stat " + logPath + ": " + std::strerror(errno));
+        }
+        size = info.st_size;
+        if(size == 0) {
+            std::string header = logHeader();
+            if(::write(fd, header.data(), header.size()) != static_cast<ssize_t>(header.size())) {
+                throw std::runtime_error("DurableAVLTree: cannot write " + logPath + ": " + std::strerror(errno));
+            }
+            sync(fd, logPath);
+            syncDirectory();
+            size = LOG_HEADER_BYTES;
+        }
+    }
+    catch(...) {
+        ::close(fd);
+        throw;
+    }
+    // only a log that is ready to append to is kept open
+    log_ = fd;
+    logSize_ = size;
+}
+
+/**
+* Counts the record just added to the group and writes the group out if
+* it is full.
+*/
+template<typename Key, typename Value, typename Compare>
+void DurableAVLTree<Key, Value, Compare>::logRecord()
+{
+    if(++pending_ >= options_.groupSize) {
+        writeGroup(false);
+    }
+}
+
+/**
+* Writes the pending records to the log as one group and syncs it as the
+* policy says, or always when forceSync is set and the policy is not
+* SYNC_NEVER. The group is only cleared once it has been written.
+*/
+template<typename Key, typename Value, typename Compare>
+void DurableAVLTree<Key, Value, Compare>::writeGroup(bool forceSync)
+{
+    if(!group_.empty()) {
+        std::string frame;
+        std::uint32_t length = static_cast<std::uint32_t>(group_.size());
+        std::uint32_t crc = snapshotCrc32(0, reinterpret_cast<const unsigned char*>(group_.data()), group_.size());
+        for(int i = 0; i < 4; ++i) {
+            frame.push_back(static_cast<char>((length >> (8 * i)) & 0xFF));
+        }
+        for(int i = 0; i < 4; ++i) {
+            frame.push_back(static_cast<char>((crc >> (8 * i)) & 0xFF));
+        }
+        frame += group_;
+        const char* data = frame.data();
+        std::size_t left = frame.size();
+        while(left > 0) {
+            ssize_t written = ::write(log_, data, left);
+            if(written < 0 && errno == EINTR) {
+                continue;
+            }
+            if(written <= 0) {
+                int error = errno;
+                // cut off any piece that did get written, or recovery
+                // would stop there and drop the group when it is retried
+                if(::ftruncate(log_, logSize_) != 0) {
+                    error = errno;
+                }
+                throw std::runtime_error("DurableAVLTree: cannot write " + path_ + ".log: " + std::strerror(error));
+            }
+            data += written;
+            left -= static_cast<std::size_t>(written);
+        }
+        logSize_ += static_cast<off_t>(frame.size());
+        unsynced_ = true;
+        group_.clear();
+        pending_ = 0;
+    }
+
+    bool due = false;
+    switch(options_.sync) {
+    case SYNC_EVERY_GROUP:
+        due = true;
+        break;
+    case SYNC_INTERVAL:
+        due = forceSync || std::chrono::steady_clock::now() - lastSync_ >=
+                           std::chrono::milliseconds(options_.syncIntervalMs);
+        break;
+    case SYNC_NEVER:
+        break;
+    }
+    if(due && unsynced_) {
+        sync(log_, path_ + ".log");
+        lastSync_ = std::chrono::steady_clock::now();
+        unsynced_ = false;
+    }
+}
+
+/**
+* Forces the file's data to the disk.
+*/
+template<typename Key, typename Value, typename Compare>
+void DurableAVLTree<Key, Value, Compare>::sync(int fd, const std::string& what)
+{
+    if(::fdatasync(fd) != 0) {
+        throw std::runtime_error("DurableAVLTree: cannot sync " + what + ": " + std::strerror(errno));
+    }
+}
+
+/**
+* Forces the directory holding the files to the disk, so that a file
+* just created or renamed there is found after a crash.
+*/
+template<typename Key, typename Value, typename Compare>
+void DurableAVLTree<Key, Value, Compare>::syncDirectory()
+{
+    std::string::size_type slash = path_.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path_.substr(0, slash);
+    int fd = ::open(directory.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw std::runtime_error("DurableAVLTree: cannot open " + directory + ": " + std::strerror(errno));
+    }
+    int result = ::fsync(fd);
+    ::close(fd);
+    if(result != 0) {
+        throw std::runtime_error("DurableAVLTree: cannot sync " + directory + ": " + std::strerror(errno));
+    }
+}
+
+/**
+* Returns the header every log for these key and value types starts with.
+*/
+template<typename Key, typename Value, typename Compare>
+std::string DurableAVLTree<Key, Value, Compare>::logHeader() const
+{
+    std::string header("BSTL");
+    header.push_back(static_cast<char>(DURABLE_LOG_VERSION & 0xFF));
+    header.push_back(static_cast<char>(DURABLE_LOG_VERSION >> 8));
+    header.push_back(static_cast<char>(sizeof(Key)));
+    header.push_back(static_cast<char>(sizeof(Value)));
+    header.append(LOG_HEADER_BYTES - header.size(), '\0');
+    return header;
+}
+
+/*
+  -----------------------------------------
+  End implementations for the DurableAVLTree class.
+  -----------------------------------------
+*/
+
+#endif
@@ -0,0 +1,406 @@
+#ifndef FORK_JOIN_H
+#define FORK_JOIN_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+* A fixed set of worker threads that run fork-join computations with
+* work stealing.
+*
+* A computation starts with invoke() and splits itself with fork(f, g):
+* the forking worker makes g available to others, runs f, and then runs g
+* itself unless another worker has stolen it meanwhile. Each worker keeps
+* the tasks it forked in its own deque and takes the newest back first,
+* so it works depth-first on its own part of the problem. An idle worker
+* steals the oldest task from another worker's deque, which is the
+* largest piece of work still waiting. A worker waiting for a stolen task
+* to finish runs other tasks until it has.
+*
+* The deques are guarded by a mutex each. Forks are meant to be coarse
+* (callers stop forking once the pieces are small), so the locks are
+* rarely contended.
+*/
+class ForkJoinPool
+{
+public:
+    explicit ForkJoinPool(std::size_t threads = 0);
+    ~ForkJoinPool();
+
+    std::size_t threads() const;
+
+    template<typename F>
+    void invoke(F f);
+    template<typename F, typename G>
+    void fork(F f, G g);
+
+    static ForkJoinPool& global();
+
+private:
+    ForkJoinPool(const ForkJoinPool&) = delete;
+    ForkJoinPool& operator=(const ForkJoinPool&) = delete;
+
+    // A forked piece of work, living on the stack of the thread that
+    // forked it until that thread has seen it finish.
+    struct Task
+    {
+        Task() : done(false) { }
+        virtual ~Task() { }
+        virtual void run() = 0;
+
+        std::atomic<bool> done;
+        std::exception_ptr error;
+    };
+
+    template<typename F>
+    struct FunctionTask : Task
+    {
+        explicit FunctionTask(F& f) : function(f) { }
+        virtual void run() { function(); }
+        F& function;
+    };
+
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<Task*> tasks;   // newest at the back
+    };
+
+    void workerLoop(std::size_t index);
+    void push(std::size_t index, Task* task);
+    bool popIf(std::size_t index, Task* task);
+    bool runOne(std::size_t index);
+    Task* steal(std::size_t thief);
+    static void execute(Task* task);
+    std::size_t currentWorker() const;
+
+    static const std::size_t NOT_A_WORKER = static_cast<std::size_t>(-1);
+
+    std::vector<Worker*> workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<std::size_t> queued_;   // tasks sitting in some deque
+    std::atomic<std::size_t> sleepers_;
+    std::atomic<bool> stopping_;
+    std::mutex sleepLock_;
+    std::condition_variable wakeUp_;
+};
+
+/*
+  -------------------------------------------
+  Begin implementations for the ForkJoinPool class.
+  -------------------------------------------
+*/
+
+/**
+* Identifies the pool and worker the calling thread belongs to, if any.
+*/
+struct ForkJoinWorkerId
+{
+    const ForkJoinPool* pool;
+    std::size_t index;
+};
+
+/**
+* Returns the calling thread's worker identity; pool is NULL on threads
+* that are not pool workers.
+*/
+inline ForkJoinWorkerId& forkJoinCurrentWorker()
+{
+    static thread_local ForkJoinWorkerId id = { NULL, 0 };
+    return id;
+}
+
+/**
+* Starts the given number of workers, or one per hardware thread if 0.
+*/
+inline ForkJoinPool::ForkJoinPool(std::size_t threads) :
+    queued_(0),
+    sleepers_(0),
+    stopping_(false)
+{
+    if(threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for(std::size_t i = 0; i < threads; ++i) {
+        workers_.push_back(new Worker());
+    }
+    for(std::size_t i = 0; i < threads; ++i) {
+        threads_.push_back(std::thread(&ForkJoinPool::workerLoop, this, i));
+    }
+}
+
+/**
+* Stops and joins the workers. No computation may still be running.
+*/
+inline ForkJoinPool::~ForkJoinPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(sleepLock_);
+        stopping_ = true;
+    }
+    wakeUp_.notify_all();
+    for(std::size_t i = 0; i < threads_.size(); ++i) {
+        threads_[i].join();
+    }
+    for(std::size_t i = 0; i < workers_.size(); ++i) {
+        delete workers_[i];
+    }
+}
+
+/**
+* Returns the number of worker threads.
+*/
+inline std::size_t ForkJoinPool::threads() const
+{
+    return workers_.size();
+}
+
+/**
+* Runs f on the pool and waits for it, along with everything it forks,
+* to finish. Called from one of the pool's own workers, it just runs f.
+* Rethrows anything f throws.
+*/
+template<typename F>
+void ForkJoinPool::invoke(F f)
+{
+    if(currentWorker() != NOT_A_WORKER) {
+        f();
+        return;
+    }
+
+    std::mutex doneLock;
+    std::condition_variable finished;
+    bool done = false;
+    std::exception_ptr error;
+    auto root = [&]() {
+        try {
+            f();
+        }
+        catch(...) {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> guard(doneLock);
+        done = true;
+        finished.notify_one();
+    };
+    FunctionTask<decltype(root)> task(root);
+    push(0, &task);
+
+    {
+        std::unique_lock<std::mutex> lock(doneLock);
+        finished.wait(lock, [&]() { return done; });
+    }
+    // the worker still marks the task done after root returns
+    while(!task.done.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+    if(error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/**
+* Runs f and g, in parallel if another worker is free to take g. Returns
+* once both have finished. Outside the pool it simply runs f, then g.
+* If either throws, the exception is rethrown here after both are done.
+*/
+template<typename F, typename G>
+void ForkJoinPool::fork(F f, G g)
+{
+    std::size_t me = currentWorker();
+    if(me == NOT_A_WORKER) {
+        f();
+        g();
+        return;
+    }
+
+    FunctionTask<G> task(g);
+    push(me, &task);
+    std::exception_ptr error;
+    try {
+        f();
+    }
+    catch(...) {
+        error = std::current_exception();
+    }
+
+    if(popIf(me, &task)) {
+        execute(&task);
+    }
+    else {
+        // stolen; help with other work rather than sit idle
+        while(!task.done.load(std::memory_order_acquire)) {
+            if(!runOne(me)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+    if(error) {
+        std::rethrow_exception(error);
+    }
+    if(task.error) {
+        std::rethrow_exception(task.error);
+    }
+}
+
+/**
+* Returns a process-wide pool with one worker per hardware thread,
+* started on first use.
+*/
+inline ForkJoinPool& ForkJoinPool::global()
+{
+    static ForkJoinPool pool;
+    return pool;
+}
+
+/**
+* Body of each worker thread: run tasks while there are any, otherwise
+* sleep until one is pushed.
+*/
+inline void ForkJoinPool::workerLoop(std::size_t index)
+{
+    ForkJoinWorkerId& id = forkJoinCurrentWorker();
+    id.pool = this;
+    id.index = index;
+
+    while(true) {
+        if(runOne(index)) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepLock_);
+        ++sleepers_;
+        // a pusher that saw no sleepers has already raised queued_
+        wakeUp_.wait(lock, [this]() { return stopping_.load() || queued_.load() > 0; });
+        --sleepers_;
+        if(stopping_ && queued_.load() == 0) {
+            return;
+        }
+    }
+}
+
+/**
+* Adds task to the back of worker index's deque and wakes a sleeping
+* worker to steal it.
+*/
+inline void ForkJoinPool::push(std::size_t index, Task* task)
+{
+    // counted first, so the count never drops below the real number
+    ++queued_;
+    {
+        std::lock_guard<std::mutex> guard(workers_[index]->lock);
+        workers_[index]->tasks.push_back(task);
+    }
+    if(sleepers_.load() > 0) {
+        std::lock_guard<std::mutex> guard(sleepLock_);
+        wakeUp_.notify_one();
+    }
+}
+
+/**
+* Takes task back off the back of worker index's deque, unless another
+* worker has stolen it. Everything pushed after it has been taken back
+* already, so it is either at the back or gone.
+*/
+inline bool ForkJoinPool::popIf(std::size_t index, Task* task)
+{
+    std::lock_guard<std::mutex> guard(workers_[index]->lock);
+    std::deque<Task*>& tasks = workers_[index]->tasks;
+    if(!tasks.empty() && tasks.back() == task) {
+        tasks.pop_back();
+        --queued_;
+        return true;
+    }
+    return false;
+}
+
+/**
+* Runs one task, the newest from worker index's own deque or else one
+* stolen from another worker. Returns false if there was none.
+*/
+inline bool ForkJoinPool::runOne(std::size_t index)
+{
+    Task* task = NULL;
+    {
+        std::lock_guard<std::mutex> guard(workers_[index]->lock);
+        std::deque<Task*>& tasks = workers_[index]->tasks;
+        if(!tasks.empty()) {
+            task = tasks.back();
+            tasks.pop_back();
+            --queued_;
+        }
+    }
+    if(task == NULL) {
+        task = steal(index);
+    }
+    if(task == NULL) {
+        return false;
+    }
+    execute(task);
+    return true;
+}
+
+/**
+* Takes the oldest task from the first other worker that has one,
+* starting with the thief's neighbour so thieves spread out.
+*/
+inline ForkJoinPool::Task* ForkJoinPool::steal(std::size_t thief)
+{
+    if(queued_.load() == 0) {
+        return NULL;
+    }
+    for(std::size_t i = 1; i <= workers_.size(); ++i) {
+        Worker* victim = workers_[(thief + i) % workers_.size()];
+        std::lock_guard<std::mutex> guard(victim->lock);
+        if(!victim->tasks.empty()) {
+            Task* task = victim->tasks.front();
+            victim->tasks.pop_front();
+            --queued_;
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/**
+* Runs task, keeping anything it throws for the thread that forked it,
+* and marks it done. The forking thread may destroy the task as soon as
+* done is set, so nothing touches it afterwards.
+*/
+inline void ForkJoinPool::execute(Task* task)
+{
+    try {
+        task->run();
+    }
+    catch(...) {
+        task->error = std::current_exception();
+    }
+    task->done.store(true, std::memory_order_release);
+}
+
+/**
+* Returns the calling thread's worker index in this pool, or
+* NOT_A_WORKER if it is not one of this pool's workers.
+*/
+inline std::size_t ForkJoinPool::currentWorker() const
+{
+    const ForkJoinWorkerId& id = forkJoinCurrentWorker();
+    if(id.pool == this) {
+        return id.index;
+    }
+    return NOT_A_WORKER;
+}
+
+/*
+  -----------------------------------------
+  End implementations for the ForkJoinPool class.
+  -----------------------------------------
+*/
+
+#endif
@@ -0,0 +1,461 @@
+#ifndef FROZEN_MAP_H
+#define FROZEN_MAP_H
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "bst.h"
+
+/**
+* An immutable sorted map laid out for lookups rather than updates.
+*
+* The keys live in one contiguous array in Eytzinger (breadth-first)
+* order: the root at index 1 and the children of k at 2k and 2k+1. A
+* search touches the same indexes as a walk down a balanced tree, but
+* the first levels share a few cache lines, and the next levels can be
+* prefetched because their addresses are known in advance. Values are
+* kept in a parallel array so that they do not dilute the key array.
+*
+* Build one from a tree with freeze(), or from any sorted range.
+* Keys and values must be copy-assignable.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class FrozenMap
+{
+public:
+    FrozenMap();
+    template<typename ForwardIt>
+    FrozenMap(ForwardIt first, ForwardIt last, const Compare& comp = Compare());
+
+    /**
+    * A read-only, bidirectional iterator visiting keys in order.
+    * Dereferencing gives a pair of references into the map.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key&, const Value&> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, const Value&> reference;
+
+        // operator-> has to return something that outlives the call
+        class pointer
+        {
+        public:
+            pointer(const reference& ref) : ref_(ref) { }
+            const reference* operator->() const { return &ref_; }
+        private:
+            reference ref_;
+        };
+
+        const_iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class FrozenMap<Key, Value, Compare>;
+        const_iterator(const FrozenMap<Key, Value, Compare>* map, std::size_t index);
+        const FrozenMap<Key, Value, Compare> *map_;
+        std::size_t index_;     // Eytzinger index, 0 for end()
+    };
+    typedef const_iterator iterator;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const Key& key) const;
+    const_iterator lower_bound(const Key& key) const;
+    const Value& at(const Key& key) const;
+    std::size_t size() const;
+    bool empty() const;
+
+private:
+    std::size_t lowerBoundIndex(const Key& key) const;
+    template<typename ForwardIt>
+    void fill(std::size_t index, ForwardIt& it);
+    std::size_t leftmost(std::size_t index) const;
+    std::size_t rightmost(std::size_t index) const;
+    std::size_t next(std::size_t index) const;
+    std::size_t prev(std::size_t index) const;
+
+    // Index 0 is unused padding so that the children of k are 2k, 2k+1.
+    std::vector<Key> keys_;
+    std::vector<Value> values_;
+    std::size_t size_;
+    Compare comp_;
+};
+
+/**
+* Copies the contents of a tree into a FrozenMap. The tree is left
+* unchanged, and the map does not see later changes to it.
+*/
+template<typename Key, typename Value, typename Compare>
+FrozenMap<Key, Value, Compare> freeze(const BinarySearchTree<Key, Value, Compare>& tree)
+{
+    return FrozenMap<Key, Value, Compare>(tree.cbegin(), tree.cend(), tree.key_comp());
+}
+
+/*
+  -------------------------------------------------------
+  Begin implementations for the FrozenMap::const_iterator class.
+  -------------------------------------------------------
+*/
+
+/**
+* A default constructor that initializes the iterator to NULL.
+*/
+template<typename Key, typename Value, typename Compare>
+FrozenMap<Key, Value, Compare>::const_iterator::const_iterator() :
+    map_(NULL),
+    index_(0)
+{
+
+}
+
+/**
+* Initializes the iterator at the given Eytzinger index.
+*/
+template<typename Key, typename Value, typename Compare>
+FrozenMap<Key, Value, Compare>::const_iterator::const_iterator(const FrozenMap<Key, Value, Compare>* map, std::size_t index) :
+    map_(map),
+    index_(index)
+{
+
+}
+
+/**
+* Provides access to the key and value.
+*/
+template<typename Key, typename Value, typename Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator::reference
+FrozenMap<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return reference(map_->keys_[index_], map_->values_[index_]);
+}
+
+/**
+* Provides member access to the key and value, as it->first and it->second.
+*/
+template<typename Key, typename Value, typename Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator::pointer
+FrozenMap<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+/**
+* Checks if both iterators are at the same position.
+*/
+template<typename Key, typename Value, typename Compare>
+bool FrozenMap<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return index_ == rhs.index_;
+}
+
+/**
+* Checks if the iterators are at different positions.
+*/
+template<typename Key, typename Value, typename Compare>
+bool FrozenMap<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return index_ != rhs.index_;
+}
+
+/**
+* Advances to the next key in order.
+*/
+template<typename Key, typename Value, typename Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator&
+FrozenMap<Key, Value, Compare>::const_iterator::operator++()
+{
+    index_ = map_->next(index_);
+    return *this;
+}
+
+/**
+* Advances the iterator, returning its previous position.
+*/
+template<typename Key, typename Value, typename Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator
+FrozenMap<Key, Value, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/**
+* Moves back to the previous key in order; end() moves to the largest.
+*/
+template<typename Key, typename Value, typename Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator&
+FrozenMap<Key, Value, Compare>::const_iterator::operator--()
+{
+    index_ = map_->prev(index_);
+    return *this;
+}
+
+/**
+* Moves the iterator back, returning its previous position.
+*/
+template<typename Key, typename Value, typename Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator
+FrozenMap<Key, Value, Compare>::const_iterator::operator--(int)
+{
+    const_iterator old(*this);
+    --(*this);
+    return old;
+}
+
+/*
+  -----------------------------------------------------
+  End implementations for the FrozenMap::const_iterator class.
+  -----------------------------------------------------
+*/
+
+/*
+  -------------------------------------------
+  Begin implementations for the FrozenMap class.
+  -------------------------------------------
+*/
+
+/**
+* Constructs an empty map.
+*/
+template<typename Key, typename Value, typename Compare>
+FrozenMap<Key, Value, Compare>::FrozenMap() :
+    size_(0),
+    comp_()
+{
+
+}
+
+/**
+* Builds the map from the key/value pairs in [first, last), which must be
+* sorted by strictly increasing key under comp.
+* @throws std::invalid_argument if the keys are not strictly increasing
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename ForwardIt>
+FrozenMap<Key, Value, Compare>::FrozenMap(ForwardIt first, ForwardIt last, const Compare& comp) :
+    size_(0),
+    comp_(comp)
+{
+    if(first == last) {
+        return;
+    }
+    ForwardIt prev = first;
+    ForwardIt it = first;
+    for(++it, size_ = 1; it != last; ++it, ++prev, ++size_) {
+        if(!comp_(prev->first, it->first)) {
+            throw std::invalid_argument("FrozenMap: keys must be strictly increasing");
+        }
+    }
+
+    // fill the slots with copies of the first item, then overwrite them
+    // in the order an in-order walk of the implicit tree visits them
+    keys_.assign(size_ + 1, first->first);
+    values_.assign(size_ + 1, first->second);
+    it = first;
+    fill(1, it);
+}
+
+/**
+* Returns an iterator to the smallest key.
+*/
+template<typename Key, typename Value, typename Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator
+FrozenMap<Key, Value, Compare>::begin() const
+{
+    return const_iterator(this, size_ == 0 ? 0 : leftmost(1));
+}
+
+/**
+* Returns the end iterator.
+*/
+template<typename Key, typename Value, typename Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator
+FrozenMap<Key, Value, Compare>::end() const
+{
+    return const_iterator(this, 0);
+}
+
+/**
+* Returns an iterator to the item with the given key, or end().
+*/
+template<typename Key, typename Value, typename Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator
+FrozenMap<Key, Value, Compare>::find(const Key& key) const
+{
+    std::size_t index = lowerBoundIndex(key);
+    if(index != 0 && comp_(key, keys_[index])) {
+        index = 0;
+    }
+    return const_iterator(this, index);
+}
+
+/**
+* Returns an iterator to the first key not less than key, or end().
+*/
+template<typename Key, typename Value, typename Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator
+FrozenMap<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    return const_iterator(this, lowerBoundIndex(key));
+}
+
+/**
+* Returns the value for key.
+* @throws std::out_of_range if the key is not in the map
+*/
+template<typename Key, typename Value, typename Compare>
+const Value& FrozenMap<Key, Value, Compare>::at(const Key& key) const
+{
+    const_iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return values_[it.index_];
+}
+
+/**
+* Returns the number of items.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenMap<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+/**
+* Returns true if the map is empty.
+*/
+template<typename Key, typename Value, typename Compare>
+bool FrozenMap<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+/**
+* Returns the Eytzinger index of the first key not less than key, or 0.
+* The descent has no data-dependent branch: each step moves to the left
+* or right child by adding the comparison result. The lower bound is the
+* last node where the search went left, which is recovered from the path
+* bits afterwards by dropping the trailing right turns and one more.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenMap<Key, Value, Compare>::lowerBoundIndex(const Key& key) const
+{
+    // the keys four levels down from k start at 16k; fetch their line
+    // early so the load is under way by the time the search gets there
+    const Key* keys = keys_.data();
+    std::size_t index = 1;
+    while(index <= size_) {
+#if defined(__GNUC__)
+        __builtin_prefetch(keys + 16 * index);
+#endif
+        index = 2 * index + (comp_(keys[index], key) ? 1 : 0);
+    }
+    while(index & 1) {
+        index >>= 1;
+    }
+    return index >> 1;
+}
+
+/**
+* Copies items from it into the subtree rooted at index, in order.
+* Recursion depth is the height of the implicit tree, about log2(n).
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename ForwardIt>
+void FrozenMap<Key, Value, Compare>::fill(std::size_t index, ForwardIt& it)
+{
+    if(index > size_) {
+        return;
+    }
+    fill(2 * index, it);
+    keys_[index] = it->first;
+    values_[index] = it->second;
+    ++it;
+    fill(2 * index + 1, it);
+}
+
+/**
+* Returns the index of the smallest key in the subtree rooted at index.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenMap<Key, Value, Compare>::leftmost(std::size_t index) const
+{
+    while(2 * index <= size_) {
+        index = 2 * index;
+    }
+    return index;
+}
+
+/**
+* Returns the index of the largest key in the subtree rooted at index.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenMap<Key, Value, Compare>::rightmost(std::size_t index) const
+{
+    while(2 * index + 1 <= size_) {
+        index = 2 * index + 1;
+    }
+    return index;
+}
+
+/**
+* Returns the in-order successor of index, or 0 after the largest key.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenMap<Key, Value, Compare>::next(std::size_t index) const
+{
+    if(index == 0) {
+        return 0;
+    }
+    if(2 * index + 1 <= size_) {
+        return leftmost(2 * index + 1);
+    }
+    // climb while we are a right child, then once more
+    while(index & 1) {
+        index >>= 1;
+    }
+    return index >> 1;
+}
+
+/**
+* Returns the in-order predecessor of index, or the largest key for 0.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t FrozenMap<Key, Value, Compare>::prev(std::size_t index) const
+{
+    if(index == 0) {
+        return size_ == 0 ? 0 : rightmost(1);
+    }
+    if(2 * index <= size_) {
+        return rightmost(2 * index);
+    }
+    // climb while we are a left child, then once more
+    while(index != 0 && (index & 1) == 0) {
+        index >>= 1;
+    }
+    return index >> 1;
+}
+
+/*
+  -----------------------------------------
+  End implementations for the FrozenMap class.
+  -----------------------------------------
+*/
+
+#endif
@@ -0,0 +1,629 @@
+#ifndef MAPPED_AVL_H
+#define MAPPED_AVL_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bst.h"
+#include "tree_snapshot.h"
+
+/*
+  An on-disk tree image that MappedAVLTree maps and searches in place.
+
+  The image is a MappedImageHeader followed by one MappedNode per item.
+  Nodes link to their children by byte offset from the start of the
+  image, 0 meaning no child, so the image means the same thing wherever
+  it is mapped. The nodes are stored in key order, which makes iteration
+  and range scans a sequential walk through the file, and they form a
+  perfectly balanced tree, so a search reads about log2(n) of them.
+
+  Keys, values and offsets are stored in the writer's native layout. The
+  header records the byte order and type sizes, and an image written on
+  an incompatible machine or for other types is refused when opened.
+*/
+
+static const std::uint16_t MAPPED_IMAGE_VERSION = 1;
+static const std::uint32_t MAPPED_IMAGE_BYTE_ORDER = 0x01020304;
+
+/**
+* The fixed-size start of a tree image.
+*/
+struct MappedImageHeader
+{
+    char magic[4];                  // "BSTM"
+    std::uint16_t version;          // MAPPED_IMAGE_VERSION
+    std::uint16_t reserved;
+    std::uint32_t byteOrder;        // MAPPED_IMAGE_BYTE_ORDER as written
+    std::uint32_t keySize;
+    std::uint32_t valueSize;
+    std::uint32_t nodeSize;
+    std::uint32_t height;           // longest root-to-leaf path, in nodes
+    std::uint32_t nodeChecksum;     // CRC-32 of all the nodes
+    std::uint64_t count;
+    std::uint64_t root;             // offset of the root node, 0 if empty
+    std::uint64_t nodes;            // offset of the first node
+    std::uint64_t imageSize;
+    std::uint32_t headerChecksum;   // CRC-32 of the fields above
+    std::uint32_t padding;
+};
+
+/**
+* One item of a tree image and the offsets of its children.
+*/
+template<typename Key, typename Value>
+struct MappedNode
+{
+    Key key;
+    Value value;
+    std::uint64_t left;
+    std::uint64_t right;
+};
+
+/**
+* A read-only AVL tree served straight from a memory-mapped image file.
+*
+* Opening an image maps it and checks its header; nothing is read or
+* built per item, so opening takes the same time whatever the size of
+* the tree, and pages are read in as searches reach them. Write an image
+* with writeMappedImage().
+*
+* Keys and values must be trivially copyable. The image is trusted once
+* its header checks out: a search never reads outside the mapping, but a
+* damaged image can give wrong answers. Call verify() to check every
+* node's bytes against the stored checksum.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class MappedAVLTree
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "MappedAVLTree needs trivially copyable keys and values");
+
+public:
+    typedef MappedNode<Key, Value> Node;
+
+    explicit MappedAVLTree(const std::string& path, const Compare& comp = Compare());
+    ~MappedAVLTree();
+
+    /**
+    * A read-only, bidirectional iterator visiting keys in order.
+    * Dereferencing gives a pair of references into the image.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key&, const Value&> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, const Value&> reference;
+
+        // operator-> has to return something that outlives the call
+        class pointer
+        {
+        public:
+            pointer(const reference& ref) : ref_(ref) { }
+            const reference* operator->() const { return &ref_; }
+        private:
+            reference ref_;
+        };
+
+        const_iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class MappedAVLTree<Key, Value, Compare>;
+        explicit const_iterator(const Node* node);
+        const Node* node_;      // nodes are in key order, so ++ is node_ + 1
+    };
+    typedef const_iterator iterator;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const Key& key) const;
+    const_iterator lower_bound(const Key& key) const;
+    const_iterator upper_bound(const Key& key) const;
+    const Value& at(const Key& key) const;
+    template<typename F>
+    void scan(const Key& lo, const Key& hi, F fn) const;
+    std::size_t size() const;
+    bool empty() const;
+    int height() const;
+    bool verify() const;
+
+private:
+    MappedAVLTree(const MappedAVLTree&) = delete;
+    MappedAVLTree& operator=(const MappedAVLTree&) = delete;
+
+    const MappedImageHeader& header() const;
+    const Node* nodeAt(std::uint64_t offset) const;
+    template<typename Less>
+    const Node* descend(Less goesLeft) const;
+
+    const char* base_;      // start of the mapping
+    std::size_t mapped_;    // bytes mapped
+    const Node* first_;
+    std::size_t size_;
+    Compare comp_;
+};
+
+/*
+  -------------------------------------------------------
+  Begin implementations for the MappedAVLTree::const_iterator class.
+  -------------------------------------------------------
+*/
+
+/**
+* A default constructor that initializes the iterator to NULL.
+*/
+template<typename Key, typename Value, typename Compare>
+MappedAVLTree<Key, Value, Compare>::const_iterator::const_iterator() :
+    node_(NULL)
+{
+
+}
+
+/**
+* Initializes the iterator at the given node.
+*/
+template<typename Key, typename Value, typename Compare>
+MappedAVLTree<Key, Value, Compare>::const_iterator::const_iterator(const Node* node) :
+    node_(node)
+{
+
+}
+
+/**
+* Provides access to the key and value.
+*/
+template<typename Key, typename Value, typename Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator::reference
+MappedAVLTree<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return reference(node_->key, node_->value);
+}
+
+/**
+* Provides member access to the key and value.
+*/
+template<typename Key, typename Value, typename Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator::pointer
+MappedAVLTree<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+/**
+* Checks if 'this' iterator's internals have the same value
+* as 'rhs'
+*/
+template<typename Key, typename Value, typename Compare>
+bool MappedAVLTree<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return node_ == rhs.node_;
+}
+
+/**
+* Checks if 'this' iterator's internals have a different value
+* as 'rhs'
+*/
+template<typename Key, typename Value, typename Compare>
+bool MappedAVLTree<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return node_ != rhs.node_;
+}
+
+/**
+* Advances the iterator to the next key.
+*/
+template<typename Key, typename Value, typename Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator&
+MappedAVLTree<Key, Value, Compare>::const_iterator::operator++()
+{
+    ++node_;
+    return *this;
+}
+
+/**
+* Advances the iterator, returning its previous position.
+*/
+template<typename Key, typename Value, typename Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator
+MappedAVLTree<Key, Value, Compare>::const_iterator::operator++(int)
+{
+    const_iterator before(*this);
+    ++node_;
+    return before;
+}
+
+/**
+* Moves the iterator to the previous key.
+*/
+template<typename Key, typename Value, typename Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator&
+MappedAVLTree<Key, Value, Compare>::const_iterator::operator--()
+{
+    --node_;
+    return *this;
+}
+
+/**
+* Moves the iterator back, returning its previous position.
+*/
+template<typename Key, typename Value, typename Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator
+MappedAVLTree<Key, Value, Compare>::const_iterator::operator--(int)
+{
+    const_iterator before(*this);
+    --node_;
+    return before;
+}
+
+/*
+  -------------------------------------------------------
+  End implementations for the MappedAVLTree::const_iterator class.
+  -------------------------------------------------------
+*/
+
+/*
+  -------------------------------------------
+  Begin implementations for the MappedAVLTree class.
+  -------------------------------------------
+*/
+
+/**
+* Maps the image at path and checks its header.
+* @throws std::runtime_error if the file cannot be mapped, is not a tree
+*         image, or was written for other types or another byte order
+*/
+template<typename Key, typename Value, typename Compare>
+MappedAVLTree<Key, Value, Compare>::MappedAVLTree(const std::string& path, const Compare& comp) :
+    base_(NULL),
+    mapped_(0),
+    first_(NULL),
+    size_(0),
+    comp_(comp)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw std::runtime_error("MappedAVLTree: cannot open " + path + ": " + std::strerror(errno));
+    }
+    struct stat info;
+    if(::fstat(fd, &info) != 0 || static_cast<std::size_t>(info.st_size) < sizeof(MappedImageHeader)) {
+        ::close(fd);
+        throw std::runtime_error("MappedAVLTree: " + path + " is not a tree image");
+    }
+    mapped_ = static_cast<std::size_t>(info.st_size);
+    void* base = ::mmap(NULL, mapped_, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping keeps the file alive on its own
+    ::close(fd);
+    if(base == MAP_FAILED) {
+        throw std::runtime_error("MappedAVLTree: cannot map " + path + ": " + std::strerror(errno));
+    }
+    base_ = static_cast<const char*>(base);
+
+    const MappedImageHeader& h = header();
+    const char* problem = NULL;
+    if(std::memcmp(h.magic, "BSTM", 4) != 0 ||
+       h.headerChecksum != snapshotCrc32(0, reinterpret_cast<const unsigned char*>(&h),
+                                         offsetof(MappedImageHeader, headerChecksum))) {
+        problem = " is not a tree image";
+    }
+    else if(h.version != MAPPED_IMAGE_VERSION) {
+        problem = " has an unsupported image version";
+    }
+    else if(h.byteOrder != MAPPED_IMAGE_BYTE_ORDER || h.keySize != sizeof(Key) ||
+            h.valueSize != sizeof(Value) || h.nodeSize != sizeof(Node)) {
+        problem = " was written for other key or value types or another byte order";
+    }
+    else if(h.imageSize != mapped_ || h.nodes % alignof(Node) != 0 ||
+            h.nodes > mapped_ || (mapped_ - h.nodes) / sizeof(Node) != h.count ||
+            (mapped_ - h.nodes) % sizeof(Node) != 0 || (h.count == 0) != (h.root == 0)) {
+        problem = " is truncated or damaged";
+    }
+    if(problem != NULL) {
+        ::munmap(const_cast<char*>(base_), mapped_);
+        throw std::runtime_error("MappedAVLTree: " + path + problem);
+    }
+    first_ = reinterpret_cast<const Node*>(base_ + h.nodes);
+    size_ = static_cast<std::size_t>(h.count);
+    if(size_ > 0 && nodeAt(h.root) == NULL) {
+        ::munmap(const_cast<char*>(base_), mapped_);
+        throw std::runtime_error("MappedAVLTree: " + path + " is truncated or damaged");
+    }
+}
+
+/**
+* Unmaps the image. Iterators and references into it become invalid.
+*/
+template<typename Key, typename Value, typename Compare>
+MappedAVLTree<Key, Value, Compare>::~MappedAVLTree()
+{
+    ::munmap(const_cast<char*>(base_), mapped_);
+}
+
+/**
+* Returns an iterator to the smallest key.
+*/
+template<typename Key, typename Value, typename Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator
+MappedAVLTree<Key, Value, Compare>::begin() const
+{
+    return const_iterator(first_);
+}
+
+/**
+* Returns the end iterator.
+*/
+template<typename Key, typename Value, typename Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator
+MappedAVLTree<Key, Value, Compare>::end() const
+{
+    return const_iterator(first_ + size_);
+}
+
+/**
+* Returns an iterator to the item with the given key, or end().
+*/
+template<typename Key, typename Value, typename Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator
+MappedAVLTree<Key, Value, Compare>::find(const Key& key) const
+{
+    const_iterator it = lower_bound(key);
+    if(it != end() && comp_(key, it->first)) {
+        return end();
+    }
+    return it;
+}
+
+/**
+* Returns an iterator to the first key not less than key, or end().
+*/
+template<typename Key, typename Value, typename Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator
+MappedAVLTree<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    return const_iterator(descend([&](const Key& k) { return !comp_(k, key); }));
+}
+
+/**
+* Returns an iterator to the first key greater than key, or end().
+*/
+template<typename Key, typename Value, typename Compare>
+typename MappedAVLTree<Key, Value, Compare>::const_iterator
+MappedAVLTree<Key, Value, Compare>::upper_bound(const Key& key) const
+{
+    return const_iterator(descend([&](const Key& k) { return comp_(key, k); }));
+}
+
+/**
+* Returns the value for key.
+* @throws std::out_of_range if the key is not in the tree
+*/
+template<typename Key, typename Value, typename Compare>
+const Value& MappedAVLTree<Key, Value, Compare>::at(const Key& key) const
+{
+    const_iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it.node_->value;
+}
+
+/**
+* Calls fn on every item with a key in [lo, hi), in key order, reading
+* the nodes front to back.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename F>
+void MappedAVLTree<Key, Value, Compare>::scan(const Key& lo, const Key& hi, F fn) const
+{
+    const_iterator last = end();
+    for(const_iterator it = lower_bound(lo); it != last && comp_(it->first, hi); ++it) {
+        fn(*it);
+    }
+}
+
+/**
+* Returns the number of items.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t MappedAVLTree<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+/**
+* Returns true if the tree is empty.
+*/
+template<typename Key, typename Value, typename Compare>
+bool MappedAVLTree<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+/**
+* Returns the height recorded in the image: the number of nodes on the
+* longest path from the root, 0 if empty.
+*/
+template<typename Key, typename Value, typename Compare>
+int MappedAVLTree<Key, Value, Compare>::height() const
+{
+    return static_cast<int>(header().height);
+}
+
+/**
+* Reads every node and returns true if they match the checksum in the
+* header. Takes time proportional to the size of the image.
+*/
+template<typename Key, typename Value, typename Compare>
+bool MappedAVLTree<Key, Value, Compare>::verify() const
+{
+    return header().nodeChecksum ==
+        snapshotCrc32(0, reinterpret_cast<const unsigned char*>(first_), size_ * sizeof(Node));
+}
+
+/**
+* Returns the header at the start of the mapping.
+*/
+template<typename Key, typename Value, typename Compare>
+const MappedImageHeader& MappedAVLTree<Key, Value, Compare>::header() const
+{
+    return *reinterpret_cast<const MappedImageHeader*>(base_);
+}
+
+/**
+* Returns the node at the given offset into the image, or NULL if the
+* offset is 0 or does not point at a node.
+*/
+template<typename Key, typename Value, typename Compare>
+const typename MappedAVLTree<Key, Value, Compare>::Node*
+MappedAVLTree<Key, Value, Compare>::nodeAt(std::uint64_t offset) const
+{
+    std::uint64_t start = reinterpret_cast<const char*>(first_) - base_;
+    if(offset < start || (offset - start) % sizeof(Node) != 0 || (offset - start) / sizeof(Node) >= size_) {
+        return NULL;
+    }
+    const Node* node = first_ + (offset - start) / sizeof(Node);
+    return node;
+}
+
+/**
+* Walks down from the root and returns the last node where goesLeft held
+* for its key, which is the first such node in key order, or end() if
+* there is none. Stops after height() steps, so a damaged image cannot
+* loop.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename Less>
+const typename MappedAVLTree<Key, Value, Compare>::Node*
+MappedAVLTree<Key, Value, Compare>::descend(Less goesLeft) const
+{
+    const Node* found = first_ + size_;
+    const Node* node = size_ == 0 ? NULL : nodeAt(header().root);
+    for(std::uint32_t steps = header().height; node != NULL && steps > 0; --steps) {
+        if(goesLeft(node->key)) {
+            found = node;
+            node = node->left == 0 ? NULL : nodeAt(node->left);
+        }
+        else {
+            node = node->right == 0 ? NULL : nodeAt(node->right);
+        }
+    }
+    return found;
+}
+
+/*
+  -----------------------------------------
+  End implementations for the MappedAVLTree class.
+  -----------------------------------------
+*/
+
+/**
+* Returns the node index at the root of the balanced subtree over the
+* in-order positions [lo, hi), which must not be empty.
+*/
+inline std::uint64_t mappedSubtreeRoot(std::uint64_t lo, std::uint64_t hi)
+{
+    return lo + (hi - lo) / 2;
+}
+
+/**
+* Writes the nodes for in-order positions [lo, hi) to out, taking the
+* items from it and adding their bytes to crc. Recursion depth is the
+* height of the image, about log2(n).
+*/
+template<typename Key, typename Value, typename InputIt>
+void writeMappedRange(std::ofstream& out, std::uint64_t nodes, std::uint64_t lo, std::uint64_t hi,
+                      InputIt& it, std::uint32_t& crc)
+{
+    if(lo == hi) {
+        return;
+    }
+    std::uint64_t mid = mappedSubtreeRoot(lo, hi);
+    writeMappedRange<Key, Value>(out, nodes, lo, mid, it, crc);
+
+    MappedNode<Key, Value> node;
+    // zero the padding too, so that equal trees give identical images
+    std::memset(static_cast<void*>(&node), 0, sizeof(node));
+    node.key = it->first;
+    node.value = it->second;
+    node.left = lo == mid ? 0 : nodes + mappedSubtreeRoot(lo, mid) * sizeof(node);
+    node.right = mid + 1 == hi ? 0 : nodes + mappedSubtreeRoot(mid + 1, hi) * sizeof(node);
+    out.write(reinterpret_cast<const char*>(&node), sizeof(node));
+    crc = snapshotCrc32(crc, reinterpret_cast<const unsigned char*>(&node), sizeof(node));
+    ++it;
+
+    writeMappedRange<Key, Value>(out, nodes, mid + 1, hi, it, crc);
+}
+
+/**
+* Writes an image of tree to path for MappedAVLTree to open. The image
+* is written beside path and renamed over it once complete, so a reader
+* never maps a half-written file. The tree's own shape does not matter:
+* the image is always perfectly balanced.
+* @throws std::runtime_error if the file cannot be written
+*/
+template<typename Key, typename Value, typename Compare>
+void writeMappedImage(const BinarySearchTree<Key, Value, Compare>& tree, const std::string& path)
+{
+    typedef MappedNode<Key, Value> Node;
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "tree images need trivially copyable keys and values");
+
+    MappedImageHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, "BSTM", 4);
+    h.version = MAPPED_IMAGE_VERSION;
+    h.byteOrder = MAPPED_IMAGE_BYTE_ORDER;
+    h.keySize = sizeof(Key);
+    h.valueSize = sizeof(Value);
+    h.nodeSize = sizeof(Node);
+    h.count = tree.size();
+    h.nodes = (sizeof(h) + alignof(Node) - 1) / alignof(Node) * alignof(Node);
+    h.root = h.count == 0 ? 0 : h.nodes + mappedSubtreeRoot(0, h.count) * sizeof(Node);
+    h.imageSize = h.nodes + h.count * sizeof(Node);
+    for(std::uint64_t n = h.count; n > 0; n /= 2) {
+        ++h.height;
+    }
+
+    std::string temp = path + ".tmp";
+    std::ofstream out(temp.c_str(), std::ios::binary | std::ios::trunc);
+    // the header goes in last, once the checksum of the nodes is known
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    for(std::size_t i = sizeof(h); i < h.nodes; ++i) {
+        out.put('\0');
+    }
+    typename BinarySearchTree<Key, Value, Compare>::const_iterator it = tree.cbegin();
+    writeMappedRange<Key, Value>(out, h.nodes, 0, h.count, it, h.nodeChecksum);
+    h.headerChecksum = snapshotCrc32(0, reinterpret_cast<const unsigned char*>(&h),
+                                     offsetof(MappedImageHeader, headerChecksum));
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.close();
+    if(!out || std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::remove(temp.c_str());
+        throw std::runtime_error("writeMappedImage: cannot write " + path);
+    }
+}
+
+#endif
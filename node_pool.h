@@ -0,0 +1,268 @@
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <cstddef>
+#include <new>
+#include <stdexcept>
+
+/**
+* Counters kept by a NodePool. slabAllocs/slabFrees count calls into the
+* general-purpose heap; nodeAllocs/nodeFrees count slots handed out and
+* returned. Under steady insert/remove churn only the node counters move.
+*/
+struct PoolStats
+{
+    std::size_t slabAllocs;
+    std::size_t slabFrees;
+    std::size_t nodeAllocs;
+    std::size_t nodeFrees;
+};
+
+/**
+* A fixed-size slot allocator for tree nodes.
+* Slots are carved out of larger slabs taken from the heap. A freed slot goes
+* onto an intrusive free list and is reused by the next allocate(), so the
+* heap is only touched when the pool needs another slab. Slabs are returned
+* to the heap all at once by release().
+*/
+class NodePool
+{
+public:
+    NodePool(std::size_t slotSize, std::size_t slotAlign);
+    ~NodePool();
+
+    void* allocate();
+    void deallocate(void* slot);
+    void reserve(std::size_t numSlots);
+    void release();
+    void adopt(NodePool& other);
+    const PoolStats& stats() const;
+
+private:
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    void addSlab(std::size_t numSlots);
+
+    // Header stored at the front of every slab so they can be chained.
+    struct Slab
+    {
+        Slab* next;
+    };
+    // Overlaid on a free slot to link it into the free list.
+    struct FreeSlot
+    {
+        FreeSlot* next;
+    };
+
+    static const std::size_t FIRST_SLAB_SLOTS = 16;
+    static const std::size_t MAX_SLAB_SLOTS = 4096;
+
+    std::size_t slotSize_;
+    std::size_t headerSize_;
+    Slab* slabs_;
+    FreeSlot* freeList_;
+    char* bump_;        // next never-used slot in the newest slab
+    char* bumpEnd_;
+    std::size_t nextSlabSlots_;
+    PoolStats stats_;
+};
+
+/*
+  -------------------------------------------
+  Begin implementations for the NodePool class.
+  -------------------------------------------
+*/
+
+/**
+* Constructs an empty pool handing out slots of at least slotSize bytes,
+* each aligned to slotAlign. No memory is taken until the first allocate().
+* @throws std::invalid_argument if slotAlign is stricter than operator new
+*         guarantees, i.e. over alignof(std::max_align_t)
+*/
+inline NodePool::NodePool(std::size_t slotSize, std::size_t slotAlign) :
+    slabs_(NULL),
+    freeList_(NULL),
+    bump_(NULL),
+    bumpEnd_(NULL),
+    nextSlabSlots_(FIRST_SLAB_SLOTS)
+{
+    // slabs come from plain operator new, which aligns no further
+    if(slotAlign > alignof(std::max_align_t)) {
+        throw std::invalid_argument("NodePool: over-aligned slots are not supported");
+    }
+    if(slotAlign < alignof(FreeSlot)) slotAlign = alignof(FreeSlot);
+    if(slotSize < sizeof(FreeSlot)) slotSize = sizeof(FreeSlot);
+    slotSize_ = (slotSize + slotAlign - 1) / slotAlign * slotAlign;
+
+    // slabs come from operator new, so they are aligned for any fundamental
+    // type; keep the first slot on that boundary too
+    std::size_t maxAlign = alignof(std::max_align_t);
+    headerSize_ = (sizeof(Slab) + maxAlign - 1) / maxAlign * maxAlign;
+
+    stats_.slabAllocs = 0;
+    stats_.slabFrees = 0;
+    stats_.nodeAllocs = 0;
+    stats_.nodeFrees = 0;
+}
+
+/**
+* Returns every slab to the heap. Objects still living in the pool must
+* already have been destroyed by their owner.
+*/
+inline NodePool::~NodePool()
+{
+    release();
+}
+
+/**
+* Hands out one uninitialized slot, preferring the free list, then the
+* unused tail of the newest slab, and only then a fresh slab from the heap.
+*/
+inline void* NodePool::allocate()
+{
+    void* slot;
+    if(freeList_ != NULL) {
+        slot = freeList_;
+        freeList_ = freeList_->next;
+    }
+    else {
+        if(bump_ == bumpEnd_) {
+            addSlab(nextSlabSlots_);
+            if(nextSlabSlots_ < MAX_SLAB_SLOTS) nextSlabSlots_ *= 2;
+        }
+        slot = bump_;
+        bump_ += slotSize_;
+    }
+    ++stats_.nodeAllocs;
+    return slot;
+}
+
+/**
+* Puts a slot back on the free list. The object in it must already have
+* been destroyed.
+*/
+inline void NodePool::deallocate(void* slot)
+{
+    FreeSlot* freed = static_cast<FreeSlot*>(slot);
+    freed->next = freeList_;
+    freeList_ = freed;
+    ++stats_.nodeFrees;
+}
+
+/**
+* Makes sure the next numSlots slots handed out come from one contiguous
+* run of memory, adding a single slab of exactly that size if needed.
+* Slots on the free list are still handed out first, so this is most
+* useful on an empty pool, e.g. right after release().
+*/
+inline void NodePool::reserve(std::size_t numSlots)
+{
+    if(freeList_ == NULL && static_cast<std::size_t>(bumpEnd_ - bump_) / slotSize_ < numSlots) {
+        addSlab(numSlots);
+    }
+}
+
+/**
+* Returns all slabs to the heap at once, invalidating every slot handed
+* out so far. The counters are kept so callers can compare before/after.
+*/
+inline void NodePool::release()
+{
+    while(slabs_ != NULL) {
+        Slab* next = slabs_->next;
+        ::operator delete(slabs_);
+        slabs_ = next;
+        ++stats_.slabFrees;
+    }
+    freeList_ = NULL;
+    bump_ = NULL;
+    bumpEnd_ = NULL;
+    nextSlabSlots_ = FIRST_SLAB_SLOTS;
+}
+
+/**
+* Takes over every slab of other, so that objects other handed out now
+* belong to this pool. other's free slots and the unused tail of its
+* newest slab join this pool's free list, and its counters are added to
+* this pool's. Both pools must hand out slots of the same size. Runs in
+* time proportional to other's slab count and free list; other is left
+* empty, as after release(), with its counters zeroed.
+* @throws std::invalid_argument if the slot sizes differ
+*/
+inline void NodePool::adopt(NodePool& other)
+{
+    if(&other == this || other.slabs_ == NULL) {
+        return;
+    }
+    if(other.slotSize_ != slotSize_) {
+        throw std::invalid_argument("NodePool::adopt: slot sizes differ");
+    }
+
+    Slab* last = other.slabs_;
+    while(last->next != NULL) {
+        last = last->next;
+    }
+    last->next = slabs_;
+    slabs_ = other.slabs_;
+
+    for(char* slot = other.bump_; slot != other.bumpEnd_; slot += slotSize_) {
+        FreeSlot* freed = reinterpret_cast<FreeSlot*>(slot);
+        freed->next = freeList_;
+        freeList_ = freed;
+    }
+    if(other.freeList_ != NULL) {
+        FreeSlot* tail = other.freeList_;
+        while(tail->next != NULL) {
+            tail = tail->next;
+        }
+        tail->next = freeList_;
+        freeList_ = other.freeList_;
+    }
+
+    stats_.slabAllocs += other.stats_.slabAllocs;
+    stats_.slabFrees += other.stats_.slabFrees;
+    stats_.nodeAllocs += other.stats_.nodeAllocs;
+    stats_.nodeFrees += other.stats_.nodeFrees;
+
+    other.slabs_ = NULL;
+    other.freeList_ = NULL;
+    other.bump_ = NULL;
+    other.bumpEnd_ = NULL;
+    other.nextSlabSlots_ = FIRST_SLAB_SLOTS;
+    other.stats_.slabAllocs = 0;
+    other.stats_.slabFrees = 0;
+    other.stats_.nodeAllocs = 0;
+    other.stats_.nodeFrees = 0;
+}
+
+/**
+* Returns the allocation counters.
+*/
+inline const PoolStats& NodePool::stats() const
+{
+    return stats_;
+}
+
+/**
+* Takes a slab with room for numSlots slots from the heap and makes its
+* slots the next ones handed out.
+*/
+inline void NodePool::addSlab(std::size_t numSlots)
+{
+    char* raw = static_cast<char*>(::operator new(headerSize_ + numSlots * slotSize_));
+    Slab* slab = reinterpret_cast<Slab*>(raw);
+    slab->next = slabs_;
+    slabs_ = slab;
+    bump_ = raw + headerSize_;
+    bumpEnd_ = bump_ + numSlots * slotSize_;
+    ++stats_.slabAllocs;
+}
+
+/*
+  -----------------------------------------
+  End implementations for the NodePool class.
+  -----------------------------------------
+*/
+
+#endif
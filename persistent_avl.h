@@ -0,0 +1,798 @@
+#ifndef PERSISTENT_AVL_H
+#define PERSISTENT_AVL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/**
+* A node of a persistent AVL tree. Nodes never change once built, so any
+* number of tree versions, and any number of threads, can share them.
+* refs_ counts the parents and roots that point at the node.
+*/
+template <typename Key, typename Value>
+struct PersistentAVLNode
+{
+    PersistentAVLNode(const std::pair<const Key, Value>& item, PersistentAVLNode* left, PersistentAVLNode* right);
+
+    const std::pair<const Key, Value> item_;
+    PersistentAVLNode* const left_;
+    PersistentAVLNode* const right_;
+    const int height_;      // 1 for a leaf
+    mutable std::atomic<unsigned> refs_;
+};
+
+/**
+* The operations of a path-copying AVL tree. An update never changes an
+* existing node: it builds new copies of the nodes on the path from the
+* root to the change, rebalancing as it goes, and shares every subtree
+* off that path with the old version. The result is a new root, and the
+* old root still describes the tree as it was.
+*
+* Roots are owned references. insert() and remove() leave the reference
+* they are given alone and return a new one; release() drops one, which
+* frees the nodes that no other version shares. Nodes come from the
+* general heap rather than a NodePool, since the last reference to a node
+* may be dropped on any thread.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class PersistentAVLCore
+{
+public:
+    typedef PersistentAVLNode<Key, Value> Node;
+
+    explicit PersistentAVLCore(const Compare& comp = Compare());
+
+    Node* insert(const Node* root, const std::pair<const Key, Value>& item, bool& added) const;
+    Node* remove(const Node* root, const Key& key, bool& removed) const;
+    const Node* find(const Node* root, const Key& key) const;
+    template<typename F>
+    void scan(const Node* root, const Key& lo, const Key& hi, F& callback) const;
+
+    static Node* share(const Node* node);
+    static void release(const Node* node);
+    static int height(const Node* node);
+    const Compare& key_comp() const;
+
+private:
+    Node* insertAt(const Node* node, const std::pair<const Key, Value>& item, bool& added) const;
+    Node* removeAt(const Node* node, const Key& key) const;
+    static Node* removeMin(const Node* node);
+    static Node* balance(const std::pair<const Key, Value>& item, Node* left, Node* right);
+    static Node* rotateRight(const std::pair<const Key, Value>& item, Node* left, Node* right);
+    static Node* rotateLeft(const std::pair<const Key, Value>& item, Node* left, Node* right);
+
+    Compare comp_;
+};
+
+/*
+  -------------------------------------------------
+  Begin implementations for the PersistentAVLNode struct.
+  -------------------------------------------------
+*/
+
+/**
+* Builds a node holding a copy of item. The node takes over one reference
+* to each child, and starts with the one reference its creator holds.
+*/
+template<typename Key, typename Value>
+PersistentAVLNode<Key, Value>::PersistentAVLNode(const std::pair<const Key, Value>& item, PersistentAVLNode* left, PersistentAVLNode* right) :
+    item_(item),
+    left_(left),
+    right_(right),
+    height_(1 + std::max(left == NULL ? 0 : left->height_, right == NULL ? 0 : right->height_)),
+    refs_(1)
+{
+
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the PersistentAVLNode struct.
+  -----------------------------------------------
+*/
+
+/*
+  -------------------------------------------------
+  Begin implementations for the PersistentAVLCore class.
+  -------------------------------------------------
+*/
+
+/**
+* Constructor that orders keys with comp.
+*/
+template<typename Key, typename Value, typename Compare>
+PersistentAVLCore<Key, Value, Compare>::PersistentAVLCore(const Compare& comp) :
+    comp_(comp)
+{
+
+}
+
+/**
+* Returns the root of a tree with item added to root's tree, or with the
+* value replaced if the key is already there. added tells which.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLCore<Key, Value, Compare>::Node*
+PersistentAVLCore<Key, Value, Compare>::insert(const Node* root, const std::pair<const Key, Value>& item, bool& added) const
+{
+    added = false;
+    return insertAt(root, item, added);
+}
+
+/**
+* Returns the root of a tree with key removed from root's tree. When the
+* key is absent, removed is false and the result shares root itself.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLCore<Key, Value, Compare>::Node*
+PersistentAVLCore<Key, Value, Compare>::remove(const Node* root, const Key& key, bool& removed) const
+{
+    removed = find(root, key) != NULL;
+    return removed ? removeAt(root, key) : share(root);
+}
+
+/**
+* Returns the node holding key, or NULL.
+*/
+template<typename Key, typename Value, typename Compare>
+const typename PersistentAVLCore<Key, Value, Compare>::Node*
+PersistentAVLCore<Key, Value, Compare>::find(const Node* root, const Key& key) const
+{
+    const Node* bound = NULL;
+    while(root != NULL) {
+        if(comp_(root->item_.first, key)) {
+            root = root->right_;
+        }
+        else {
+            bound = root;
+            root = root->left_;
+        }
+    }
+    if(bound != NULL && !comp_(key, bound->item_.first)) {
+        return bound;
+    }
+    return NULL;
+}
+
+/**
+* Calls callback(item) for each item with lo <= key < hi, in key order,
+* skipping the subtrees that lie wholly outside the range.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename F>
+void PersistentAVLCore<Key, Value, Compare>::scan(const Node* root, const Key& lo, const Key& hi, F& callback) const
+{
+    if(root == NULL) {
+        return;
+    }
+    bool aboveLo = !comp_(root->item_.first, lo);
+    bool belowHi = comp_(root->item_.first, hi);
+    if(aboveLo) {
+        scan(root->left_, lo, hi, callback);
+    }
+    if(aboveLo && belowHi) {
+        callback(root->item_);
+    }
+    if(belowHi) {
+        scan(root->right_, lo, hi, callback);
+    }
+}
+
+/**
+* Takes another reference to node, which may be NULL, and returns it.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLCore<Key, Value, Compare>::Node*
+PersistentAVLCore<Key, Value, Compare>::share(const Node* node)
+{
+    if(node != NULL) {
+        node->refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return const_cast<Node*>(node);
+}
+
+/**
+* Drops a reference to node, which may be NULL. When it was the last
+* one, the node is freed and its references to its children dropped in
+* turn. Recursion depth is bounded by the height of the tree.
+*/
+template<typename Key, typename Value, typename Compare>
+void PersistentAVLCore<Key, Value, Compare>::release(const Node* node)
+{
+    while(node != NULL && node->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        const Node* right = node->right_;
+        release(node->left_);
+        delete node;
+        node = right;
+    }
+}
+
+/**
+* Returns the height of node, 0 for NULL.
+*/
+template<typename Key, typename Value, typename Compare>
+int PersistentAVLCore<Key, Value, Compare>::height(const Node* node)
+{
+    return node == NULL ? 0 : node->height_;
+}
+
+/**
+* Returns the comparator keys are ordered with.
+*/
+template<typename Key, typename Value, typename Compare>
+const Compare& PersistentAVLCore<Key, Value, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+* Copies the path from node down to where item belongs.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLCore<Key, Value, Compare>::Node*
+PersistentAVLCore<Key, Value, Compare>::insertAt(const Node* node, const std::pair<const Key, Value>& item, bool& added) const
+{
+    if(node == NULL) {
+        added = true;
+        return new Node(item, NULL, NULL);
+    }
+    if(comp_(item.first, node->item_.first)) {
+        return balance(node->item_, insertAt(node->left_, item, added), share(node->right_));
+    }
+    if(comp_(node->item_.first, item.first)) {
+        return balance(node->item_, share(node->left_), insertAt(node->right_, item, added));
+    }
+    return new Node(item, share(node->left_), share(node->right_));
+}
+
+/**
+* Copies the path from node down to key, which must be present, leaving
+* it out. A node with two children is replaced by its successor.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLCore<Key, Value, Compare>::Node*
+PersistentAVLCore<Key, Value, Compare>::removeAt(const Node* node, const Key& key) const
+{
+    if(comp_(key, node->item_.first)) {
+        return balance(node->item_, removeAt(node->left_, key), share(node->right_));
+    }
+    if(comp_(node->item_.first, key)) {
+        return balance(node->item_, share(node->left_), removeAt(node->right_, key));
+    }
+    if(node->left_ == NULL) {
+        return share(node->right_);
+    }
+    if(node->right_ == NULL) {
+        return share(node->left_);
+    }
+    const Node* successor = node->right_;
+    while(successor->left_ != NULL) {
+        successor = successor->left_;
+    }
+    return balance(successor->item_, share(node->left_), removeMin(node->right_));
+}
+
+/**
+* Copies the path from node down to its smallest key, leaving it out.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLCore<Key, Value, Compare>::Node*
+PersistentAVLCore<Key, Value, Compare>::removeMin(const Node* node)
+{
+    if(node->left_ == NULL) {
+        return share(node->right_);
+    }
+    return balance(node->item_, removeMin(node->left_), share(node->right_));
+}
+
+/**
+* Builds a node for item over left and right, rotating if their heights
+* differ by two. Takes over the references to left and right.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLCore<Key, Value, Compare>::Node*
+PersistentAVLCore<Key, Value, Compare>::balance(const std::pair<const Key, Value>& item, Node* left, Node* right)
+{
+    if(height(left) > height(right) + 1) {
+        return rotateRight(item, left, right);
+    }
+    if(height(right) > height(left) + 1) {
+        return rotateLeft(item, left, right);
+    }
+    return new Node(item, left, right);
+}
+
+/**
+* Rebuilds a left-heavy node: a single rotation when the left child leans
+* left or not at all, a double one when it leans right. The rotated nodes
+* are copies, so versions sharing left are unaffected.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLCore<Key, Value, Compare>::Node*
+PersistentAVLCore<Key, Value, Compare>::rotateRight(const std::pair<const Key, Value>& item, Node* left, Node* right)
+{
+    Node* result;
+    if(height(left->left_) >= height(left->right_)) {
+        result = new Node(left->item_, share(left->left_),
+                          new Node(item, share(left->right_), right));
+    }
+    else {
+        const Node* middle = left->right_;
+        result = new Node(middle->item_,
+                          new Node(left->item_, share(left->left_), share(middle->left_)),
+                          new Node(item, share(middle->right_), right));
+    }
+    release(left);
+    return result;
+}
+
+/**
+* Mirror image of rotateRight().
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLCore<Key, Value, Compare>::Node*
+PersistentAVLCore<Key, Value, Compare>::rotateLeft(const std::pair<const Key, Value>& item, Node* left, Node* right)
+{
+    Node* result;
+    if(height(right->right_) >= height(right->left_)) {
+        result = new Node(right->item_, new Node(item, left, share(right->left_)),
+                          share(right->right_));
+    }
+    else {
+        const Node* middle = right->left_;
+        result = new Node(middle->item_,
+                          new Node(item, left, share(middle->left_)),
+                          new Node(right->item_, share(middle->right_), share(right->right_)));
+    }
+    release(right);
+    return result;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the PersistentAVLCore class.
+  -----------------------------------------------
+*/
+
+/**
+* An AVL tree map whose copies are O(1) snapshots.
+*
+* Built on PersistentAVLCore: insert() and remove() copy only the
+* O(log n) nodes on the path to the change, and a copy of the tree, or
+* snapshot(), just shares the root. Each version then goes its own way
+* without affecting the others, and the nodes only one version used are
+* freed when it goes away.
+*
+* A tree and its snapshots may be used from different threads at once,
+* since they share only immutable nodes and atomic reference counts. A
+* single tree object needs the same outside locking as a std::map.
+* Iterators stay valid while the version they came from is alive.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class PersistentAVLTree
+{
+    typedef PersistentAVLCore<Key, Value, Compare> Core;
+    typedef typename Core::Node Node;
+
+public:
+    PersistentAVLTree();
+    explicit PersistentAVLTree(const Compare& comp);
+    PersistentAVLTree(const PersistentAVLTree& other);
+    PersistentAVLTree(PersistentAVLTree&& other);
+    PersistentAVLTree& operator=(PersistentAVLTree other);
+    ~PersistentAVLTree();
+
+    PersistentAVLTree snapshot() const;
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    std::size_t size() const;
+    bool empty() const;
+    int height() const;
+
+    /**
+    * A read-only iterator visiting items in key order. Nodes have no
+    * parent pointers, as they are shared between versions, so the
+    * iterator keeps the path of ancestors it still has to visit.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const std::pair<const Key, Value>* pointer;
+        typedef const std::pair<const Key, Value>& reference;
+
+        const_iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+
+    protected:
+        friend class PersistentAVLTree<Key, Value, Compare>;
+        void pushLeft(const Node* node);
+        // the current node on top, below it the ancestors whose items
+        // come next; empty at end()
+        std::vector<const Node*> path_;
+    };
+    typedef const_iterator iterator;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const Key& key) const;
+    const Value& at(const Key& key) const;
+    Value const & operator[](const Key& key) const;
+    template<typename F>
+    void scan(const Key& lo, const Key& hi, F callback) const;
+
+private:
+    void replaceRoot(Node* root);
+
+    Core core_;
+    Node* root_;
+    std::size_t size_;
+};
+
+/*
+  -------------------------------------------------------
+  Begin implementations for the PersistentAVLTree::const_iterator class.
+  -------------------------------------------------------
+*/
+
+/**
+* A default constructor that initializes the iterator to end().
+*/
+template<typename Key, typename Value, typename Compare>
+PersistentAVLTree<Key, Value, Compare>::const_iterator::const_iterator()
+{
+
+}
+
+/**
+* Provides access to the item.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator::reference
+PersistentAVLTree<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return path_.back()->item_;
+}
+
+/**
+* Provides member access to the item.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator::pointer
+PersistentAVLTree<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return &path_.back()->item_;
+}
+
+/**
+* Checks if both iterators are at the same node.
+*/
+template<typename Key, typename Value, typename Compare>
+bool PersistentAVLTree<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    const Node* mine = path_.empty() ? NULL : path_.back();
+    const Node* theirs = rhs.path_.empty() ? NULL : rhs.path_.back();
+    return mine == theirs;
+}
+
+/**
+* Checks if the iterators are at different nodes.
+*/
+template<typename Key, typename Value, typename Compare>
+bool PersistentAVLTree<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Advances to the next item: the leftmost node of the right subtree if
+* there is one, else the nearest ancestor still waiting on the path.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator&
+PersistentAVLTree<Key, Value, Compare>::const_iterator::operator++()
+{
+    const Node* node = path_.back();
+    path_.pop_back();
+    pushLeft(node->right_);
+    return *this;
+}
+
+/**
+* Advances the iterator, returning its previous position.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/**
+* Pushes node and its chain of left children, ending at the smallest.
+*/
+template<typename Key, typename Value, typename Compare>
+void PersistentAVLTree<Key, Value, Compare>::const_iterator::pushLeft(const Node* node)
+{
+    while(node != NULL) {
+        path_.push_back(node);
+        node = node->left_;
+    }
+}
+
+/*
+  -----------------------------------------------------
+  End implementations for the PersistentAVLTree::const_iterator class.
+  -----------------------------------------------------
+*/
+
+/*
+  -------------------------------------------
+  Begin implementations for the PersistentAVLTree class.
+  -------------------------------------------
+*/
+
+/**
+* Default constructor, which creates an empty tree.
+*/
+template<typename Key, typename Value, typename Compare>
+PersistentAVLTree<Key, Value, Compare>::PersistentAVLTree() :
+    core_(),
+    root_(NULL),
+    size_(0)
+{
+
+}
+
+/**
+* Constructor that orders keys with the given comparator.
+*/
+template<typename Key, typename Value, typename Compare>
+PersistentAVLTree<Key, Value, Compare>::PersistentAVLTree(const Compare& comp) :
+    core_(comp),
+    root_(NULL),
+    size_(0)
+{
+
+}
+
+/**
+* Copy constructor. Shares other's root, so it takes O(1).
+*/
+template<typename Key, typename Value, typename Compare>
+PersistentAVLTree<Key, Value, Compare>::PersistentAVLTree(const PersistentAVLTree& other) :
+    core_(other.core_),
+    root_(Core::share(other.root_)),
+    size_(other.size_)
+{
+
+}
+
+/**
+* Move constructor. Leaves other empty.
+*/
+template<typename Key, typename Value, typename Compare>
+PersistentAVLTree<Key, Value, Compare>::PersistentAVLTree(PersistentAVLTree&& other) :
+    core_(other.core_),
+    root_(other.root_),
+    size_(other.size_)
+{
+    other.root_ = NULL;
+    other.size_ = 0;
+}
+
+/**
+* Copy and move assignment, O(1) either way.
+*/
+template<typename Key, typename Value, typename Compare>
+PersistentAVLTree<Key, Value, Compare>&
+PersistentAVLTree<Key, Value, Compare>::operator=(PersistentAVLTree other)
+{
+    std::swap(core_, other.core_);
+    std::swap(root_, other.root_);
+    std::swap(size_, other.size_);
+    return *this;
+}
+
+/**
+* Destructor, which frees the nodes no other version shares.
+*/
+template<typename Key, typename Value, typename Compare>
+PersistentAVLTree<Key, Value, Compare>::~PersistentAVLTree()
+{
+    Core::release(root_);
+}
+
+/**
+* Returns a copy of the tree as it is now, in O(1).
+* Later changes to either tree do not show in the other.
+*/
+template<typename Key, typename Value, typename Compare>
+PersistentAVLTree<Key, Value, Compare> PersistentAVLTree<Key, Value, Compare>::snapshot() const
+{
+    return PersistentAVLTree(*this);
+}
+
+/**
+* Inserts the key/value pair, replacing the value if the key is present.
+* Copies O(log n) nodes.
+*/
+template<typename Key, typename Value, typename Compare>
+void PersistentAVLTree<Key, Value, Compare>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    bool added;
+    replaceRoot(core_.insert(root_, keyValuePair, added));
+    if(added) {
+        ++size_;
+    }
+}
+
+/**
+* Removes key if present. Copies O(log n) nodes.
+*/
+template<typename Key, typename Value, typename Compare>
+void PersistentAVLTree<Key, Value, Compare>::remove(const Key& key)
+{
+    bool removed;
+    replaceRoot(core_.remove(root_, key, removed));
+    if(removed) {
+        --size_;
+    }
+}
+
+/**
+* Removes every item. Snapshots keep theirs.
+*/
+template<typename Key, typename Value, typename Compare>
+void PersistentAVLTree<Key, Value, Compare>::clear()
+{
+    replaceRoot(NULL);
+    size_ = 0;
+}
+
+/**
+* Returns the number of items.
+*/
+template<typename Key, typename Value, typename Compare>
+std::size_t PersistentAVLTree<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+/**
+* Returns true if the tree is empty.
+*/
+template<typename Key, typename Value, typename Compare>
+bool PersistentAVLTree<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+/**
+* Returns the height of the tree, 0 when empty.
+*/
+template<typename Key, typename Value, typename Compare>
+int PersistentAVLTree<Key, Value, Compare>::height() const
+{
+    return Core::height(root_);
+}
+
+/**
+* Returns an iterator to the item with the smallest key.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::begin() const
+{
+    const_iterator it;
+    it.pushLeft(root_);
+    return it;
+}
+
+/**
+* Returns the end iterator.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::end() const
+{
+    return const_iterator();
+}
+
+/**
+* Returns an iterator to the item with the given key, or end(). The
+* search records the nodes where it went left, which are the ones the
+* iterator visits after the match.
+*/
+template<typename Key, typename Value, typename Compare>
+typename PersistentAVLTree<Key, Value, Compare>::const_iterator
+PersistentAVLTree<Key, Value, Compare>::find(const Key& key) const
+{
+    const Compare& comp = core_.key_comp();
+    const_iterator it;
+    const Node* node = root_;
+    while(node != NULL) {
+        if(comp(key, node->item_.first)) {
+            it.path_.push_back(node);
+            node = node->left_;
+        }
+        else if(comp(node->item_.first, key)) {
+            node = node->right_;
+        }
+        else {
+            it.path_.push_back(node);
+            return it;
+        }
+    }
+    return end();
+}
+
+/**
+* Returns the value for key.
+* @throws std::out_of_range if the key is not in the tree
+*/
+template<typename Key, typename Value, typename Compare>
+const Value& PersistentAVLTree<Key, Value, Compare>::at(const Key& key) const
+{
+    const Node* node = core_.find(root_, key);
+    if(node == NULL) throw std::out_of_range("Invalid key");
+    return node->item_.second;
+}
+
+/**
+ * @precondition The key exists in the tree
+ * Returns the value associated with the key
+ */
+template<typename Key, typename Value, typename Compare>
+Value const & PersistentAVLTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    return at(key);
+}
+
+/**
+* Calls callback(item) for each item with lo <= key < hi, in key order.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename F>
+void PersistentAVLTree<Key, Value, Compare>::scan(const Key& lo, const Key& hi, F callback) const
+{
+    core_.scan(root_, lo, hi, callback);
+}
+
+/**
+* Installs a new root, dropping this tree's reference to the old one.
+*/
+template<typename Key, typename Value, typename Compare>
+void PersistentAVLTree<Key, Value, Compare>::replaceRoot(Node* root)
+{
+    Node* old = root_;
+    root_ = root;
+    Core::release(old);
+}
+
+/*
+  -----------------------------------------
+  End implementations for the PersistentAVLTree class.
+  -----------------------------------------
+*/
+
+#endif
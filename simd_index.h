@@ -0,0 +1,692 @@
+#ifndef SIMD_INDEX_H
+#define SIMD_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "bst.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_INDEX_X86 1
+#include <immintrin.h>
+#endif
+
+/**
+* Instruction sets a SimdIndex can search with, from slowest to fastest.
+*/
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_SSE,
+    SIMD_AVX2
+};
+
+/**
+* Returns the fastest SimdLevel the running CPU supports.
+*/
+inline SimdLevel detectSimdLevel()
+{
+#ifdef SIMD_INDEX_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+    if(__builtin_cpu_supports("sse4.2")) {
+        return SIMD_SSE;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+/**
+* Block kernels for SimdIndex. Each counts the keys of one 64-byte block
+* that are less than key, which, as blocks are sorted, is the position
+* key would take in the block. The vector kernels compare a whole block
+* in two to four instructions and add up the match mask, so the count
+* has no branch that depends on the data.
+*
+* x86 only has signed integer comparisons, so keys are compared after
+* xoring with bias: the sign bit for unsigned keys, zero for signed ones.
+*/
+template<std::size_t KeySize>
+struct SimdBlockOps;
+
+template<>
+struct SimdBlockOps<4>
+{
+    static const std::size_t BLOCK = 16;
+
+    template<typename Key>
+    static unsigned countScalar(const Key* block, Key key)
+    {
+        unsigned count = 0;
+        for(std::size_t i = 0; i < BLOCK; ++i) {
+            count += block[i] < key ? 1 : 0;
+        }
+        return count;
+    }
+
+#ifdef SIMD_INDEX_X86
+    __attribute__((target("sse4.2")))
+    static unsigned countSse(const void* block, std::uint32_t key, std::uint32_t bias)
+    {
+        const __m128i* b = static_cast<const __m128i*>(block);
+        __m128i flip = _mm_set1_epi32(static_cast<int>(bias));
+        __m128i k = _mm_set1_epi32(static_cast<int>(key ^ bias));
+        unsigned mask = 0;
+        for(int i = 0; i < 4; ++i) {
+            __m128i lt = _mm_cmpgt_epi32(k, _mm_xor_si128(_mm_load_si128(b + i), flip));
+            mask |= static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(lt))) << (4 * i);
+        }
+        return __builtin_popcount(mask);
+    }
+
+    __attribute__((target("avx2")))
+    static unsigned countAvx2(const void* block, std::uint32_t key, std::uint32_t bias)
+    {
+        const __m256i* b = static_cast<const __m256i*>(block);
+        __m256i flip = _mm256_set1_epi32(static_cast<int>(bias));
+        __m256i k = _mm256_set1_epi32(static_cast<int>(key ^ bias));
+        __m256i lo = _mm256_cmpgt_epi32(k, _mm256_xor_si256(_mm256_load_si256(b), flip));
+        __m256i hi = _mm256_cmpgt_epi32(k, _mm256_xor_si256(_mm256_load_si256(b + 1), flip));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(lo)))
+            | static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(hi))) << 8;
+        return __builtin_popcount(mask);
+    }
+#endif
+};
+
+template<>
+struct SimdBlockOps<8>
+{
+    static const std::size_t BLOCK = 8;
+
+    template<typename Key>
+    static unsigned countScalar(const Key* block, Key key)
+    {
+        unsigned count = 0;
+        for(std::size_t i = 0; i < BLOCK; ++i) {
+            count += block[i] < key ? 1 : 0;
+        }
+        return count;
+    }
+
+#ifdef SIMD_INDEX_X86
+    __attribute__((target("sse4.2")))
+    static unsigned countSse(const void* block, std::uint64_t key, std::uint64_t bias)
+    {
+        const __m128i* b = static_cast<const __m128i*>(block);
+        __m128i flip = _mm_set1_epi64x(static_cast<long long>(bias));
+        __m128i k = _mm_set1_epi64x(static_cast<long long>(key ^ bias));
+        unsigned mask = 0;
+        for(int i = 0; i < 4; ++i) {
+            __m128i lt = _mm_cmpgt_epi64(k, _mm_xor_si128(_mm_load_si128(b + i), flip));
+            mask |= static_cast<unsigned>(_mm_movemask_pd(_mm_castsi128_pd(lt))) << (2 * i);
+        }
+        return __builtin_popcount(mask);
+    }
+
+    __attribute__((target("avx2")))
+    static unsigned countAvx2(const void* block, std::uint64_t key, std::uint64_t bias)
+    {
+        const __m256i* b = static_cast<const __m256i*>(block);
+        __m256i flip = _mm256_set1_epi64x(static_cast<long long>(bias));
+        __m256i k = _mm256_set1_epi64x(static_cast<long long>(key ^ bias));
+        __m256i lo = _mm256_cmpgt_epi64(k, _mm256_xor_si256(_mm256_load_si256(b), flip));
+        __m256i hi = _mm256_cmpgt_epi64(k, _mm256_xor_si256(_mm256_load_si256(b + 1), flip));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(lo)))
+            | static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(hi))) << 4;
+        return __builtin_popcount(mask);
+    }
+#endif
+};
+
+/**
+* A read-only sorted map for 32- and 64-bit integer keys, searched a
+* 64-byte block of keys at a time with SSE or AVX2.
+*
+* The keys are laid out as a static B-tree: the sorted keys, cut into
+* blocks of one cache line, form the bottom layer, and each layer above
+* holds, for every group of BLOCK + 1 blocks below it, the first keys of
+* all but the first. A lookup reads one block per layer and picks the
+* next block from how many keys in it are less than the search key, so
+* it takes about log base 17 (or 9) of n cache misses, and no branch
+* along the way depends on the keys. The instruction set is picked at
+* run time from what the CPU supports, with a plain loop as fallback.
+*
+* Build one from a tree with makeSimdIndex(), or from any sorted range.
+*/
+template <typename Key, typename Value>
+class SimdIndex
+{
+    static_assert(std::is_integral<Key>::value && (sizeof(Key) == 4 || sizeof(Key) == 8),
+                  "SimdIndex keys must be 32- or 64-bit integers");
+    typedef SimdBlockOps<sizeof(Key)> Ops;
+    typedef typename std::conditional<sizeof(Key) == 4, std::uint32_t, std::uint64_t>::type Bits;
+
+public:
+    static const std::size_t BLOCK = Ops::BLOCK;
+
+    SimdIndex();
+    template<typename ForwardIt>
+    SimdIndex(ForwardIt first, ForwardIt last);
+    SimdIndex(const SimdIndex& other);
+    SimdIndex(SimdIndex&& other) = default;
+    SimdIndex& operator=(SimdIndex other);
+
+    /**
+    * A read-only, bidirectional iterator visiting keys in order.
+    * Dereferencing gives a pair of references into the index.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key&, const Value&> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, const Value&> reference;
+
+        // operator-> has to return something that outlives the call
+        class pointer
+        {
+        public:
+            pointer(const reference& ref) : ref_(ref) { }
+            const reference* operator->() const { return &ref_; }
+        private:
+            reference ref_;
+        };
+
+        const_iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class SimdIndex<Key, Value>;
+        const_iterator(const SimdIndex<Key, Value>* index, std::size_t rank);
+        const SimdIndex<Key, Value> *index_;
+        std::size_t rank_;      // position in key order, size() for end()
+    };
+    typedef const_iterator iterator;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const Key& key) const;
+    const_iterator lower_bound(const Key& key) const;
+    const Value& at(const Key& key) const;
+    std::size_t size() const;
+    bool empty() const;
+    SimdLevel level() const;
+    void setLevel(SimdLevel level);
+
+private:
+    static const std::size_t ALIGN = 64;
+
+    const Key* blocks() const;
+    const Key* leafKeys() const;
+    void realign();
+    template<unsigned (*Count)(const Key*, Key)>
+    static std::size_t descend(const SimdIndex* index, Key key);
+    static unsigned countScalar(const Key* block, Key key);
+#ifdef SIMD_INDEX_X86
+    static unsigned countSse(const Key* block, Key key);
+    static unsigned countAvx2(const Key* block, Key key);
+#endif
+
+    // Layers of BLOCK-key blocks, the root first and the sorted keys
+    // last, starting ALIGN bytes into storage_ at index offset_.
+    std::vector<Key> storage_;
+    std::size_t offset_;
+    std::vector<std::size_t> layerStart_;   // first block of each layer
+    std::vector<Value> values_;
+    std::size_t size_;
+    SimdLevel level_;
+    std::size_t (*lowerBound_)(const SimdIndex*, Key);
+};
+
+/**
+* Copies the contents of a tree into a SimdIndex. The tree is left
+* unchanged, and the index does not see later changes to it.
+*/
+template<typename Key, typename Value>
+SimdIndex<Key, Value> makeSimdIndex(const BinarySearchTree<Key, Value>& tree)
+{
+    return SimdIndex<Key, Value>(tree.cbegin(), tree.cend());
+}
+
+template<typename Key, typename Value>
+const std::size_t SimdIndex<Key, Value>::BLOCK;
+
+/*
+  -------------------------------------------------------
+  Begin implementations for the SimdIndex::const_iterator class.
+  -------------------------------------------------------
+*/
+
+/**
+* A default constructor that initializes the iterator to NULL.
+*/
+template<typename Key, typename Value>
+SimdIndex<Key, Value>::const_iterator::const_iterator() :
+    index_(NULL),
+    rank_(0)
+{
+
+}
+
+/**
+* Initializes the iterator at the key with the given rank.
+*/
+template<typename Key, typename Value>
+SimdIndex<Key, Value>::const_iterator::const_iterator(const SimdIndex<Key, Value>* index, std::size_t rank) :
+    index_(index),
+    rank_(rank)
+{
+
+}
+
+/**
+* Provides access to the key and value.
+*/
+template<typename Key, typename Value>
+typename SimdIndex<Key, Value>::const_iterator::reference
+SimdIndex<Key, Value>::const_iterator::operator*() const
+{
+    return reference(index_->leafKeys()[rank_], index_->values_[rank_]);
+}
+
+/**
+* Provides member access to the key and value, as it->first and it->second.
+*/
+template<typename Key, typename Value>
+typename SimdIndex<Key, Value>::const_iterator::pointer
+SimdIndex<Key, Value>::const_iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+/**
+* Checks if both iterators are at the same position.
+*/
+template<typename Key, typename Value>
+bool SimdIndex<Key, Value>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return rank_ == rhs.rank_;
+}
+
+/**
+* Checks if the iterators are at different positions.
+*/
+template<typename Key, typename Value>
+bool SimdIndex<Key, Value>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return rank_ != rhs.rank_;
+}
+
+/**
+* Advances to the next key in order.
+*/
+template<typename Key, typename Value>
+typename SimdIndex<Key, Value>::const_iterator&
+SimdIndex<Key, Value>::const_iterator::operator++()
+{
+    ++rank_;
+    return *this;
+}
+
+/**
+* Advances the iterator, returning its previous position.
+*/
+template<typename Key, typename Value>
+typename SimdIndex<Key, Value>::const_iterator
+SimdIndex<Key, Value>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/**
+* Moves back to the previous key in order; end() moves to the largest.
+*/
+template<typename Key, typename Value>
+typename SimdIndex<Key, Value>::const_iterator&
+SimdIndex<Key, Value>::const_iterator::operator--()
+{
+    --rank_;
+    return *this;
+}
+
+/**
+* Moves the iterator back, returning its previous position.
+*/
+template<typename Key, typename Value>
+typename SimdIndex<Key, Value>::const_iterator
+SimdIndex<Key, Value>::const_iterator::operator--(int)
+{
+    const_iterator old(*this);
+    --(*this);
+    return old;
+}
+
+/*
+  -----------------------------------------------------
+  End implementations for the SimdIndex::const_iterator class.
+  -----------------------------------------------------
+*/
+
+/*
+  -------------------------------------------
+  Begin implementations for the SimdIndex class.
+  -------------------------------------------
+*/
+
+/**
+* Constructs an empty index.
+*/
+template<typename Key, typename Value>
+SimdIndex<Key, Value>::SimdIndex() :
+    offset_(0),
+    size_(0)
+{
+    setLevel(SIMD_AVX2);
+}
+
+/**
+* Builds the index from the key/value pairs in [first, last), which must
+* be sorted by strictly increasing key.
+* @throws std::invalid_argument if the keys are not strictly increasing
+*/
+template<typename Key, typename Value>
+template<typename ForwardIt>
+SimdIndex<Key, Value>::SimdIndex(ForwardIt first, ForwardIt last) :
+    offset_(0),
+    size_(0)
+{
+    setLevel(SIMD_AVX2);
+    std::vector<Key> keys;
+    for(ForwardIt it = first; it != last; ++it) {
+        if(!keys.empty() && !(keys.back() < it->first)) {
+            throw std::invalid_argument("SimdIndex: keys must be strictly increasing");
+        }
+        keys.push_back(it->first);
+        values_.push_back(it->second);
+    }
+    size_ = keys.size();
+    if(size_ == 0) {
+        return;
+    }
+
+    // block counts per layer, from the sorted keys up to a single root
+    std::vector<std::size_t> counts(1, (size_ + BLOCK - 1) / BLOCK);
+    while(counts.back() > 1) {
+        counts.push_back((counts.back() + BLOCK) / (BLOCK + 1));
+    }
+    std::size_t total = 0;
+    layerStart_.resize(counts.size());
+    for(std::size_t h = counts.size(); h-- > 0; ) {
+        layerStart_[h] = total;
+        total += counts[h];
+    }
+
+    // padding keys sort after everything and are never counted as less
+    const Key pad = std::numeric_limits<Key>::max();
+    storage_.assign(total * BLOCK + ALIGN / sizeof(Key), pad);
+    realign();
+    Key* out = &storage_[offset_];
+    std::memcpy(out + layerStart_[0] * BLOCK, keys.data(), size_ * sizeof(Key));
+
+    // separator j of block b in layer h is the first key under child j + 1,
+    // whose leftmost leaf block is child * (BLOCK + 1)^(h - 1)
+    std::size_t span = 1;
+    for(std::size_t h = 1; h < counts.size(); ++h) {
+        for(std::size_t b = 0; b < counts[h]; ++b) {
+            for(std::size_t j = 0; j < BLOCK; ++j) {
+                std::size_t leaf = (b * (BLOCK + 1) + j + 1) * span;
+                if(leaf < counts[0]) {
+                    out[(layerStart_[h] + b) * BLOCK + j] = keys[leaf * BLOCK];
+                }
+            }
+        }
+        span *= BLOCK + 1;
+    }
+}
+
+/**
+* Copy constructor. The copy's keys are moved to its own alignment.
+*/
+template<typename Key, typename Value>
+SimdIndex<Key, Value>::SimdIndex(const SimdIndex& other) :
+    storage_(other.storage_.size()),
+    offset_(0),
+    layerStart_(other.layerStart_),
+    values_(other.values_),
+    size_(other.size_),
+    level_(other.level_),
+    lowerBound_(other.lowerBound_)
+{
+    if(!storage_.empty()) {
+        realign();
+        std::size_t used = storage_.size() - ALIGN / sizeof(Key);
+        std::memcpy(&storage_[offset_], other.blocks(), used * sizeof(Key));
+    }
+}
+
+/**
+* Copy and move assignment.
+*/
+template<typename Key, typename Value>
+SimdIndex<Key, Value>& SimdIndex<Key, Value>::operator=(SimdIndex other)
+{
+    storage_.swap(other.storage_);
+    std::swap(offset_, other.offset_);
+    layerStart_.swap(other.layerStart_);
+    values_.swap(other.values_);
+    std::swap(size_, other.size_);
+    std::swap(level_, other.level_);
+    std::swap(lowerBound_, other.lowerBound_);
+    return *this;
+}
+
+/**
+* Returns an iterator to the smallest key.
+*/
+template<typename Key, typename Value>
+typename SimdIndex<Key, Value>::const_iterator
+SimdIndex<Key, Value>::begin() const
+{
+    return const_iterator(this, 0);
+}
+
+/**
+* Returns the end iterator.
+*/
+template<typename Key, typename Value>
+typename SimdIndex<Key, Value>::const_iterator
+SimdIndex<Key, Value>::end() const
+{
+    return const_iterator(this, size_);
+}
+
+/**
+* Returns an iterator to the item with the given key, or end().
+*/
+template<typename Key, typename Value>
+typename SimdIndex<Key, Value>::const_iterator
+SimdIndex<Key, Value>::find(const Key& key) const
+{
+    std::size_t rank = lowerBound_(this, key);
+    if(rank != size_ && leafKeys()[rank] != key) {
+        rank = size_;
+    }
+    return const_iterator(this, rank);
+}
+
+/**
+* Returns an iterator to the first key not less than key, or end().
+*/
+template<typename Key, typename Value>
+typename SimdIndex<Key, Value>::const_iterator
+SimdIndex<Key, Value>::lower_bound(const Key& key) const
+{
+    return const_iterator(this, lowerBound_(this, key));
+}
+
+/**
+* Returns the value for key.
+* @throws std::out_of_range if the key is not in the index
+*/
+template<typename Key, typename Value>
+const Value& SimdIndex<Key, Value>::at(const Key& key) const
+{
+    const_iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return values_[it.rank_];
+}
+
+/**
+* Returns the number of items.
+*/
+template<typename Key, typename Value>
+std::size_t SimdIndex<Key, Value>::size() const
+{
+    return size_;
+}
+
+/**
+* Returns true if the index is empty.
+*/
+template<typename Key, typename Value>
+bool SimdIndex<Key, Value>::empty() const
+{
+    return size_ == 0;
+}
+
+/**
+* Returns the instruction set lookups use.
+*/
+template<typename Key, typename Value>
+SimdLevel SimdIndex<Key, Value>::level() const
+{
+    return level_;
+}
+
+/**
+* Makes lookups use the given instruction set, or the fastest one below
+* it that the CPU supports. Meant for benchmarks and tests; the
+* constructors already pick the fastest.
+*/
+template<typename Key, typename Value>
+void SimdIndex<Key, Value>::setLevel(SimdLevel level)
+{
+    static const SimdLevel supported = detectSimdLevel();
+    level_ = level < supported ? level : supported;
+    lowerBound_ = &SimdIndex::template descend<&SimdIndex::countScalar>;
+#ifdef SIMD_INDEX_X86
+    if(level_ == SIMD_SSE) {
+        lowerBound_ = &SimdIndex::template descend<&SimdIndex::countSse>;
+    }
+    else if(level_ == SIMD_AVX2) {
+        lowerBound_ = &SimdIndex::template descend<&SimdIndex::countAvx2>;
+    }
+#endif
+}
+
+/**
+* Returns the first block of the root layer.
+*/
+template<typename Key, typename Value>
+const Key* SimdIndex<Key, Value>::blocks() const
+{
+    return storage_.data() + offset_;
+}
+
+/**
+* Returns the sorted keys, which are the bottom layer.
+*/
+template<typename Key, typename Value>
+const Key* SimdIndex<Key, Value>::leafKeys() const
+{
+    return blocks() + (layerStart_.empty() ? 0 : layerStart_[0] * BLOCK);
+}
+
+/**
+* Points offset_ at the first ALIGN-byte boundary in storage_.
+*/
+template<typename Key, typename Value>
+void SimdIndex<Key, Value>::realign()
+{
+    std::uintptr_t address = reinterpret_cast<std::uintptr_t>(storage_.data());
+    offset_ = ((ALIGN - address % ALIGN) % ALIGN) / sizeof(Key);
+}
+
+/**
+* Returns the rank of the first key not less than key. Picks a block in
+* each layer from the count of keys less than key in the block above; in
+* the bottom layer that count is the offset of the answer. If every key
+* in a block is less, the answer is the first key of the next block,
+* which the same arithmetic lands on.
+*/
+template<typename Key, typename Value>
+template<unsigned (*Count)(const Key*, Key)>
+std::size_t SimdIndex<Key, Value>::descend(const SimdIndex* index, Key key)
+{
+    if(index->size_ == 0) {
+        return 0;
+    }
+    const Key* base = index->blocks();
+    const std::size_t* start = index->layerStart_.data();
+    std::size_t block = 0;
+    for(std::size_t h = index->layerStart_.size() - 1; h > 0; --h) {
+        block = block * (BLOCK + 1) + Count(base + (start[h] + block) * BLOCK, key);
+    }
+    std::size_t rank = block * BLOCK + Count(base + start[0] * BLOCK + block * BLOCK, key);
+    return rank < index->size_ ? rank : index->size_;
+}
+
+/**
+* Block kernels bound to this key type.
+*/
+template<typename Key, typename Value>
+unsigned SimdIndex<Key, Value>::countScalar(const Key* block, Key key)
+{
+    return Ops::countScalar(block, key);
+}
+
+#ifdef SIMD_INDEX_X86
+template<typename Key, typename Value>
+unsigned SimdIndex<Key, Value>::countSse(const Key* block, Key key)
+{
+    const Bits bias = std::is_signed<Key>::value ? 0 : Bits(1) << (8 * sizeof(Key) - 1);
+    return Ops::countSse(block, static_cast<Bits>(key), bias);
+}
+
+template<typename Key, typename Value>
+unsigned SimdIndex<Key, Value>::countAvx2(const Key* block, Key key)
+{
+    const Bits bias = std::is_signed<Key>::value ? 0 : Bits(1) << (8 * sizeof(Key) - 1);
+    return Ops::countAvx2(block, static_cast<Bits>(key), bias);
+}
+#endif
+
+/*
+  -----------------------------------------
+  End implementations for the SimdIndex class.
+  -----------------------------------------
+*/
+
+#endif
@@ -0,0 +1,606 @@
+#ifndef TREE_SNAPSHOT_H
+#define TREE_SNAPSHOT_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+  Binary snapshots of a tree's items, written by save() and read back by
+  load() on BinarySearchTree and AVLTree.
+
+  All fixed-size integers are little-endian. A snapshot is:
+
+    header, 24 bytes:
+      "BSTS"         magic
+      uint16         format version (SNAPSHOT_VERSION)
+      uint8          flags; SNAPSHOT_DELTA_KEYS if keys are delta-encoded
+      uint8, uint8   sizeof(Key), sizeof(Value), to catch type mismatches
+      3 bytes        zero
+      uint64         number of items
+      uint32         CRC-32 of the 20 bytes above
+    blocks, each:
+      uint32         length in bytes, never 0
+      bytes          whole records
+      uint32         CRC-32 of those bytes
+    uint32 0         end marker
+
+  A record is the item's key followed by its value, in key order.
+  Integral keys are stored as the varint of their difference from the
+  previous key (the first from 0), which takes a byte or two for dense
+  keys. Other keys and all values use SnapshotCodec. Blocks let a reader
+  verify each checksum before parsing, and read exactly the snapshot's
+  bytes from the stream and no further.
+*/
+
+static const std::uint16_t SNAPSHOT_VERSION = 1;
+static const std::uint8_t SNAPSHOT_DELTA_KEYS = 1;
+
+// Records are flushed as a block once this many bytes pile up. Every
+// record takes at least a byte, so no block holds more records than this.
+static const std::size_t SNAPSHOT_BLOCK_BYTES = 64 * 1024;
+
+/**
+* Returns the table-driven CRC-32 (the zlib/PNG polynomial) of len bytes
+* at data, continuing from crc, which is 0 for a fresh checksum. Reads
+* eight bytes per step with eight tables.
+*/
+inline std::uint32_t snapshotCrc32(std::uint32_t crc, const unsigned char* data, std::size_t len)
+{
+    struct Tables
+    {
+        std::uint32_t t[8][256];
+        Tables()
+        {
+            for(std::uint32_t i = 0; i < 256; ++i) {
+                std::uint32_t c = i;
+                for(int k = 0; k < 8; ++k) {
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                t[0][i] = c;
+            }
+            for(std::uint32_t i = 0; i < 256; ++i) {
+                for(int s = 1; s < 8; ++s) {
+                    t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+                }
+            }
+        }
+    };
+    static const Tables tables;
+    const std::uint32_t (*t)[256] = tables.t;
+
+    crc = ~crc;
+    while(len >= 8) {
+        std::uint32_t lo = crc ^ (std::uint32_t(data[0]) | std::uint32_t(data[1]) << 8 |
+                                  std::uint32_t(data[2]) << 16 | std::uint32_t(data[3]) << 24);
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+    while(len-- > 0) {
+        crc = t[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+* Appends value as a LEB128 varint: seven bits per byte, low bits first,
+* with the high bit set on every byte but the last.
+*/
+inline void snapshotPutVarint(std::string& out, std::uint64_t value)
+{
+    while(value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+/**
+* Reads a varint written by snapshotPutVarint() from [p, end) into
+* value, returning the position after it.
+* @throws std::runtime_error if it runs past end or past 64 bits
+*/
+inline const char* snapshotGetVarint(const char* p, const char* end, std::uint64_t& value)
+{
+    value = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        if(p == end) {
+            break;
+        }
+        std::uint64_t byte = static_cast<unsigned char>(*p++);
+        value |= (byte & 0x7F) << shift;
+        if(byte < 0x80) {
+            return p;
+        }
+    }
+    throw std::runtime_error("load: malformed varint");
+}
+
+/**
+* Writes and reads one key or value inside a record. This default
+* handles trivially copyable types by copying their bytes, so a snapshot
+* of such types only reads back on a machine with the same layout and
+* byte order. Specialize it for other types.
+*/
+template<typename T, typename Enable = void>
+struct SnapshotCodec
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "SnapshotCodec must be specialized for types that are not trivially copyable");
+
+    static void write(std::string& out, const T& value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static const char* read(const char* p, const char* end, T& value)
+    {
+        if(static_cast<std::size_t>(end - p) < sizeof(T)) {
+            throw std::runtime_error("load: record runs past its block");
+        }
+        std::memcpy(&value, p, sizeof(T));
+        return p + sizeof(T);
+    }
+};
+
+/**
+* Integers (but not bool) are varints, zigzag-encoded when signed so
+* that small negative numbers stay short.
+*/
+template<typename T>
+struct SnapshotCodec<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>
+{
+    typedef typename std::make_unsigned<T>::type Unsigned;
+
+    static void write(std::string& out, const T& value)
+    {
+        std::uint64_t bits = static_cast<Unsigned>(value);
+        if(std::is_signed<T>::value) {
+            // move the sign to the low bit: 0, -1, 1, -2 ... -> 0, 1, 2, 3 ...
+            bits = (bits << 1) ^ (value < 0 ? ~std::uint64_t(0) : 0);
+        }
+        snapshotPutVarint(out, bits);
+    }
+
+    static const char* read(const char* p, const char* end, T& value)
+    {
+        std::uint64_t bits;
+        p = snapshotGetVarint(p, end, bits);
+        if(std::is_signed<T>::value) {
+            bits = (bits >> 1) ^ (~(bits & 1) + 1);
+        }
+        value = static_cast<T>(static_cast<Unsigned>(bits));
+        return p;
+    }
+};
+
+/**
+* Strings are their length as a varint, then their bytes.
+*/
+template<>
+struct SnapshotCodec<std::string>
+{
+    static void write(std::string& out, const std::string& value)
+    {
+        snapshotPutVarint(out, value.size());
+        out.append(value);
+    }
+
+    static const char* read(const char* p, const char* end, std::string& value)
+    {
+        std::uint64_t length;
+        p = snapshotGetVarint(p, end, length);
+        if(static_cast<std::uint64_t>(end - p) < length) {
+            throw std::runtime_error("load: record runs past its block");
+        }
+        value.assign(p, static_cast<std::size_t>(length));
+        return p + length;
+    }
+};
+
+/**
+* Encodes the keys of successive records. Integral keys (not bool) are
+* stored as deltas from the previous key, taken modulo 2^bits so that
+* any order round-trips; everything else goes through SnapshotCodec.
+*/
+template<typename Key, typename Enable = void>
+struct SnapshotKeyCodec
+{
+    static const bool DELTA = false;
+
+    void write(std::string& out, const Key& key)
+    {
+        SnapshotCodec<Key>::write(out, key);
+    }
+
+    const char* read(const char* p, const char* end, Key& key)
+    {
+        return SnapshotCodec<Key>::read(p, end, key);
+    }
+};
+
+template<typename Key>
+struct SnapshotKeyCodec<Key, typename std::enable_if<std::is_integral<Key>::value && !std::is_same<Key, bool>::value>::type>
+{
+    typedef typename std::make_unsigned<Key>::type Unsigned;
+    static const bool DELTA = true;
+
+    SnapshotKeyCodec() : prev_(0) { }
+
+    void write(std::string& out, const Key& key)
+    {
+        Unsigned bits = static_cast<Unsigned>(key);
+        snapshotPutVarint(out, static_cast<Unsigned>(bits - prev_));
+        prev_ = bits;
+    }
+
+    const char* read(const char* p, const char* end, Key& key)
+    {
+        std::uint64_t delta;
+        p = snapshotGetVarint(p, end, delta);
+        prev_ = static_cast<Unsigned>(prev_ + static_cast<Unsigned>(delta));
+        key = static_cast<Key>(prev_);
+        return p;
+    }
+
+private:
+    Unsigned prev_;
+};
+
+template<typename Key, typename Enable>
+const bool SnapshotKeyCodec<Key, Enable>::DELTA;
+
+template<typename Key>
+const bool SnapshotKeyCodec<Key, typename std::enable_if<std::is_integral<Key>::value && !std::is_same<Key, bool>::value>::type>::DELTA;
+
+/**
+* Writes a snapshot to a stream: the header, then records gathered into
+* checksummed blocks, then the end marker from finish().
+*/
+template<typename Key, typename Value>
+class SnapshotWriter
+{
+public:
+    SnapshotWriter(std::ostream& out, std::uint64_t count);
+
+    void put(const Key& key, const Value& value);
+    void finish();
+
+private:
+    // The header keeps sizeof(Key) and sizeof(Value) in a byte each.
+    static_assert(sizeof(Key) < 256 && sizeof(Value) < 256, "snapshot keys and values must be under 256 bytes");
+
+    void flushBlock();
+    void write(const char* data, std::size_t len);
+    static void putFixed(std::string& out, std::uint64_t value, int bytes);
+
+    std::ostream& out_;
+    std::string block_;
+    SnapshotKeyCodec<Key> keys_;
+};
+
+/**
+* Reads a snapshot written by SnapshotWriter from a stream, one item at a
+* time. Verifies the header on construction and each block's checksum
+* before handing out any item from it.
+*/
+template<typename Key, typename Value>
+class SnapshotReader
+{
+public:
+    explicit SnapshotReader(std::istream& in);
+
+    std::uint64_t count() const;
+    void next(std::pair<Key, Value>& item);
+    void finish();
+
+private:
+    static_assert(sizeof(Key) < 256 && sizeof(Value) < 256, "snapshot keys and values must be under 256 bytes");
+
+    bool readBlock();
+    void read(char* data, std::size_t len);
+    static std::uint64_t getFixed(const char* p, int bytes);
+
+    std::istream& in_;
+    std::uint64_t count_;
+    std::vector<char> block_;
+    const char* pos_;
+    const char* end_;
+    SnapshotKeyCodec<Key> keys_;
+};
+
+/**
+* An input iterator over a SnapshotReader's items, so that code taking
+* an iterator range can build straight from a stream. Holds one item at
+* a time.
+*/
+template<typename Key, typename Value>
+class SnapshotItemIterator
+{
+public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef std::pair<Key, Value> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const std::pair<Key, Value>* pointer;
+    typedef const std::pair<Key, Value>& reference;
+
+    SnapshotItemIterator(SnapshotReader<Key, Value>& reader, std::uint64_t remaining) :
+        reader_(reader), remaining_(remaining)
+    {
+        if(remaining_ > 0) {
+            reader_.next(item_);
+        }
+    }
+
+    reference operator*() const { return item_; }
+    pointer operator->() const { return &item_; }
+
+    SnapshotItemIterator& operator++()
+    {
+        if(--remaining_ > 0) {
+            reader_.next(item_);
+        }
+        return *this;
+    }
+
+private:
+    SnapshotReader<Key, Value>& reader_;
+    std::uint64_t remaining_;
+    std::pair<Key, Value> item_;
+};
+
+/*
+  -------------------------------------------
+  Begin implementations for the SnapshotWriter class.
+  -------------------------------------------
+*/
+
+/**
+* Writes the header for a snapshot of count items.
+*/
+template<typename Key, typename Value>
+SnapshotWriter<Key, Value>::SnapshotWriter(std::ostream& out, std::uint64_t count) :
+    out_(out)
+{
+    std::string header("BSTS");
+    putFixed(header, SNAPSHOT_VERSION, 2);
+    header.push_back(static_cast<char>(SnapshotKeyCodec<Key>::DELTA ? SNAPSHOT_DELTA_KEYS : 0));
+    header.push_back(static_cast<char>(sizeof(Key)));
+    header.push_back(static_cast<char>(sizeof(Value)));
+    header.append(3, '\0');
+    putFixed(header, count, 8);
+    putFixed(header, snapshotCrc32(0, reinterpret_cast<const unsigned char*>(header.data()), header.size()), 4);
+    write(header.data(), header.size());
+    block_.reserve(SNAPSHOT_BLOCK_BYTES + 64);
+}
+
+/**
+* Appends one record. Items must come in key order.
+*/
+template<typename Key, typename Value>
+void SnapshotWriter<Key, Value>::put(const Key& key, const Value& value)
+{
+    keys_.write(block_, key);
+    SnapshotCodec<Value>::write(block_, value);
+    if(block_.size() >= SNAPSHOT_BLOCK_BYTES) {
+        flushBlock();
+    }
+}
+
+/**
+* Writes the last block and the end marker, and flushes the stream.
+* @throws std::runtime_error if the stream failed
+*/
+template<typename Key, typename Value>
+void SnapshotWriter<Key, Value>::finish()
+{
+    flushBlock();
+    std::string marker;
+    putFixed(marker, 0, 4);
+    write(marker.data(), marker.size());
+    out_.flush();
+    if(!out_) {
+        throw std::runtime_error("save: write failed");
+    }
+}
+
+/**
+* Writes the pending records as one block, if there are any.
+*/
+template<typename Key, typename Value>
+void SnapshotWriter<Key, Value>::flushBlock()
+{
+    if(block_.empty()) {
+        return;
+    }
+    if(block_.size() > 0xFFFFFFFFu) {
+        throw std::runtime_error("save: record too large");
+    }
+    std::string frame;
+    putFixed(frame, block_.size(), 4);
+    write(frame.data(), frame.size());
+    write(block_.data(), block_.size());
+    frame.clear();
+    putFixed(frame, snapshotCrc32(0, reinterpret_cast<const unsigned char*>(block_.data()), block_.size()), 4);
+    write(frame.data(), frame.size());
+    block_.clear();
+}
+
+/**
+* Writes len bytes to the stream.
+* @throws std::runtime_error if the stream failed
+*/
+template<typename Key, typename Value>
+void SnapshotWriter<Key, Value>::write(const char* data, std::size_t len)
+{
+    out_.write(data, static_cast<std::streamsize>(len));
+    if(!out_) {
+        throw std::runtime_error("save: write failed");
+    }
+}
+
+/**
+* Appends the low bytes of value, least significant first.
+*/
+template<typename Key, typename Value>
+void SnapshotWriter<Key, Value>::putFixed(std::string& out, std::uint64_t value, int bytes)
+{
+    for(int i = 0; i < bytes; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+/*
+  -----------------------------------------
+  End implementations for the SnapshotWriter class.
+  -----------------------------------------
+*/
+
+/*
+  -------------------------------------------
+  Begin implementations for the SnapshotReader class.
+  -------------------------------------------
+*/
+
+/**
+* Reads and checks the header.
+* @throws std::runtime_error if it is truncated, corrupt, of another
+*         version, or written for other key or value types
+*/
+template<typename Key, typename Value>
+SnapshotReader<Key, Value>::SnapshotReader(std::istream& in) :
+    in_(in),
+    count_(0),
+    pos_(NULL),
+    end_(NULL)
+{
+    char header[24];
+    read(header, sizeof(header));
+    if(std::memcmp(header, "BSTS", 4) != 0) {
+        throw std::runtime_error("load: not a tree snapshot");
+    }
+    if(getFixed(header + 20, 4) != snapshotCrc32(0, reinterpret_cast<const unsigned char*>(header), 20)) {
+        throw std::runtime_error("load: header checksum mismatch");
+    }
+    if(getFixed(header + 4, 2) != SNAPSHOT_VERSION) {
+        throw std::runtime_error("load: unsupported snapshot version");
+    }
+    std::uint8_t flags = static_cast<std::uint8_t>(header[6]);
+    if(flags != (SnapshotKeyCodec<Key>::DELTA ? SNAPSHOT_DELTA_KEYS : 0) ||
+       static_cast<std::uint8_t>(header[7]) != sizeof(Key) ||
+       static_cast<std::uint8_t>(header[8]) != sizeof(Value)) {
+        throw std::runtime_error("load: snapshot was written for other key or value types");
+    }
+    count_ = getFixed(header + 12, 8);
+}
+
+/**
+* Returns the number of items the snapshot holds.
+*/
+template<typename Key, typename Value>
+std::uint64_t SnapshotReader<Key, Value>::count() const
+{
+    return count_;
+}
+
+/**
+* Reads the next item into item.
+* @throws std::runtime_error if the snapshot is truncated or corrupt
+*/
+template<typename Key, typename Value>
+void SnapshotReader<Key, Value>::next(std::pair<Key, Value>& item)
+{
+    if(pos_ == end_ && !readBlock()) {
+        throw std::runtime_error("load: snapshot ends early");
+    }
+    pos_ = keys_.read(pos_, end_, item.first);
+    pos_ = SnapshotCodec<Value>::read(pos_, end_, item.second);
+}
+
+/**
+* Reads the end marker once every item has been read.
+* @throws std::runtime_error if records or blocks are left over
+*/
+template<typename Key, typename Value>
+void SnapshotReader<Key, Value>::finish()
+{
+    if(pos_ != end_ || readBlock()) {
+        throw std::runtime_error("load: snapshot holds more records than its header says");
+    }
+}
+
+/**
+* Reads the next block and checks its checksum. Returns false at the end
+* marker.
+*/
+template<typename Key, typename Value>
+bool SnapshotReader<Key, Value>::readBlock()
+{
+    char frame[4];
+    read(frame, 4);
+    std::uint64_t length = getFixed(frame, 4);
+    if(length == 0) {
+        pos_ = end_ = NULL;
+        return false;
+    }
+    // grow as the bytes arrive, so a corrupt length cannot make us
+    // allocate far more than the stream holds
+    block_.clear();
+    while(block_.size() < length) {
+        std::size_t chunk = std::min<std::uint64_t>(length - block_.size(), 1 << 20);
+        std::size_t at = block_.size();
+        block_.resize(at + chunk);
+        read(&block_[at], chunk);
+    }
+    read(frame, 4);
+    if(getFixed(frame, 4) != snapshotCrc32(0, reinterpret_cast<const unsigned char*>(block_.data()), block_.size())) {
+        throw std::runtime_error("load: block checksum mismatch");
+    }
+    pos_ = block_.data();
+    end_ = pos_ + block_.size();
+    return true;
+}
+
+/**
+* Reads exactly len bytes from the stream.
+* @throws std::runtime_error if it ends first
+*/
+template<typename Key, typename Value>
+void SnapshotReader<Key, Value>::read(char* data, std::size_t len)
+{
+    if(in_.rdbuf()->sgetn(data, static_cast<std::streamsize>(len)) != static_cast<std::streamsize>(len)) {
+        in_.setstate(std::ios::failbit | std::ios::eofbit);
+        throw std::runtime_error("load: snapshot ends early");
+    }
+}
+
+/**
+* Reads a little-endian integer of the given number of bytes.
+*/
+template<typename Key, typename Value>
+std::uint64_t SnapshotReader<Key, Value>::getFixed(const char* p, int bytes)
+{
+    std::uint64_t value = 0;
+    for(int i = 0; i < bytes; ++i) {
+        value |= std::uint64_t(static_cast<unsigned char>(p[i])) << (8 * i);
+    }
+    return value;
+}
+
+/*
+  -----------------------------------------
+  End implementations for the SnapshotReader class.
+  -----------------------------------------
+*/
+
+#endif